@@ -0,0 +1,66 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_CREATIONSLOT_H
+#define WNDLIB_CREATIONSLOT_H
+
+#include "WndLibBase.h"
+
+namespace WndLib
+{
+	class Wnd;
+
+	//
+	// CreationSlot: Hands the Wnd being created to its window procedure.
+	//
+
+	namespace Private
+	{
+		// Wnd::CreateIndirect puts the Wnd in the slot before calling
+		// CreateWindowEx, and Wnd::StaticWndProc claims it on the first message
+		// the new window receives. Each thread has its own slot, so threads
+		// creating windows at the same time don't contend. A window created
+		// while handling the new window's messages (e.g., a child created in
+		// WM_CREATE) saves and restores the slot.
+		class CreationSlot
+		{
+		public:
+
+			// Returns the previous contents of the slot, to pass to End.
+			Wnd *Begin(Wnd *wnd)
+			{
+				Wnd *previous = (Wnd *) _slot.Get();
+				_slot.Set(wnd);
+				return previous;
+			}
+
+			// Returns NULL if this thread isn't creating a window or the window
+			// has already been claimed.
+			Wnd *Claim()
+			{
+				Wnd *wnd = (Wnd *) _slot.Get();
+				_slot.Set(NULL);
+				return wnd;
+			}
+
+			// Restores the slot. Returns false if nothing claimed wnd, meaning
+			// the window was never created.
+			bool End(Wnd *wnd, Wnd *previous)
+			{
+				bool claimed = _slot.Get() != wnd;
+				_slot.Set(previous);
+				return claimed;
+			}
+
+		private:
+
+			ThreadLocalPointer _slot;
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,249 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "DispatchProfiler.h"
+#include <algorithm>
+#include <map>
+#include <string.h>
+
+namespace WndLib
+{
+	//
+	// DispatchProfiler
+	//
+
+	#ifdef WNDLIB_PROFILE_DISPATCH
+
+	namespace
+	{
+		struct ProfileCounter
+		{
+			LPCTSTR className;
+			UINT msg;
+			DWORD count;
+			LONGLONG totalTicks;
+			LONGLONG maxTicks;
+			DWORD histogram[DispatchProfiler::HISTOGRAM_BUCKETS];
+		};
+
+		// One per thread. Only the owning thread writes to it.
+		struct ProfileThread
+		{
+			ProfileThread *next;
+			LONG generation;
+
+			enum { CAPACITY = 512 };
+
+			// Open addressing. Calls that don't fit are counted against the
+			// last slot, which has a NULL className.
+			ProfileCounter counters[CAPACITY + 1];
+			size_t used;
+		};
+
+		ThreadLocalPointer profileThreadPointer;
+
+		// Every thread's table, pushed on with InterlockedCompareExchangePointer.
+		// Tables are never freed, since a snapshot may be reading one.
+		ProfileThread * volatile profileThreads = NULL;
+
+		volatile LONG profileGeneration = 0;
+
+		LARGE_INTEGER profileFrequency;
+		volatile LONG profileFrequencyKnown = 0;
+
+		double ProfileTicksToMicroseconds(LONGLONG ticks)
+		{
+			if (! profileFrequencyKnown)
+			{
+				QueryPerformanceFrequency(&profileFrequency);
+				InterlockedExchange(&profileFrequencyKnown, 1);
+			}
+
+			return (double) ticks * 1000000.0 / (double) profileFrequency.QuadPart;
+		}
+
+		void ProfileClear(ProfileThread *thread)
+		{
+			memset(thread->counters, 0, sizeof(thread->counters));
+			thread->used = 0;
+		}
+
+		ProfileThread *ProfileGetThread()
+		{
+			ProfileThread *thread = (ProfileThread *) profileThreadPointer.Get();
+			if (! thread)
+			{
+				thread = new ProfileThread;
+				ProfileClear(thread);
+				thread->generation = profileGeneration;
+
+				for (;;)
+				{
+					ProfileThread *head = profileThreads;
+					thread->next = head;
+					if (InterlockedCompareExchangePointer((PVOID volatile *) &profileThreads, thread, head) == head)
+						break;
+				}
+
+				profileThreadPointer.Set(thread);
+			}
+			else if (thread->generation != profileGeneration)
+			{
+				ProfileClear(thread);
+				thread->generation = profileGeneration;
+			}
+
+			return thread;
+		}
+
+		ProfileCounter *ProfileFindCounter(ProfileThread *thread, LPCTSTR className, UINT msg)
+		{
+			size_t hash = ((size_t) className >> 2) * 31 + msg;
+			hash ^= hash >> 7;
+
+			size_t index = hash % ProfileThread::CAPACITY;
+			for (size_t probes = 0; probes != ProfileThread::CAPACITY; ++probes)
+			{
+				ProfileCounter *counter = &thread->counters[index];
+
+				if (counter->className == className && counter->msg == msg)
+					return counter;
+
+				if (! counter->className)
+				{
+					if (thread->used * 4 >= ProfileThread::CAPACITY * 3)
+						break;
+
+					counter->className = className;
+					counter->msg = msg;
+					++thread->used;
+					return counter;
+				}
+
+				if (++index == ProfileThread::CAPACITY)
+					index = 0;
+			}
+
+			return &thread->counters[ProfileThread::CAPACITY];
+		}
+
+		bool ProfileRecordLess(const DispatchProfiler::Record &a, const DispatchProfiler::Record &b)
+		{
+			return a.totalMicroseconds > b.totalMicroseconds;
+		}
+	}
+
+	LONGLONG DispatchProfiler::Begin()
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		return now.QuadPart;
+	}
+
+	void DispatchProfiler::End(LPCTSTR className, UINT msg, LONGLONG start)
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		LONGLONG ticks = now.QuadPart - start;
+
+		ProfileCounter *counter = ProfileFindCounter(ProfileGetThread(), className, msg);
+
+		++counter->count;
+		counter->totalTicks += ticks;
+		if (ticks > counter->maxTicks)
+			counter->maxTicks = ticks;
+
+		DWORD microseconds = (DWORD) ProfileTicksToMicroseconds(ticks);
+		unsigned bucket = 0;
+		while (microseconds && bucket != HISTOGRAM_BUCKETS - 1)
+		{
+			microseconds >>= 1;
+			++bucket;
+		}
+
+		++counter->histogram[bucket];
+	}
+
+	void DispatchProfiler::Reset()
+	{
+		InterlockedIncrement(&profileGeneration);
+	}
+
+	void DispatchProfiler::Snapshot(std::vector<Record> *records)
+	{
+		typedef std::map<std::pair<TCharString, UINT>, Record> RecordMap;
+		RecordMap merged;
+
+		LONG generation = profileGeneration;
+
+		for (ProfileThread *thread = profileThreads; thread; thread = thread->next)
+		{
+			// Tables that haven't been cleared since the last Reset are stale.
+			if (thread->generation != generation)
+				continue;
+
+			for (size_t i = 0; i != WNDLIB_COUNTOF(thread->counters); ++i)
+			{
+				const ProfileCounter &counter = thread->counters[i];
+				if (! counter.count)
+					continue;
+
+				TCharString className = counter.className ? counter.className : TEXT("(overflow)");
+
+				RecordMap::iterator found = merged.find(std::make_pair(className, counter.msg));
+				if (found == merged.end())
+				{
+					Record empty;
+					empty.className = className;
+					empty.msg = counter.msg;
+					empty.count = 0;
+					empty.totalMicroseconds = 0;
+					empty.maxMicroseconds = 0;
+					std::fill(empty.histogram, empty.histogram + HISTOGRAM_BUCKETS, (DWORD) 0);
+
+					found = merged.insert(std::make_pair(std::make_pair(className, counter.msg), empty)).first;
+				}
+
+				Record &record = found->second;
+				record.count += counter.count;
+				record.totalMicroseconds += ProfileTicksToMicroseconds(counter.totalTicks);
+
+				double maxMicroseconds = ProfileTicksToMicroseconds(counter.maxTicks);
+				if (maxMicroseconds > record.maxMicroseconds)
+					record.maxMicroseconds = maxMicroseconds;
+
+				for (unsigned bucket = 0; bucket != HISTOGRAM_BUCKETS; ++bucket)
+					record.histogram[bucket] += counter.histogram[bucket];
+			}
+		}
+
+		records->clear();
+		records->reserve(merged.size());
+
+		for (RecordMap::const_iterator i = merged.begin(); i != merged.end(); ++i)
+			records->push_back(i->second);
+
+		std::sort(records->begin(), records->end(), &ProfileRecordLess);
+	}
+
+	double DispatchProfiler::Record::GetPercentile(double percentile) const
+	{
+		double target = (double) count * percentile / 100.0;
+		double seen = 0;
+
+		for (unsigned bucket = 0; bucket != HISTOGRAM_BUCKETS - 1; ++bucket)
+		{
+			seen += histogram[bucket];
+			if (seen >= target)
+				return (double) (1u << bucket);
+		}
+
+		return maxMicroseconds;
+	}
+
+	#endif // WNDLIB_PROFILE_DISPATCH
+}
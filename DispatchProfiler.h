@@ -0,0 +1,73 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_DISPATCHPROFILER_H
+#define WNDLIB_DISPATCHPROFILER_H
+
+#include "WndLibBase.h"
+#include <vector>
+
+namespace WndLib
+{
+	//
+	// DispatchProfiler: Call counts and latency histograms for each (class name,
+	// message) handled by Wnd::StaticWndProc, Wnd::SubclassWndProc and
+	// Dlg::StaticDlgProc. Only available if WndLib is compiled with
+	// WNDLIB_PROFILE_DISPATCH defined, otherwise the window procedures contain no
+	// profiling code at all.
+	//
+	// Each thread counts in to its own table, so recording takes no locks and no
+	// interlocked operations. Snapshot merges the tables. LogWnd can dump a
+	// snapshot with LogWnd::LogDispatchProfile.
+	//
+
+	#ifdef WNDLIB_PROFILE_DISPATCH
+
+	class WNDLIB_EXPORT DispatchProfiler
+	{
+	public:
+
+		enum
+		{
+			// Bucket 0 counts calls taking under a microsecond, bucket n those
+			// taking [2^(n-1), 2^n) microseconds. The last bucket takes the rest.
+			HISTOGRAM_BUCKETS = 20
+		};
+
+		struct Record
+		{
+			TCharString className;
+			UINT msg;
+			DWORD count;
+			double totalMicroseconds;
+			double maxMicroseconds;
+			DWORD histogram[HISTOGRAM_BUCKETS];
+
+			// Returns an upper bound, in microseconds, on the given percentile
+			// (0 to 100) of call times.
+			double GetPercentile(double percentile) const;
+		};
+
+		// Merge every thread's counters. The records are sorted by total time,
+		// most expensive first. Counters being updated while this runs may be
+		// slightly out.
+		static void Snapshot(std::vector<Record> *records);
+
+		// Zero every thread's counters. Each thread clears its own table the next
+		// time it records something.
+		static void Reset();
+
+		// Used by the window procedures. End records a call that started at the
+		// time returned by Begin.
+		static LONGLONG Begin();
+		static void End(LPCTSTR className, UINT msg, LONGLONG start);
+	};
+
+	#endif // WNDLIB_PROFILE_DISPATCH
+}
+
+#endif
@@ -85,17 +85,17 @@ private:
 // StopwatchWnd	
 //
 
-WND_WM_BEGIN(StopwatchWnd, MainWnd)
-	WND_WM(WM_ERASEBKGND, OnEraseBkgnd)
-	WND_WM(WM_CREATE, OnCreate)
-	WND_WM(WM_SIZE, OnSize)
-	WND_WM(WM_PAINT, OnPaint)
-	WND_WM(WM_CTLCOLORBTN, OnCtlColorBtn)
-	WND_WM_COMMAND(ID_STARTSTOP, OnStartStop)
-	WND_WM_COMMAND(ID_RESET, OnReset)
-	WND_WM(WM_TIMER, OnTimer)
-	WND_WM(WM_LBUTTONDOWN, OnLButtonDown)
-WND_WM_END()
+WND_WM_TABLE_BEGIN(StopwatchWnd, MainWnd)
+	WND_WM_TABLE(WM_ERASEBKGND, OnEraseBkgnd)
+	WND_WM_TABLE(WM_CREATE, OnCreate)
+	WND_WM_TABLE(WM_SIZE, OnSize)
+	WND_WM_TABLE(WM_PAINT, OnPaint)
+	WND_WM_TABLE(WM_CTLCOLORBTN, OnCtlColorBtn)
+	WND_WM_TABLE_COMMAND(ID_STARTSTOP, OnStartStop)
+	WND_WM_TABLE_COMMAND(ID_RESET, OnReset)
+	WND_WM_TABLE(WM_TIMER, OnTimer)
+	WND_WM_TABLE(WM_LBUTTONDOWN, OnLButtonDown)
+WND_WM_TABLE_END()
 
 StopwatchWnd::StopwatchWnd()
 {
@@ -406,17 +406,10 @@ int WINAPI WinMain(HINSTANCE hinstance, HINSTANCE, LPSTR, int showCommand)
 	
 	myWnd.ShowWindow(showCommand);
 	
-	MSG msg;
-	while (GetMessage(&msg, NULL, 0, 0))
-	{
-		if (! FilterMessage(&msg))
-		{
-			TranslateMessage(&msg);
-			DispatchMessage(&msg);
-		}
-	}
+	MessageLoop loop;
+	int exitCode = loop.Run();
 	
 	timeEndPeriod(1);
 	
-	return 0;
+	return exitCode;
 }
@@ -0,0 +1,542 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "LogFileSink.h"
+#include "LogScan.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#include <process.h>
+#else
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <stdlib.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+namespace WndLib
+{
+	//
+	// UTF-8
+	//
+
+	#ifdef _WIN32
+
+		// Returns the length of the UTF-8, writing it to utf8 if it's not NULL.
+		static size_t ConvertToUTF8(LPCWSTR text, size_t length, char *utf8, size_t utf8Length)
+		{
+			int result = WideCharToMultiByte(CP_UTF8, 0, text, (int) length, utf8, (int) utf8Length, NULL, NULL);
+			return result > 0 ? (size_t) result : 0;
+		}
+
+	#elif defined(WNDLIB_UNICODE)
+
+		// Encodes UTF-32, as wchar_t is outside Windows.
+		static size_t ConvertToUTF8(const WCHAR *text, size_t length, char *utf8, size_t)
+		{
+			size_t utf8Length = 0;
+
+			for (const WCHAR *end = text + length; text != end; ++text)
+			{
+				DWORD c = (DWORD) *text;
+				if ((c >= 0xd800 && c < 0xe000) || c > 0x10ffff)
+					c = 0xfffd;
+
+				char bytes[4];
+				size_t count;
+				if (c < 0x80)
+				{
+					bytes[0] = (char) c;
+					count = 1;
+				}
+				else if (c < 0x800)
+				{
+					bytes[0] = (char) (0xc0 | (c >> 6));
+					bytes[1] = (char) (0x80 | (c & 0x3f));
+					count = 2;
+				}
+				else if (c < 0x10000)
+				{
+					bytes[0] = (char) (0xe0 | (c >> 12));
+					bytes[1] = (char) (0x80 | ((c >> 6) & 0x3f));
+					bytes[2] = (char) (0x80 | (c & 0x3f));
+					count = 3;
+				}
+				else
+				{
+					bytes[0] = (char) (0xf0 | (c >> 18));
+					bytes[1] = (char) (0x80 | ((c >> 12) & 0x3f));
+					bytes[2] = (char) (0x80 | ((c >> 6) & 0x3f));
+					bytes[3] = (char) (0x80 | (c & 0x3f));
+					count = 4;
+				}
+
+				if (utf8)
+					memcpy(utf8 + utf8Length, bytes, count);
+
+				utf8Length += count;
+			}
+
+			return utf8Length;
+		}
+
+	#else
+
+		// Narrow text is taken to be UTF-8 already.
+		static size_t ConvertToUTF8(const char *text, size_t length, char *utf8, size_t)
+		{
+			if (utf8)
+				memcpy(utf8, text, length);
+
+			return length;
+		}
+
+	#endif
+
+	//
+	// Files
+	//
+
+	#ifdef _WIN32
+
+		static bool DeleteOldFile(const TCharString &path)
+		{
+			return DeleteFile(path.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND;
+		}
+
+		// Succeeds if there's nothing at from to move.
+		static bool MoveOldFile(const TCharString &from, const TCharString &to)
+		{
+			return MoveFile(from.c_str(), to.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND;
+		}
+
+	#else
+
+		// The system calls take narrow names.
+		static std::string GetNativeName(LPCTSTR name)
+		{
+			#ifdef WNDLIB_UNICODE
+				size_t length = wcstombs(NULL, name, 0);
+				if (length == (size_t) -1)
+					return std::string();
+
+				std::vector<char> narrow(length + 1);
+				wcstombs(&narrow[0], name, length + 1);
+				return std::string(&narrow[0], length);
+			#else
+				return name;
+			#endif
+		}
+
+		static bool DeleteOldFile(const TCharString &path)
+		{
+			return unlink(GetNativeName(path.c_str()).c_str()) == 0 || errno == ENOENT;
+		}
+
+		// Succeeds if there's nothing at from to move.
+		static bool MoveOldFile(const TCharString &from, const TCharString &to)
+		{
+			return rename(GetNativeName(from.c_str()).c_str(), GetNativeName(to.c_str()).c_str()) == 0 || errno == ENOENT;
+		}
+
+	#endif
+
+	// path.index
+	static TCharString GetRotatedPath(const TCharString &path, unsigned index)
+	{
+		char suffix[16];
+		sprintf(suffix, ".%u", index);
+
+		TCharString rotated = path;
+		for (const char *p = suffix; *p; ++p)
+			rotated += (TCHAR) *p;
+
+		return rotated;
+	}
+
+	//
+	// LogFileSink
+	//
+
+	LogFileSink::LogFileSink()
+	{
+		#ifdef _WIN32
+			_file = INVALID_HANDLE_VALUE;
+			_thread = NULL;
+		#else
+			_file = -1;
+		#endif
+
+		_fileSize = 0;
+		_fileOpenTime = 0;
+		_maxBytes = 0;
+		_maxMilliseconds = 0;
+		_maxFiles = 5;
+		_syncPolicy = SYNC_ON_FLUSH;
+		_writeInterval = 1000;
+		_bufferLimit = 8 * 1024 * 1024;
+		_dropped = 0;
+		_lost = 0;
+		_lostBytes = 0;
+		_running = false;
+		_stopping = 0;
+		_unsynced = false;
+	}
+
+	LogFileSink::~LogFileSink()
+	{
+		Close();
+	}
+
+	void LogFileSink::SetRotation(ULONGLONG maxBytes, DWORD maxMilliseconds, unsigned maxFiles)
+	{
+		CriticalSection::ScopedLock lock(_fileCs);
+
+		_maxBytes = maxBytes;
+		_maxMilliseconds = maxMilliseconds;
+		_maxFiles = maxFiles;
+	}
+
+	bool LogFileSink::Open(LPCTSTR path)
+	{
+		Close();
+
+		_path = path;
+		if (! OpenFile(true))
+			return false;
+
+		_stopping = 0;
+		_wakeEvent.Reset();
+
+		#ifdef _WIN32
+			_thread = (HANDLE) _beginthreadex(NULL, 0, &StaticThreadProc, this, 0, NULL);
+			_running = _thread != NULL;
+		#else
+			_running = pthread_create(&_thread, NULL, &StaticThreadProc, this) == 0;
+		#endif
+
+		if (! _running)
+		{
+			CloseFile();
+			return false;
+		}
+
+		return true;
+	}
+
+	void LogFileSink::Close()
+	{
+		if (_running)
+		{
+			// The thread writes out what's left before it exits.
+			InterlockedExchange(&_stopping, 1);
+			_wakeEvent.Set();
+
+			#ifdef _WIN32
+				WaitForSingleObject(_thread, INFINITE);
+				CloseHandle(_thread);
+				_thread = NULL;
+			#else
+				pthread_join(_thread, NULL);
+			#endif
+
+			_running = false;
+		}
+
+		CloseFile();
+	}
+
+	#ifdef _WIN32
+
+		bool LogFileSink::OpenFile(bool append)
+		{
+			_file = CreateFile(_path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+				append ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+			if (_file == INVALID_HANDLE_VALUE)
+				return false;
+
+			LARGE_INTEGER size;
+			_fileSize = GetFileSizeEx(_file, &size) ? (ULONGLONG) size.QuadPart : 0;
+			_fileOpenTime = GetTickCount();
+			return true;
+		}
+
+		void LogFileSink::CloseFile()
+		{
+			if (_file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(_file);
+				_file = INVALID_HANDLE_VALUE;
+			}
+		}
+
+		bool LogFileSink::IsFileOpen() const
+		{
+			return _file != INVALID_HANDLE_VALUE;
+		}
+
+		void LogFileSink::SyncFile()
+		{
+			FlushFileBuffers(_file);
+		}
+
+		size_t LogFileSink::WriteFileData(const char *data, size_t bytes)
+		{
+			DWORD written;
+			if (! WriteFile(_file, data, (DWORD) bytes, &written, NULL))
+				return 0;
+
+			return written;
+		}
+
+	#else
+
+		bool LogFileSink::OpenFile(bool append)
+		{
+			_file = open(GetNativeName(_path.c_str()).c_str(), O_WRONLY | O_APPEND | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+			if (_file < 0)
+				return false;
+
+			struct stat status;
+			_fileSize = fstat(_file, &status) == 0 ? (ULONGLONG) status.st_size : 0;
+			_fileOpenTime = GetTickCount();
+			return true;
+		}
+
+		void LogFileSink::CloseFile()
+		{
+			if (_file >= 0)
+			{
+				close(_file);
+				_file = -1;
+			}
+		}
+
+		bool LogFileSink::IsFileOpen() const
+		{
+			return _file >= 0;
+		}
+
+		void LogFileSink::SyncFile()
+		{
+			fsync(_file);
+		}
+
+		size_t LogFileSink::WriteFileData(const char *data, size_t bytes)
+		{
+			ssize_t written;
+			do
+				written = write(_file, data, bytes);
+			while (written < 0 && errno == EINTR);
+
+			return written > 0 ? (size_t) written : 0;
+		}
+
+	#endif
+
+	void LogFileSink::Rotate()
+	{
+		if (_syncPolicy != SYNC_NEVER && _unsynced)
+			SyncFile();
+
+		_unsynced = false;
+
+		CloseFile();
+
+		// If a file can't be moved out of the way the ones after it are left
+		// where they are, and the current file is appended to rather than
+		// truncated. Moving them is tried again at the next rotation.
+		bool moved = true;
+		if (_maxFiles)
+		{
+			TCharString to = GetRotatedPath(_path, _maxFiles);
+			moved = DeleteOldFile(to);
+
+			for (unsigned i = _maxFiles - 1; i != 0 && moved; --i)
+			{
+				TCharString from = GetRotatedPath(_path, i);
+				moved = MoveOldFile(from, to);
+				to = from;
+			}
+
+			if (moved)
+				moved = MoveOldFile(_path, to);
+		}
+
+		// Without old files to keep the current file is truncated rather than
+		// left to grow without limit.
+		OpenFile(! moved);
+	}
+
+	void LogFileSink::Write(LPCTSTR text, size_t length, COLORREF)
+	{
+		if (! length || ! _running)
+			return;
+
+		// The file gets CRLF line breaks, like SaveTo's. Most entries are a
+		// single line, so there's usually nothing to convert.
+		TCharString normalized;
+		if (Private::FindLineBreak(text, text + length) != text + length)
+		{
+			Private::NormalizeLineBreaks(text, length, &normalized, (std::vector<size_t> *) NULL);
+			text = normalized.data();
+			length = normalized.size();
+
+			if (! length)
+				return;
+		}
+
+		#if defined(_WIN32) && ! defined(WNDLIB_UNICODE)
+			// Narrow text is in the ANSI code page, so it's widened first.
+			int wideLength = MultiByteToWideChar(CP_ACP, 0, text, (int) length, NULL, 0);
+			if (wideLength <= 0)
+				return;
+
+			WCharString wideString(wideLength, 0);
+			MultiByteToWideChar(CP_ACP, 0, text, (int) length, &wideString[0], wideLength);
+			LPCWSTR source = wideString.data();
+			size_t sourceLength = wideString.size();
+		#else
+			LPCTSTR source = text;
+			size_t sourceLength = length;
+		#endif
+
+		size_t utf8Length = ConvertToUTF8(source, sourceLength, NULL, 0);
+		if (! utf8Length)
+			return;
+
+		bool wake;
+
+		{
+			CriticalSection::ScopedLock lock(_cs);
+
+			size_t used = _buffer.size();
+			if (used + utf8Length > _bufferLimit)
+			{
+				InterlockedIncrement(&_dropped);
+				return;
+			}
+
+			// Converted straight in to the buffer, so there's no temporary.
+			_buffer.resize(used + utf8Length);
+			ConvertToUTF8(source, sourceLength, &_buffer[used], utf8Length);
+			_bufferEnds.push_back(_buffer.size());
+
+			// Wake the thread once there's enough for a worthwhile write.
+			wake = used < (size_t) WAKE_BYTES && _buffer.size() >= (size_t) WAKE_BYTES;
+		}
+
+		if (wake)
+			_wakeEvent.Set();
+	}
+
+	void LogFileSink::Flush()
+	{
+		if (_running)
+			WriteBuffer(_syncPolicy != SYNC_NEVER);
+	}
+
+	bool LogFileSink::WriteBuffer(bool sync)
+	{
+		CriticalSection::ScopedLock fileLock(_fileCs);
+
+		{
+			// Swapping keeps both strings' capacity, so neither reallocates once
+			// they've grown.
+			CriticalSection::ScopedLock lock(_cs);
+			_writing.swap(_buffer);
+			_writingEnds.swap(_bufferEnds);
+		}
+
+		if (IsFileOpen() && ! _writing.empty() &&
+			((_maxBytes && _fileSize && _fileSize + _writing.size() > _maxBytes) ||
+			(_maxMilliseconds && GetTickCount() - _fileOpenTime >= _maxMilliseconds)))
+		{
+			Rotate();
+		}
+
+		size_t offset = 0;
+		if (IsFileOpen())
+		{
+			while (offset != _writing.size())
+			{
+				size_t remaining = _writing.size() - offset;
+				size_t written = WriteFileData(_writing.data() + offset, remaining < (size_t) MAX_WRITE_BYTES ? remaining : (size_t) MAX_WRITE_BYTES);
+				if (! written)
+					break;
+
+				offset += written;
+				_fileSize += written;
+				_unsynced = true;
+			}
+		}
+
+		bool ok = offset == _writing.size();
+		if (! ok)
+			CountLost(offset);
+
+		_writing.clear();
+		_writingEnds.clear();
+
+		// Nothing to sync if the thread woke up with nothing to write.
+		if (sync && _unsynced)
+		{
+			SyncFile();
+			_unsynced = false;
+		}
+
+		return ok;
+	}
+
+	void LogFileSink::CountLost(size_t offset)
+	{
+		// Every write that ends after offset didn't make it to the file whole.
+		size_t lost = _writingEnds.end() - std::upper_bound(_writingEnds.begin(), _writingEnds.end(), offset);
+
+		InterlockedExchangeAdd(&_lost, (LONG) lost);
+		InterlockedExchangeAdd(&_lostBytes, (LONG) (_writing.size() - offset));
+	}
+
+	#ifdef _WIN32
+
+		unsigned __stdcall LogFileSink::StaticThreadProc(void *param)
+		{
+			((LogFileSink *) param)->ThreadProc();
+			return 0;
+		}
+
+	#else
+
+		void *LogFileSink::StaticThreadProc(void *param)
+		{
+			((LogFileSink *) param)->ThreadProc();
+			return NULL;
+		}
+
+	#endif
+
+	void LogFileSink::ThreadProc()
+	{
+		for (;;)
+		{
+			// Write woke the thread for whatever's in the buffer now, which the
+			// write below takes, so a wake-up can't be missed.
+			_wakeEvent.Wait(_writeInterval ? _writeInterval : INFINITE);
+			_wakeEvent.Reset();
+
+			bool stopping = _stopping != 0;
+			WriteBuffer(stopping ? _syncPolicy != SYNC_NEVER : _syncPolicy == SYNC_ALWAYS);
+
+			if (stopping)
+				break;
+		}
+	}
+}
@@ -0,0 +1,195 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_LOGFILESINK_H
+#define WNDLIB_LOGFILESINK_H
+
+#include "LogQueue.h"
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+	#include <pthread.h>
+#endif
+
+namespace WndLib
+{
+	//
+	// LogFileSink: Writes log text to a file, as UTF-8 with CRLF line breaks, on
+	// a background thread. Write only copies the text in to a buffer, so it
+	// never waits for the disk. The buffer is written out by the thread once
+	// enough has built up, or after the write interval has passed.
+	//
+	// On Windows the file is written with WriteFile. Elsewhere it's a POSIX
+	// file and thread, and text that isn't WNDLIB_UNICODE is taken to be UTF-8
+	// already, so the sink can be tested anywhere.
+	//
+
+	class WNDLIB_EXPORT LogFileSink : public LogSink
+	{
+	public:
+
+		enum SyncPolicy
+		{
+			// Leave it to the system to decide when data reaches the disk.
+			SYNC_NEVER,
+
+			// Flush and rotation sync the file (FlushFileBuffers or fsync).
+			SYNC_ON_FLUSH,
+
+			// The file is synced every time the buffer is written out.
+			SYNC_ALWAYS
+		};
+
+		LogFileSink();
+
+		~LogFileSink();
+
+		// Open the file, appending to it if it exists, and start the writer
+		// thread.
+		bool Open(LPCTSTR path);
+
+		// Write out anything buffered, stop the thread and close the file.
+		void Close();
+
+		bool IsOpen() const
+		{
+			return _running;
+		}
+
+		// Rotate the file once it's maxBytes long, or once it's been open for
+		// maxMilliseconds. The current file is renamed to path.1, path.1 to
+		// path.2 and so on, keeping at most maxFiles old files. 0 disables
+		// either limit. Both default to 0, and maxFiles defaults to 5. If the
+		// files can't be renamed the current one is appended to, and renaming
+		// is tried again at the next rotation.
+		void SetRotation(ULONGLONG maxBytes, DWORD maxMilliseconds, unsigned maxFiles);
+
+		void SetSyncPolicy(SyncPolicy syncPolicy)
+		{
+			_syncPolicy = syncPolicy;
+		}
+
+		// The longest buffered text waits before the thread writes it out.
+		// Defaults to 1000 milliseconds.
+		void SetWriteInterval(DWORD milliseconds)
+		{
+			_writeInterval = milliseconds;
+		}
+
+		// Text is dropped rather than buffered beyond this many bytes, so a
+		// stalled disk can't use up memory. Defaults to 8MB.
+		void SetBufferLimit(size_t bytes)
+		{
+			_bufferLimit = bytes;
+		}
+
+		// Can be called from any thread. The colour is ignored.
+		virtual void Write(LPCTSTR text, size_t length, COLORREF colour);
+
+		// Write out everything written so far, waiting for it to complete.
+		void Flush();
+
+		// The number of writes dropped because the buffer was full.
+		LONG GetDroppedCount() const
+		{
+			return _dropped;
+		}
+
+		// The number of writes, and the bytes of UTF-8, that were buffered but
+		// couldn't be written to the file. A write that was only partly
+		// written is counted.
+		LONG GetLostCount() const
+		{
+			return _lost;
+		}
+
+		LONG GetLostBytes() const
+		{
+			return _lostBytes;
+		}
+
+	private:
+
+		enum
+		{
+			// Buffered bytes that wake the thread early, and the most passed to
+			// a single write.
+			WAKE_BYTES = 64 * 1024,
+			MAX_WRITE_BYTES = 1024 * 1024
+		};
+
+		#ifdef _WIN32
+			static unsigned __stdcall StaticThreadProc(void *param);
+		#else
+			static void *StaticThreadProc(void *param);
+		#endif
+
+		void ThreadProc();
+
+		// Write the buffer to the file. Returns false if the file couldn't be
+		// written.
+		bool WriteBuffer(bool sync);
+
+		// Count what's left of _writing from offset as lost.
+		void CountLost(size_t offset);
+
+		bool OpenFile(bool append);
+		void CloseFile();
+		bool IsFileOpen() const;
+		void SyncFile();
+
+		// Returns the number of bytes written, 0 if the write failed.
+		size_t WriteFileData(const char *data, size_t bytes);
+
+		void Rotate();
+
+		// Guards _buffer and _bufferEnds.
+		CriticalSection _cs;
+		std::string _buffer;
+
+		// The offset in _buffer after each write, to count the writes lost if
+		// the buffer can't be written.
+		std::vector<size_t> _bufferEnds;
+
+		// Held while writing to the file, so Flush and the thread take turns.
+		CriticalSection _fileCs;
+		std::string _writing;
+		std::vector<size_t> _writingEnds;
+		ULONGLONG _fileSize;
+		DWORD _fileOpenTime;
+
+		#ifdef _WIN32
+			HANDLE _file;
+			HANDLE _thread;
+		#else
+			int _file;
+			pthread_t _thread;
+		#endif
+
+		TCharString _path;
+		ULONGLONG _maxBytes;
+		DWORD _maxMilliseconds;
+		unsigned _maxFiles;
+		SyncPolicy _syncPolicy;
+		DWORD _writeInterval;
+		size_t _bufferLimit;
+		volatile LONG _dropped;
+		volatile LONG _lost;
+		volatile LONG _lostBytes;
+
+		bool _running;
+		Event _wakeEvent;
+		volatile LONG _stopping;
+
+		// Set once something has been written since the file was last synced.
+		bool _unsynced;
+	};
+}
+
+#endif
@@ -0,0 +1,220 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "LogLineStore.h"
+#include "LogScan.h"
+#include <string.h>
+
+namespace WndLib
+{
+	//
+	// LogLineStore
+	//
+
+	LogLineStore::LogLineStore()
+	{
+		_blocks.push_back(new TCHAR[BLOCK_CHARS]);
+		_firstBlock = 0;
+		_blockUsed = 0;
+		_firstRun = 0;
+		_lineOpen = false;
+		_textLength = 0;
+	}
+
+	LogLineStore::~LogLineStore()
+	{
+		for (size_t i = 0; i != _blocks.size(); ++i)
+			delete[] _blocks[i];
+	}
+
+	void LogLineStore::Append(LPCTSTR text, size_t length, COLORREF colour)
+	{
+		for (LPCTSTR end = text + length; text != end;)
+		{
+			LPCTSTR lineBreak = Private::FindLineBreak(text, end);
+
+			if (lineBreak != text || *text == '\n')
+			{
+				if (! _lineOpen)
+				{
+					_lineStarts.push_back(_firstRun + _runs.size());
+					_lineOpen = true;
+				}
+
+				AppendText(text, lineBreak - text, colour);
+			}
+
+			if (lineBreak == end)
+				break;
+
+			if (*lineBreak == '\n')
+			{
+				_lineOpen = false;
+				++_textLength;
+			}
+
+			text = lineBreak + 1;
+		}
+	}
+
+	void LogLineStore::AppendText(LPCTSTR text, size_t length, COLORREF colour)
+	{
+		while (length)
+		{
+			if (_blockUsed == BLOCK_CHARS)
+			{
+				_blocks.push_back(new TCHAR[BLOCK_CHARS]);
+				_blockUsed = 0;
+			}
+
+			size_t count = BLOCK_CHARS - _blockUsed;
+			if (count > length)
+				count = length;
+
+			AppendToRun(text, count, colour);
+			text += count;
+			length -= count;
+		}
+	}
+
+	void LogLineStore::AppendToRun(LPCTSTR text, size_t length, COLORREF colour)
+	{
+		size_t block = _firstBlock + _blocks.size() - 1;
+		TCHAR *dest = _blocks.back() + _blockUsed;
+
+		// Extend the last run if it's in this line, the same colour, and ends
+		// right here.
+		StoredRun *run = NULL;
+		if (! _runs.empty() && _firstRun + _runs.size() - 1 >= _lineStarts.back())
+		{
+			run = &_runs.back();
+			if (run->colour != colour || run->block != block || run->text + run->length != dest)
+				run = NULL;
+		}
+
+		if (! run)
+		{
+			StoredRun newRun;
+			newRun.text = dest;
+			newRun.length = 0;
+			newRun.colour = colour;
+			newRun.block = block;
+			_runs.push_back(newRun);
+			run = &_runs.back();
+		}
+
+		memcpy(dest, text, length * sizeof(TCHAR));
+		_blockUsed += length;
+		run->length += length;
+		_textLength += length;
+	}
+
+	size_t LogLineStore::GetRunCount(size_t line) const
+	{
+		size_t end = line + 1 < _lineStarts.size() ? _lineStarts[line + 1] : _firstRun + _runs.size();
+		return end - _lineStarts[line];
+	}
+
+	void LogLineStore::RemoveFrontLines(size_t count)
+	{
+		if (count > _lineStarts.size())
+			count = _lineStarts.size();
+
+		if (! count)
+			return;
+
+		// Every removed line has been ended, except perhaps the last line.
+		size_t endedLines = count;
+		if (count == _lineStarts.size() && _lineOpen)
+		{
+			--endedLines;
+			_lineOpen = false;
+		}
+
+		size_t endRun = count < _lineStarts.size() ? _lineStarts[count] : _firstRun + _runs.size();
+
+		_textLength -= endedLines;
+		for (; _firstRun != endRun; ++_firstRun)
+		{
+			_textLength -= _runs.front().length;
+			_runs.pop_front();
+		}
+
+		_lineStarts.erase(_lineStarts.begin(), _lineStarts.begin() + count);
+
+		// Free the blocks nothing refers to any more, but always keep the one
+		// being written.
+		size_t firstUsedBlock = _runs.empty() ? _firstBlock + _blocks.size() - 1 : _runs.front().block;
+		while (_firstBlock != firstUsedBlock)
+		{
+			delete[] _blocks.front();
+			_blocks.pop_front();
+			++_firstBlock;
+		}
+	}
+
+	size_t LogLineStore::Trim(size_t maxLines, size_t maxChars)
+	{
+		size_t lines = GetLineCount();
+		size_t removeLines = 0;
+
+		if (maxLines && lines > maxLines)
+			removeLines = lines - (maxLines - maxLines / 4);
+
+		if (maxChars && _textLength > maxChars)
+		{
+			size_t targetChars = maxChars - maxChars / 4;
+			size_t removeChars = _textLength - targetChars;
+
+			// Count whole lines until enough characters are covered.
+			size_t line = 0;
+			for (size_t chars = 0; line < lines && chars < removeChars; ++line)
+			{
+				for (size_t run = 0; run != GetRunCount(line); ++run)
+					chars += GetRun(line, run).length;
+
+				++chars;
+			}
+
+			if (line > removeLines)
+				removeLines = line;
+		}
+
+		if (removeLines)
+			RemoveFrontLines(removeLines);
+
+		return removeLines;
+	}
+
+	//
+	// LogMemorySink
+	//
+
+	LogMemorySink::LogMemorySink()
+	{
+		_maxLines = _maxChars = 0;
+		_entryCount = 0;
+	}
+
+	void LogMemorySink::SetScrollback(size_t maxLines, size_t maxChars)
+	{
+		CriticalSection::ScopedLock lock(_cs);
+
+		_maxLines = maxLines;
+		_maxChars = maxChars;
+		_store.Trim(_maxLines, _maxChars);
+	}
+
+	void LogMemorySink::Write(LPCTSTR text, size_t length, COLORREF colour)
+	{
+		CriticalSection::ScopedLock lock(_cs);
+
+		_store.Append(text, length, colour);
+		_store.Trim(_maxLines, _maxChars);
+		InterlockedIncrement(&_entryCount);
+	}
+}
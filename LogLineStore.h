@@ -0,0 +1,154 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_LOGLINESTORE_H
+#define WNDLIB_LOGLINESTORE_H
+
+#include "LogQueue.h"
+#include <stddef.h>
+#include <deque>
+
+namespace WndLib
+{
+	//
+	// LogLineStore: Lines of colourised text, indexed by line. Text is kept in
+	// large blocks that are never moved, so appending is cheap however many
+	// lines are stored, and lines can be removed from the front.
+	//
+
+	class WNDLIB_EXPORT LogLineStore
+	{
+	public:
+
+		// A piece of a line in a single colour.
+		struct Run
+		{
+			LPCTSTR text;
+			size_t length;
+			COLORREF colour;
+		};
+
+		LogLineStore();
+
+		~LogLineStore();
+
+		// '\n' ends a line, '\r' is ignored.
+		void Append(LPCTSTR text, size_t length, COLORREF colour);
+
+		// The last line may not have been ended yet.
+		size_t GetLineCount() const
+		{
+			return _lineStarts.size();
+		}
+
+		size_t GetRunCount(size_t line) const;
+
+		const Run &GetRun(size_t line, size_t run) const
+		{
+			return _runs[_lineStarts[line] - _firstRun + run];
+		}
+
+		// The number of characters stored, counting each line end as one.
+		size_t GetTextLength() const
+		{
+			return _textLength;
+		}
+
+		void RemoveFrontLines(size_t count);
+
+		// If either limit is exceeded (0 means no limit), remove the oldest lines
+		// to bring the store down to three quarters of the limit, so trimming is
+		// rare. Returns the number of lines removed.
+		size_t Trim(size_t maxLines, size_t maxChars);
+
+		// True if the last line hasn't been ended with a '\n'.
+		bool IsLastLineOpen() const
+		{
+			return _lineOpen;
+		}
+
+		void Clear()
+		{
+			RemoveFrontLines(GetLineCount());
+		}
+
+	private:
+
+		enum { BLOCK_CHARS = 65536 };
+
+		struct StoredRun : public Run
+		{
+			size_t block;
+		};
+
+		// Copy text in to the blocks, starting new ones as they fill up.
+		void AppendText(LPCTSTR text, size_t length, COLORREF colour);
+
+		// Copy text, which must fit, in to the current block and add it to the
+		// current line.
+		void AppendToRun(LPCTSTR text, size_t length, COLORREF colour);
+
+		// Blocks are numbered, _firstBlock being the number of _blocks.front().
+		std::deque<TCHAR *> _blocks;
+		size_t _firstBlock;
+		size_t _blockUsed;
+
+		// Runs are numbered too, and each line is the number of its first run.
+		std::deque<StoredRun> _runs;
+		size_t _firstRun;
+		std::deque<size_t> _lineStarts;
+
+		// True if the last line hasn't been ended.
+		bool _lineOpen;
+
+		size_t _textLength;
+	};
+
+	//
+	// LogMemorySink: Keeps what's logged in a LogLineStore.
+	//
+
+	class WNDLIB_EXPORT LogMemorySink : public LogSink
+	{
+	public:
+
+		LogMemorySink();
+
+		// Works like LogWnd::SetScrollback.
+		void SetScrollback(size_t maxLines, size_t maxChars);
+
+		// The number of entries written.
+		LONG GetEntryCount() const
+		{
+			return _entryCount;
+		}
+
+		// Lock this while using GetStore if other threads may be logging.
+		CriticalSection &GetLock()
+		{
+			return _cs;
+		}
+
+		const LogLineStore &GetStore() const
+		{
+			return _store;
+		}
+
+		// LogSink overrides
+		virtual void Write(LPCTSTR text, size_t length, COLORREF colour);
+
+	private:
+
+		CriticalSection _cs;
+		LogLineStore _store;
+		size_t _maxLines;
+		size_t _maxChars;
+		volatile LONG _entryCount;
+	};
+}
+
+#endif
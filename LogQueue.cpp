@@ -0,0 +1,1294 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "LogQueue.h"
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <algorithm>
+
+namespace WndLib
+{
+	//
+	// Formatting: TCharFormat lives with the window code, so the queue has its
+	// own.
+	//
+
+	static TCharString LogFormatVA(const TCHAR *fmt, va_list argPtr)
+	{
+		const size_t MAX_LENGTH = 1u << 16;
+		TCharString buffer(128, 0);
+
+		for (;;)
+		{
+			va_list args;
+			WNDLIB_VA_COPY(args, argPtr);
+
+			#ifdef _MSC_VER
+			#pragma warning(disable:4996)
+			#endif
+			#if defined(_WIN32) && defined(WNDLIB_UNICODE)
+				int length = _vsnwprintf(&buffer[0], buffer.size(), fmt, args);
+			#elif defined(_WIN32)
+				int length = _vsnprintf(&buffer[0], buffer.size(), fmt, args);
+			#elif defined(WNDLIB_UNICODE)
+				int length = vswprintf(&buffer[0], buffer.size(), fmt, args);
+			#else
+				int length = vsnprintf(&buffer[0], buffer.size(), fmt, args);
+			#endif
+			#ifdef _MSC_VER
+			#pragma warning(default:4996)
+			#endif
+
+			va_end(args);
+
+			if (length >= 0 && (size_t) length < buffer.size())
+			{
+				buffer.resize(length);
+				return buffer;
+			}
+
+			if (buffer.size() > MAX_LENGTH)
+				return TCharString();
+
+			// Older runtimes return -1 rather than the length needed.
+			buffer.resize(length >= 0 ? (size_t) length + 1 : buffer.size() * 2);
+		}
+	}
+
+	static TCharString LogFormat(const TCHAR *fmt, ...)
+	{
+		va_list argPtr;
+		va_start(argPtr, fmt);
+		TCharString result = LogFormatVA(fmt, argPtr);
+		va_end(argPtr);
+		return result;
+	}
+
+	//
+	// Deferred formatting: Format can store its format string and a copy of its
+	// arguments, which TakeEntries formats later. The arguments are stored in
+	// the order they're read, each padded to 8 bytes, with strings copied
+	// including their terminator. Their types come from parsing the format
+	// string again.
+	//
+
+	enum FormatArgType
+	{
+		FORMAT_ARG_NONE,
+		FORMAT_ARG_INT,
+		FORMAT_ARG_INT64,
+		FORMAT_ARG_DOUBLE,
+		FORMAT_ARG_POINTER,
+		FORMAT_ARG_CHAR_STRING,
+		FORMAT_ARG_WCHAR_STRING
+	};
+
+	struct FormatSpec
+	{
+		// From the '%' to just past the conversion character.
+		const TCHAR *begin;
+		const TCHAR *end;
+
+		// True if the width or precision is an argument.
+		bool argWidth;
+		bool argPrecision;
+
+		FormatArgType type;
+	};
+
+	// Parse the conversion specification at p, which must point to a '%'.
+	// Returns false if it isn't one that can be deferred.
+	static bool ParseFormatSpec(const TCHAR *p, FormatSpec *spec)
+	{
+		spec->begin = p++;
+		spec->argWidth = spec->argPrecision = false;
+
+		if (*p == '%')
+		{
+			spec->end = p + 1;
+			spec->type = FORMAT_ARG_NONE;
+			return true;
+		}
+
+		while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+			++p;
+
+		if (*p == '*')
+		{
+			spec->argWidth = true;
+			++p;
+		}
+		else
+		{
+			while (*p >= '0' && *p <= '9')
+				++p;
+		}
+
+		if (*p == '.')
+		{
+			++p;
+			if (*p == '*')
+			{
+				spec->argPrecision = true;
+				++p;
+			}
+			else
+			{
+				while (*p >= '0' && *p <= '9')
+					++p;
+			}
+		}
+
+		// Anything that isn't one of these, e.g., z, j, t or L, can't be deferred.
+		enum { SIZE_DEFAULT, SIZE_SHORT, SIZE_LONG, SIZE_INT64, SIZE_POINTER, SIZE_WIDE } size = SIZE_DEFAULT;
+
+		if (*p == 'h')
+		{
+			size = SIZE_SHORT;
+			if (*++p == 'h')
+				++p;
+		}
+		else if (*p == 'l')
+		{
+			size = SIZE_LONG;
+			if (*++p == 'l')
+			{
+				size = SIZE_INT64;
+				++p;
+			}
+		}
+		else if (*p == 'w')
+		{
+			size = SIZE_WIDE;
+			++p;
+		}
+		else if (*p == 'I')
+		{
+			if (p[1] == '6' && p[2] == '4')
+			{
+				size = SIZE_INT64;
+				p += 3;
+			}
+			else if (p[1] == '3' && p[2] == '2')
+			{
+				p += 3;
+			}
+			else
+			{
+				size = SIZE_POINTER;
+				++p;
+			}
+		}
+
+		switch (*p)
+		{
+			case 'd':
+			case 'i':
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				// long is 64-bit on LP64 systems.
+				if (size == SIZE_INT64 || (size == SIZE_POINTER && sizeof(void *) == 8) || (size == SIZE_LONG && sizeof(long) == 8))
+					spec->type = FORMAT_ARG_INT64;
+				else if (size != SIZE_WIDE)
+					spec->type = FORMAT_ARG_INT;
+				else
+					return false;
+				break;
+
+			case 'c':
+			case 'C':
+				// Promoted to int.
+				spec->type = FORMAT_ARG_INT;
+				break;
+
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+				// l does nothing to a double.
+				if (size != SIZE_DEFAULT && size != SIZE_LONG)
+					return false;
+
+				spec->type = FORMAT_ARG_DOUBLE;
+				break;
+
+			case 'p':
+				if (size != SIZE_DEFAULT)
+					return false;
+
+				spec->type = FORMAT_ARG_POINTER;
+				break;
+
+			case 's':
+			case 'S':
+				// %s is a TCHAR string and %S the other kind, unless there's a
+				// size prefix.
+				if (size == SIZE_SHORT)
+					spec->type = FORMAT_ARG_CHAR_STRING;
+				else if (size == SIZE_LONG || size == SIZE_WIDE)
+					spec->type = FORMAT_ARG_WCHAR_STRING;
+				else if (size != SIZE_DEFAULT)
+					return false;
+				else
+				{
+					#ifdef WNDLIB_UNICODE
+						spec->type = *p == 's' ? FORMAT_ARG_WCHAR_STRING : FORMAT_ARG_CHAR_STRING;
+					#else
+						spec->type = *p == 's' ? FORMAT_ARG_CHAR_STRING : FORMAT_ARG_WCHAR_STRING;
+					#endif
+				}
+				break;
+
+			default:
+				// Including %n, which writes through its argument.
+				return false;
+		}
+
+		spec->end = p + 1;
+		return true;
+	}
+
+	static size_t PadFormatArgSize(size_t size)
+	{
+		return (size + 7) & ~(size_t) 7;
+	}
+
+	// Returns false if there isn't room.
+	static bool PutFormatArg(char *record, size_t recordSize, size_t *used, const void *data, size_t size)
+	{
+		size_t padded = PadFormatArgSize(size);
+		if (recordSize - *used < padded)
+			return false;
+
+		memcpy(record + *used, data, size);
+		memset(record + *used + size, 0, padded - size);
+		*used += padded;
+		return true;
+	}
+
+	// Store fmt and the arguments it reads from argPtr in record. Returns the
+	// number of bytes used, or 0 if the format can't be deferred or the
+	// arguments don't fit.
+	static size_t CaptureFormat(char *record, size_t recordSize, const TCHAR *fmt, va_list argPtr)
+	{
+		size_t used = 0;
+		if (! PutFormatArg(record, recordSize, &used, &fmt, sizeof(fmt)))
+			return 0;
+
+		for (const TCHAR *p = fmt; *p;)
+		{
+			if (*p != '%')
+			{
+				++p;
+				continue;
+			}
+
+			FormatSpec spec;
+			if (! ParseFormatSpec(p, &spec))
+				return 0;
+
+			p = spec.end;
+
+			if (spec.type == FORMAT_ARG_NONE)
+				continue;
+
+			bool ok = true;
+
+			for (int stars = (spec.argWidth ? 1 : 0) + (spec.argPrecision ? 1 : 0); stars; --stars)
+			{
+				int value = va_arg(argPtr, int);
+				ok = ok && PutFormatArg(record, recordSize, &used, &value, sizeof(value));
+			}
+
+			switch (spec.type)
+			{
+				case FORMAT_ARG_INT:
+				{
+					int value = va_arg(argPtr, int);
+					ok = ok && PutFormatArg(record, recordSize, &used, &value, sizeof(value));
+					break;
+				}
+
+				case FORMAT_ARG_INT64:
+				{
+					LONGLONG value = va_arg(argPtr, LONGLONG);
+					ok = ok && PutFormatArg(record, recordSize, &used, &value, sizeof(value));
+					break;
+				}
+
+				case FORMAT_ARG_DOUBLE:
+				{
+					double value = va_arg(argPtr, double);
+					ok = ok && PutFormatArg(record, recordSize, &used, &value, sizeof(value));
+					break;
+				}
+
+				case FORMAT_ARG_POINTER:
+				{
+					void *value = va_arg(argPtr, void *);
+					ok = ok && PutFormatArg(record, recordSize, &used, &value, sizeof(value));
+					break;
+				}
+
+				case FORMAT_ARG_CHAR_STRING:
+				{
+					const char *value = va_arg(argPtr, const char *);
+					if (! value)
+						value = "(null)";
+
+					ok = ok && PutFormatArg(record, recordSize, &used, value, strlen(value) + 1);
+					break;
+				}
+
+				case FORMAT_ARG_WCHAR_STRING:
+				{
+					const WCHAR *value = va_arg(argPtr, const WCHAR *);
+					if (! value)
+						value = L"(null)";
+
+					ok = ok && PutFormatArg(record, recordSize, &used, value, (wcslen(value) + 1) * sizeof(WCHAR));
+					break;
+				}
+
+				default:
+					break;
+			}
+
+			if (! ok)
+				return 0;
+		}
+
+		return used;
+	}
+
+	// Format a record stored by CaptureFormat.
+	static TCharString RenderFormat(const char *record, size_t recordSize)
+	{
+		const char *read = record;
+		const char *end = record + recordSize;
+
+		const TCHAR *fmt;
+		memcpy(&fmt, read, sizeof(fmt));
+		read += PadFormatArgSize(sizeof(fmt));
+
+		TCharString result;
+		TCharString specString;
+
+		for (const TCHAR *p = fmt; *p;)
+		{
+			if (*p != '%')
+			{
+				const TCHAR *literal = p;
+				while (*p && *p != '%')
+					++p;
+
+				result.append(literal, p);
+				continue;
+			}
+
+			// CaptureFormat has already checked the format.
+			FormatSpec spec;
+			ParseFormatSpec(p, &spec);
+			p = spec.end;
+
+			if (spec.type == FORMAT_ARG_NONE)
+			{
+				result += '%';
+				continue;
+			}
+
+			// Substitute any width and precision arguments in to the spec.
+			specString.clear();
+			for (const TCHAR *s = spec.begin; s != spec.end; ++s)
+			{
+				if (*s != '*')
+				{
+					specString += *s;
+					continue;
+				}
+
+				int value = 0;
+				if (end - read >= 8)
+					memcpy(&value, read, sizeof(value));
+
+				read += 8;
+				specString += LogFormat(TEXT("%d"), value);
+			}
+
+			if (read >= end)
+				break;
+
+			switch (spec.type)
+			{
+				case FORMAT_ARG_INT:
+				{
+					int value;
+					memcpy(&value, read, sizeof(value));
+					read += PadFormatArgSize(sizeof(value));
+					result += LogFormat(specString.c_str(), value);
+					break;
+				}
+
+				case FORMAT_ARG_INT64:
+				{
+					LONGLONG value;
+					memcpy(&value, read, sizeof(value));
+					read += PadFormatArgSize(sizeof(value));
+					result += LogFormat(specString.c_str(), value);
+					break;
+				}
+
+				case FORMAT_ARG_DOUBLE:
+				{
+					double value;
+					memcpy(&value, read, sizeof(value));
+					read += PadFormatArgSize(sizeof(value));
+					result += LogFormat(specString.c_str(), value);
+					break;
+				}
+
+				case FORMAT_ARG_POINTER:
+				{
+					void *value;
+					memcpy(&value, read, sizeof(value));
+					read += PadFormatArgSize(sizeof(value));
+					result += LogFormat(specString.c_str(), value);
+					break;
+				}
+
+				case FORMAT_ARG_CHAR_STRING:
+				{
+					const char *value = read;
+					read += PadFormatArgSize(strlen(value) + 1);
+					result += LogFormat(specString.c_str(), value);
+					break;
+				}
+
+				case FORMAT_ARG_WCHAR_STRING:
+				{
+					// Strings start 8 byte aligned, so this is safe to read.
+					const WCHAR *value = (const WCHAR *) read;
+					read += PadFormatArgSize((wcslen(value) + 1) * sizeof(WCHAR));
+					result += LogFormat(specString.c_str(), value);
+					break;
+				}
+
+				default:
+					break;
+			}
+		}
+
+		return result;
+	}
+
+	//
+	// Staging buffers
+	//
+
+	struct LogStagingBuffer
+	{
+		enum { CAPACITY = 16 * 1024 };
+
+		// Non-zero while claimed, by the thread that owns the buffer or by
+		// TakeEntries.
+		volatile LONG claimed;
+
+		size_t used;
+		LONG entries;
+		DWORD startTime;
+		LogQueue::ShowCommand highestShowCommand;
+
+		// Staged entries, each a LogStagedEntry followed by its text, both
+		// padded with GetStagedSize.
+		char data[CAPACITY];
+	};
+
+	struct LogStagedEntry
+	{
+		// In bytes.
+		DWORD size;
+		COLORREF colour;
+		LogQueue::ShowCommand showCommand;
+		LONGLONG stamp;
+		BYTE type;
+	};
+
+	// Staged sizes are rounded up to pointer alignment, so a deferred record
+	// following an entry of an odd number of bytes (text, in an ANSI build)
+	// keeps its arguments aligned.
+	static size_t GetStagedSize(size_t size)
+	{
+		return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	}
+
+	//
+	// LogQueue
+	//
+
+	LogQueue::LogQueue()
+	{
+		_cells = NULL;
+		_cellCount = 0;
+		_cellMask = 0;
+		_maxEntryCells = 0;
+		_writePosition = _readPosition = 0;
+		_overflowPolicy = OVERFLOW_DROP_OLDEST;
+		_dropped = 0;
+		_droppedReported = 0;
+		_sink = NULL;
+		_sharedRing = NULL;
+		_deferredFormatting = false;
+		_stagingInterval = 10;
+		_stagingActive = false;
+
+		for (unsigned i = 0; i != MAX_CATEGORIES; ++i)
+			_levels[i] = LEVEL_TRACE;
+
+		SetQueueSize(256 * 1024);
+	}
+
+	LogQueue::~LogQueue()
+	{
+		delete[] _cells;
+
+		for (size_t i = 0; i != _stagingBuffers.size(); ++i)
+			delete _stagingBuffers[i];
+	}
+
+	void LogQueue::SetQueueSize(size_t bytes)
+	{
+		CriticalSection::ScopedLock lock(_cs);
+
+		// Positions wrap around at 2^32, so the cell count must be a power of
+		// two for them to keep mapping to the same cells.
+		LONG cellCount = 64;
+		while (cellCount < 0x10000000 && (size_t) cellCount * 2 * sizeof(LogCell) <= bytes)
+			cellCount *= 2;
+
+		delete[] _cells;
+		_cells = new LogCell[cellCount];
+		_cellCount = cellCount;
+		_cellMask = cellCount - 1;
+		_maxEntryCells = cellCount / 2;
+		_writePosition = _readPosition = 0;
+
+		// Make sure no cell looks like a published entry. A cell is never asked
+		// about a position a whole ring behind it.
+		for (LONG i = 0; i != cellCount; ++i)
+			_cells[i].sequence = i - cellCount;
+	}
+
+	void LogQueue::SetOverflowPolicy(OverflowPolicy overflowPolicy)
+	{
+		_overflowPolicy = overflowPolicy;
+	}
+
+	void LogQueue::OnPublish()
+	{
+	}
+
+	bool LogQueue::OnQueueFull()
+	{
+		return false;
+	}
+
+	bool LogQueue::CanWaitForSpace()
+	{
+		return false;
+	}
+
+	void LogQueue::OnStagingEnabled()
+	{
+	}
+
+	void LogQueue::WriteCellText(LogCell *cell, const TCHAR *text, size_t length)
+	{
+		size_t count = length < (size_t) FIRST_CELL_CHARS ? length : (size_t) FIRST_CELL_CHARS;
+		memcpy(cell->text + (CELL_CHARS - FIRST_CELL_CHARS), text, count * sizeof(TCHAR));
+
+		for (text += count, length -= count; length; text += count, length -= count)
+		{
+			++cell;
+			count = length < (size_t) CELL_CHARS ? length : (size_t) CELL_CHARS;
+			memcpy(cell->text, text, count * sizeof(TCHAR));
+		}
+	}
+
+	void LogQueue::ReadCellText(const LogCell *cell, TCHAR *text, size_t length)
+	{
+		size_t count = length < (size_t) FIRST_CELL_CHARS ? length : (size_t) FIRST_CELL_CHARS;
+		memcpy(text, cell->text + (CELL_CHARS - FIRST_CELL_CHARS), count * sizeof(TCHAR));
+
+		for (text += count, length -= count; length; text += count, length -= count)
+		{
+			++cell;
+			count = length < (size_t) CELL_CHARS ? length : (size_t) CELL_CHARS;
+			memcpy(text, cell->text, count * sizeof(TCHAR));
+		}
+	}
+
+	LogQueue::LogCell *LogQueue::ReserveCells(LONG cells, LONG *position)
+	{
+		for (;;)
+		{
+			LONG write = _writePosition;
+			LONG read = _readPosition;
+
+			// Entries were freed and written between the two reads.
+			if (write - read < 0)
+				continue;
+
+			LONG offset = write & _cellMask;
+			LONG padding = offset + cells > _cellCount ? _cellCount - offset : 0;
+
+			if (write - read + padding + cells > _cellCount)
+				return NULL;
+
+			if (InterlockedCompareExchange(&_writePosition, write + padding + cells, write) != write)
+				continue;
+
+			if (padding)
+			{
+				LogCell *pad = &_cells[offset];
+				pad->header.cells = padding;
+				pad->header.length = PADDING_LENGTH;
+
+				MemoryBarrier();
+				pad->sequence = write;
+			}
+
+			*position = write + padding;
+			return &_cells[*position & _cellMask];
+		}
+	}
+
+	bool LogQueue::IsHeaderValid(const LogCellHeader &header, LONG position) const
+	{
+		if (header.cells < 1 || header.cells > _cellCount - (position & _cellMask))
+			return false;
+
+		if (header.length == PADDING_LENGTH)
+			return true;
+
+		if (header.entries < 1)
+			return false;
+
+		return header.cells <= _maxEntryCells && GetCellsForLength(header.length) == header.cells;
+	}
+
+	bool LogQueue::DropOldestEntry()
+	{
+		LONG read = _readPosition;
+		if (read == _writePosition)
+			return true;
+
+		const LogCell *cell = &_cells[read & _cellMask];
+		if (cell->sequence != read)
+			return false;
+
+		MemoryBarrier();
+		LogCellHeader header = cell->header;
+		MemoryBarrier();
+
+		// If the header is torn, someone else has freed the entry already.
+		if (! IsHeaderValid(header, read))
+			return true;
+
+		if (InterlockedCompareExchange(&_readPosition, read + header.cells, read) == read)
+		{
+			if (header.length != PADDING_LENGTH)
+				InterlockedExchangeAdd(&_dropped, header.entries);
+		}
+
+		return true;
+	}
+
+	bool LogQueue::SkipUnreadableEntry(LONG read)
+	{
+		// Where the entry ends isn't known, but the next one starts at the next
+		// cell holding its own position with a header that makes sense. Only
+		// an entry's first cell is ever given its position, and continuation
+		// cells hold positions from earlier laps.
+		LONG write = _writePosition;
+		for (LONG position = read + 1; position - write < 0; ++position)
+		{
+			const LogCell *cell = &_cells[position & _cellMask];
+			if (cell->sequence != position)
+				continue;
+
+			MemoryBarrier();
+			LogCellHeader header = cell->header;
+
+			if (! IsHeaderValid(header, position))
+				continue;
+
+			// An entry still being written in between is lost too, which is
+			// harmless, as nothing reuses its cells until the write position
+			// has gone a whole ring further.
+			if (InterlockedCompareExchange(&_readPosition, position, read) == read)
+				InterlockedIncrement(&_dropped);
+
+			return true;
+		}
+
+		return false;
+	}
+
+	// Stamps are the whole performance counter, so they never wrap and can be
+	// compared directly.
+	static LONGLONG GetLogStamp()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	void LogQueue::Log(const TCHAR *log, COLORREF colour, ShowCommand showCommand)
+	{
+		Submit(log, std::char_traits<TCHAR>::length(log), colour, showCommand, ENTRY_TEXT);
+	}
+
+	bool LogQueue::Submit(const TCHAR *text, size_t length, COLORREF colour, ShowCommand showCommand, EntryType type)
+	{
+		if (type == ENTRY_TEXT)
+		{
+			if (_sink)
+				_sink->Write(text, length, colour);
+
+			if (_sharedRing)
+				_sharedRing->Write(text, length, colour);
+		}
+
+		LogStagingBuffer *staging = (LogStagingBuffer *) _staging.Get();
+		if (staging)
+		{
+			ClaimStaging(staging);
+			bool staged = Stage(staging, text, length, colour, showCommand, type);
+			ReleaseStaging(staging);
+
+			if (staged)
+				return true;
+		}
+
+		return Post(text, length, colour, showCommand, type, 1);
+	}
+
+	bool LogQueue::Post(const TCHAR *text, size_t length, COLORREF colour, ShowCommand showCommand, EntryType type, LONG entries)
+	{
+		size_t maxLength = GetMaxEntryLength();
+		if (length > maxLength)
+		{
+			// Only plain text can be cut short.
+			if (type != ENTRY_TEXT)
+				return false;
+
+			length = maxLength;
+		}
+
+		LONG cells = GetCellsForLength(length);
+
+		LONG position;
+		LogCell *cell;
+
+		while ((cell = ReserveCells(cells, &position)) == NULL)
+		{
+			// The thread taking entries may be able to make room itself.
+			if (OnQueueFull() && (cell = ReserveCells(cells, &position)) != NULL)
+				break;
+
+			OverflowPolicy overflowPolicy = _overflowPolicy;
+
+			if (overflowPolicy == OVERFLOW_DROP_OLDEST)
+			{
+				// Give the thread writing the oldest entry a chance to finish.
+				if (! DropOldestEntry())
+					Sleep(0);
+
+				continue;
+			}
+
+			if (overflowPolicy == OVERFLOW_BLOCK && CanWaitForSpace())
+			{
+				// Reset before trying again, so a Set can't be missed.
+				_spaceEvent.Reset();
+				if ((cell = ReserveCells(cells, &position)) != NULL)
+					break;
+
+				// Keep checking entries are still being taken.
+				_spaceEvent.Wait(100);
+				continue;
+			}
+
+			InterlockedExchangeAdd(&_dropped, entries);
+			return true;
+		}
+
+		cell->header.cells = cells;
+		cell->header.length = (DWORD) length;
+		cell->header.colour = colour;
+		cell->header.showCommand = showCommand;
+		cell->header.type = (BYTE) type;
+		cell->header.entries = entries;
+		LONGLONG stamp = _stagingActive ? GetLogStamp() : 0;
+		cell->header.stampLow = (DWORD) stamp;
+		cell->header.stampHigh = (DWORD) ((ULONGLONG) stamp >> 32);
+		WriteCellText(cell, text, length);
+
+		MemoryBarrier();
+		cell->sequence = position;
+
+		OnPublish();
+
+		return true;
+	}
+
+	//
+	// Staging
+	//
+
+	void LogQueue::EnableStaging()
+	{
+		if (_staging.Get())
+			return;
+
+		LogStagingBuffer *staging = new LogStagingBuffer;
+		staging->claimed = 0;
+		staging->used = 0;
+		staging->entries = 0;
+		staging->startTime = 0;
+		staging->highestShowCommand = SHOWCOMMAND_NO_CHANGE;
+
+		bool first;
+
+		{
+			CriticalSection::ScopedLock lock(_stagingCs);
+			_stagingBuffers.push_back(staging);
+			first = ! _stagingActive;
+			_stagingActive = true;
+		}
+
+		_staging.Set(staging);
+
+		if (first)
+			OnStagingEnabled();
+	}
+
+	void LogQueue::DisableStaging()
+	{
+		LogStagingBuffer *staging = (LogStagingBuffer *) _staging.Get();
+		if (! staging)
+			return;
+
+		ClaimStaging(staging);
+		PublishStaging(staging);
+		ReleaseStaging(staging);
+
+		_staging.Set(NULL);
+
+		// TakeEntries only claims buffers while holding _stagingCs, so once
+		// it's held the buffer is free.
+		CriticalSection::ScopedLock lock(_stagingCs);
+		_stagingBuffers.erase(std::find(_stagingBuffers.begin(), _stagingBuffers.end(), staging));
+		delete staging;
+	}
+
+	void LogQueue::FlushStaging()
+	{
+		LogStagingBuffer *staging = (LogStagingBuffer *) _staging.Get();
+		if (staging)
+		{
+			ClaimStaging(staging);
+			PublishStaging(staging);
+			ReleaseStaging(staging);
+		}
+	}
+
+	bool LogQueue::TryClaimStaging(LogStagingBuffer *staging)
+	{
+		return InterlockedCompareExchange(&staging->claimed, 1, 0) == 0;
+	}
+
+	void LogQueue::ClaimStaging(LogStagingBuffer *staging)
+	{
+		// TakeEntries only holds the buffer long enough to copy it.
+		while (! TryClaimStaging(staging))
+			Sleep(0);
+	}
+
+	void LogQueue::ReleaseStaging(LogStagingBuffer *staging)
+	{
+		InterlockedExchange(&staging->claimed, 0);
+	}
+
+	bool LogQueue::HasStagedEntries()
+	{
+		CriticalSection::ScopedLock lock(_stagingCs);
+
+		for (size_t i = 0; i != _stagingBuffers.size(); ++i)
+		{
+			if (_stagingBuffers[i]->used)
+				return true;
+		}
+
+		return false;
+	}
+
+	bool LogQueue::Stage(LogStagingBuffer *staging, const TCHAR *text, size_t length, COLORREF colour, ShowCommand showCommand, EntryType type)
+	{
+		// A batch has to fit in the queue as a single entry.
+		size_t capacity = GetMaxEntryLength() * sizeof(TCHAR);
+		if (capacity > LogStagingBuffer::CAPACITY)
+			capacity = LogStagingBuffer::CAPACITY;
+
+		size_t size = length * sizeof(TCHAR);
+		size_t needed = GetStagedSize(sizeof(LogStagedEntry)) + GetStagedSize(size);
+
+		if (needed > capacity)
+		{
+			// Publish what's staged so this entry stays in order.
+			PublishStaging(staging);
+			return false;
+		}
+
+		if (staging->used + needed > capacity)
+			PublishStaging(staging);
+
+		if (! staging->used)
+			staging->startTime = GetTickCount();
+
+		LogStagedEntry entry;
+		entry.size = (DWORD) size;
+		entry.colour = colour;
+		entry.showCommand = showCommand;
+		entry.stamp = GetLogStamp();
+		entry.type = (BYTE) type;
+
+		memcpy(staging->data + staging->used, &entry, sizeof(entry));
+		memcpy(staging->data + staging->used + GetStagedSize(sizeof(entry)), text, size);
+		staging->used += needed;
+		++staging->entries;
+
+		if (showCommand > staging->highestShowCommand)
+			staging->highestShowCommand = showCommand;
+
+		// Anything that shows the window goes straight out.
+		if (showCommand != SHOWCOMMAND_NO_CHANGE || GetTickCount() - staging->startTime >= _stagingInterval)
+			PublishStaging(staging);
+
+		return true;
+	}
+
+	void LogQueue::PublishStaging(LogStagingBuffer *staging)
+	{
+		if (! staging->used)
+			return;
+
+		Post((const TCHAR *) staging->data, (staging->used + sizeof(TCHAR) - 1) / sizeof(TCHAR), 0,
+			staging->highestShowCommand, ENTRY_BATCH, staging->entries);
+
+		staging->used = 0;
+		staging->entries = 0;
+		staging->highestShowCommand = SHOWCOMMAND_NO_CHANGE;
+	}
+
+	void LogQueue::Format(COLORREF colour, ShowCommand showCommand, const TCHAR *fmt, ...)
+	{
+		va_list argPtr;
+		va_start(argPtr, fmt);
+		FormatVA(colour, showCommand, fmt, argPtr);
+		va_end(argPtr);
+	}
+
+	void LogQueue::FormatVA(COLORREF colour, ShowCommand showCommand, const TCHAR *fmt, va_list argPtr)
+	{
+		// The sink is written to as entries are submitted, so it can't wait for
+		// them to be formatted.
+		if (_deferredFormatting && ! _sink)
+		{
+			// LONGLONGs, so the arguments are aligned whatever TCHAR is.
+			LONGLONG record[MAX_DEFERRED_BYTES / sizeof(LONGLONG)];
+
+			// On some platforms va_list is an array, so passing it on doesn't
+			// copy it. Copy it explicitly so argPtr stays at the first argument.
+			va_list captureArgs;
+			WNDLIB_VA_COPY(captureArgs, argPtr);
+			size_t size = CaptureFormat((char *) record, sizeof(record), fmt, captureArgs);
+			va_end(captureArgs);
+
+			if (size && Submit((const TCHAR *) record, (size + sizeof(TCHAR) - 1) / sizeof(TCHAR), colour, showCommand, ENTRY_DEFERRED))
+				return;
+		}
+
+		Log(LogFormatVA(fmt, argPtr).c_str(), colour, showCommand);
+	}
+
+	void LogQueue::SetLevel(unsigned category, Level level)
+	{
+		WNDLIB_ASSERT(category < MAX_CATEGORIES);
+		if (category < MAX_CATEGORIES)
+			InterlockedExchange(&_levels[category], level);
+	}
+
+	void LogQueue::SetLevel(Level level)
+	{
+		for (unsigned i = 0; i != MAX_CATEGORIES; ++i)
+			InterlockedExchange(&_levels[i], level);
+	}
+
+	void LogQueue::Log(unsigned category, Level level, const TCHAR *log, COLORREF colour, ShowCommand showCommand)
+	{
+		if (IsEnabled(category, level))
+			Log(log, colour, showCommand);
+	}
+
+	void LogQueue::Format(unsigned category, Level level, COLORREF colour, ShowCommand showCommand, const TCHAR *fmt, ...)
+	{
+		if (! IsEnabled(category, level))
+			return;
+
+		va_list argPtr;
+		va_start(argPtr, fmt);
+		FormatVA(colour, showCommand, fmt, argPtr);
+		va_end(argPtr);
+	}
+
+	//
+	// Taking entries
+	//
+
+	struct LogQueuedEntry
+	{
+		LONGLONG stamp;
+		COLORREF colour;
+		LogQueue::ShowCommand showCommand;
+		TCharString text;
+
+		struct EarlierStamp
+		{
+			bool operator()(const LogQueuedEntry &a, const LogQueuedEntry &b) const
+			{
+				return a.stamp < b.stamp;
+			}
+		};
+	};
+
+	void LogQueue::TakeBatch(const char *batch, size_t size, std::vector<LogQueuedEntry> *merged)
+	{
+		const char *end = batch + size;
+
+		while ((size_t) (end - batch) >= sizeof(LogStagedEntry))
+		{
+			LogStagedEntry entry;
+			memcpy(&entry, batch, sizeof(entry));
+			batch += GetStagedSize(sizeof(entry));
+
+			LogQueuedEntry queued;
+			queued.stamp = entry.stamp;
+			queued.colour = entry.colour;
+			queued.showCommand = entry.showCommand;
+
+			if (entry.type == ENTRY_DEFERRED)
+			{
+				queued.text = RenderFormat(batch, entry.size);
+
+				if (_sharedRing)
+					_sharedRing->Write(queued.text.data(), queued.text.size(), queued.colour);
+			}
+			else
+			{
+				queued.text.resize(entry.size / sizeof(TCHAR));
+				if (entry.size)
+					memcpy(&queued.text[0], batch, entry.size);
+			}
+
+			batch += GetStagedSize(entry.size);
+			merged->push_back(queued);
+		}
+	}
+
+	void LogQueue::TakeStaleStaging(std::vector<LogQueuedEntry> *merged)
+	{
+		CriticalSection::ScopedLock lock(_stagingCs);
+		DWORD now = GetTickCount();
+
+		for (size_t i = 0; i != _stagingBuffers.size(); ++i)
+		{
+			LogStagingBuffer *staging = _stagingBuffers[i];
+
+			// A buffer its thread is writing to will be published by it.
+			if (! TryClaimStaging(staging))
+				continue;
+
+			if (staging->used && now - staging->startTime >= _stagingInterval)
+			{
+				// Copied, so the buffer is held for as short a time as possible.
+				TCharString batch((const TCHAR *) staging->data, (staging->used + sizeof(TCHAR) - 1) / sizeof(TCHAR));
+
+				staging->used = 0;
+				staging->entries = 0;
+				staging->highestShowCommand = SHOWCOMMAND_NO_CHANGE;
+				ReleaseStaging(staging);
+
+				TakeBatch((const char *) batch.data(), batch.size() * sizeof(TCHAR), merged);
+			}
+			else
+			{
+				ReleaseStaging(staging);
+			}
+		}
+	}
+
+	size_t LogQueue::TakeEntries(EntryCallback callback, void *context)
+	{
+		size_t taken = 0;
+		Entry taking;
+
+		LONG dropped = _dropped;
+		if (dropped != _droppedReported)
+		{
+			TCharString message = LogFormat(TEXT("(%ld log entries dropped)\n"), (long) (dropped - _droppedReported));
+			taking.text = message.data();
+			taking.length = message.size();
+			taking.colour = RGB(128, 128, 128);
+			taking.showCommand = SHOWCOMMAND_NO_CHANGE;
+			callback(context, taking);
+			++taken;
+
+			_droppedReported = dropped;
+		}
+
+		// Once staging is in use, entries are collected and sorted before
+		// they're passed on.
+		const bool mergeEntries = _stagingActive;
+		std::vector<LogQueuedEntry> merged;
+
+		// Taken before the ring, which holds anything their threads published
+		// earlier, so sorting puts both in order.
+		if (mergeEntries)
+			TakeStaleStaging(&merged);
+
+		// Take entries until we reach one that hasn't been published yet. Each is
+		// copied out before being freed, since producers dropping the oldest
+		// entry can free it, and then overwrite it, while we're reading it.
+		TCharString text;
+		LONG invalidPosition = _readPosition;
+		int invalidReads = 0;
+
+		for (;;)
+		{
+			LONG read = _readPosition;
+			if (read == _writePosition)
+				break;
+
+			const LogCell *cell = &_cells[read & _cellMask];
+			if (cell->sequence != read)
+				break;
+
+			MemoryBarrier();
+			LogCellHeader header = cell->header;
+
+			if (! IsHeaderValid(header, read))
+			{
+				// Usually the entry was freed and overwritten while we read it,
+				// and _readPosition has moved on. If it keeps failing at the
+				// same position, the header itself is bad.
+				if (read != invalidPosition)
+				{
+					invalidPosition = read;
+					invalidReads = 0;
+				}
+
+				if (++invalidReads >= MAX_HEADER_RETRIES)
+				{
+					// Try again once something's been published after it.
+					if (! SkipUnreadableEntry(read))
+						break;
+
+					invalidReads = 0;
+				}
+
+				continue;
+			}
+
+			if (header.length != PADDING_LENGTH)
+			{
+				text.resize(header.length);
+				if (header.length)
+					ReadCellText(cell, &text[0], header.length);
+			}
+
+			MemoryBarrier();
+
+			if (InterlockedCompareExchange(&_readPosition, read + header.cells, read) != read)
+				continue;
+
+			if (header.length == PADDING_LENGTH)
+				continue;
+
+			// Only now is the copy known to be intact.
+			if (header.type == ENTRY_BATCH)
+			{
+				TakeBatch((const char *) text.data(), text.size() * sizeof(TCHAR), &merged);
+				continue;
+			}
+
+			if (header.type == ENTRY_DEFERRED)
+			{
+				text = RenderFormat((const char *) text.data(), text.size() * sizeof(TCHAR));
+
+				if (_sharedRing)
+					_sharedRing->Write(text.data(), text.size(), header.colour);
+			}
+
+			if (mergeEntries)
+			{
+				LogQueuedEntry queued;
+				queued.stamp = (LONGLONG) (((ULONGLONG) header.stampHigh << 32) | header.stampLow);
+				queued.colour = header.colour;
+				queued.showCommand = header.showCommand;
+				queued.text = text;
+				merged.push_back(queued);
+			}
+			else
+			{
+				taking.text = text.data();
+				taking.length = text.size();
+				taking.colour = header.colour;
+				taking.showCommand = header.showCommand;
+				callback(context, taking);
+				++taken;
+			}
+		}
+
+		if (! merged.empty())
+		{
+			// Batches arrive late, so put everything back in the order it was
+			// logged.
+			std::stable_sort(merged.begin(), merged.end(), LogQueuedEntry::EarlierStamp());
+
+			for (size_t i = 0; i != merged.size(); ++i)
+			{
+				taking.text = merged[i].text.data();
+				taking.length = merged[i].text.size();
+				taking.colour = merged[i].colour;
+				taking.showCommand = merged[i].showCommand;
+				callback(context, taking);
+			}
+
+			taken += merged.size();
+		}
+
+		_spaceEvent.Set();
+		return taken;
+	}
+}
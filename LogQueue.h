@@ -0,0 +1,446 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_LOGQUEUE_H
+#define WNDLIB_LOGQUEUE_H
+
+#include "WndLibBase.h"
+#include <stddef.h>
+#include <vector>
+
+namespace WndLib
+{
+	//
+	// LogSink: Receives everything logged to a LogWnd, in addition to (or,
+	// for a LogWnd with no window, instead of) the window.
+	//
+
+	class WNDLIB_EXPORT LogSink
+	{
+	public:
+
+		virtual ~LogSink() {}
+
+		// Called with the text of each entry by the thread that logs it, before
+		// the entry is queued for the window, so nothing the queue drops is
+		// lost to the sink. Must be safe to call from several threads at once.
+		virtual void Write(LPCTSTR text, size_t length, COLORREF colour) = 0;
+	};
+
+	struct LogStagingBuffer;
+	struct LogQueuedEntry;
+
+	//
+	// LogQueue: Carries log entries from the threads that log them to the one
+	// that displays them. This is everything LogWnd does that doesn't involve
+	// the window (levels, the sink, staging, deferred formatting and the ring
+	// buffer) so it builds, and is benchmarked, without Win32. LogWnd's thread
+	// takes entries from the queue; a derived class decides who does by
+	// overriding OnPublish.
+	//
+
+	class WNDLIB_EXPORT LogQueue
+	{
+	public:
+
+		LogQueue();
+
+		virtual ~LogQueue();
+
+		enum ShowCommand
+		{
+			// The window is not shown if it's hidden.
+			SHOWCOMMAND_NO_CHANGE,
+
+			// The window is shown if it's hidden, but it doesn't move to the foreground.
+			SHOWCOMMAND_SHOW_IN_BACKGROUND,
+
+			// The window is shown and activated if it's hidden.
+			SHOWCOMMAND_SHOW_IN_FOREGROUND,
+
+			// The window is shown if it's hidden, and moved to the foreground.
+			SHOWCOMMAND_ALERT
+		};
+
+		// Write to the log. Can be called from any thread.
+		void Log(const TCHAR *log, COLORREF colour, ShowCommand showCommand);
+
+		// Write a printf formatted string to the log. Can be called from any thread.
+		void Format(COLORREF colour, ShowCommand showCommand, const TCHAR *fmt, ...);
+
+		enum OverflowPolicy
+		{
+			// Wait for the window to catch up. Logging from the window's own
+			// thread never waits, and if there's no window the entry is dropped.
+			OVERFLOW_BLOCK,
+
+			// Drop the oldest entries that haven't been displayed yet.
+			OVERFLOW_DROP_OLDEST,
+
+			// Drop the entry being logged.
+			OVERFLOW_DROP_NEWEST
+		};
+
+		// Entries waiting to be displayed are held in a fixed size ring buffer,
+		// 256KB by default, so logging doesn't allocate or lock and memory use
+		// stays bounded however fast other threads log. The size is rounded down
+		// to a power of two. Entries longer than half the ring buffer are
+		// truncated. Call before logging anything, any entries already waiting
+		// are discarded.
+		void SetQueueSize(size_t bytes);
+
+		// What to do when the ring buffer is full. Defaults to
+		// OVERFLOW_DROP_OLDEST.
+		void SetOverflowPolicy(OverflowPolicy overflowPolicy);
+
+		// The number of entries dropped because the ring buffer was full. A
+		// dropped batch from a staging buffer counts every entry in it.
+		LONG GetDroppedCount() const
+		{
+			return _dropped;
+		}
+
+		// Collect entries logged by the calling thread in a buffer of its own,
+		// and add them to the queue as a single batch when it fills, when the
+		// staging interval has passed since the first was staged, when an entry
+		// would show the window, or when FlushStaging is called. TakeEntries
+		// orders the entries it takes from different batches by when they were
+		// logged. Entries staged by a thread that then stops logging are taken
+		// by TakeEntries once the staging interval has passed. Each queue uses
+		// a thread local storage index (see ThreadLocalPointer), of which a
+		// process only has a limited number, so don't create queues freely.
+		void EnableStaging();
+
+		// Flush the calling thread's staging buffer and stop using it.
+		void DisableStaging();
+
+		// Add the calling thread's staged entries to the queue.
+		void FlushStaging();
+
+		// Defaults to 10 milliseconds.
+		void SetStagingInterval(DWORD milliseconds)
+		{
+			_stagingInterval = milliseconds;
+		}
+
+		// Also send everything logged to a sink, e.g., a LogFileSink. The sink
+		// is written to as entries are logged, ahead of the queue, so it gets
+		// every entry whatever the overflow policy. It must outlive the queue
+		// or be removed by passing NULL.
+		void SetSink(LogSink *sink)
+		{
+			_sink = sink;
+		}
+
+		// Also append everything logged to a LogSharedRing, so it survives a
+		// crash. Entries are appended as they're logged, except that deferred
+		// entries are appended once they've been formatted. The ring must
+		// outlive the queue or be removed by passing NULL.
+		void SetSharedRing(LogSink *sharedRing)
+		{
+			_sharedRing = sharedRing;
+		}
+
+		// Have Format store the format string and a copy of its arguments in the
+		// queue, leaving the window's thread to format them as they're
+		// displayed. Entries dropped before then are never formatted. Ignored
+		// while there's a sink, since the sink needs the text at once. Only
+		// enable this if every format string passed to Format is never freed,
+		// e.g., they're all string literals. Formats using %n, and entries too
+		// large to store this way, are formatted straight away. Defaults to
+		// false.
+		void SetDeferredFormatting(bool deferredFormatting)
+		{
+			_deferredFormatting = deferredFormatting;
+		}
+
+		enum Level
+		{
+			LEVEL_TRACE,
+			LEVEL_DEBUG,
+			LEVEL_INFO,
+			LEVEL_WARNING,
+			LEVEL_ERROR,
+
+			// Only as a threshold, to suppress everything.
+			LEVEL_OFF
+		};
+
+		// Categories are numbered by the application, from 0 to MAX_CATEGORIES - 1.
+		// Any other category is treated as LEVEL_OFF, i.e., always disabled.
+		enum { MAX_CATEGORIES = 32 };
+
+		// Entries in category below level are discarded. Can be called from any
+		// thread at any time. Every category starts at LEVEL_TRACE. Does nothing
+		// if category is out of range.
+		void SetLevel(unsigned category, Level level);
+
+		// Set the level of every category.
+		void SetLevel(Level level);
+
+		Level GetLevel(unsigned category) const
+		{
+			return category < MAX_CATEGORIES ? (Level) _levels[category] : LEVEL_OFF;
+		}
+
+		// Check before building an entry that's expensive to produce. This is
+		// the whole cost of an entry that's discarded.
+		bool IsEnabled(unsigned category, Level level) const
+		{
+			return category < MAX_CATEGORIES && (LONG) level >= _levels[category];
+		}
+
+		// As Log and Format, but discarded before any formatting or allocation
+		// if category's level is above level.
+		void Log(unsigned category, Level level, const TCHAR *log, COLORREF colour, ShowCommand showCommand);
+		void Format(unsigned category, Level level, COLORREF colour, ShowCommand showCommand, const TCHAR *fmt, ...);
+
+		// An entry taken from the queue. text is only valid during the callback.
+		struct Entry
+		{
+			LPCTSTR text;
+			size_t length;
+			COLORREF colour;
+			ShowCommand showCommand;
+		};
+
+		typedef void (*EntryCallback)(void *context, const Entry &entry);
+
+		// Take every entry that's been published and pass it to callback, in the
+		// order they were logged. If entries have been dropped since the last
+		// call, a line saying how many comes first. Deferred entries are
+		// formatted here, and staged entries that have waited longer than the
+		// staging interval are taken from their staging buffers. Only one
+		// thread may take entries at a time. Returns the number of entries
+		// passed to callback.
+		size_t TakeEntries(EntryCallback callback, void *context);
+
+	protected:
+
+		// Called by the logging thread after it's added an entry to the queue,
+		// to have entries taken. Does nothing by default, so entries wait for
+		// the next TakeEntries.
+		virtual void OnPublish();
+
+		// Called by a logging thread that has found the ring buffer full, before
+		// the overflow policy is applied, so the thread that takes entries can
+		// make room itself. Returns true if it may have. Defaults to false.
+		virtual bool OnQueueFull();
+
+		// Whether OVERFLOW_BLOCK may wait for the calling thread, which it
+		// mustn't if nothing is taking entries or if the calling thread is the
+		// one that does. Defaults to false.
+		virtual bool CanWaitForSpace();
+
+		// Called by the first thread to enable staging, so the thread that
+		// takes entries can start calling TakeEntries regularly to collect
+		// staged entries that are never published. Does nothing by default.
+		virtual void OnStagingEnabled();
+
+		bool IsStagingActive() const
+		{
+			return _stagingActive;
+		}
+
+		DWORD GetStagingInterval() const
+		{
+			return _stagingInterval;
+		}
+
+		// Whether any thread has entries staged. Only a hint, as they may be
+		// published at any moment.
+		bool HasStagedEntries();
+
+	private:
+
+		// The ring buffer is made of cells. An entry is a header, in its first
+		// cell, followed by its text, which continues in to as many cells as it
+		// needs. Entries don't wrap around the end of the ring, a padding entry
+		// fills the gap instead.
+		//
+		// Producers reserve cells by advancing _writePosition with
+		// InterlockedCompareExchange, and publish an entry by setting the
+		// sequence of its first cell to its position. TakeEntries, and
+		// producers dropping the oldest entry, free entries by advancing
+		// _readPosition the same way. Nothing takes a lock.
+		enum { CELL_SIZE = 64 };
+
+		struct LogCellHeader
+		{
+			// The number of cells in the entry, including this one.
+			LONG cells;
+
+			// PADDING_LENGTH for a padding entry.
+			DWORD length;
+
+			COLORREF colour;
+			ShowCommand showCommand;
+
+			// An EntryType.
+			BYTE type;
+
+			// How many log entries this is, which for a batch is more than one.
+			LONG entries;
+
+			// When the entry was logged, if staging is in use. Split in two, as
+			// a LONGLONG would need 8 byte alignment and make the cells bigger.
+			DWORD stampLow;
+			DWORD stampHigh;
+		};
+
+		struct LogCell
+		{
+			// Only meaningful in an entry's first cell. Only ever holds a
+			// position, so a cell whose entry hasn't been published yet holds
+			// the position of an older entry.
+			volatile LONG sequence;
+
+			union
+			{
+				LogCellHeader header;
+				TCHAR text[(CELL_SIZE - sizeof(LONG)) / sizeof(TCHAR)];
+			};
+		};
+
+		static const DWORD PADDING_LENGTH = 0xffffffff;
+
+		enum
+		{
+			// Characters of text that fit in an entry's first cell, and in each
+			// of the following cells.
+			FIRST_CELL_CHARS = (CELL_SIZE - sizeof(LONG) - sizeof(LogCellHeader)) / sizeof(TCHAR),
+			CELL_CHARS = (CELL_SIZE - sizeof(LONG)) / sizeof(TCHAR)
+		};
+
+		static LONG GetCellsForLength(size_t length)
+		{
+			if (length <= FIRST_CELL_CHARS)
+				return 1;
+
+			return (LONG) (1 + (length - FIRST_CELL_CHARS + CELL_CHARS - 1) / CELL_CHARS);
+		}
+
+		// Copy an entry's text in to or out of the cells following cell.
+		static void WriteCellText(LogCell *cell, const TCHAR *text, size_t length);
+		static void ReadCellText(const LogCell *cell, TCHAR *text, size_t length);
+
+		// Returns NULL if there isn't room.
+		LogCell *ReserveCells(LONG cells, LONG *position);
+
+		enum EntryType
+		{
+			ENTRY_TEXT,
+
+			// The text is a format string and its arguments, to be formatted by
+			// TakeEntries.
+			ENTRY_DEFERRED,
+
+			// The text is a staging buffer's entries.
+			ENTRY_BATCH
+		};
+
+		// The most characters an entry can hold.
+		size_t GetMaxEntryLength() const
+		{
+			return FIRST_CELL_CHARS + (size_t) (_maxEntryCells - 1) * CELL_CHARS;
+		}
+
+		// Add an entry, made of entries log entries, to the queue. Returns false
+		// if a deferred entry or batch is too large; text that's too large is
+		// truncated.
+		bool Post(const TCHAR *text, size_t length, COLORREF colour, ShowCommand showCommand, EntryType type, LONG entries);
+
+		// Add an entry to the calling thread's staging buffer, if it has one,
+		// otherwise to the queue.
+		bool Submit(const TCHAR *text, size_t length, COLORREF colour, ShowCommand showCommand, EntryType type);
+
+		// Returns false, having published what's already staged, if the entry
+		// is too large to stage.
+		bool Stage(LogStagingBuffer *staging, const TCHAR *text, size_t length, COLORREF colour, ShowCommand showCommand, EntryType type);
+
+		// The caller must have claimed the staging buffer.
+		void PublishStaging(LogStagingBuffer *staging);
+
+		// A staging buffer is claimed by its thread while it's written to, and
+		// by TakeEntries while it takes stale entries from it.
+		static bool TryClaimStaging(LogStagingBuffer *staging);
+		static void ClaimStaging(LogStagingBuffer *staging);
+		static void ReleaseStaging(LogStagingBuffer *staging);
+
+		void FormatVA(COLORREF colour, ShowCommand showCommand, const TCHAR *fmt, va_list argPtr);
+
+		// The largest deferred entry, format pointer and arguments included.
+		enum { MAX_DEFERRED_BYTES = 1024 };
+
+		// Free the oldest entry. Returns false if it's still being written.
+		bool DropOldestEntry();
+
+		// Returns false if the header is torn, i.e., the entry was freed and
+		// overwritten while it was being read.
+		bool IsHeaderValid(const LogCellHeader &header, LONG position) const;
+
+		// How many times TakeEntries rereads an invalid header at the same
+		// position before it gives up on the entry.
+		enum { MAX_HEADER_RETRIES = 64 };
+
+		// Add the entries in a batch to merged, formatting any deferred ones.
+		void TakeBatch(const char *batch, size_t size, std::vector<LogQueuedEntry> *merged);
+
+		// Take the entries from any staging buffer whose entries have waited
+		// longer than the staging interval, and whose thread isn't using it.
+		void TakeStaleStaging(std::vector<LogQueuedEntry> *merged);
+
+		// Discard the entry at read, whose header can't be made sense of, by
+		// moving on to the next entry that's been published, counting it as
+		// one dropped entry. Returns false if there isn't one yet.
+		bool SkipUnreadableEntry(LONG read);
+
+		// Only used by SetQueueSize.
+		CriticalSection _cs;
+
+		LogCell *_cells;
+		LONG _cellCount;
+		LONG _cellMask;
+
+		// Entries are truncated to this many cells, which guarantees an entry
+		// fits in an empty ring wherever the ring starts.
+		LONG _maxEntryCells;
+
+		// Count cells ever reserved and freed. The difference is the number of
+		// cells in use.
+		volatile LONG _writePosition;
+		volatile LONG _readPosition;
+
+		volatile OverflowPolicy _overflowPolicy;
+		volatile LONG _dropped;
+		LONG _droppedReported;
+
+		// Set when TakeEntries frees space, for OVERFLOW_BLOCK.
+		Event _spaceEvent;
+
+		LogSink *_sink;
+		LogSink *_sharedRing;
+		bool _deferredFormatting;
+
+		// Each thread's staging buffer, and all of them so they can be freed
+		// and so TakeEntries can find stale ones.
+		ThreadLocalPointer _staging;
+		CriticalSection _stagingCs;
+		std::vector<LogStagingBuffer *> _stagingBuffers;
+		DWORD _stagingInterval;
+
+		// Set once any thread has enabled staging, after which entries are
+		// stamped and TakeEntries sorts them.
+		volatile bool _stagingActive;
+
+		// The level of each category. Aligned LONGs, so they're read and written
+		// atomically without a lock.
+		volatile LONG _levels[MAX_CATEGORIES];
+	};
+}
+
+#endif
@@ -0,0 +1,428 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "LogRtf.h"
+#include "LogScan.h"
+
+namespace WndLib
+{
+	//
+	// RTF control words are built here rather than with sprintf, which is
+	// several times slower and differs between runtimes.
+	//
+
+	static void AppendDecimal(std::string *rtf, int value)
+	{
+		char digits[16];
+		char *p = digits + sizeof(digits);
+
+		unsigned magnitude = value < 0 ? 0u - (unsigned) value : (unsigned) value;
+		do
+		{
+			*--p = (char) ('0' + magnitude % 10);
+			magnitude /= 10;
+		}
+		while (magnitude);
+
+		if (value < 0)
+			*--p = '-';
+
+		rtf->append(p, digits + sizeof(digits));
+	}
+
+	static void AppendControl(std::string *rtf, const char *control, int value)
+	{
+		*rtf += control;
+		AppendDecimal(rtf, value);
+	}
+
+	//
+	// LogRtfWriter
+	//
+
+	LogRtfWriter::LogRtfWriter(std::vector<COLORREF> *palette) :
+		_palette(palette),
+		_firstColourIndex(1),
+		_colour(-1),
+		_lastColour(CLR_INVALID)
+	{
+	}
+
+	void LogRtfWriter::Append(LPCTSTR text, size_t length, COLORREF colour)
+	{
+		if (colour != _lastColour)
+		{
+			int index = GetColourIndex(colour);
+			if (index != _colour)
+			{
+				AppendControl(&_body, "\\cf", index);
+				_body += ' ';
+				_colour = index;
+			}
+
+			_lastColour = colour;
+		}
+
+		AppendEscaped(&_body, text, length);
+	}
+
+	std::string LogRtfWriter::Finish(LPCTSTR faceName, int charSet, LONG height) const
+	{
+		std::string rtf = GetHeader(faceName, charSet, height);
+		rtf.reserve(rtf.size() + _body.size() + 1);
+		rtf += _body;
+		rtf += '}';
+		return rtf;
+	}
+
+	std::string LogRtfWriter::GetHeader(LPCTSTR faceName, int charSet, LONG height) const
+	{
+		std::string rtf;
+
+		AppendControl(&rtf, "{\\rtf1\\ansi\\uc1\\deff0{\\fonttbl{\\f0\\fnil\\fcharset", charSet);
+		rtf += ' ';
+		AppendEscaped(&rtf, faceName, std::char_traits<TCHAR>::length(faceName));
+		rtf += ";}}{\\colortbl;";
+		rtf += GetColourTable();
+
+		// height is in twips, \fs wants half points.
+		AppendControl(&rtf, "}\\f0\\fs", (int) (height / 10));
+		rtf += ' ';
+		return rtf;
+	}
+
+	std::string LogRtfWriter::GetColourTable() const
+	{
+		std::string table;
+
+		const std::vector<COLORREF> &colours = *_palette;
+		for (size_t i = 0; i != colours.size(); ++i)
+		{
+			AppendControl(&table, "\\red", GetRValue(colours[i]));
+			AppendControl(&table, "\\green", GetGValue(colours[i]));
+			AppendControl(&table, "\\blue", GetBValue(colours[i]));
+			table += ';';
+		}
+
+		return table;
+	}
+
+	int LogRtfWriter::GetColourIndex(COLORREF colour)
+	{
+		std::vector<COLORREF> &colours = *_palette;
+		for (size_t i = 0; i != colours.size(); ++i)
+		{
+			if (colours[i] == colour)
+				return (int) i + _firstColourIndex;
+		}
+
+		colours.push_back(colour);
+		return (int) colours.size() - 1 + _firstColourIndex;
+	}
+
+	void LogRtfWriter::AppendEscaped(std::string *rtf, LPCTSTR text, size_t length)
+	{
+		static const char hexDigits[] = "0123456789abcdef";
+
+		for (LPCTSTR end = text + length; text != end; ++text)
+		{
+			// Copy ordinary characters in bulk.
+			LPCTSTR special = Private::FindRtfSpecialChar(text, end);
+			if (special != text)
+			{
+				size_t count = special - text;
+				size_t used = rtf->size();
+				rtf->resize(used + count);
+
+				char *dest = &(*rtf)[used];
+				for (size_t i = 0; i != count; ++i)
+					dest[i] = (char) text[i];
+
+				text = special;
+				if (text == end)
+					break;
+			}
+
+			TCHAR ch = *text;
+
+			switch (ch)
+			{
+				case '\r':
+					// Newlines are normalised to \n.
+					break;
+
+				case '\n':
+					*rtf += "\\par\n";
+					break;
+
+				case '\t':
+					*rtf += "\\tab ";
+					break;
+
+				case '\\':
+				case '{':
+				case '}':
+					*rtf += '\\';
+					*rtf += (char) ch;
+					break;
+
+				default:
+					if (Private::IsPlainRtfChar(ch))
+					{
+						*rtf += (char) ch;
+					}
+					else
+					{
+						#ifdef WNDLIB_UNICODE
+							AppendControl(rtf, "\\u", (int) (short) ch);
+							*rtf += '?';
+						#else
+							unsigned byte = (unsigned) (unsigned char) ch;
+							*rtf += "\\'";
+							*rtf += hexDigits[byte >> 4];
+							*rtf += hexDigits[byte & 15];
+						#endif
+					}
+					break;
+			}
+		}
+	}
+
+	//
+	// LogRtfMerger
+	//
+
+	LogRtfMerger::LogRtfMerger(const std::string &colourTable) :
+		_colourTable(colourTable),
+		_inHeader(true),
+		_firstColourIndex(1)
+	{
+	}
+
+	void LogRtfMerger::Write(const char *data, size_t size, std::string *out)
+	{
+		_pending.append(data, size);
+
+		if (_inHeader)
+		{
+			if (! AddColourTable(_pending.size() > MAX_HEADER_LENGTH))
+				return;
+		}
+
+		// The last brace seen might be the document's.
+		size_t brace = _pending.rfind('}');
+		if (brace == std::string::npos)
+		{
+			*out += _pending;
+			_pending.clear();
+		}
+		else
+		{
+			out->append(_pending, 0, brace);
+			_pending.erase(0, brace);
+		}
+	}
+
+	void LogRtfMerger::Finish(std::string *out)
+	{
+		if (_inHeader)
+			AddColourTable(true);
+
+		// Drop the brace, and anything following it, such as a line break.
+		size_t brace = _pending.rfind('}');
+		out->append(_pending, 0, brace == std::string::npos ? _pending.size() : brace);
+		_pending.clear();
+	}
+
+	bool LogRtfMerger::AddColourTable(bool final)
+	{
+		static const char colourTableWord[] = "\\colortbl";
+		static const char fontTableWord[] = "\\fonttbl";
+		const size_t colourTableWordLength = sizeof(colourTableWord) - 1;
+		const size_t fontTableWordLength = sizeof(fontTableWord) - 1;
+
+		const std::string &rtf = _pending;
+		size_t fontTableEnd = std::string::npos;
+		size_t fontTableDepth = 0;
+		size_t depth = 0;
+		bool bodyFound = false;
+
+		for (size_t i = 0; i < rtf.size(); ++i)
+		{
+			char ch = rtf[i];
+
+			if (ch == '\\')
+			{
+				// Skip the escaped character, or the control word's first letter.
+				++i;
+				continue;
+			}
+
+			if (ch == '{')
+			{
+				++depth;
+
+				// Only the document's own groups are of interest.
+				if (depth != 2)
+					continue;
+
+				if (rtf.size() - (i + 1) < colourTableWordLength && ! final)
+					return false;
+
+				if (rtf.compare(i + 1, colourTableWordLength, colourTableWord) == 0)
+				{
+					size_t end = rtf.find('}', i);
+					if (end == std::string::npos)
+					{
+						if (! final)
+							return false;
+
+						break;
+					}
+
+					// Entries end with a semicolon, the first being the default
+					// colour's, so the added colours start at the number of them.
+					_firstColourIndex = 0;
+					for (size_t j = i; j != end; ++j)
+					{
+						if (rtf[j] == ';')
+							++_firstColourIndex;
+					}
+
+					// There's always a default colour.
+					if (! _firstColourIndex)
+					{
+						_pending.insert(end, ";" + _colourTable);
+						_firstColourIndex = 1;
+					}
+					else
+					{
+						_pending.insert(end, _colourTable);
+					}
+
+					_inHeader = false;
+					return true;
+				}
+
+				if (rtf.compare(i + 1, fontTableWordLength, fontTableWord) == 0)
+					fontTableDepth = depth;
+
+				continue;
+			}
+
+			if (ch == '}')
+			{
+				if (fontTableDepth && depth == fontTableDepth)
+				{
+					fontTableEnd = i + 1;
+					fontTableDepth = 0;
+				}
+
+				if (depth)
+					--depth;
+
+				continue;
+			}
+
+			// Anything else in the document's own group after the font table
+			// is the start of the body, so there's no colour table.
+			if (depth == 1 && fontTableEnd != std::string::npos && ch != '\r' && ch != '\n' && ch != ' ')
+			{
+				bodyFound = true;
+				break;
+			}
+		}
+
+		if (! bodyFound && ! final)
+			return false;
+
+		// Without a font table this isn't the document expected, so it's
+		// passed on unchanged.
+		if (fontTableEnd != std::string::npos)
+			_pending.insert(fontTableEnd, "{\\colortbl;" + _colourTable + "}");
+
+		_firstColourIndex = 1;
+		_inHeader = false;
+		return true;
+	}
+
+	//
+	// LogLineLengths
+	//
+
+	// The number of characters the edit control sees in text, which in an ANSI
+	// build on Windows isn't the number of bytes if the code page has double
+	// byte characters.
+	static size_t CountChars(LPCTSTR text, LPCTSTR end)
+	{
+		#if defined(_WIN32) && ! defined(WNDLIB_UNICODE)
+			size_t count = 0;
+			for (; text < end; ++count)
+			{
+				LPCSTR next = CharNextA(text);
+
+				// CharNextA doesn't move past a terminator.
+				text = next == text ? text + 1 : next;
+			}
+
+			return count;
+		#else
+			return end - text;
+		#endif
+	}
+
+	LogLineLengths::LogLineLengths() :
+		_partialLineLength(0),
+		_textLength(0)
+	{
+	}
+
+	void LogLineLengths::Add(LPCTSTR text, size_t length)
+	{
+		for (LPCTSTR end = text + length; text != end; ++text)
+		{
+			LPCTSTR lineBreak = Private::FindLineBreak(text, end);
+			size_t chars = CountChars(text, lineBreak);
+			_partialLineLength += chars;
+			_textLength += chars;
+
+			text = lineBreak;
+			if (text == end)
+				break;
+
+			if (*text == '\n')
+			{
+				++_textLength;
+				_lineLengths.push_back(_partialLineLength + 1);
+				_partialLineLength = 0;
+			}
+		}
+	}
+
+	size_t LogLineLengths::Trim(size_t maxLines, size_t maxChars)
+	{
+		// The line being written counts as a line.
+		bool tooManyLines = maxLines && _lineLengths.size() + 1 > maxLines;
+		bool tooManyChars = maxChars && _textLength > maxChars;
+
+		if (! tooManyLines && ! tooManyChars)
+			return 0;
+
+		size_t targetLines = maxLines ? maxLines - maxLines / 4 : (size_t) -1;
+		size_t targetChars = maxChars ? maxChars - maxChars / 4 : (size_t) -1;
+
+		size_t trimLength = 0;
+		while (! _lineLengths.empty() && (_lineLengths.size() + 1 > targetLines || _textLength > targetChars))
+		{
+			trimLength += _lineLengths.front();
+			_textLength -= _lineLengths.front();
+			_lineLengths.pop_front();
+		}
+
+		return trimLength;
+	}
+}
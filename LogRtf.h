@@ -0,0 +1,186 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_LOGRTF_H
+#define WNDLIB_LOGRTF_H
+
+#include "WndLibBase.h"
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+namespace WndLib
+{
+	//
+	// LogRtfWriter: Builds the RTF that LogWnd streams in to its RichEdit
+	// control, and that LogWnd::SaveTo writes. Doesn't depend on Win32, so it
+	// can be tested and benchmarked anywhere.
+	//
+
+	class WNDLIB_EXPORT LogRtfWriter
+	{
+	public:
+
+		// palette is the window's, so colours keep their indices from one
+		// document to the next.
+		LogRtfWriter(std::vector<COLORREF> *palette);
+
+		// Number the palette's colours from index rather than 1, for when
+		// they're added to the end of another document's colour table. Call
+		// before appending anything.
+		void SetFirstColourIndex(int index)
+		{
+			_firstColourIndex = index;
+		}
+
+		bool IsEmpty() const
+		{
+			return _body.empty();
+		}
+
+		// Consecutive entries in the same colour are merged in to one run.
+		void Append(LPCTSTR text, size_t length, COLORREF colour);
+
+		// Wrap the text in an RTF document in the given font, e.g., the edit
+		// control's default font, so the text looks the same as if it had been
+		// inserted directly. height is in twips, like CHARFORMAT's yHeight.
+		std::string Finish(LPCTSTR faceName, int charSet, LONG height) const;
+
+		// The start of the document, up to the body. For writing a document
+		// a piece at a time, with GetBody and ClearBody, in which case every
+		// colour must have been added beforehand.
+		std::string GetHeader(LPCTSTR faceName, int charSet, LONG height) const;
+
+		// The palette's entries in a colour table, without the table's group.
+		std::string GetColourTable() const;
+
+		const std::string &GetBody() const
+		{
+			return _body;
+		}
+
+		void ClearBody()
+		{
+			_body.clear();
+		}
+
+		void AddColour(COLORREF colour)
+		{
+			GetColourIndex(colour);
+		}
+
+		void EndLine()
+		{
+			_body += "\\par\n";
+		}
+
+	private:
+
+		// Colour table indices start at _firstColourIndex. 0 is the default
+		// colour.
+		int GetColourIndex(COLORREF colour);
+
+		static void AppendEscaped(std::string *rtf, LPCTSTR text, size_t length);
+
+		std::string _body;
+		std::vector<COLORREF> *_palette;
+		int _firstColourIndex;
+		int _colour;
+		COLORREF _lastColour;
+	};
+
+	//
+	// LogRtfMerger: Passes on an RTF document a piece at a time, e.g., as it's
+	// streamed out of a RichEdit control, so more text can be added to the
+	// end of it: colours are added to the document's colour table, and its
+	// closing brace is held back.
+	//
+
+	class WNDLIB_EXPORT LogRtfMerger
+	{
+	public:
+
+		// colourTable is the colours to add, from LogRtfWriter::GetColourTable.
+		LogRtfMerger(const std::string &colourTable);
+
+		// Append the next piece of the document to out, less anything that has
+		// to be held back until more has been seen.
+		void Write(const char *data, size_t size, std::string *out);
+
+		// Append the rest of the document to out, except its closing brace.
+		// The text to add can then be written, followed by a '}'.
+		void Finish(std::string *out);
+
+		// The index in the document's colour table of the first colour added,
+		// for LogRtfWriter::SetFirstColourIndex. Only known after Finish.
+		int GetFirstColourIndex() const
+		{
+			return _firstColourIndex;
+		}
+
+	private:
+
+		// Look for the colour table in the start of the document, which is
+		// held in _pending until it's found, and add the colours to it. If
+		// there isn't one, one is added after the font table. Returns false
+		// if more of the document is needed, unless final is true.
+		bool AddColourTable(bool final);
+
+		// The header is only held back this long, in case it's not RTF.
+		enum { MAX_HEADER_LENGTH = 64 * 1024 };
+
+		std::string _colourTable;
+		std::string _pending;
+		bool _inHeader;
+		int _firstColourIndex;
+	};
+
+	//
+	// LogLineLengths: Keeps track of the lines of text in a RichEdit control
+	// that's only ever appended to with LogRtfWriter, so the oldest can be
+	// trimmed without asking the control where they end.
+	//
+
+	class WNDLIB_EXPORT LogLineLengths
+	{
+	public:
+
+		LogLineLengths();
+
+		// Mirrors LogRtfWriter: '\r' is dropped and '\n' becomes a paragraph
+		// mark, which the control counts as one character.
+		void Add(LPCTSTR text, size_t length);
+
+		// If either limit is exceeded (0 means no limit), forget the oldest
+		// lines, bringing the text down to three quarters of the limit so
+		// trimming is rare. Returns how many characters they took up, which
+		// are the characters to remove from the start of the control.
+		size_t Trim(size_t maxLines, size_t maxChars);
+
+		// Complete lines, not counting the one being written.
+		size_t GetLineCount() const
+		{
+			return _lineLengths.size();
+		}
+
+		// The length of the text, in the control's characters rather than
+		// TCHARs. In an ANSI build a double byte character counts as one.
+		size_t GetTextLength() const
+		{
+			return _textLength;
+		}
+
+	private:
+
+		// Each complete line's length, including its paragraph mark.
+		std::deque<size_t> _lineLengths;
+		size_t _partialLineLength;
+		size_t _textLength;
+	};
+}
+
+#endif
@@ -0,0 +1,484 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "LogScan.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	#define WNDLIB_SCAN_X86 1
+#else
+	#define WNDLIB_SCAN_X86 0
+#endif
+
+// SSE2 is always compiled in with Visual C++, and checked for at run time on
+// x86. GCC and Clang only use it if they've been told it's there, which on
+// x64 they always have.
+#if WNDLIB_SCAN_X86 && ! defined(WNDLIB_NO_SSE2) && (defined(_MSC_VER) || defined(__SSE2__))
+	#define WNDLIB_SCAN_SSE2 1
+	#include <emmintrin.h>
+#else
+	#define WNDLIB_SCAN_SSE2 0
+#endif
+
+// AVX2 needs Visual C++ 2013, or a GCC or Clang that can compile individual
+// functions for it, and is always checked for at run time.
+#if WNDLIB_SCAN_SSE2 && ! defined(WNDLIB_NO_AVX2) && \
+	((defined(_MSC_VER) && _MSC_VER >= 1800) || defined(__clang__) || \
+	(defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+	#define WNDLIB_SCAN_AVX2 1
+	#include <immintrin.h>
+#else
+	#define WNDLIB_SCAN_AVX2 0
+#endif
+
+// cpuid is available as an intrinsic from Visual C++ 2005. Before that,
+// Windows is asked.
+#if WNDLIB_SCAN_SSE2
+	#if defined(_MSC_VER) && _MSC_VER >= 1400
+		#include <intrin.h>
+		#define WNDLIB_SCAN_CPUID 1
+	#elif defined(_MSC_VER)
+		#define WNDLIB_SCAN_CPUID 0
+	#else
+		#include <cpuid.h>
+		#define WNDLIB_SCAN_CPUID 1
+	#endif
+#endif
+
+#if WNDLIB_SCAN_AVX2 && defined(__GNUC__)
+	#define WNDLIB_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+	#define WNDLIB_TARGET_AVX2
+#endif
+
+namespace WndLib
+{
+	namespace Private
+	{
+		//
+		// Processor features
+		//
+
+		static volatile LONG maxScanLevel = SCAN_AVX2;
+
+		#if WNDLIB_SCAN_SSE2 && WNDLIB_SCAN_CPUID
+			static void GetCpuid(int leaf, int cpuInfo[4])
+			{
+				#if defined(_MSC_VER)
+					__cpuid(cpuInfo, leaf);
+				#else
+					unsigned a = 0, b = 0, c = 0, d = 0;
+					__cpuid(leaf, a, b, c, d);
+					cpuInfo[0] = (int) a;
+					cpuInfo[1] = (int) b;
+					cpuInfo[2] = (int) c;
+					cpuInfo[3] = (int) d;
+				#endif
+			}
+		#endif
+
+		#if WNDLIB_SCAN_AVX2
+			// Leaf 7 has subleaves, and the features are in subleaf 0.
+			static void GetCpuidSubleaf0(int leaf, int cpuInfo[4])
+			{
+				#if defined(_MSC_VER)
+					__cpuidex(cpuInfo, leaf, 0);
+				#else
+					unsigned a = 0, b = 0, c = 0, d = 0;
+					__cpuid_count(leaf, 0, a, b, c, d);
+					cpuInfo[0] = (int) a;
+					cpuInfo[1] = (int) b;
+					cpuInfo[2] = (int) c;
+					cpuInfo[3] = (int) d;
+				#endif
+			}
+
+			// Whether the OS saves the YMM registers on a context switch.
+			static bool IsYmmStateEnabled()
+			{
+				#if defined(_MSC_VER)
+					return (_xgetbv(0) & 6) == 6;
+				#else
+					unsigned eax, edx;
+					__asm__ __volatile__("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+					return (eax & 6) == 6;
+				#endif
+			}
+		#endif
+
+		#if WNDLIB_SCAN_SSE2
+			static ScanLevel DetectScanLevel()
+			{
+				#if ! WNDLIB_SCAN_CPUID
+					return IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) ? SCAN_SSE2 : SCAN_SCALAR;
+				#else
+					int cpuInfo[4];
+					GetCpuid(0, cpuInfo);
+					int maxLeaf = cpuInfo[0];
+
+					GetCpuid(1, cpuInfo);
+					if (! (cpuInfo[3] & (1 << 26)))
+						return SCAN_SCALAR;
+
+					#if WNDLIB_SCAN_AVX2
+						// AVX2 needs the OS to support AVX (OSXSAVE, AVX and the
+						// XCR0 bits) as well as the processor.
+						const int osxsave = 1 << 27;
+						const int avx = 1 << 28;
+
+						if ((cpuInfo[2] & osxsave) && (cpuInfo[2] & avx) && maxLeaf >= 7 && IsYmmStateEnabled())
+						{
+							GetCpuidSubleaf0(7, cpuInfo);
+							if (cpuInfo[1] & (1 << 5))
+								return SCAN_AVX2;
+						}
+					#else
+						(void) maxLeaf;
+					#endif
+
+					return SCAN_SSE2;
+				#endif
+			}
+		#endif
+
+		static ScanLevel GetSupportedScanLevel()
+		{
+			#if WNDLIB_SCAN_SSE2
+				// Detecting twice at once is harmless.
+				static volatile LONG supported = -1;
+				if (supported < 0)
+					InterlockedExchange(&supported, DetectScanLevel());
+
+				return (ScanLevel) supported;
+			#else
+				return SCAN_SCALAR;
+			#endif
+		}
+
+		ScanLevel GetScanLevel()
+		{
+			ScanLevel supported = GetSupportedScanLevel();
+			return (LONG) supported < maxScanLevel ? supported : (ScanLevel) maxScanLevel;
+		}
+
+		void SetMaxScanLevel(ScanLevel level)
+		{
+			InterlockedExchange(&maxScanLevel, level);
+		}
+
+		//
+		// SIMD helpers
+		//
+
+		// The index of the lowest set bit in a non-zero mask.
+		static inline unsigned LowestSetBit(unsigned mask)
+		{
+			#if defined(_MSC_VER) && _MSC_VER >= 1400
+				unsigned long index;
+				_BitScanForward(&index, mask);
+				return (unsigned) index;
+			#elif defined(__GNUC__)
+				return (unsigned) __builtin_ctz(mask);
+			#else
+				unsigned index = 0;
+				for (; ! (mask & 1); mask >>= 1)
+					++index;
+
+				return index;
+			#endif
+		}
+
+		// Each character has sizeof(Char) bits in a _mm_movemask_epi8 mask.
+		template<typename Char>
+		inline const Char *FindMaskedChar(const Char *text, unsigned mask)
+		{
+			return text + LowestSetBit(mask) / sizeof(Char);
+		}
+
+		//
+		// FindLineBreak
+		//
+
+		#if WNDLIB_SCAN_SSE2
+			static const char *FindLineBreakSSE2(const char *text, const char *end)
+			{
+				const __m128i cr = _mm_set1_epi8('\r');
+				const __m128i lf = _mm_set1_epi8('\n');
+
+				for (; end - text >= 16; text += 16)
+				{
+					__m128i chars = _mm_loadu_si128((const __m128i *) text);
+					__m128i found = _mm_or_si128(_mm_cmpeq_epi8(chars, cr), _mm_cmpeq_epi8(chars, lf));
+
+					unsigned mask = (unsigned) _mm_movemask_epi8(found);
+					if (mask)
+						return FindMaskedChar(text, mask);
+				}
+
+				return text;
+			}
+
+			static const WORD *FindLineBreakSSE2(const WORD *text, const WORD *end)
+			{
+				const __m128i cr = _mm_set1_epi16('\r');
+				const __m128i lf = _mm_set1_epi16('\n');
+
+				for (; end - text >= 8; text += 8)
+				{
+					__m128i chars = _mm_loadu_si128((const __m128i *) text);
+					__m128i found = _mm_or_si128(_mm_cmpeq_epi16(chars, cr), _mm_cmpeq_epi16(chars, lf));
+
+					unsigned mask = (unsigned) _mm_movemask_epi8(found);
+					if (mask)
+						return FindMaskedChar(text, mask);
+				}
+
+				return text;
+			}
+		#endif
+
+		#if WNDLIB_SCAN_AVX2
+			WNDLIB_TARGET_AVX2 static const char *FindLineBreakAVX2(const char *text, const char *end)
+			{
+				const __m256i cr = _mm256_set1_epi8('\r');
+				const __m256i lf = _mm256_set1_epi8('\n');
+
+				for (; end - text >= 32; text += 32)
+				{
+					__m256i chars = _mm256_loadu_si256((const __m256i *) text);
+					__m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chars, cr), _mm256_cmpeq_epi8(chars, lf));
+
+					unsigned mask = (unsigned) _mm256_movemask_epi8(found);
+					if (mask)
+						return FindMaskedChar(text, mask);
+				}
+
+				return text;
+			}
+
+			WNDLIB_TARGET_AVX2 static const WORD *FindLineBreakAVX2(const WORD *text, const WORD *end)
+			{
+				const __m256i cr = _mm256_set1_epi16('\r');
+				const __m256i lf = _mm256_set1_epi16('\n');
+
+				for (; end - text >= 16; text += 16)
+				{
+					__m256i chars = _mm256_loadu_si256((const __m256i *) text);
+					__m256i found = _mm256_or_si256(_mm256_cmpeq_epi16(chars, cr), _mm256_cmpeq_epi16(chars, lf));
+
+					unsigned mask = (unsigned) _mm256_movemask_epi8(found);
+					if (mask)
+						return FindMaskedChar(text, mask);
+				}
+
+				return text;
+			}
+		#endif
+
+		template<typename Char>
+		static const Char *FindLineBreakScalar(const Char *text, const Char *end)
+		{
+			for (; text != end; ++text)
+			{
+				if (*text == '\r' || *text == '\n')
+					break;
+			}
+
+			return text;
+		}
+
+		template<typename Char>
+		static const Char *FindLineBreakImpl(const Char *text, const Char *end)
+		{
+			// The SIMD loops stop short of the last partial vector, which the
+			// scalar loop finishes off.
+			#if WNDLIB_SCAN_SSE2
+				ScanLevel level = GetScanLevel();
+
+				#if WNDLIB_SCAN_AVX2
+					if (level == SCAN_AVX2)
+					{
+						text = FindLineBreakAVX2(text, end);
+						if (text != end && (*text == '\r' || *text == '\n'))
+							return text;
+					}
+				#endif
+
+				if (level >= SCAN_SSE2)
+				{
+					text = FindLineBreakSSE2(text, end);
+					if (text != end && (*text == '\r' || *text == '\n'))
+						return text;
+				}
+			#endif
+
+			return FindLineBreakScalar(text, end);
+		}
+
+		const char *FindLineBreak8(const char *text, const char *end)
+		{
+			return FindLineBreakImpl(text, end);
+		}
+
+		const WORD *FindLineBreak16(const WORD *text, const WORD *end)
+		{
+			return FindLineBreakImpl(text, end);
+		}
+
+		//
+		// FindRtfSpecialChar
+		//
+
+		#if WNDLIB_SCAN_SSE2
+			static const char *FindRtfSpecialCharSSE2(const char *text, const char *end)
+			{
+				// Signed comparisons, so anything from 0x80 up is below 0x20.
+				const __m128i below = _mm_set1_epi8(0x20);
+				const __m128i backslash = _mm_set1_epi8('\\');
+				const __m128i openBrace = _mm_set1_epi8('{');
+				const __m128i closeBrace = _mm_set1_epi8('}');
+
+				for (; end - text >= 16; text += 16)
+				{
+					__m128i chars = _mm_loadu_si128((const __m128i *) text);
+					__m128i found = _mm_cmplt_epi8(chars, below);
+					found = _mm_or_si128(found, _mm_cmpeq_epi8(chars, backslash));
+					found = _mm_or_si128(found, _mm_cmpeq_epi8(chars, openBrace));
+					found = _mm_or_si128(found, _mm_cmpeq_epi8(chars, closeBrace));
+
+					unsigned mask = (unsigned) _mm_movemask_epi8(found);
+					if (mask)
+						return FindMaskedChar(text, mask);
+				}
+
+				return text;
+			}
+
+			static const WORD *FindRtfSpecialCharSSE2(const WORD *text, const WORD *end)
+			{
+				// Signed comparisons, so anything from 0x8000 up is below 0x20.
+				const __m128i below = _mm_set1_epi16(0x20);
+				const __m128i above = _mm_set1_epi16(0x7f);
+				const __m128i backslash = _mm_set1_epi16('\\');
+				const __m128i openBrace = _mm_set1_epi16('{');
+				const __m128i closeBrace = _mm_set1_epi16('}');
+
+				for (; end - text >= 8; text += 8)
+				{
+					__m128i chars = _mm_loadu_si128((const __m128i *) text);
+					__m128i found = _mm_or_si128(_mm_cmplt_epi16(chars, below), _mm_cmpgt_epi16(chars, above));
+					found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, backslash));
+					found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, openBrace));
+					found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, closeBrace));
+
+					unsigned mask = (unsigned) _mm_movemask_epi8(found);
+					if (mask)
+						return FindMaskedChar(text, mask);
+				}
+
+				return text;
+			}
+		#endif
+
+		#if WNDLIB_SCAN_AVX2
+			WNDLIB_TARGET_AVX2 static const char *FindRtfSpecialCharAVX2(const char *text, const char *end)
+			{
+				// AVX2 has no less than, so below > chars.
+				const __m256i below = _mm256_set1_epi8(0x20);
+				const __m256i backslash = _mm256_set1_epi8('\\');
+				const __m256i openBrace = _mm256_set1_epi8('{');
+				const __m256i closeBrace = _mm256_set1_epi8('}');
+
+				for (; end - text >= 32; text += 32)
+				{
+					__m256i chars = _mm256_loadu_si256((const __m256i *) text);
+					__m256i found = _mm256_cmpgt_epi8(below, chars);
+					found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chars, backslash));
+					found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chars, openBrace));
+					found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chars, closeBrace));
+
+					unsigned mask = (unsigned) _mm256_movemask_epi8(found);
+					if (mask)
+						return FindMaskedChar(text, mask);
+				}
+
+				return text;
+			}
+
+			WNDLIB_TARGET_AVX2 static const WORD *FindRtfSpecialCharAVX2(const WORD *text, const WORD *end)
+			{
+				const __m256i below = _mm256_set1_epi16(0x20);
+				const __m256i above = _mm256_set1_epi16(0x7f);
+				const __m256i backslash = _mm256_set1_epi16('\\');
+				const __m256i openBrace = _mm256_set1_epi16('{');
+				const __m256i closeBrace = _mm256_set1_epi16('}');
+
+				for (; end - text >= 16; text += 16)
+				{
+					__m256i chars = _mm256_loadu_si256((const __m256i *) text);
+					__m256i found = _mm256_or_si256(_mm256_cmpgt_epi16(below, chars), _mm256_cmpgt_epi16(chars, above));
+					found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, backslash));
+					found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, openBrace));
+					found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, closeBrace));
+
+					unsigned mask = (unsigned) _mm256_movemask_epi8(found);
+					if (mask)
+						return FindMaskedChar(text, mask);
+				}
+
+				return text;
+			}
+		#endif
+
+		template<typename Char>
+		static const Char *FindRtfSpecialCharScalar(const Char *text, const Char *end)
+		{
+			for (; text != end; ++text)
+			{
+				if (! IsPlainRtfChar(*text))
+					break;
+			}
+
+			return text;
+		}
+
+		template<typename Char>
+		static const Char *FindRtfSpecialCharImpl(const Char *text, const Char *end)
+		{
+			#if WNDLIB_SCAN_SSE2
+				ScanLevel level = GetScanLevel();
+
+				#if WNDLIB_SCAN_AVX2
+					if (level == SCAN_AVX2)
+					{
+						text = FindRtfSpecialCharAVX2(text, end);
+						if (text != end && ! IsPlainRtfChar(*text))
+							return text;
+					}
+				#endif
+
+				if (level >= SCAN_SSE2)
+				{
+					text = FindRtfSpecialCharSSE2(text, end);
+					if (text != end && ! IsPlainRtfChar(*text))
+						return text;
+				}
+			#endif
+
+			return FindRtfSpecialCharScalar(text, end);
+		}
+
+		const char *FindRtfSpecialChar8(const char *text, const char *end)
+		{
+			return FindRtfSpecialCharImpl(text, end);
+		}
+
+		const WORD *FindRtfSpecialChar16(const WORD *text, const WORD *end)
+		{
+			return FindRtfSpecialCharImpl(text, end);
+		}
+	}
+}
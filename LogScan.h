@@ -0,0 +1,134 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_LOGSCAN_H
+#define WNDLIB_LOGSCAN_H
+
+#include "WndLibBase.h"
+#include <stddef.h>
+#include <vector>
+
+namespace WndLib
+{
+	//
+	// Log text scanning: Log text is mostly runs of ordinary characters, so
+	// these find the next character that needs handling, 16 or 32 bytes at a
+	// time with SSE2 or AVX2 where the processor has them. They work on 8 bit
+	// text and on 16 bit (UTF-16) text; anything else is scanned a character
+	// at a time.
+	//
+
+	namespace Private
+	{
+		enum ScanLevel
+		{
+			SCAN_SCALAR,
+			SCAN_SSE2,
+			SCAN_AVX2
+		};
+
+		// The instruction set the scanners use, which is the best this processor
+		// and compiler support, up to the limit set by SetMaxScanLevel.
+		WNDLIB_EXPORT ScanLevel GetScanLevel();
+
+		// Limit the instruction set used, so tests and benchmarks can compare the
+		// implementations. Defaults to SCAN_AVX2.
+		WNDLIB_EXPORT void SetMaxScanLevel(ScanLevel level);
+
+		// The implementations, for 8 and 16 bit characters. Use the templates
+		// below instead.
+		WNDLIB_EXPORT const char *FindLineBreak8(const char *text, const char *end);
+		WNDLIB_EXPORT const WORD *FindLineBreak16(const WORD *text, const WORD *end);
+		WNDLIB_EXPORT const char *FindRtfSpecialChar8(const char *text, const char *end);
+		WNDLIB_EXPORT const WORD *FindRtfSpecialChar16(const WORD *text, const WORD *end);
+
+		// Find the first '\r' or '\n'. Returns end if there isn't one.
+		template<typename Char>
+		const Char *FindLineBreak(const Char *text, const Char *end)
+		{
+			if (sizeof(Char) == 1)
+				return (const Char *) FindLineBreak8((const char *) text, (const char *) end);
+
+			if (sizeof(Char) == 2)
+				return (const Char *) FindLineBreak16((const WORD *) text, (const WORD *) end);
+
+			for (; text != end; ++text)
+			{
+				if (*text == '\r' || *text == '\n')
+					break;
+			}
+
+			return text;
+		}
+
+		template<typename Char>
+		bool IsPlainRtfChar(Char ch)
+		{
+			return ch >= 0x20 && ch < 0x80 && ch != '\\' && ch != '{' && ch != '}';
+		}
+
+		// Find the first character that can't be copied straight in to RTF,
+		// i.e., a control character, anything outside ASCII, or one of \ { and
+		// }. Returns end if there isn't one.
+		template<typename Char>
+		const Char *FindRtfSpecialChar(const Char *text, const Char *end)
+		{
+			if (sizeof(Char) == 1)
+				return (const Char *) FindRtfSpecialChar8((const char *) text, (const char *) end);
+
+			if (sizeof(Char) == 2)
+				return (const Char *) FindRtfSpecialChar16((const WORD *) text, (const WORD *) end);
+
+			for (; text != end; ++text)
+			{
+				if (! IsPlainRtfChar(*text))
+					break;
+			}
+
+			return text;
+		}
+
+		// Append text to output with every line break made CRLF, in one pass.
+		// As everywhere else in the log, '\n' ends a line and '\r' is dropped.
+		// If lineEnds isn't NULL, the offset in output just past each line
+		// break is appended to it. Returns the number of line breaks.
+		template<typename Char>
+		size_t NormalizeLineBreaks(const Char *text, size_t length, std::basic_string<Char> *output,
+			std::vector<size_t> *lineEnds)
+		{
+			// Enough unless more than one character in 16 is a line break.
+			output->reserve(output->size() + length + length / 16);
+
+			size_t lines = 0;
+
+			for (const Char *end = text + length;;)
+			{
+				const Char *lineBreak = FindLineBreak(text, end);
+				output->append(text, lineBreak - text);
+
+				if (lineBreak == end)
+					break;
+
+				if (*lineBreak == '\n')
+				{
+					output->push_back('\r');
+					output->push_back('\n');
+					++lines;
+
+					if (lineEnds)
+						lineEnds->push_back(output->size());
+				}
+
+				text = lineBreak + 1;
+			}
+
+			return lines;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,486 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "LogSharedRing.h"
+#include <string.h>
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <stdlib.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+namespace WndLib
+{
+	//
+	// LogSharedRing
+	//
+
+	#ifdef _WIN32
+
+		LogSharedRing::LogSharedRing()
+		{
+			_file = INVALID_HANDLE_VALUE;
+			_mapping = NULL;
+			_header = NULL;
+			_data = NULL;
+			_mask = 0;
+			_writable = false;
+		}
+
+	#else
+
+		LogSharedRing::LogSharedRing()
+		{
+			_file = -1;
+			_mappedSize = 0;
+			_header = NULL;
+			_data = NULL;
+			_mask = 0;
+			_writable = false;
+		}
+
+	#endif
+
+	LogSharedRing::~LogSharedRing()
+	{
+		Close();
+	}
+
+	static DWORD GetRingCapacity(size_t bytes)
+	{
+		DWORD capacity = 4096;
+		while (capacity < bytes && capacity < 0x40000000)
+			capacity *= 2;
+
+		return capacity;
+	}
+
+	#ifdef _WIN32
+
+		bool LogSharedRing::Create(LPCTSTR name, size_t bytes, LPCTSTR path)
+		{
+			Close();
+
+			HANDLE file = INVALID_HANDLE_VALUE;
+			if (path)
+			{
+				file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+					OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+				if (file == INVALID_HANDLE_VALUE)
+					return false;
+			}
+
+			return Map(file, name, GetRingCapacity(bytes), true, true);
+		}
+
+		bool LogSharedRing::Open(LPCTSTR name)
+		{
+			Close();
+			return Map(INVALID_HANDLE_VALUE, name, 0, false, false);
+		}
+
+		bool LogSharedRing::OpenFile(LPCTSTR path)
+		{
+			Close();
+
+			HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+
+			return Map(file, NULL, 0, false, false);
+		}
+
+		bool LogSharedRing::Remove(LPCTSTR)
+		{
+			return true;
+		}
+
+		bool LogSharedRing::Map(HANDLE file, LPCTSTR name, DWORD capacity, bool writable, bool create)
+		{
+			_file = file;
+			_writable = writable;
+
+			if (create)
+			{
+				_mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, 0, DATA_OFFSET + capacity, name);
+			}
+			else if (file != INVALID_HANDLE_VALUE)
+			{
+				_mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			}
+			else
+			{
+				_mapping = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+			}
+
+			if (! _mapping)
+			{
+				Close();
+				return false;
+			}
+
+			void *view = MapViewOfFile(_mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+			if (! view)
+			{
+				Close();
+				return false;
+			}
+
+			_header = (RingHeader *) view;
+
+			MEMORY_BASIC_INFORMATION info;
+			size_t mappedSize = VirtualQuery(view, &info, sizeof(info)) ? info.RegionSize : 0;
+
+			return Attach(view, mappedSize, capacity, create);
+		}
+
+		void LogSharedRing::Close()
+		{
+			if (_header)
+			{
+				UnmapViewOfFile(_header);
+				_header = NULL;
+				_data = NULL;
+			}
+
+			if (_mapping)
+			{
+				CloseHandle(_mapping);
+				_mapping = NULL;
+			}
+
+			if (_file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(_file);
+				_file = INVALID_HANDLE_VALUE;
+			}
+		}
+
+	#else
+
+		// The system calls take narrow names.
+		static std::string GetNativeName(LPCTSTR name)
+		{
+			#ifdef WNDLIB_UNICODE
+				size_t length = wcstombs(NULL, name, 0);
+				if (length == (size_t) -1)
+					return std::string();
+
+				std::vector<char> narrow(length + 1);
+				wcstombs(&narrow[0], name, length + 1);
+				return std::string(&narrow[0], length);
+			#else
+				return name;
+			#endif
+		}
+
+		bool LogSharedRing::Create(LPCTSTR name, size_t bytes, LPCTSTR path)
+		{
+			Close();
+
+			int file = path ? open(GetNativeName(path).c_str(), O_RDWR | O_CREAT, 0644) :
+				shm_open(GetNativeName(name).c_str(), O_RDWR | O_CREAT, 0600);
+
+			if (file < 0)
+				return false;
+
+			return Map(file, GetRingCapacity(bytes), true, true);
+		}
+
+		bool LogSharedRing::Open(LPCTSTR name)
+		{
+			Close();
+
+			int file = shm_open(GetNativeName(name).c_str(), O_RDONLY, 0);
+			if (file < 0)
+				return false;
+
+			return Map(file, 0, false, false);
+		}
+
+		bool LogSharedRing::OpenFile(LPCTSTR path)
+		{
+			Close();
+
+			int file = open(GetNativeName(path).c_str(), O_RDONLY);
+			if (file < 0)
+				return false;
+
+			return Map(file, 0, false, false);
+		}
+
+		bool LogSharedRing::Remove(LPCTSTR name)
+		{
+			return shm_unlink(GetNativeName(name).c_str()) == 0;
+		}
+
+		bool LogSharedRing::Map(int file, DWORD capacity, bool writable, bool create)
+		{
+			_file = file;
+			_writable = writable;
+
+			struct stat info;
+			if (fstat(file, &info) != 0)
+			{
+				Close();
+				return false;
+			}
+
+			size_t mappedSize = (size_t) info.st_size;
+
+			// Unlike a file mapping, the object doesn't grow to the size asked
+			// for by itself.
+			if (create && mappedSize < DATA_OFFSET + (size_t) capacity)
+			{
+				if (ftruncate(file, DATA_OFFSET + capacity) != 0)
+				{
+					Close();
+					return false;
+				}
+
+				mappedSize = DATA_OFFSET + capacity;
+			}
+
+			if (! mappedSize)
+			{
+				Close();
+				return false;
+			}
+
+			void *view = mmap(NULL, mappedSize, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+			if (view == MAP_FAILED)
+			{
+				Close();
+				return false;
+			}
+
+			_header = (RingHeader *) view;
+			_mappedSize = mappedSize;
+
+			return Attach(view, mappedSize, capacity, create);
+		}
+
+		void LogSharedRing::Close()
+		{
+			if (_header)
+			{
+				munmap(_header, _mappedSize);
+				_header = NULL;
+				_data = NULL;
+				_mappedSize = 0;
+			}
+
+			if (_file >= 0)
+			{
+				close(_file);
+				_file = -1;
+			}
+		}
+
+	#endif
+
+	bool LogSharedRing::Attach(void *view, size_t mappedSize, DWORD capacity, bool create)
+	{
+		_data = (char *) view + DATA_OFFSET;
+
+		bool valid = mappedSize >= DATA_OFFSET && _header->magic == MAGIC && _header->version == VERSION &&
+			_header->charSize == sizeof(TCHAR) && _header->capacity >= 4096 &&
+			(_header->capacity & (_header->capacity - 1)) == 0 &&
+			DATA_OFFSET + (size_t) _header->capacity <= mappedSize;
+
+		if (create && (! valid || _header->capacity != capacity))
+		{
+			// An existing mapping may be smaller than asked for.
+			if (mappedSize < DATA_OFFSET + (size_t) capacity)
+			{
+				Close();
+				return false;
+			}
+
+			// New, or left by something else, so start again.
+			memset(view, 0, DATA_OFFSET + capacity);
+			_header->version = VERSION;
+			_header->charSize = sizeof(TCHAR);
+			_header->capacity = capacity;
+			_header->writePosition = 0;
+
+			// Every record position is a multiple of RECORD_ALIGNMENT, so make
+			// sure none of the zeroed records looks like it was written at 0.
+			for (DWORD offset = 0; offset != capacity; offset += RECORD_ALIGNMENT)
+				((RecordHeader *) (_data + offset))->position = -1;
+
+			MemoryBarrier();
+			_header->magic = MAGIC;
+		}
+		else if (! valid)
+		{
+			Close();
+			return false;
+		}
+
+		_mask = _header->capacity - 1;
+		return true;
+	}
+
+	void LogSharedRing::Append(LPCTSTR text, size_t length, COLORREF colour)
+	{
+		if (! _header || ! _writable)
+			return;
+
+		DWORD capacity = _mask + 1;
+
+		size_t bytes = length * sizeof(TCHAR);
+		size_t maxBytes = capacity / 4 - sizeof(RecordHeader);
+		if (bytes > maxBytes)
+			bytes = maxBytes - maxBytes % sizeof(TCHAR);
+
+		DWORD size = (DWORD) ((sizeof(RecordHeader) + bytes + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1));
+
+		// Reserve the record, along with padding to the end of the ring if it
+		// wouldn't fit before it.
+		LONG write;
+		DWORD padding;
+		for (;;)
+		{
+			write = _header->writePosition;
+			DWORD offset = write & _mask;
+			padding = offset + size > capacity ? capacity - offset : 0;
+
+			if (InterlockedCompareExchange(&_header->writePosition, write + padding + size, write) == write)
+				break;
+		}
+
+		if (padding)
+		{
+			RecordHeader *record = GetRecord(write);
+			record->position = -1;
+			record->size = padding;
+			record->length = PADDING_LENGTH;
+			record->colour = 0;
+			MemoryBarrier();
+			record->position = write;
+
+			write += padding;
+		}
+
+		// Invalidate the record before writing it, so it can't be mistaken for
+		// whatever was here before.
+		RecordHeader *record = GetRecord(write);
+		record->position = -1;
+		MemoryBarrier();
+
+		record->size = size;
+		record->length = (DWORD) bytes;
+		record->colour = colour;
+		memcpy(record + 1, text, bytes);
+
+		MemoryBarrier();
+		record->position = write;
+	}
+
+	LONG LogSharedRing::GetOldestPosition() const
+	{
+		if (! _header)
+			return 0;
+
+		LONG write = _header->writePosition;
+		return (DWORD) write > _mask ? write - (LONG) _mask - 1 : 0;
+	}
+
+	LONG LogSharedRing::FindRecord(LONG position, LONG write) const
+	{
+		position = (position + RECORD_ALIGNMENT - 1) & ~(LONG) (RECORD_ALIGNMENT - 1);
+
+		for (; (LONG) (write - position) > 0; position += RECORD_ALIGNMENT)
+		{
+			if (GetRecord(position)->position == position)
+				break;
+		}
+
+		return (LONG) (write - position) > 0 ? position : write;
+	}
+
+	size_t LogSharedRing::Read(LONG *position, ReadCallback callback, void *context, bool skipUnfinished)
+	{
+		if (! _header)
+			return 0;
+
+		size_t count = 0;
+		LONG write = _header->writePosition;
+		MemoryBarrier();
+
+		LONG read = *position;
+
+		// Fallen behind, or a position from a different ring.
+		if ((DWORD) (write - read) > _mask + 1)
+			read = FindRecord(GetOldestPosition(), write);
+
+		while (read != write)
+		{
+			const RecordHeader *record = GetRecord(read);
+
+			if (record->position != read)
+			{
+				// Overwritten since we looked, or not written yet.
+				if ((DWORD) (_header->writePosition - read) > _mask + 1)
+				{
+					read = FindRecord(GetOldestPosition(), write);
+					continue;
+				}
+
+				if (! skipUnfinished)
+					break;
+
+				read = FindRecord(read + RECORD_ALIGNMENT, write);
+				continue;
+			}
+
+			MemoryBarrier();
+			RecordHeader header;
+			header.size = record->size;
+			header.length = record->length;
+			header.colour = record->colour;
+
+			DWORD offset = read & _mask;
+			if (header.size < sizeof(RecordHeader) || header.size % RECORD_ALIGNMENT || header.size > _mask + 1 - offset ||
+				(header.length != PADDING_LENGTH && header.length > header.size - sizeof(RecordHeader)))
+			{
+				// Torn by a writer lapping us.
+				read = FindRecord(read + RECORD_ALIGNMENT, write);
+				continue;
+			}
+
+			if (header.length != PADDING_LENGTH)
+			{
+				size_t length = header.length / sizeof(TCHAR);
+				_readBuffer.resize(length + 1);
+				memcpy(&_readBuffer[0], record + 1, length * sizeof(TCHAR));
+				_readBuffer[length] = 0;
+
+				// Make sure it wasn't overwritten while we copied it.
+				MemoryBarrier();
+				if (record->position == read)
+				{
+					Record result = { &_readBuffer[0], length, header.colour };
+					callback(context, result);
+					++count;
+				}
+			}
+
+			read += header.size;
+		}
+
+		*position = read;
+		return count;
+	}
+}
@@ -0,0 +1,170 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_LOGSHAREDRING_H
+#define WNDLIB_LOGSHAREDRING_H
+
+#include "LogQueue.h"
+#include <stddef.h>
+#include <vector>
+
+namespace WndLib
+{
+	//
+	// LogSharedRing: A ring buffer of log text in named shared memory,
+	// optionally backed by a file, so the most recent entries outlive a crash.
+	// Another process can attach to it to follow the log, and a ring backed by
+	// a file can be read after the process has gone. Appending is lock-free
+	// and costs little more than copying the text. It's a LogSink so a
+	// LogQueue can write to it.
+	//
+	// On Windows the ring is a named file mapping. Elsewhere it's POSIX shared
+	// memory (shm_open), which has the same layout, so the ring can be tested
+	// anywhere.
+	//
+
+	class WNDLIB_EXPORT LogSharedRing : public LogSink
+	{
+	public:
+
+		LogSharedRing();
+
+		~LogSharedRing();
+
+		// Create a ring of at least bytes (rounded up to a power of two), or
+		// open it for writing if it already exists. name is the name of the
+		// file mapping, e.g., TEXT("Local\\MyAppLog"), or on other systems of
+		// the shared memory object, e.g., TEXT("/MyAppLog"). If path isn't NULL
+		// the ring is kept in that file, and the entries already in it from a
+		// previous run are kept. Other than on Windows, a ring kept in a file
+		// is only the file, and name is ignored; read it with OpenFile.
+		bool Create(LPCTSTR name, size_t bytes, LPCTSTR path = NULL);
+
+		// Attach to a ring another process has created, to read it.
+		bool Open(LPCTSTR name);
+
+		// Read a ring kept in a file, e.g., after the process writing it has
+		// crashed.
+		bool OpenFile(LPCTSTR path);
+
+		void Close();
+
+		// Windows frees a ring that isn't kept in a file once the last process
+		// has closed it. POSIX shared memory lasts until it's removed, so call
+		// this once nothing needs the ring. Does nothing on Windows.
+		static bool Remove(LPCTSTR name);
+
+		bool IsOpen() const
+		{
+			return _header != NULL;
+		}
+
+		// Can be called from any thread. Only for rings opened with Create.
+		// Text longer than a quarter of the ring is truncated.
+		void Append(LPCTSTR text, size_t length, COLORREF colour);
+
+		// LogSink overrides
+		virtual void Write(LPCTSTR text, size_t length, COLORREF colour)
+		{
+			Append(text, length, colour);
+		}
+
+		struct Record
+		{
+			LPCTSTR text;
+			size_t length;
+			COLORREF colour;
+		};
+
+		typedef void (*ReadCallback)(void *context, const Record &record);
+
+		// Call callback for each record from *position to the newest, then set
+		// *position to follow it. Start from GetOldestPosition(). If the
+		// records at *position have since been overwritten, reading resumes
+		// at the oldest. A record that's been reserved but not yet written
+		// stops reading, unless skipUnfinished is true, as when reading the
+		// ring of a process that crashed. Returns the number of records read.
+		size_t Read(LONG *position, ReadCallback callback, void *context, bool skipUnfinished = false);
+
+		LONG GetOldestPosition() const;
+
+	private:
+
+		enum
+		{
+			MAGIC = 0x676e5257,
+			VERSION = 1,
+
+			// Records are aligned to RECORD_ALIGNMENT, so a padding record
+			// always has room for its header.
+			RECORD_ALIGNMENT = 16,
+
+			// The data starts a cache line after the header.
+			DATA_OFFSET = 64
+		};
+
+		static const DWORD PADDING_LENGTH = 0xffffffff;
+
+		struct RingHeader
+		{
+			DWORD magic;
+			DWORD version;
+			DWORD charSize;
+			DWORD capacity;
+			volatile LONG writePosition;
+		};
+
+		struct RecordHeader
+		{
+			// The record's position once it's been written.
+			volatile LONG position;
+
+			// The whole record, a multiple of RECORD_ALIGNMENT.
+			DWORD size;
+
+			// In bytes, PADDING_LENGTH for padding.
+			DWORD length;
+
+			COLORREF colour;
+		};
+
+		#ifdef _WIN32
+			bool Map(HANDLE file, LPCTSTR name, DWORD capacity, bool writable, bool create);
+		#else
+			bool Map(int file, DWORD capacity, bool writable, bool create);
+		#endif
+
+		// Check the ring that's been mapped at view, starting it again if it
+		// isn't valid, or has the wrong capacity, and create is true.
+		bool Attach(void *view, size_t mappedSize, DWORD capacity, bool create);
+
+		// Find the first record written at or after position. Returns write if
+		// there isn't one.
+		LONG FindRecord(LONG position, LONG write) const;
+
+		RecordHeader *GetRecord(LONG position) const
+		{
+			return (RecordHeader *) (_data + (position & _mask));
+		}
+
+		#ifdef _WIN32
+			HANDLE _file;
+			HANDLE _mapping;
+		#else
+			int _file;
+			size_t _mappedSize;
+		#endif
+
+		RingHeader *_header;
+		char *_data;
+		DWORD _mask;
+		bool _writable;
+		std::vector<TCHAR> _readBuffer;
+	};
+}
+
+#endif
@@ -1,38 +1,520 @@
 #include "LogWnd.h"
-#include <memory>
 
 namespace WndLib
 {
+	//
+	// LogViewWnd
+	//
+
+	// Older SDKs don't have these.
+	#ifndef WM_MOUSEHWHEEL
+		#define WM_MOUSEHWHEEL 0x020e
+	#endif
+
+	#ifndef SPI_GETWHEELSCROLLCHARS
+		#define SPI_GETWHEELSCROLLCHARS 0x006c
+	#endif
+
+	#ifndef WHEEL_PAGESCROLL
+		#define WHEEL_PAGESCROLL UINT_MAX
+	#endif
+
+	WND_WM_TABLE_BEGIN(LogViewWnd, Wnd)
+		WND_WM_TABLE(WM_PAINT, OnPaint)
+		WND_WM_TABLE(WM_ERASEBKGND, OnEraseBkgnd)
+		WND_WM_TABLE(WM_SIZE, OnSize)
+		WND_WM_TABLE(WM_VSCROLL, OnVScroll)
+		WND_WM_TABLE(WM_HSCROLL, OnHScroll)
+		WND_WM_TABLE(WM_MOUSEWHEEL, OnMouseWheel)
+		WND_WM_TABLE(WM_MOUSEHWHEEL, OnMouseHWheel)
+		WND_WM_TABLE(WM_KEYDOWN, OnKeyDown)
+		WND_WM_TABLE(WM_LBUTTONDOWN, OnLButtonDown)
+		WND_WM_TABLE(WM_SETFONT, OnSetFont)
+		WND_WM_TABLE(WM_GETFONT, OnGetFont)
+	WND_WM_TABLE_END()
+
+	LogViewWnd::LogViewWnd()
+	{
+		_maxLines = _maxChars = 0;
+		_font = NULL;
+		_lineHeight = 16;
+		_visibleLines = 1;
+		_topLine = 0;
+		_scrollX = 0;
+		_contentWidth = 0;
+		_clientWidth = 0;
+		_charWidth = 8;
+		_wheelRemainder = _hwheelRemainder = 0;
+	}
+
+	bool LogViewWnd::Create(HWND parent, DWORD exStyle)
+	{
+		return CreateEx(exStyle, NULL,
+			WS_CHILD | WS_VISIBLE | WS_VSCROLL | WS_HSCROLL | WS_CLIPSIBLINGS,
+			0, 0, 0, 0, parent, NULL, GetHInstance());
+	}
+
+	LPCTSTR LogViewWnd::GetClassName()
+	{
+		return TEXT("LogViewWnd");
+	}
+
+	void LogViewWnd::GetWndClass(WNDCLASSEX *wc)
+	{
+		Wnd::GetWndClass(wc);
+
+		wc->hCursor = LoadCursor(NULL, IDC_IBEAM);
+		wc->hbrBackground = GetSysColorBrush(COLOR_WINDOW);
+	}
+
+	void LogViewWnd::Update()
+	{
+		bool following = _topLine >= GetMaxTopLine();
+
+		size_t removedLines = _store.Trim(_maxLines, _maxChars);
+		_topLine = _topLine > removedLines ? _topLine - removedLines : 0;
+
+		if (following)
+			_topLine = GetMaxTopLine();
+
+		UpdateScrollBar();
+		InvalidateRect(NULL, FALSE);
+	}
+
+	void LogViewWnd::ScrollToEnd()
+	{
+		ScrollTo(GetMaxTopLine());
+	}
+
+	size_t LogViewWnd::GetMaxTopLine() const
+	{
+		size_t lines = _store.GetLineCount();
+		return lines > (size_t) _visibleLines ? lines - _visibleLines : 0;
+	}
+
+	int LogViewWnd::GetScrollScale() const
+	{
+		size_t lines = _store.GetLineCount();
+		size_t scale = 1;
+		while (lines / scale > 0x3fffffff)
+			scale *= 2;
+
+		return (int) scale;
+	}
+
+	void LogViewWnd::UpdateScrollBar()
+	{
+		int scale = GetScrollScale();
+
+		SCROLLINFO si;
+		memset(&si, 0, sizeof(si));
+		si.cbSize = sizeof(si);
+		si.fMask = SIF_RANGE | SIF_PAGE | SIF_POS | SIF_DISABLENOSCROLL;
+		si.nMin = 0;
+		si.nMax = _store.GetLineCount() ? (int) ((_store.GetLineCount() - 1) / scale) : 0;
+		si.nPage = (UINT) (_visibleLines / scale);
+		si.nPos = (int) (_topLine / scale);
+		::SetScrollInfo(GetHWnd(), SB_VERT, &si, TRUE);
+
+		si.nMax = _contentWidth ? _contentWidth - 1 : 0;
+		si.nPage = (UINT) _clientWidth;
+		si.nPos = _scrollX;
+		::SetScrollInfo(GetHWnd(), SB_HORZ, &si, TRUE);
+	}
+
+	int LogViewWnd::GetMaxScrollX() const
+	{
+		return _contentWidth > _clientWidth ? _contentWidth - _clientWidth : 0;
+	}
+
+	void LogViewWnd::ScrollHorizontallyTo(int scrollX)
+	{
+		int maxScrollX = GetMaxScrollX();
+		if (scrollX > maxScrollX)
+			scrollX = maxScrollX;
+
+		if (scrollX < 0)
+			scrollX = 0;
+
+		if (scrollX == _scrollX)
+			return;
+
+		_scrollX = scrollX;
+		UpdateScrollBar();
+		InvalidateRect(NULL, FALSE);
+	}
+
+	void LogViewWnd::ScrollTo(size_t topLine)
+	{
+		size_t maxTopLine = GetMaxTopLine();
+		if (topLine > maxTopLine)
+			topLine = maxTopLine;
+
+		if (topLine == _topLine)
+			return;
+
+		_topLine = topLine;
+		UpdateScrollBar();
+		InvalidateRect(NULL, FALSE);
+	}
+
+	LRESULT LogViewWnd::OnPaint(UINT, WPARAM, LPARAM)
+	{
+		PaintDC dc(this);
+
+		RECT client;
+		GetClientRect(&client);
+
+		RECT update;
+		::GetClipBox(dc, &update);
+		::FillRect(dc, &update, GetSysColorBrush(COLOR_WINDOW));
+
+		HGDIOBJ oldFont = _font ? ::SelectObject(dc, _font) : NULL;
+		::SetBkMode(dc, TRANSPARENT);
+
+		const int margin = 2;
+
+		// Only the lines intersecting the update rectangle are drawn.
+		size_t first = _topLine + (update.top > 0 ? update.top / _lineHeight : 0);
+		size_t last = _topLine + (update.bottom + _lineHeight - 1) / _lineHeight;
+		if (last > _store.GetLineCount())
+			last = _store.GetLineCount();
+
+		// Most logs are mostly one colour, so only change it when it differs.
+		COLORREF textColour = ::GetTextColor(dc);
+
+		const int origin = margin - _scrollX;
+		int contentWidth = _contentWidth;
+
+		for (size_t line = first; line < last; ++line)
+		{
+			int y = (int) (line - _topLine) * _lineHeight;
+			int x = origin;
+			size_t runCount = _store.GetRunCount(line);
+			size_t i = 0;
+
+			for (; i != runCount && x < client.right; ++i)
+			{
+				const LogLineStore::Run &run = _store.GetRun(line, i);
+
+				if (run.colour != textColour)
+				{
+					::SetTextColor(dc, run.colour);
+					textColour = run.colour;
+				}
+
+				DWORD extent = ::TabbedTextOut(dc, x, y, run.text, (int) run.length, 0, NULL, origin);
+				x += LOWORD(extent);
+			}
+
+			// Measure the rest of the line, for the horizontal scroll range.
+			for (; i != runCount; ++i)
+			{
+				const LogLineStore::Run &run = _store.GetRun(line, i);
+				DWORD extent = ::GetTabbedTextExtent(dc, run.text, (int) run.length, 0, NULL);
+				x += LOWORD(extent);
+			}
+
+			if (x - origin + 2 * margin > contentWidth)
+				contentWidth = x - origin + 2 * margin;
+		}
+
+		if (oldFont)
+			::SelectObject(dc, oldFont);
+
+		if (contentWidth != _contentWidth)
+		{
+			_contentWidth = contentWidth;
+			UpdateScrollBar();
+		}
+
+		return 0;
+	}
+
+	LRESULT LogViewWnd::OnEraseBkgnd(UINT, WPARAM, LPARAM)
+	{
+		// WM_PAINT fills the background.
+		return 1;
+	}
+
+	LRESULT LogViewWnd::OnSize(UINT msg, WPARAM wparam, LPARAM lparam)
+	{
+		bool following = _topLine >= GetMaxTopLine();
+
+		int height = HIWORD(lparam);
+		_visibleLines = height / _lineHeight;
+		if (_visibleLines < 1)
+			_visibleLines = 1;
+
+		_clientWidth = LOWORD(lparam);
+		if (_scrollX > GetMaxScrollX())
+			_scrollX = GetMaxScrollX();
+
+		_topLine = following ? GetMaxTopLine() : (_topLine < GetMaxTopLine() ? _topLine : GetMaxTopLine());
+		UpdateScrollBar();
+
+		return BaseWndProc(msg, wparam, lparam);
+	}
+
+	LRESULT LogViewWnd::OnVScroll(UINT, WPARAM wparam, LPARAM)
+	{
+		size_t page = _visibleLines > 1 ? _visibleLines - 1 : 1;
+
+		switch (LOWORD(wparam))
+		{
+			case SB_LINEUP:
+				ScrollTo(_topLine ? _topLine - 1 : 0);
+				break;
+
+			case SB_LINEDOWN:
+				ScrollTo(_topLine + 1);
+				break;
+
+			case SB_PAGEUP:
+				ScrollTo(_topLine > page ? _topLine - page : 0);
+				break;
+
+			case SB_PAGEDOWN:
+				ScrollTo(_topLine + page);
+				break;
+
+			case SB_TOP:
+				ScrollTo(0);
+				break;
+
+			case SB_BOTTOM:
+				ScrollToEnd();
+				break;
+
+			case SB_THUMBTRACK:
+			case SB_THUMBPOSITION:
+			{
+				// The position in wparam is only 16 bits.
+				SCROLLINFO si;
+				memset(&si, 0, sizeof(si));
+				si.cbSize = sizeof(si);
+				si.fMask = SIF_TRACKPOS;
+				::GetScrollInfo(GetHWnd(), SB_VERT, &si);
+				ScrollTo((size_t) si.nTrackPos * GetScrollScale());
+				break;
+			}
+		}
+
+		return 0;
+	}
+
+	LRESULT LogViewWnd::OnHScroll(UINT, WPARAM wparam, LPARAM)
+	{
+		int page = _clientWidth > _charWidth ? _clientWidth - _charWidth : _charWidth;
+
+		switch (LOWORD(wparam))
+		{
+			case SB_LINELEFT:
+				ScrollHorizontallyTo(_scrollX - _charWidth);
+				break;
+
+			case SB_LINERIGHT:
+				ScrollHorizontallyTo(_scrollX + _charWidth);
+				break;
+
+			case SB_PAGELEFT:
+				ScrollHorizontallyTo(_scrollX - page);
+				break;
+
+			case SB_PAGERIGHT:
+				ScrollHorizontallyTo(_scrollX + page);
+				break;
+
+			case SB_LEFT:
+				ScrollHorizontallyTo(0);
+				break;
+
+			case SB_RIGHT:
+				ScrollHorizontallyTo(GetMaxScrollX());
+				break;
+
+			case SB_THUMBTRACK:
+			case SB_THUMBPOSITION:
+			{
+				SCROLLINFO si;
+				memset(&si, 0, sizeof(si));
+				si.cbSize = sizeof(si);
+				si.fMask = SIF_TRACKPOS;
+				::GetScrollInfo(GetHWnd(), SB_HORZ, &si);
+				ScrollHorizontallyTo(si.nTrackPos);
+				break;
+			}
+		}
+
+		return 0;
+	}
+
+	int LogViewWnd::TakeWheelSteps(int *remainder, int delta, UINT stepsPerNotch)
+	{
+		// Start again if the wheel changes direction.
+		if ((*remainder > 0 && delta < 0) || (*remainder < 0 && delta > 0))
+			*remainder = 0;
+
+		*remainder += delta;
+
+		if (! stepsPerNotch)
+		{
+			*remainder = 0;
+			return 0;
+		}
+
+		// Touchpads and high resolution wheels send deltas much smaller than
+		// WHEEL_DELTA, which would otherwise each round down to nothing.
+		int deltaPerStep = stepsPerNotch < WHEEL_DELTA ? WHEEL_DELTA / (int) stepsPerNotch : 1;
+		int steps = *remainder / deltaPerStep;
+		*remainder -= steps * deltaPerStep;
+		return steps;
+	}
+
+	LRESULT LogViewWnd::OnMouseWheel(UINT, WPARAM wparam, LPARAM)
+	{
+		UINT linesPerNotch = 3;
+		::SystemParametersInfo(SPI_GETWHEELSCROLLLINES, 0, &linesPerNotch, 0);
+
+		int delta = (short) HIWORD(wparam);
+		int lines;
+
+		if (linesPerNotch == WHEEL_PAGESCROLL)
+		{
+			size_t page = _visibleLines > 1 ? _visibleLines - 1 : 1;
+			lines = TakeWheelSteps(&_wheelRemainder, delta, 1) * (int) page;
+		}
+		else
+		{
+			lines = TakeWheelSteps(&_wheelRemainder, delta, linesPerNotch);
+		}
+
+		// A positive delta is away from the user, which scrolls up.
+		if (lines > 0)
+			ScrollTo(_topLine > (size_t) lines ? _topLine - lines : 0);
+		else if (lines < 0)
+			ScrollTo(_topLine + (size_t) -lines);
+
+		return 0;
+	}
+
+	LRESULT LogViewWnd::OnMouseHWheel(UINT, WPARAM wparam, LPARAM)
+	{
+		UINT charsPerNotch = 3;
+		::SystemParametersInfo(SPI_GETWHEELSCROLLCHARS, 0, &charsPerNotch, 0);
+
+		// A positive delta is to the right.
+		int chars = TakeWheelSteps(&_hwheelRemainder, (short) HIWORD(wparam), charsPerNotch);
+		if (chars)
+			ScrollHorizontallyTo(_scrollX + chars * _charWidth);
+
+		return TRUE;
+	}
+
+	LRESULT LogViewWnd::OnKeyDown(UINT msg, WPARAM wparam, LPARAM lparam)
+	{
+		switch (wparam)
+		{
+			case VK_UP: SendMessage(WM_VSCROLL, SB_LINEUP, 0); return 0;
+			case VK_DOWN: SendMessage(WM_VSCROLL, SB_LINEDOWN, 0); return 0;
+			case VK_PRIOR: SendMessage(WM_VSCROLL, SB_PAGEUP, 0); return 0;
+			case VK_NEXT: SendMessage(WM_VSCROLL, SB_PAGEDOWN, 0); return 0;
+			case VK_HOME: SendMessage(WM_VSCROLL, SB_TOP, 0); return 0;
+			case VK_END: SendMessage(WM_VSCROLL, SB_BOTTOM, 0); return 0;
+			case VK_LEFT: SendMessage(WM_HSCROLL, SB_LINELEFT, 0); return 0;
+			case VK_RIGHT: SendMessage(WM_HSCROLL, SB_LINERIGHT, 0); return 0;
+		}
+
+		return BaseWndProc(msg, wparam, lparam);
+	}
+
+	LRESULT LogViewWnd::OnLButtonDown(UINT msg, WPARAM wparam, LPARAM lparam)
+	{
+		SetFocus();
+		return BaseWndProc(msg, wparam, lparam);
+	}
+
+	LRESULT LogViewWnd::OnSetFont(UINT, WPARAM wparam, LPARAM lparam)
+	{
+		_font = (HFONT) wparam;
+
+		ClientDC dc(this);
+		HGDIOBJ oldFont = _font ? ::SelectObject(dc, _font) : NULL;
+
+		TEXTMETRIC tm;
+		if (::GetTextMetrics(dc, &tm))
+		{
+			_lineHeight = tm.tmHeight + tm.tmExternalLeading;
+			_charWidth = tm.tmAveCharWidth;
+		}
+
+		if (_lineHeight < 1)
+			_lineHeight = 1;
+
+		if (_charWidth < 1)
+			_charWidth = 1;
+
+		// The widths measured so far were in the old font.
+		_contentWidth = 0;
+		_scrollX = 0;
+
+		if (oldFont)
+			::SelectObject(dc, oldFont);
+
+		RECT client;
+		GetClientRect(&client);
+		_visibleLines = (client.bottom - client.top) / _lineHeight;
+		if (_visibleLines < 1)
+			_visibleLines = 1;
+
+		_clientWidth = client.right - client.left;
+
+		UpdateScrollBar();
+
+		if (LOWORD(lparam))
+			InvalidateRect(NULL, FALSE);
+
+		return 0;
+	}
+
+	LRESULT LogViewWnd::OnGetFont(UINT, WPARAM, LPARAM)
+	{
+		return (LRESULT) _font;
+	}
+
 	//
 	// LogWnd
 	//
 
-	WND_WM_BEGIN(LogWnd, Wnd)
-		WND_WM(WM_CLOSE, OnClose)
-		WND_WM(WM_CREATE, OnCreate)
-		WND_WM(WM_SIZE, OnSize)
-		WND_WM(WM_USER, OnUser)
-		WND_WM(WM_SETFOCUS, OnSetFocus)
-	WND_WM_END()
+	WND_WM_TABLE_BEGIN(LogWnd, Wnd)
+		WND_WM_TABLE(WM_CLOSE, OnClose)
+		WND_WM_TABLE(WM_CREATE, OnCreate)
+		WND_WM_TABLE(WM_DESTROY, OnDestroy)
+		WND_WM_TABLE(WM_SIZE, OnSize)
+		WND_WM_TABLE(WM_USER, OnUser)
+		WND_WM_TABLE(WM_TIMER, OnTimer)
+		WND_WM_TABLE(WM_SETFOCUS, OnSetFocus)
+		WND_WM_TABLE(WM_SHOWWINDOW, OnShowWindow)
+	WND_WM_TABLE_END()
 
 	LogWnd::LogWnd()
 	{
-		_logEntry = _lastLogEntry = 0;
+		_threadId = 0;
+		_flushPending = 0;
+		_stagingTimerRunning = false;
+		_flushInterval = 0;
+		_lastFlushTime = 0;
+		_posts = _postsAvoided = 0;
+		_flushes = 0;
+		_maxLines = _maxChars = 0;
+		_storeWhileHidden = false;
+		_processingQueue = false;
 		_userDidClose = false;
 	}
 
 	LogWnd::~LogWnd()
 	{
 		DestroyWindow();
-
-		CriticalSection::ScopedLock lock(_cs);
-
-		while (_logEntry)
-		{
-			LogEntry *next = _logEntry->next;
-			delete _logEntry;
-			_logEntry = next;
-		}
 	}
 
 	bool LogWnd::Create(LPCTSTR title, HWND parent)
@@ -91,15 +573,29 @@ namespace WndLib
 
 		DWORD clientedge = (_flags & FLAG_CLIENT_EDGE) ? WS_EX_CLIENTEDGE : 0;
 
-		if (! _edit.CreateEx(clientedge, TEXT(""),
-			WS_CHILD | WS_VISIBLE | ES_MULTILINE | ES_READONLY |
-			ES_AUTOVSCROLL | WS_CLIPCHILDREN | WS_CLIPSIBLINGS | WS_VSCROLL, 
-			0, 0, 0, 0, GetHWnd(), NULL, NULL, NULL, true))
+		if (_flags & FLAG_VIRTUAL_VIEW)
 		{
-			return -1;
+			if (! _view.Create(GetHWnd(), clientedge))
+				return -1;
+
+			_view.SetFont(_font);
+			_view.SetScrollback(_maxLines, _maxChars);
 		}
+		else
+		{
+			if (! _edit.CreateEx(clientedge, TEXT(""),
+				WS_CHILD | WS_VISIBLE | ES_MULTILINE | ES_READONLY |
+				ES_AUTOVSCROLL | WS_CLIPCHILDREN | WS_CLIPSIBLINGS | WS_VSCROLL, 
+				0, 0, 0, 0, GetHWnd(), NULL, NULL, NULL, true))
+			{
+				return -1;
+			}
+
+			_edit.SetFont(_font);
 
-		_edit.SetFont(_font);
+			// The default limit is 32K characters. SetScrollback is how to limit it.
+			_edit.ExLimitText(0x7ffffffe);
+		}
 
 		if (ispopup)
 		{
@@ -109,6 +605,15 @@ namespace WndLib
 				SWP_NOZORDER | SWP_NOSIZE | SWP_NOACTIVATE);
 		}
 
+		_threadId = GetCurrentThreadId();
+
+		return BaseWndProc(msg, wparam, lparam);
+	}
+
+	LRESULT LogWnd::OnDestroy(UINT msg, WPARAM wparam, LPARAM lparam)
+	{
+		_threadId = 0;
+		_stagingTimerRunning = false;
 		return BaseWndProc(msg, wparam, lparam);
 	}
 
@@ -122,7 +627,7 @@ namespace WndLib
 		if (pad)
 			InflateRect(&rect, -2, -2);
 
-		_edit.SetWindowPos(NULL, rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
+		GetDisplayWnd().SetWindowPos(NULL, rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
 			SWP_NOZORDER);
 
 		return BaseWndProc(msg, wparam, lparam);
@@ -130,10 +635,18 @@ namespace WndLib
 
 	LRESULT LogWnd::OnSetFocus(UINT, WPARAM, LPARAM)
 	{
-		_edit.SetFocus();
+		GetDisplayWnd().SetFocus();
 		return 0;
 	}
 
+	LRESULT LogWnd::OnShowWindow(UINT msg, WPARAM wparam, LPARAM lparam)
+	{
+		if (wparam)
+			RenderHiddenLines();
+
+		return BaseWndProc(msg, wparam, lparam);
+	}
+
 	LRESULT LogWnd::OnClose(UINT, WPARAM, LPARAM)
 	{
 		ShowFrame(SW_HIDE);
@@ -141,70 +654,310 @@ namespace WndLib
 		return 0;
 	}
 
-	void LogWnd::AppendEditControl(LPCTSTR string, ptrdiff_t length)
+	struct LogRtfStream
+	{
+		const char *data;
+		size_t remaining;
+	};
+
+	static DWORD CALLBACK LogRtfStreamCallback(DWORD_PTR cookie, LPBYTE buffer, LONG size, LONG *written)
+	{
+		LogRtfStream *stream = (LogRtfStream *) cookie;
+
+		size_t count = stream->remaining < (size_t) size ? stream->remaining : (size_t) size;
+		memcpy(buffer, stream->data, count);
+
+		stream->data += count;
+		stream->remaining -= count;
+		*written = (LONG) count;
+		return 0;
+	}
+
+	void LogWnd::AppendRtf(const std::string &rtf, size_t trimLength)
 	{
-		if (length < 0)
-			length = lstrlen(string);
+		_edit.SendMessage(WM_SETREDRAW, FALSE, 0);
 
-		LPCTSTR end = string + length;
-		LPCTSTR start;
+		DWORD len = _edit.GetTextLength();
+		_edit.ExSetSel(len, len);
 
-		for (;;)
+		LogRtfStream source = { rtf.data(), rtf.size() };
+
+		EDITSTREAM stream;
+		stream.dwCookie = (DWORD_PTR) &source;
+		stream.dwError = 0;
+		stream.pfnCallback = &LogRtfStreamCallback;
+		_edit.StreamIn(SF_RTF | SFF_SELECTION, &stream);
+
+		if (trimLength)
 		{
-			start = string;
+			_edit.ExSetSel(0, (LONG) trimLength);
+			_edit.ReplaceSel(FALSE, TEXT(""));
+		}
 
-			while (string != end && *string != '\n' && *string != '\r')
-				string++;
+		_edit.SendMessage(WM_SETREDRAW, TRUE, 0);
+		_edit.InvalidateRect(NULL, FALSE);
 
-			if (string != start)
-				AppendEditControlRaw(start, string - start);
+		ScrollEditControl();
+	}
 
-			if (string == end)
-				break;
+	//
+	// Saving
+	//
 
-			if (*string == '\n')
-				AppendEditControlRaw(TEXT("\r\n"), 2);
+	struct LogSaveFile
+	{
+		HANDLE file;
+		bool ok;
 
-			++string;
+		void Write(const void *data, size_t size)
+		{
+			DWORD written;
+			if (ok && size && (! WriteFile(file, data, (DWORD) size, &written, NULL) || written != size))
+				ok = false;
 		}
+	};
+
+	static DWORD CALLBACK LogSaveStreamCallback(DWORD_PTR cookie, LPBYTE buffer, LONG size, LONG *written)
+	{
+		LogSaveFile *save = (LogSaveFile *) cookie;
+		save->Write(buffer, size);
+		*written = size;
+		return save->ok ? 0 : 1;
 	}
 
-	void LogWnd::AppendEditControlRaw(LPCTSTR string, ptrdiff_t length)
+	static void AppendUTF8(std::string *utf8, LPCTSTR text, size_t length)
 	{
-		if (length < 0)
-			length = lstrlen(string);
+		if (! length)
+			return;
+
+		#ifdef WNDLIB_UNICODE
+			LPCWSTR wide = text;
+			int wideLength = (int) length;
+		#else
+			WCharString wideString = CharToWide(CP_ACP, std::string(text, length));
+			LPCWSTR wide = wideString.data();
+			int wideLength = (int) wideString.size();
+		#endif
+
+		int utf8Length = WideCharToMultiByte(CP_UTF8, 0, wide, wideLength, NULL, 0, NULL, NULL);
+		if (utf8Length <= 0)
+			return;
+
+		size_t used = utf8->size();
+		utf8->resize(used + utf8Length);
+		WideCharToMultiByte(CP_UTF8, 0, wide, wideLength, &(*utf8)[used], utf8Length, NULL, NULL);
+	}
 
-		DWORD len = _edit.GetTextLength();
-		_edit.ExSetSel(len, len);
-		_edit.ReplaceSel(FALSE, TEXT(""));
+	static const size_t saveChunkSize = 64 * 1024;
 
-		TCHAR buf[256];
+	// Write a LogLineStore's lines as UTF-8 text, a chunk at a time.
+	static void SaveLineStoreText(LogSaveFile *save, const LogLineStore &store)
+	{
+		size_t lineCount = store.GetLineCount();
 
-		while (length)
+		std::string chunk;
+		chunk.reserve(saveChunkSize * 2);
+
+		for (size_t line = 0; line != lineCount && save->ok; ++line)
 		{
-			int thistime;
-			if (length >= WNDLIB_COUNTOF(buf))
-				thistime = (int) (WNDLIB_COUNTOF(buf) - 1);
-			else
-				thistime = (int) length;
+			for (size_t i = 0; i != store.GetRunCount(line); ++i)
+			{
+				const LogLineStore::Run &run = store.GetRun(line, i);
+				AppendUTF8(&chunk, run.text, run.length);
+			}
+
+			// Every line that's been ended gets its line break, like the text
+			// LogFileSink writes. Only an open last line goes without.
+			if (line + 1 != lineCount || ! store.IsLastLineOpen())
+				chunk += "\r\n";
 
-			lstrcpyn(buf, string, thistime + 1);
-			buf[thistime] = 0;
+			if (chunk.size() >= saveChunkSize)
+			{
+				save->Write(chunk.data(), chunk.size());
+				chunk.clear();
+			}
+		}
 
-			len = _edit.GetTextLength();
-			_edit.ExSetSel(len, len);
-			_edit.SetCharFormat(SCF_SELECTION, &_charFormat);
-			_edit.ReplaceSel(FALSE, buf);
+		save->Write(chunk.data(), chunk.size());
+	}
 
-			string += thistime;
-			length -= thistime;
+	// The colour table comes before the text, so find every colour used first.
+	static void AddLineStoreColours(const LogLineStore &store, LogRtfWriter *rtf)
+	{
+		for (size_t line = 0; line != store.GetLineCount(); ++line)
+		{
+			for (size_t i = 0; i != store.GetRunCount(line); ++i)
+				rtf->AddColour(store.GetRun(line, i).colour);
 		}
+	}
 
-		ScrollEditControl();
+	// Write a LogLineStore's lines as the body of an RTF document, a chunk at
+	// a time.
+	static void SaveLineStoreRtf(LogSaveFile *save, const LogLineStore &store, LogRtfWriter *rtf)
+	{
+		size_t lineCount = store.GetLineCount();
+
+		for (size_t line = 0; line != lineCount && save->ok; ++line)
+		{
+			for (size_t i = 0; i != store.GetRunCount(line); ++i)
+			{
+				const LogLineStore::Run &run = store.GetRun(line, i);
+				rtf->Append(run.text, run.length, run.colour);
+			}
+
+			if (line + 1 != lineCount)
+				rtf->EndLine();
+
+			if (rtf->GetBody().size() >= saveChunkSize)
+			{
+				save->Write(rtf->GetBody().data(), rtf->GetBody().size());
+				rtf->ClearBody();
+			}
+		}
+
+		save->Write(rtf->GetBody().data(), rtf->GetBody().size());
+		rtf->ClearBody();
+	}
+
+	// Write a LogLineStore as UTF-8 text or RTF, a chunk at a time.
+	static bool SaveLineStore(HANDLE file, const LogLineStore &store, LogWnd::SaveFormat format, HFONT font)
+	{
+		LogSaveFile save = { file, true };
+
+		if (format == LogWnd::SAVE_TEXT)
+		{
+			SaveLineStoreText(&save, store);
+			return save.ok;
+		}
+
+		std::vector<COLORREF> palette;
+		LogRtfWriter rtf(&palette);
+		AddLineStoreColours(store, &rtf);
+
+		LOGFONT logFont;
+		memset(&logFont, 0, sizeof(logFont));
+		if (! font || ! GetObject(font, sizeof(logFont), &logFont))
+			GetObject(GetStockObject(DEFAULT_GUI_FONT), sizeof(logFont), &logFont);
+
+		CHARFORMAT charFormat;
+		memset(&charFormat, 0, sizeof(charFormat));
+		charFormat.cbSize = sizeof(charFormat);
+		charFormat.bCharSet = logFont.lfCharSet;
+		lstrcpyn(charFormat.szFaceName, logFont.lfFaceName, LF_FACESIZE);
+
+		ClientDC dc((HWND) NULL);
+		int height = logFont.lfHeight < 0 ? -logFont.lfHeight : logFont.lfHeight;
+		charFormat.yHeight = MulDiv(height, 1440, GetDeviceCaps(dc, LOGPIXELSY));
+
+		std::string header = rtf.GetHeader(charFormat.szFaceName, charFormat.bCharSet, charFormat.yHeight);
+		save.Write(header.data(), header.size());
+
+		SaveLineStoreRtf(&save, store, &rtf);
+		save.Write("}", 1);
+		return save.ok;
+	}
+
+	struct LogSaveMerging
+	{
+		LogSaveFile *save;
+		LogRtfMerger *merger;
+		std::string merged;
+	};
+
+	static DWORD CALLBACK LogSaveMergeCallback(DWORD_PTR cookie, LPBYTE buffer, LONG size, LONG *written)
+	{
+		LogSaveMerging *merging = (LogSaveMerging *) cookie;
+
+		merging->merged.clear();
+		merging->merger->Write((const char *) buffer, size, &merging->merged);
+		merging->save->Write(merging->merged.data(), merging->merged.size());
+
+		*written = size;
+		return merging->save->ok ? 0 : 1;
+	}
+
+	bool LogWnd::SaveTo(LPCTSTR path, SaveFormat format)
+	{
+		if (! GetHWnd())
+			return false;
+
+		// Include anything still queued. Anything kept while hidden is written
+		// after the control's contents, without adding it to the control.
+		ProcessQueue();
+
+		HANDLE file = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		bool ok;
+
+		if (_flags & FLAG_VIRTUAL_VIEW)
+		{
+			ok = SaveLineStore(file, _view.GetStore(), format, (HFONT) _view.SendMessage(WM_GETFONT, 0, 0));
+		}
+		else if (format == SAVE_RTF)
+		{
+			// The hidden lines' colours are added to the control's colour
+			// table, and they're written before the document's closing brace.
+			std::vector<COLORREF> palette;
+			LogRtfWriter rtf(&palette);
+			AddLineStoreColours(_hiddenStore, &rtf);
+
+			LogSaveFile save = { file, true };
+			LogRtfMerger merger(rtf.GetColourTable());
+			LogSaveMerging merging = { &save, &merger };
+
+			EDITSTREAM stream;
+			stream.dwCookie = (DWORD_PTR) &merging;
+			stream.dwError = 0;
+			stream.pfnCallback = &LogSaveMergeCallback;
+			_edit.StreamOut(SF_RTF, &stream);
+
+			std::string end;
+			merger.Finish(&end);
+			save.Write(end.data(), end.size());
+
+			rtf.SetFirstColourIndex(merger.GetFirstColourIndex());
+			SaveLineStoreRtf(&save, _hiddenStore, &rtf);
+			save.Write("}", 1);
+
+			ok = save.ok && ! stream.dwError;
+		}
+		else
+		{
+			// The control converts to UTF-8 itself, a chunk at a time.
+			LogSaveFile save = { file, true };
+
+			EDITSTREAM stream;
+			stream.dwCookie = (DWORD_PTR) &save;
+			stream.dwError = 0;
+			stream.pfnCallback = &LogSaveStreamCallback;
+			_edit.StreamOut((CP_UTF8 << 16) | SF_USECODEPAGE | SF_TEXT, &stream);
+
+			// The hidden lines carry on from the control's last line.
+			SaveLineStoreText(&save, _hiddenStore);
+
+			ok = save.ok && ! stream.dwError;
+		}
+
+		CloseHandle(file);
+
+		if (! ok)
+			DeleteFile(path);
+
+		return ok;
 	}
 
 	void LogWnd::ScrollEditControl()
 	{
+		if (_flags & FLAG_VIRTUAL_VIEW)
+		{
+			_view.ScrollToEnd();
+			return;
+		}
+
 		DWORD len = _edit.GetTextLength();
 		_edit.ExSetSel(len, len);
 		_edit.SendMessage(WM_VSCROLL, SB_BOTTOM, 0);
@@ -212,67 +965,212 @@ namespace WndLib
 		//_edit.UpdateWindow();
 	}
 
-	void LogWnd::Log(const TCHAR *log, COLORREF colour, ShowCommand showCommand)
+	void LogWnd::OnPublish()
 	{
-		CriticalSection::ScopedLock lock(_cs);
+		if (_threadId == GetCurrentThreadId() && ! _flushInterval)
+			ProcessQueue();
+		else
+			RequestFlush();
+	}
 
-		std::auto_ptr<LogEntry> logEntry(new LogEntry);
-		logEntry->text = log;
-		logEntry->colour = colour;
-		logEntry->showCommand = showCommand;
-		logEntry->next = 0;
+	bool LogWnd::OnQueueFull()
+	{
+		if (_threadId != GetCurrentThreadId() || _processingQueue)
+			return false;
 
-		if (_lastLogEntry)
-			_lastLogEntry->next = logEntry.get();
-		else
-			_logEntry = logEntry.get();
+		// Make room by displaying what's waiting.
+		ProcessQueue();
+		return true;
+	}
 
-		_lastLogEntry = logEntry.release();
+	bool LogWnd::CanWaitForSpace()
+	{
+		return _threadId && _threadId != GetCurrentThreadId();
+	}
 
-		if (GetWindowThreadProcessId(GetHWnd(), NULL) == GetCurrentThreadId())
-			ProcessQueue();
-		else
-			PostMessage(WM_USER);
+	void LogWnd::OnStagingEnabled()
+	{
+		// ProcessQueue starts the staging timer.
+		RequestFlush();
+	}
+
+	void LogWnd::RequestFlush()
+	{
+		// Headless, so ProcessQueue is up to the caller.
+		if (! GetHWnd())
+			return;
+
+		if (InterlockedExchange(&_flushPending, 1) != 0)
+		{
+			InterlockedIncrement(&_postsAvoided);
+			return;
+		}
+
+		InterlockedIncrement(&_posts);
+
+		// If the message can't be posted (e.g., the queue is full), let the
+		// next entry try again.
+		if (! PostMessage(WM_USER))
+			InterlockedExchange(&_flushPending, 0);
 	}
 
-	void LogWnd::Format(COLORREF colour, ShowCommand showCommand, const TCHAR *fmt, ...)
+	void LogWnd::SetScrollback(size_t maxLines, size_t maxChars)
 	{
-		va_list argPtr;
-		va_start(argPtr, fmt);
-		TCharString formatted = TCharFormatVA(fmt, argPtr);
-		va_end(argPtr);
+		_maxLines = maxLines;
+		_maxChars = maxChars;
+		_view.SetScrollback(maxLines, maxChars);
+	}
 
-		Log(formatted.c_str(), colour, showCommand);
+	void LogWnd::GetFlushStats(FlushStats *stats) const
+	{
+		stats->posts = _posts;
+		stats->postsAvoided = _postsAvoided;
+		stats->flushes = _flushes;
 	}
 
+	#ifdef WNDLIB_PROFILE_DISPATCH
+		void LogWnd::LogDispatchProfile(COLORREF colour, size_t maxRecords)
+		{
+			std::vector<DispatchProfiler::Record> records;
+			DispatchProfiler::Snapshot(&records);
+
+			if (maxRecords && records.size() > maxRecords)
+				records.resize(maxRecords);
+
+			Format(colour, SHOWCOMMAND_NO_CHANGE, TEXT("%-24s %6s %10s %12s %10s %10s %10s\n"),
+				TEXT("Class"), TEXT("Msg"), TEXT("Calls"), TEXT("Total us"), TEXT("p50 us"), TEXT("p99 us"), TEXT("Max us"));
+
+			for (size_t i = 0; i != records.size(); ++i)
+			{
+				const DispatchProfiler::Record &record = records[i];
+
+				Format(colour, SHOWCOMMAND_NO_CHANGE, TEXT("%-24s %06x %10lu %12.0f %10.0f %10.0f %10.0f\n"),
+					record.className.c_str(), record.msg, (unsigned long) record.count, record.totalMicroseconds,
+					record.GetPercentile(50), record.GetPercentile(99), record.maxMicroseconds);
+			}
+		}
+	#endif
+
 	LRESULT LogWnd::OnUser(UINT, WPARAM, LPARAM)
 	{
+		if (_flushInterval)
+		{
+			// _flushPending stays set until the timer fires, so no more messages
+			// are posted in the meantime.
+			DWORD elapsed = GetTickCount() - _lastFlushTime;
+			if (elapsed < _flushInterval)
+			{
+				SetTimer(TIMER_FLUSH, _flushInterval - elapsed, NULL);
+				return 0;
+			}
+		}
+
 		ProcessQueue();
 		return 0;
 	}
 
-	void LogWnd::ProcessQueue()
+	LRESULT LogWnd::OnTimer(UINT msg, WPARAM wparam, LPARAM lparam)
+	{
+		if (wparam == TIMER_STAGING)
+		{
+			// Entries staged by threads that have stopped logging are never
+			// published, so TakeEntries has to go and get them.
+			if (HasStagedEntries())
+				ProcessQueue();
+
+			return 0;
+		}
+
+		if (wparam != TIMER_FLUSH)
+			return BaseWndProc(msg, wparam, lparam);
+
+		KillTimer(TIMER_FLUSH);
+		ProcessQueue();
+		return 0;
+	}
+
+	struct LogWndTaking
+	{
+		LogWnd *wnd;
+		LogRtfWriter *rtf;
+		LogWnd::ShowCommand highestShowCommand;
+	};
+
+	void LogWnd::TakeEntry(void *context, const Entry &entry)
 	{
-		ShowCommand highestShowCommand = SHOWCOMMAND_NO_CHANGE;
+		LogWndTaking *taking = (LogWndTaking *) context;
 
+		if (entry.showCommand > taking->highestShowCommand)
+			taking->highestShowCommand = entry.showCommand;
+
+		taking->wnd->WriteEntry(taking->rtf, entry.text, entry.length, entry.colour);
+	}
+
+	void LogWnd::ProcessQueue()
+	{
+		if (_processingQueue)
 		{
-			CriticalSection::ScopedLock lock(_cs);
+			RequestFlush();
+			return;
+		}
 
-			while (_logEntry)
-			{
-				SetColour(_logEntry->colour);
+		_processingQueue = true;
 
-				if (_logEntry->showCommand > highestShowCommand)
-					highestShowCommand = _logEntry->showCommand;
+		// Cleared before taking entries, so any published after this point post
+		// another message.
+		InterlockedExchange(&_flushPending, 0);
+		_lastFlushTime = GetTickCount();
+		++_flushes;
 
-				AppendEditControl(_logEntry->text.c_str());
+		// The virtual view is cheap to update, so only the edit control waits
+		// until it's visible.
+		_storeWhileHidden = GetHWnd() && ! (_flags & FLAG_VIRTUAL_VIEW) && ! IsWindowVisible();
+		if (! _storeWhileHidden)
+			RenderHiddenLines();
 
-				LogEntry *next = _logEntry->next;
-				delete _logEntry;
-				_logEntry = next;
-			}
+		// A log using more colours than this is unusual, so the palette is
+		// simply started again.
+		if (_palette.size() > MAX_PALETTE_COLOURS)
+			_palette.clear();
+
+		LogRtfWriter rtf(&_palette);
+
+		LogWndTaking taking = { this, &rtf, SHOWCOMMAND_NO_CHANGE };
+		const bool appended = TakeEntries(&TakeEntry, &taking) != 0;
+		const ShowCommand highestShowCommand = taking.highestShowCommand;
+
+		// Headless, and the sink has had everything already.
+		if (! GetHWnd())
+		{
+			_processingQueue = false;
+			return;
+		}
+
+		if (IsStagingActive() && ! _stagingTimerRunning)
+		{
+			SetTimer(TIMER_STAGING, GetStagingInterval(), NULL);
+			_stagingTimerRunning = true;
+		}
+
+		const bool virtualView = (_flags & FLAG_VIRTUAL_VIEW) != 0;
+
+		if (virtualView)
+		{
+			if (appended)
+				_view.Update();
+		}
+		else if (_storeWhileHidden)
+		{
+			_hiddenStore.Trim(_maxLines, _maxChars);
+		}
+		else if (! rtf.IsEmpty())
+		{
+			CHARFORMAT font;
+			memset(&font, 0, sizeof(font));
+			font.cbSize = sizeof(font);
+			_edit.GetCharFormat(SCF_DEFAULT, &font);
 
-			_lastLogEntry = 0;
+			AppendRtf(rtf.Finish(font.szFaceName, font.bCharSet, font.yHeight), _lineLengths.Trim(_maxLines, _maxChars));
 		}
 
 		if (! IsWindowVisible())
@@ -283,22 +1181,40 @@ namespace WndLib
 				(highestShowCommand >= SHOWCOMMAND_SHOW_IN_BACKGROUND && ! _userDidClose))
 			{
 				ShowFrame(highestShowCommand == SHOWCOMMAND_SHOW_IN_BACKGROUND ? SW_SHOWNOACTIVATE : SW_SHOWNORMAL);
-				_edit.ExSetSel(0, 0);
-				_edit.ScrollCaret();
+				if (! virtualView)
+				{
+					_edit.ExSetSel(0, 0);
+					_edit.ScrollCaret();
+				}
+
 				ScrollEditControl();
 			}
 		}
 
 		if (highestShowCommand == SHOWCOMMAND_ALERT)
 			SetForegroundWindow();
+
+		_processingQueue = false;
 	}
 
-	void LogWnd::SetColour(COLORREF colour)
+	void LogWnd::WriteEntry(LogRtfWriter *rtf, LPCTSTR text, size_t length, COLORREF colour)
 	{
-		memset(&_charFormat, 0, sizeof(_charFormat));
-		_charFormat.cbSize = sizeof(_charFormat);
-		_charFormat.dwMask = CFM_COLOR;
-		_charFormat.crTextColor = colour;
+		if (GetHWnd())
+		{
+			if (_flags & FLAG_VIRTUAL_VIEW)
+			{
+				_view.Append(text, length, colour);
+			}
+			else if (_storeWhileHidden)
+			{
+				_hiddenStore.Append(text, length, colour);
+			}
+			else
+			{
+				rtf->Append(text, length, colour);
+				_lineLengths.Add(text, length);
+			}
+		}
 	}
 
 	void LogWnd::WaitForUserToClose()
@@ -310,21 +1226,16 @@ namespace WndLib
 		if (IsWindowVisible())
 			SetForegroundWindow();
 
+		// A WM_QUIT is ignored, as before, so the user still gets to read the log.
+		MessageLoop loop;
 		while (IsWindowVisible())
-		{
-			WaitMessage();
-			PumpMessages();
-		}
+			loop.RunOnce();
 	}
 
 	void LogWnd::PumpMessages()
 	{
-		MSG msg;
-		while (::PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
-		{
-			TranslateMessage(&msg);
-			DispatchMessage(&msg);
-		}
+		MessageLoop loop;
+		loop.Pump();
 	}
 
 	void LogWnd::SetVisible(bool visible, bool inBackground)
@@ -359,11 +1270,55 @@ namespace WndLib
 			if (! hparent)
 			{
 				::ShowWindow(hwnd, command);
-				return;
+				break;
 			}
 
 			hwnd = hparent;
 		}
+
+		// A child window isn't sent WM_SHOWWINDOW when its frame is shown.
+		if (command != SW_HIDE && IsVisible())
+			RenderHiddenLines();
+	}
+
+	void LogWnd::RenderHiddenLines()
+	{
+		size_t lineCount = _hiddenStore.GetLineCount();
+		if (! lineCount || ! GetHWnd())
+			return;
+
+		_hiddenStore.Trim(_maxLines, _maxChars);
+		lineCount = _hiddenStore.GetLineCount();
+
+		if (_palette.size() > MAX_PALETTE_COLOURS)
+			_palette.clear();
+
+		LogRtfWriter rtf(&_palette);
+
+		for (size_t line = 0; line != lineCount; ++line)
+		{
+			for (size_t i = 0; i != _hiddenStore.GetRunCount(line); ++i)
+			{
+				const LogLineStore::Run &run = _hiddenStore.GetRun(line, i);
+				rtf.Append(run.text, run.length, run.colour);
+				_lineLengths.Add(run.text, run.length);
+			}
+
+			if (line + 1 != lineCount || ! _hiddenStore.IsLastLineOpen())
+			{
+				rtf.EndLine();
+				_lineLengths.Add(TEXT("\n"), 1);
+			}
+		}
+
+		_hiddenStore.Clear();
+
+		CHARFORMAT font;
+		memset(&font, 0, sizeof(font));
+		font.cbSize = sizeof(font);
+		_edit.GetCharFormat(SCF_DEFAULT, &font);
+
+		AppendRtf(rtf.Finish(font.szFaceName, font.bCharSet, font.yHeight), _lineLengths.Trim(_maxLines, _maxChars));
 	}
 }
 
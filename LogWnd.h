@@ -9,22 +9,131 @@
 #define WNDLIB_LOGWND_H
 
 #include "WndLib.h"
+#include "LogQueue.h"
+#include "LogRtf.h"
+#include "LogFileSink.h"
+#include "LogLineStore.h"
+#include "LogSharedRing.h"
 #include <stddef.h>
+#include <deque>
 
 namespace WndLib
 {
 	//
-	// LogWnd: A thread-safe logging window with colourised output.
+	// LogViewWnd: Displays a LogLineStore, drawing only the lines that are
+	// visible, so it copes with far more text than a RichEdit control. Used by
+	// LogWnd when created with FLAG_VIRTUAL_VIEW. The text can't be selected.
 	//
 
-	class WNDLIB_EXPORT LogWnd : public Wnd
+	class WNDLIB_EXPORT LogViewWnd : public Wnd
+	{
+		WND_WM_DECLARE(LogViewWnd, Wnd)
+		WND_WM_FUNC(OnPaint)
+		WND_WM_FUNC(OnEraseBkgnd)
+		WND_WM_FUNC(OnSize)
+		WND_WM_FUNC(OnVScroll)
+		WND_WM_FUNC(OnHScroll)
+		WND_WM_FUNC(OnMouseWheel)
+		WND_WM_FUNC(OnMouseHWheel)
+		WND_WM_FUNC(OnKeyDown)
+		WND_WM_FUNC(OnLButtonDown)
+		WND_WM_FUNC(OnSetFont)
+		WND_WM_FUNC(OnGetFont)
+
+	public:
+
+		LogViewWnd();
+
+		bool Create(HWND parent, DWORD exStyle = 0);
+
+		// Add text. Call Update once you're done appending.
+		void Append(LPCTSTR text, size_t length, COLORREF colour)
+		{
+			_store.Append(text, length, colour);
+		}
+
+		// Apply the scrollback limits, update the scroll bar and redraw. If the
+		// last line was visible beforehand, the view follows the new text.
+		void Update();
+
+		void ScrollToEnd();
+
+		// Works like LogWnd::SetScrollback.
+		void SetScrollback(size_t maxLines, size_t maxChars)
+		{
+			_maxLines = maxLines;
+			_maxChars = maxChars;
+		}
+
+		const LogLineStore &GetStore() const
+		{
+			return _store;
+		}
+
+		// Wnd overrides
+		virtual LPCTSTR GetClassName();
+		virtual void GetWndClass(WNDCLASSEX *wc);
+
+	private:
+
+		// The scroll bar's range is an int, so very long logs are scaled to fit.
+		int GetScrollScale() const;
+
+		void UpdateScrollBar();
+
+		void ScrollTo(size_t topLine);
+
+		size_t GetMaxTopLine() const;
+
+		void ScrollHorizontallyTo(int scrollX);
+
+		int GetMaxScrollX() const;
+
+		// Turn a wheel message's delta in to whole steps of the given number
+		// per notch, keeping what's left over in *remainder for next time.
+		static int TakeWheelSteps(int *remainder, int delta, UINT stepsPerNotch);
+
+		LogLineStore _store;
+		size_t _maxLines;
+		size_t _maxChars;
+
+		HFONT _font;
+		int _lineHeight;
+		int _visibleLines;
+		size_t _topLine;
+
+		// Horizontal scrolling, in pixels. Lines aren't measured until they're
+		// drawn, so the range is the widest line drawn so far.
+		int _scrollX;
+		int _contentWidth;
+		int _clientWidth;
+		int _charWidth;
+
+		// Wheel deltas too small to scroll by yet.
+		int _wheelRemainder;
+		int _hwheelRemainder;
+	};
+
+	//
+	// LogWnd: A thread-safe logging window with colourised output. Logging,
+	// levels, sinks and staging are LogQueue's, and the window takes the
+	// entries from the queue on its own thread.
+	//
+	// A LogWnd that's never created is headless: entries go only to the sink,
+	// and nothing empties the queue unless you call ProcessQueue.
+	//
+
+	class WNDLIB_EXPORT LogWnd : public Wnd, public LogQueue
 	{
 		WND_WM_DECLARE(LogWnd, Wnd)
 		WND_WM_FUNC(OnClose)
 		WND_WM_FUNC(OnCreate)
+		WND_WM_FUNC(OnDestroy)
 		WND_WM_FUNC(OnSize)
 		WND_WM_FUNC(OnUser)
+		WND_WM_FUNC(OnTimer)
 		WND_WM_FUNC(OnSetFocus)
+		WND_WM_FUNC(OnShowWindow)
 
 	public:
 
@@ -39,30 +148,48 @@ namespace WndLib
 			FLAG_CLIENT_EDGE = 1u,
 			FLAG_CHILD = 2u,
 			FLAG_NO_PADDING = 4u,
+
+			// Display the log with a LogViewWnd rather than a RichEdit control.
+			FLAG_VIRTUAL_VIEW = 8u,
 		};
 
 		bool Create(LPCTSTR title, DWORD flags, HWND parent = NULL);
 
-		enum ShowCommand
+		// Only the first entry logged after the window has processed the queue
+		// posts a message to it. If an interval is set, the queue is processed
+		// at most once per interval (in milliseconds), so a burst of entries is
+		// displayed in one go. Defaults to 0.
+		void SetFlushInterval(DWORD milliseconds)
 		{
-			// The window is not shown if it's hidden.
-			SHOWCOMMAND_NO_CHANGE,
-
-			// The window is shown if it's hidden, but it doesn't move to the foreground.
-			SHOWCOMMAND_SHOW_IN_BACKGROUND,
+			_flushInterval = milliseconds;
+		}
 
-			// The window is shown and activated if it's hidden.
-			SHOWCOMMAND_SHOW_IN_FOREGROUND,
+		struct FlushStats
+		{
+			// Messages posted to the window to process the queue, and posts
+			// avoided because one was already pending.
+			LONG posts;
+			LONG postsAvoided;
 
-			// The window is shown if it's hidden, and moved to the foreground.
-			SHOWCOMMAND_ALERT
+			// The number of times the queue has been processed.
+			LONG flushes;
 		};
 
-		// Write to the log. Can be called from any thread.
-		void Log(const TCHAR *log, COLORREF colour, ShowCommand showCommand);
+		void GetFlushStats(FlushStats *stats) const;
 
-		// Write a printf formatted string to the log. Can be called from any thread.
-		void Format(COLORREF colour, ShowCommand showCommand, const TCHAR *fmt, ...);
+		// Limit the text kept in the window. When either limit is exceeded, the
+		// oldest lines are removed in one go, taking the window down to three
+		// quarters of the limit so trimming is rare. 0 means no limit, the
+		// default for both. The limits also apply to the entries kept while
+		// the window is hidden, which without them grow without bound until
+		// it's shown.
+		void SetScrollback(size_t maxLines, size_t maxChars);
+
+		#ifdef WNDLIB_PROFILE_DISPATCH
+			// Write a DispatchProfiler snapshot to the log, most expensive first.
+			// maxRecords limits the number of lines written (0 for no limit).
+			void LogDispatchProfile(COLORREF colour, size_t maxRecords = 0);
+		#endif
 
 		// You don't need to call this manually.
 		void ProcessQueue();
@@ -83,6 +210,21 @@ namespace WndLib
 		// Make sure the edit control's caret is visible.
 		void ScrollEditControl();
 
+		enum SaveFormat
+		{
+			// UTF-8 with CRLF line endings.
+			SAVE_TEXT,
+
+			SAVE_RTF
+		};
+
+		// Write the log's contents to a file, streaming it out a chunk at a
+		// time so memory use doesn't depend on the size of the log. Entries
+		// kept while the window is hidden are included without being added to
+		// the edit control. Call from the window's thread. Returns false (and
+		// deletes the file) on failure.
+		bool SaveTo(LPCTSTR path, SaveFormat format = SAVE_TEXT);
+
 		// Wnd overrides
 		virtual LPCTSTR GetClassName();
 		virtual void GetWndClass(WNDCLASSEX *wc);
@@ -90,32 +232,86 @@ namespace WndLib
 		// Call ShowWindow(command) on the top-level window we're in.
 		void ShowFrame(int command);
 
-	private:
+	protected:
 
-		void AppendEditControl(LPCTSTR string, ptrdiff_t length = -1);
+		// LogQueue overrides
+		virtual void OnPublish();
+		virtual bool OnQueueFull();
+		virtual bool CanWaitForSpace();
 
-		void AppendEditControlRaw(LPCTSTR string, ptrdiff_t length = -1);
+	private:
 
-		void SetColour(COLORREF colour);
+		// Append an RTF document to the edit control with a single EM_STREAMIN,
+		// and remove trimLength characters from the start, redrawing and
+		// scrolling once.
+		void AppendRtf(const std::string &rtf, size_t trimLength);
 
 		static void PumpMessages();
 
-		struct LogEntry
+		// Pass an entry taken from the queue to the display, if there is one.
+		// rtf is only used by the RichEdit display.
+		void WriteEntry(LogRtfWriter *rtf, LPCTSTR text, size_t length, COLORREF colour);
+
+		// The TakeEntries callback. context is a LogWndTaking.
+		static void TakeEntry(void *context, const Entry &entry);
+
+		virtual void OnStagingEnabled();
+
+		// Add the entries kept in _hiddenStore to the edit control.
+		void RenderHiddenLines();
+
+		// Ask the window's thread to process the queue, unless it's already been
+		// asked.
+		void RequestFlush();
+
+		// The window the log is displayed in, _view or _edit.
+		Wnd &GetDisplayWnd()
 		{
-			TCharString text;
-			COLORREF colour;
-			ShowCommand showCommand;
-			LogEntry *next;
-		};
+			return (_flags & FLAG_VIRTUAL_VIEW) ? (Wnd &) _view : (Wnd &) _edit;
+		}
 
 		RichEdit2Wnd _edit;
+		LogViewWnd _view;
 		Font _font;
-		CHARFORMAT _charFormat;
 		DWORD _flags;
 
-		CriticalSection _cs;
-		LogEntry *_logEntry;
-		LogEntry *_lastLogEntry;
+		// The thread that created the window, and so processes the queue.
+		DWORD _threadId;
+
+		// Non-zero while a WM_USER is on its way, or the flush timer is running.
+		volatile LONG _flushPending;
+
+		enum { TIMER_FLUSH = 1, TIMER_STAGING = 2 };
+
+		// Set once the timer that collects stale staged entries is running.
+		bool _stagingTimerRunning;
+
+		volatile DWORD _flushInterval;
+		DWORD _lastFlushTime;
+
+		volatile LONG _posts;
+		volatile LONG _postsAvoided;
+		LONG _flushes;
+
+		size_t _maxLines;
+		size_t _maxChars;
+
+		// The lines in the edit control, so the oldest can be trimmed.
+		LogLineLengths _lineLengths;
+
+		// The colours used so far, which are the RTF colour table.
+		enum { MAX_PALETTE_COLOURS = 64 };
+		std::vector<COLORREF> _palette;
+
+		// While the window is hidden, entries are kept here rather than added to
+		// the edit control, and only what's within the scrollback limits is
+		// added once it's shown. Unbounded if there are no scrollback limits.
+		LogLineStore _hiddenStore;
+		bool _storeWhileHidden;
+
+		// Set while ProcessQueue is running, so log entries written by the
+		// window's thread while it's updating the edit control don't recurse.
+		bool _processingQueue;
 
 		bool _userDidClose;
 		ModuleIcons _icons;
@@ -0,0 +1,89 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "MessageLoopBase.h"
+#include <algorithm>
+
+namespace WndLib
+{
+	//
+	// MessageLoopBase
+	//
+
+	MessageLoopBase::MessageLoopBase() :
+		_budget(50),
+		_moreIdleWork(false),
+		_exitCode(0)
+	{
+	}
+
+	MessageLoopBase::~MessageLoopBase()
+	{
+	}
+
+	bool MessageLoopBase::AddHandle(HANDLE handle, HandleHandler *handler)
+	{
+		// MsgWaitForMultipleObjectsEx needs a slot for the message queue.
+		if (_handles.size() >= MAXIMUM_WAIT_OBJECTS - 1)
+			return false;
+
+		_handles.push_back(handle);
+		_handleHandlers.push_back(handler);
+		return true;
+	}
+
+	void MessageLoopBase::RemoveHandle(HANDLE handle)
+	{
+		for (size_t i = 0; i != _handles.size(); ++i)
+		{
+			if (_handles[i] == handle)
+			{
+				_handles.erase(_handles.begin() + i);
+				_handleHandlers.erase(_handleHandlers.begin() + i);
+				return;
+			}
+		}
+	}
+
+	void MessageLoopBase::AddIdleHandler(IdleHandler *handler)
+	{
+		_idleHandlers.push_back(handler);
+	}
+
+	void MessageLoopBase::RemoveIdleHandler(IdleHandler *handler)
+	{
+		std::vector<IdleHandler *>::iterator found = std::find(_idleHandlers.begin(), _idleHandlers.end(), handler);
+		if (found != _idleHandlers.end())
+			_idleHandlers.erase(found);
+	}
+
+	void MessageLoopBase::CallHandleHandler(DWORD index)
+	{
+		_handleHandlers[index]->OnHandleSignalled(_handles[index]);
+	}
+
+	void MessageLoopBase::EndIteration(bool outOfTime)
+	{
+		if (outOfTime)
+			_moreIdleWork = false;
+		else
+			CallIdleHandlers();
+	}
+
+	void MessageLoopBase::CallIdleHandlers()
+	{
+		_moreIdleWork = false;
+
+		// A handler can remove itself, so work from a copy.
+		std::vector<IdleHandler *> handlers(_idleHandlers);
+		for (size_t i = 0; i != handlers.size(); ++i)
+		{
+			if (handlers[i]->OnIdle())
+				_moreIdleWork = true;
+		}
+	}
+}
@@ -0,0 +1,135 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_MESSAGELOOPBASE_H
+#define WNDLIB_MESSAGELOOPBASE_H
+
+#include "WndLibBase.h"
+#include <vector>
+
+namespace WndLib
+{
+	//
+	// MessageLoopBase: The scheduling half of MessageLoop, which doesn't depend
+	// on Win32: the registered handles and idle handlers, the time budget and
+	// the decision whether to run idle handlers and whether to wait. MessageLoop
+	// supplies the waiting and the message dispatching.
+	//
+
+	class WNDLIB_EXPORT MessageLoopBase
+	{
+	public:
+
+		class HandleHandler
+		{
+		public:
+
+			virtual ~HandleHandler() { }
+
+			// Called when the handle is signalled.
+			virtual void OnHandleSignalled(HANDLE handle) = 0;
+		};
+
+		class IdleHandler
+		{
+		public:
+
+			virtual ~IdleHandler() { }
+
+			// Called when the message queue is empty. Return true if there's more
+			// work to do, in which case the loop won't wait before calling again.
+			virtual bool OnIdle() = 0;
+		};
+
+		MessageLoopBase();
+
+		~MessageLoopBase();
+
+		// Up to MAXIMUM_WAIT_OBJECTS - 1 handles can be registered. Returns false if
+		// there's no room.
+		bool AddHandle(HANDLE handle, HandleHandler *handler);
+
+		void RemoveHandle(HANDLE handle);
+
+		void AddIdleHandler(IdleHandler *handler);
+
+		void RemoveIdleHandler(IdleHandler *handler);
+
+		// The time, in milliseconds, spent dispatching messages in each iteration
+		// before painting is caught up. Defaults to 50. INFINITE for no limit.
+		void SetBudget(DWORD milliseconds)
+		{
+			_budget = milliseconds;
+		}
+
+		DWORD GetBudget() const
+		{
+			return _budget;
+		}
+
+		// The exit code of the WM_QUIT that stopped the loop.
+		int GetExitCode() const
+		{
+			return _exitCode;
+		}
+
+	protected:
+
+		// Returns how long an iteration should wait, given the caller's timeout:
+		// not at all if an idle handler has more work to do.
+		DWORD GetWaitTimeout(DWORD timeout) const
+		{
+			return _moreIdleWork ? 0 : timeout;
+		}
+
+		DWORD GetHandleCount() const
+		{
+			return (DWORD) _handles.size();
+		}
+
+		HANDLE *GetHandles()
+		{
+			return _handles.empty() ? NULL : &_handles[0];
+		}
+
+		void CallHandleHandler(DWORD index);
+
+		// Returns true if dispatching that started at tick start and has reached
+		// tick now has spent the budget.
+		bool IsOutOfTime(DWORD start, DWORD now) const
+		{
+			return _budget != INFINITE && now - start >= _budget;
+		}
+
+		// Called at the end of each iteration. Idle handlers only run if the
+		// queue was emptied, rather than left because the budget ran out.
+		void EndIteration(bool outOfTime);
+
+		void SetExitCode(int exitCode)
+		{
+			_exitCode = exitCode;
+		}
+
+	private:
+
+		void CallIdleHandlers();
+
+		std::vector<HANDLE> _handles;
+		std::vector<HandleHandler *> _handleHandlers;
+		std::vector<IdleHandler *> _idleHandlers;
+
+		DWORD _budget;
+		bool _moreIdleWork;
+		int _exitCode;
+
+		// Not copyable.
+		MessageLoopBase(const MessageLoopBase &);
+		MessageLoopBase &operator=(const MessageLoopBase &);
+	};
+}
+
+#endif
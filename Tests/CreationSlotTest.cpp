@@ -0,0 +1,172 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Stress tests CreationSlot, which Wnd::CreateIndirect uses to hand a Wnd to
+// its window procedure, against a stub window manager. Several threads create
+// windows at once, some of which create children while handling WM_CREATE
+// and some of which the stub refuses to create, and every window must end up
+// attached to the Wnd that created it.
+//
+
+#include "TestUtil.h"
+#include "CreationSlot.h"
+#include <vector>
+
+namespace WndLib
+{
+	// A stand-in for the real Wnd.
+	class Wnd
+	{
+	public:
+
+		Wnd() : hwnd(NULL) { }
+
+		HWND hwnd;
+	};
+}
+
+using namespace WndLib;
+
+namespace
+{
+	//
+	// Stub window manager
+	//
+
+	Private::CreationSlot creatingWnd;
+
+	volatile LONG nextHandle = 0;
+
+	struct ThreadState
+	{
+		int windows;
+		ULONG_PTR seed;
+		LONG created;
+		LONG failures;
+	};
+
+	bool CreateWnd(ThreadState *state, Wnd *wnd, int depth);
+
+	int Random(ThreadState *state, int range)
+	{
+		state->seed = state->seed * 1103515245u + 12345u;
+		return (int) ((state->seed >> 8) % (ULONG_PTR) range);
+	}
+
+	// What Wnd::StaticWndProc does with a window's first message, followed by
+	// a WM_CREATE that may create children.
+	void StubWndProc(ThreadState *state, HWND hwnd, int depth)
+	{
+		Wnd *wnd = creatingWnd.Claim();
+		if (! wnd || wnd->hwnd)
+		{
+			++state->failures;
+			return;
+		}
+
+		wnd->hwnd = hwnd;
+
+		// A second message must not claim anything.
+		if (creatingWnd.Claim())
+			++state->failures;
+
+		if (depth)
+		{
+			int children = Random(state, 3) + 1;
+			for (int i = 0; i != children; ++i)
+			{
+				Wnd child;
+				CreateWnd(state, &child, depth - 1);
+			}
+		}
+	}
+
+	// Like CreateWindowEx: one time in eight it fails without sending any
+	// messages, which is what happens if the class doesn't exist.
+	HWND StubCreateWindow(ThreadState *state, int depth)
+	{
+		if (Random(state, 8) == 0)
+			return NULL;
+
+		HWND hwnd = (HWND) (UINT_PTR) (InterlockedIncrement(&nextHandle) * 4);
+		StubWndProc(state, hwnd, depth);
+		return hwnd;
+	}
+
+	// What Wnd::CreateIndirect does.
+	bool CreateWnd(ThreadState *state, Wnd *wnd, int depth)
+	{
+		Wnd *previous = creatingWnd.Begin(wnd);
+		HWND hwnd = StubCreateWindow(state, depth);
+		bool claimed = creatingWnd.End(wnd, previous);
+
+		if (claimed != (hwnd != NULL) || wnd->hwnd != hwnd)
+			++state->failures;
+
+		if (hwnd)
+			++state->created;
+
+		return hwnd != NULL;
+	}
+
+	void CreateThread(void *param)
+	{
+		ThreadState *state = (ThreadState *) param;
+
+		for (int i = 0; i != state->windows; ++i)
+		{
+			Wnd wnd;
+			CreateWnd(state, &wnd, Random(state, 4));
+
+			// Nothing is left in the slot once the outermost window is done.
+			if (creatingWnd.Claim())
+				++state->failures;
+		}
+	}
+
+	void Stress(int threadCount, int windows)
+	{
+		std::vector<ThreadState> states(threadCount);
+		std::vector<TestThread *> threads(threadCount);
+
+		double start = GetSeconds();
+
+		for (int i = 0; i != threadCount; ++i)
+		{
+			states[i].windows = windows;
+			states[i].seed = (ULONG_PTR) i * 2654435761u + 1;
+			states[i].created = 0;
+			states[i].failures = 0;
+
+			threads[i] = new TestThread;
+			threads[i]->Start(&CreateThread, &states[i]);
+		}
+
+		LONG created = 0;
+
+		for (int i = 0; i != threadCount; ++i)
+		{
+			threads[i]->Join();
+			delete threads[i];
+
+			TEST_CHECK(states[i].failures == 0);
+			created += states[i].created;
+		}
+
+		double elapsed = GetSeconds() - start;
+
+		printf("%d threads: %ld windows, %.0f per second\n", threadCount, (long) created, (double) created / elapsed);
+	}
+}
+
+int main()
+{
+	Stress(1, 20000);
+	Stress(4, 20000);
+	Stress(16, 20000);
+
+	return TestResult();
+}
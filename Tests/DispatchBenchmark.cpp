@@ -0,0 +1,179 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Compares the cost of dispatching a message through the WND_WM if chain and
+// through a WND_WM_TABLE table as the number of handlers grows, both for
+// messages the class handles and for ones it passes on (WM_MOUSEMOVE in a
+// window that doesn't handle it, say).
+//
+
+#include "TestUtil.h"
+#include "WmTable.h"
+#include <vector>
+
+namespace WndLib
+{
+	// A stand-in for the real Wnd, which needs Win32. The message macros only
+	// need WndProc and the WmGetTable/WmClass pair that WND_WM_DECLARE adds.
+	class Wnd
+	{
+	public:
+
+		typedef Wnd WmClass;
+
+		virtual ~Wnd() { }
+
+		static Private::WmTable *WmGetTable()
+		{
+			return NULL;
+		}
+
+		virtual LRESULT WndProc(UINT msg, WPARAM wparam, LPARAM lparam)
+		{
+			(void) msg;
+			(void) wparam;
+			(void) lparam;
+			return 0;
+		}
+	};
+}
+
+using namespace WndLib;
+
+//
+// Test windows
+//
+
+#define BENCH_REPEAT4(_Macro, _Base) \
+	_Macro((_Base)) _Macro((_Base) + 1) _Macro((_Base) + 2) _Macro((_Base) + 3)
+
+#define BENCH_REPEAT16(_Macro, _Base) \
+	BENCH_REPEAT4(_Macro, (_Base)) BENCH_REPEAT4(_Macro, (_Base) + 4) \
+	BENCH_REPEAT4(_Macro, (_Base) + 8) BENCH_REPEAT4(_Macro, (_Base) + 12)
+
+#define BENCH_REPEAT64(_Macro, _Base) \
+	BENCH_REPEAT16(_Macro, (_Base)) BENCH_REPEAT16(_Macro, (_Base) + 16) \
+	BENCH_REPEAT16(_Macro, (_Base) + 32) BENCH_REPEAT16(_Macro, (_Base) + 48)
+
+#define BENCH_REPEAT256(_Macro, _Base) \
+	BENCH_REPEAT64(_Macro, (_Base)) BENCH_REPEAT64(_Macro, (_Base) + 64) \
+	BENCH_REPEAT64(_Macro, (_Base) + 128) BENCH_REPEAT64(_Macro, (_Base) + 192)
+
+// Real message IDs aren't contiguous, and a compiler can turn an if chain
+// comparing against a contiguous range into a jump table, so spread them out.
+#define BENCH_MESSAGE(_Index) (WM_USER + ((_Index) * 97) % 4099)
+
+#define BENCH_IF(_Index) WND_WM(BENCH_MESSAGE(_Index), OnMessage)
+#define BENCH_TABLE(_Index) WND_WM_TABLE(BENCH_MESSAGE(_Index), OnMessage)
+
+// Defines IfWnd<count> and TableWnd<count>, each of which handles messages
+// BENCH_MESSAGE(0) to BENCH_MESSAGE(count - 1) by returning the message.
+#define BENCH_WNDS(_Count) \
+	class IfWnd##_Count : public Wnd \
+	{ \
+		WND_WM_DECLARE(IfWnd##_Count, Wnd) \
+		WND_WM_FUNC(OnMessage) \
+	}; \
+	WND_WM_BEGIN(IfWnd##_Count, Wnd) \
+		BENCH_REPEAT##_Count(BENCH_IF, 0) \
+	WND_WM_END() \
+	LRESULT IfWnd##_Count::OnMessage(UINT msg, WPARAM, LPARAM) \
+	{ \
+		return (LRESULT) msg; \
+	} \
+	class TableWnd##_Count : public Wnd \
+	{ \
+		WND_WM_DECLARE(TableWnd##_Count, Wnd) \
+		WND_WM_FUNC(OnMessage) \
+	}; \
+	WND_WM_TABLE_BEGIN(TableWnd##_Count, Wnd) \
+		BENCH_REPEAT##_Count(BENCH_TABLE, 0) \
+	WND_WM_TABLE_END() \
+	LRESULT TableWnd##_Count::OnMessage(UINT msg, WPARAM, LPARAM) \
+	{ \
+		return (LRESULT) msg; \
+	}
+
+BENCH_WNDS(4)
+BENCH_WNDS(16)
+BENCH_WNDS(64)
+BENCH_WNDS(256)
+
+namespace
+{
+	//
+	// Benchmark
+	//
+
+	const UINT unhandledMessage = 0x0200; // WM_MOUSEMOVE
+
+	// Returns nanoseconds per message. If handled, the messages cycle through
+	// every handler so the if chain's average position is measured.
+	double Run(Wnd *wnd, UINT handlers, bool handled, size_t iterations)
+	{
+		std::vector<UINT> messages(handlers, unhandledMessage);
+		LRESULT expected = 0;
+
+		if (handled)
+		{
+			for (UINT i = 0; i != handlers; ++i)
+				messages[i] = BENCH_MESSAGE(i);
+		}
+
+		size_t rounds = iterations / handlers;
+		LRESULT sum = 0;
+		double start = GetSeconds();
+
+		for (size_t i = 0; i != rounds; ++i)
+		{
+			for (UINT j = 0; j != handlers; ++j)
+				sum += wnd->WndProc(messages[j], 0, 0);
+		}
+
+		double elapsed = GetSeconds() - start;
+
+		if (handled)
+		{
+			for (size_t i = 0; i != rounds; ++i)
+			{
+				for (UINT j = 0; j != handlers; ++j)
+					expected += messages[j];
+			}
+		}
+
+		TEST_CHECK(sum == expected);
+
+		return elapsed * 1e9 / (double) (rounds * handlers);
+	}
+
+	void Compare(Wnd *ifWnd, Wnd *tableWnd, UINT handlers, size_t iterations)
+	{
+		for (int handled = 1; handled >= 0; --handled)
+		{
+			double ifTime = Run(ifWnd, handlers, handled != 0, iterations);
+			double tableTime = Run(tableWnd, handlers, handled != 0, iterations);
+
+			printf("%-9u %-9s %12.2f %12.2f\n", handlers, handled ? "yes" : "no", ifTime, tableTime);
+		}
+
+		delete ifWnd;
+		delete tableWnd;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t iterations = IsQuickRun(argc, argv) ? 20000 : 20000000;
+
+	printf("%-9s %-9s %12s %12s\n", "handlers", "handled", "if ns/msg", "table ns/msg");
+
+	Compare(new IfWnd4, new TableWnd4, 4, iterations);
+	Compare(new IfWnd16, new TableWnd16, 16, iterations);
+	Compare(new IfWnd64, new TableWnd64, 64, iterations);
+	Compare(new IfWnd256, new TableWnd256, 256, iterations);
+
+	return TestResult();
+}
@@ -0,0 +1,170 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Drives DispatchProfiler from several threads the way the window procedures
+// do, checks that the merged snapshot accounts for every call, and measures
+// what profiling adds to each dispatched message.
+//
+
+#include "TestUtil.h"
+#include "DispatchProfiler.h"
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	const TCHAR *const classNames[] =
+	{
+		TEXT("ButtonWnd"),
+		TEXT("EditWnd"),
+		TEXT("ListViewWnd")
+	};
+
+	const UINT messageCount = 8;
+	const size_t threadCount = 4;
+
+	struct ThreadState
+	{
+		size_t calls;
+	};
+
+	// Stands in for a handler taking a few microseconds.
+	void Spin(double seconds)
+	{
+		double end = GetSeconds() + seconds;
+		while (GetSeconds() < end)
+			YieldProcessor();
+	}
+
+	void ProfileThread(void *param)
+	{
+		ThreadState *state = (ThreadState *) param;
+
+		for (size_t i = 0; i != state->calls; ++i)
+		{
+			LPCTSTR className = classNames[i % WNDLIB_COUNTOF(classNames)];
+			UINT msg = (UINT) (i % messageCount);
+
+			LONGLONG start = DispatchProfiler::Begin();
+
+			// Every so often, a slow handler for message 0.
+			if (msg == 0 && i % 64 == 0)
+				Spin(0.00005);
+
+			DispatchProfiler::End(className, msg, start);
+		}
+	}
+
+	void TestSnapshot(size_t calls)
+	{
+		DispatchProfiler::Reset();
+
+		std::vector<ThreadState> states(threadCount);
+		std::vector<TestThread *> threads(threadCount);
+
+		for (size_t i = 0; i != threadCount; ++i)
+		{
+			states[i].calls = calls;
+			threads[i] = new TestThread;
+			threads[i]->Start(&ProfileThread, &states[i]);
+		}
+
+		for (size_t i = 0; i != threadCount; ++i)
+		{
+			threads[i]->Join();
+			delete threads[i];
+		}
+
+		std::vector<DispatchProfiler::Record> records;
+		DispatchProfiler::Snapshot(&records);
+
+		// Every combination of class and message is hit, since the counts are
+		// coprime.
+		TEST_CHECK(records.size() == WNDLIB_COUNTOF(classNames) * messageCount);
+
+		DWORD total = 0;
+		bool sorted = true;
+
+		for (size_t i = 0; i != records.size(); ++i)
+		{
+			const DispatchProfiler::Record &record = records[i];
+
+			DWORD histogramTotal = 0;
+			for (unsigned bucket = 0; bucket != DispatchProfiler::HISTOGRAM_BUCKETS; ++bucket)
+				histogramTotal += record.histogram[bucket];
+
+			TEST_CHECK(histogramTotal == record.count);
+			TEST_CHECK(record.maxMicroseconds <= record.totalMicroseconds);
+			TEST_CHECK(record.GetPercentile(50) <= record.GetPercentile(100));
+
+			if (i && record.totalMicroseconds > records[i - 1].totalMicroseconds)
+				sorted = false;
+
+			total += record.count;
+		}
+
+		TEST_CHECK(sorted);
+		TEST_CHECK(total == calls * threadCount);
+
+		// The slow handler is the most expensive.
+		if (! records.empty())
+		{
+			TEST_CHECK(records[0].msg == 0);
+			TEST_CHECK(records[0].maxMicroseconds >= 50);
+		}
+
+		printf("%-12s %4s %8s %10s %8s %8s %8s\n", "class", "msg", "calls", "total us", "p50 us", "p99 us", "max us");
+
+		for (size_t i = 0; i != records.size() && i != 6; ++i)
+		{
+			const DispatchProfiler::Record &record = records[i];
+
+			#ifdef WNDLIB_UNICODE
+				printf("%-12ls", record.className.c_str());
+			#else
+				printf("%-12s", record.className.c_str());
+			#endif
+
+			printf(" %4u %8u %10.0f %8.0f %8.0f %8.1f\n", record.msg, (unsigned) record.count, record.totalMicroseconds,
+				record.GetPercentile(50), record.GetPercentile(99), record.maxMicroseconds);
+		}
+
+		// After a reset, the other threads' tables are stale and ignored.
+		DispatchProfiler::Reset();
+		DispatchProfiler::End(classNames[0], 1, DispatchProfiler::Begin());
+		DispatchProfiler::Snapshot(&records);
+
+		TEST_CHECK(records.size() == 1);
+		if (records.size() == 1)
+			TEST_CHECK(records[0].count == 1 && records[0].msg == 1);
+	}
+
+	// Nanoseconds that Begin and End add to each message.
+	void MeasureOverhead(size_t calls)
+	{
+		DispatchProfiler::Reset();
+
+		double start = GetSeconds();
+
+		for (size_t i = 0; i != calls; ++i)
+			DispatchProfiler::End(classNames[i % WNDLIB_COUNTOF(classNames)], (UINT) (i % messageCount), DispatchProfiler::Begin());
+
+		double elapsed = GetSeconds() - start;
+
+		printf("overhead: %.1f ns per profiled message\n", elapsed * 1e9 / (double) calls);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool quick = IsQuickRun(argc, argv);
+
+	TestSnapshot(quick ? 5000 : 200000);
+	MeasureOverhead(quick ? 20000 : 10000000);
+
+	return TestResult();
+}
@@ -0,0 +1,160 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Measures LogFileSink: N producer threads write entries to the sink while its
+// thread writes them to a file. Reports the entries and megabytes written per
+// second, counting until Close has written everything out, how many entries
+// were dropped, and the 50th and 99th percentile time Write took to return.
+// Run with no arguments for 1, 2, 4, 8 and 16 producers.
+//
+
+#include "TestUtil.h"
+#include "LogFileSink.h"
+#include <algorithm>
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	const TCHAR logPath[] = TEXT("LogFileSinkBenchmark.log");
+	const char logPathA[] = "LogFileSinkBenchmark.log";
+
+	// Every entry is the same length, so the file's size says how many were
+	// written.
+	const size_t entryBytes = 64;
+
+	struct Producer
+	{
+		LogFileSink *sink;
+		int thread;
+		int count;
+
+		// Nanoseconds per Write call.
+		std::vector<float> latencies;
+	};
+
+	void ProducerProc(void *param)
+	{
+		Producer *producer = (Producer *) param;
+		producer->latencies.reserve(producer->count);
+
+		char text[128];
+		TCHAR entry[128];
+
+		for (int i = 0; i != producer->count; ++i)
+		{
+			// 62 characters and a line break, which is written as CRLF.
+			int length = sprintf(text, "thread %2d entry %9d with some text, padding it out to 64\n", producer->thread, i);
+			for (int j = 0; j <= length; ++j)
+				entry[j] = (TCHAR) text[j];
+
+			double start = GetSeconds();
+			producer->sink->Write(entry, length, 0);
+			producer->latencies.push_back((float) ((GetSeconds() - start) * 1e9));
+		}
+	}
+
+	double GetPercentile(std::vector<float> *values, double percentile)
+	{
+		if (values->empty())
+			return 0;
+
+		size_t index = (size_t) ((values->size() - 1) * percentile / 100.0);
+		std::nth_element(values->begin(), values->begin() + index, values->end());
+		return (*values)[index];
+	}
+
+	long GetFileSize(const char *path)
+	{
+		FILE *file = fopen(path, "rb");
+		if (! file)
+			return -1;
+
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fclose(file);
+		return size;
+	}
+
+	void Run(int producerCount, LogFileSink::SyncPolicy syncPolicy, int entriesPerProducer)
+	{
+		remove(logPathA);
+
+		LogFileSink sink;
+		sink.SetSyncPolicy(syncPolicy);
+		TEST_CHECK(sink.Open(logPath));
+
+		std::vector<Producer> producers(producerCount);
+		for (int i = 0; i != producerCount; ++i)
+		{
+			producers[i].sink = &sink;
+			producers[i].thread = i;
+			producers[i].count = entriesPerProducer;
+		}
+
+		double start = GetSeconds();
+
+		std::vector<TestThread *> threads;
+		for (int i = 0; i != producerCount; ++i)
+		{
+			threads.push_back(new TestThread);
+			threads.back()->Start(&ProducerProc, &producers[i]);
+		}
+
+		for (int i = 0; i != producerCount; ++i)
+		{
+			threads[i]->Join();
+			delete threads[i];
+		}
+
+		sink.Close();
+
+		double elapsed = GetSeconds() - start;
+
+		std::vector<float> latencies;
+		for (int i = 0; i != producerCount; ++i)
+			latencies.insert(latencies.end(), producers[i].latencies.begin(), producers[i].latencies.end());
+
+		double p50 = GetPercentile(&latencies, 50);
+		double p99 = GetPercentile(&latencies, 99);
+
+		size_t dropped = (size_t) sink.GetDroppedCount();
+		size_t logged = (size_t) producerCount * entriesPerProducer;
+		size_t written = logged - dropped;
+
+		printf("%9d %-6s %12.0f %9.1f %9lu %9.0f %9.0f\n", producerCount,
+			syncPolicy == LogFileSink::SYNC_NEVER ? "never" : "always",
+			written / elapsed, written * entryBytes / elapsed / (1024 * 1024), (unsigned long) dropped, p50, p99);
+
+		// Every entry is either in the file or counted as dropped.
+		TEST_CHECK(GetFileSize(logPathA) == (long) (written * entryBytes));
+		TEST_CHECK(sink.GetLostCount() == 0);
+
+		remove(logPathA);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool quick = IsQuickRun(argc, argv);
+	int entriesPerProducer = quick ? 2000 : 200000;
+
+	const int producerCounts[] = { 1, 2, 4, 8, 16 };
+	size_t runs = quick ? 3 : WNDLIB_COUNTOF(producerCounts);
+
+	printf("%9s %-6s %12s %9s %9s %9s %9s\n", "producers", "sync", "entries/s", "MB/s", "dropped", "p50 ns", "p99 ns");
+
+	for (size_t i = 0; i != runs; ++i)
+	{
+		int producerCount = producerCounts[quick ? i * 2 : i];
+
+		Run(producerCount, LogFileSink::SYNC_NEVER, entriesPerProducer);
+		Run(producerCount, LogFileSink::SYNC_ALWAYS, entriesPerProducer);
+	}
+
+	return TestResult();
+}
@@ -0,0 +1,258 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Checks LogFileSink: line breaks and appending, rotating by size, carrying
+// on in the same file when it can't be rotated, dropping writes beyond the
+// buffer limit and counting the writes the file wouldn't take.
+//
+
+#include "TestUtil.h"
+#include "LogFileSink.h"
+#include <stdio.h>
+#include <string>
+
+#ifdef _WIN32
+	#include <direct.h>
+#else
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+using namespace WndLib;
+
+namespace
+{
+	const TCHAR logPath[] = TEXT("LogFileSinkTest.log");
+	const char logPathA[] = "LogFileSinkTest.log";
+
+	std::string GetRotatedPath(unsigned index)
+	{
+		char path[64];
+		sprintf(path, "%s.%u", logPathA, index);
+		return path;
+	}
+
+	void RemoveFiles()
+	{
+		remove(logPathA);
+		for (unsigned i = 1; i != 5; ++i)
+			remove(GetRotatedPath(i).c_str());
+	}
+
+	bool FileExists(const char *path)
+	{
+		FILE *file = fopen(path, "rb");
+		if (! file)
+			return false;
+
+		fclose(file);
+		return true;
+	}
+
+	std::string ReadLog(const char *path)
+	{
+		std::string contents;
+
+		FILE *file = fopen(path, "rb");
+		if (! file)
+			return contents;
+
+		char buffer[4096];
+		size_t read;
+		while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0)
+			contents.append(buffer, read);
+
+		fclose(file);
+		return contents;
+	}
+
+	void Write(LogFileSink *sink, LPCTSTR text)
+	{
+		sink->Write(text, std::char_traits<TCHAR>::length(text), 0);
+	}
+
+	void MakeTestDirectory(const char *path)
+	{
+		#ifdef _WIN32
+			_mkdir(path);
+		#else
+			mkdir(path, 0755);
+		#endif
+	}
+
+	void RemoveTestDirectory(const char *path)
+	{
+		#ifdef _WIN32
+			_rmdir(path);
+		#else
+			rmdir(path);
+		#endif
+	}
+
+	void TestWrite()
+	{
+		RemoveFiles();
+
+		LogFileSink sink;
+		TEST_CHECK(sink.Open(logPath));
+		TEST_CHECK(sink.IsOpen());
+
+		// Line breaks become CRLF, '\r' is dropped, and nothing is written
+		// until it's flushed.
+		Write(&sink, TEXT("one\n"));
+		Write(&sink, TEXT("two\r\nthr\ree\n"));
+		Write(&sink, TEXT("four"));
+		sink.Flush();
+		TEST_CHECK(ReadLog(logPathA) == "one\r\ntwo\r\nthree\r\nfour");
+
+		// Opening it again appends, and Close writes out what's buffered.
+		sink.Close();
+		TEST_CHECK(! sink.IsOpen());
+		TEST_CHECK(sink.Open(logPath));
+		Write(&sink, TEXT("\nfive\n"));
+		sink.Close();
+		TEST_CHECK(ReadLog(logPathA) == "one\r\ntwo\r\nthree\r\nfour\r\nfive\r\n");
+
+		// Writes to a closed sink are ignored.
+		Write(&sink, TEXT("ignored\n"));
+		TEST_CHECK(sink.GetDroppedCount() == 0 && sink.GetLostCount() == 0);
+
+		RemoveFiles();
+	}
+
+	// 10 bytes once it's written with a CRLF.
+	const TCHAR line[] = TEXT("12345678\n");
+
+	void TestRotation()
+	{
+		RemoveFiles();
+
+		LogFileSink sink;
+		sink.SetRotation(30, 0, 2);
+		TEST_CHECK(sink.Open(logPath));
+
+		for (int i = 0; i != 11; ++i)
+		{
+			Write(&sink, line);
+			sink.Flush();
+		}
+
+		sink.Close();
+
+		// Three lines to a file, and the oldest file has been deleted.
+		TEST_CHECK(ReadLog(logPathA).size() == 20);
+		TEST_CHECK(ReadLog(GetRotatedPath(1).c_str()).size() == 30);
+		TEST_CHECK(ReadLog(GetRotatedPath(2).c_str()).size() == 30);
+		TEST_CHECK(! FileExists(GetRotatedPath(3).c_str()));
+
+		// Without old files the log starts again.
+		RemoveFiles();
+		sink.SetRotation(30, 0, 0);
+		TEST_CHECK(sink.Open(logPath));
+
+		for (int i = 0; i != 4; ++i)
+		{
+			Write(&sink, line);
+			sink.Flush();
+		}
+
+		sink.Close();
+		TEST_CHECK(ReadLog(logPathA).size() == 10);
+		TEST_CHECK(! FileExists(GetRotatedPath(1).c_str()));
+
+		RemoveFiles();
+	}
+
+	// A file that can't be moved out of the way is appended to, and moved
+	// once it can be.
+	void TestRotationFailure()
+	{
+		RemoveFiles();
+
+		// A directory where the old file would go can't be replaced.
+		std::string blocked = GetRotatedPath(1);
+		MakeTestDirectory(blocked.c_str());
+
+		LogFileSink sink;
+		sink.SetRotation(30, 0, 1);
+		TEST_CHECK(sink.Open(logPath));
+
+		for (int i = 0; i != 5; ++i)
+		{
+			Write(&sink, line);
+			sink.Flush();
+		}
+
+		TEST_CHECK(ReadLog(logPathA).size() == 50);
+		TEST_CHECK(sink.GetLostCount() == 0);
+
+		RemoveTestDirectory(blocked.c_str());
+		Write(&sink, line);
+		sink.Close();
+
+		TEST_CHECK(ReadLog(blocked.c_str()).size() == 50);
+		TEST_CHECK(ReadLog(logPathA).size() == 10);
+
+		RemoveFiles();
+	}
+
+	void TestBufferLimit()
+	{
+		RemoveFiles();
+
+		// The thread never wakes on its own, so everything stays buffered.
+		LogFileSink sink;
+		sink.SetWriteInterval(0);
+		sink.SetBufferLimit(64);
+		TEST_CHECK(sink.Open(logPath));
+
+		for (int i = 0; i != 10; ++i)
+			Write(&sink, line);
+
+		TEST_CHECK(sink.GetDroppedCount() == 4);
+
+		sink.Flush();
+		TEST_CHECK(ReadLog(logPathA).size() == 60);
+
+		// Flushing makes room again.
+		Write(&sink, line);
+		sink.Close();
+		TEST_CHECK(ReadLog(logPathA).size() == 70);
+		TEST_CHECK(sink.GetDroppedCount() == 4 && sink.GetLostCount() == 0);
+
+		RemoveFiles();
+	}
+
+	// Writes the file won't take are counted as lost.
+	void TestWriteFailure()
+	{
+		#ifdef __linux__
+			// Every write to /dev/full fails.
+			LogFileSink sink;
+			TEST_CHECK(sink.Open(TEXT("/dev/full")));
+
+			Write(&sink, line);
+			Write(&sink, TEXT("two\nlines\n"));
+			sink.Flush();
+			TEST_CHECK(sink.GetLostCount() == 2 && sink.GetLostBytes() == 22);
+
+			Write(&sink, line);
+			sink.Close();
+			TEST_CHECK(sink.GetLostCount() == 3 && sink.GetLostBytes() == 32);
+			TEST_CHECK(sink.GetDroppedCount() == 0);
+		#endif
+	}
+}
+
+int main()
+{
+	TEST_RUN(TestWrite);
+	TEST_RUN(TestRotation);
+	TEST_RUN(TestRotationFailure);
+	TEST_RUN(TestBufferLimit);
+	TEST_RUN(TestWriteFailure);
+	return TestResult();
+}
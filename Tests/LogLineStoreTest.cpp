@@ -0,0 +1,202 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Checks LogLineStore, which holds the lines LogViewWnd displays and the
+// entries LogWnd keeps while it's hidden: splitting text in to lines, the
+// index from lines to their runs, merging runs of the same colour, lines
+// left open, and trimming to a scrollback limit.
+//
+
+#include "TestUtil.h"
+#include "LogLineStore.h"
+#include <stdio.h>
+
+using namespace WndLib;
+
+namespace
+{
+	TCharString GetRunText(const LogLineStore &store, size_t line, size_t run)
+	{
+		const LogLineStore::Run &stored = store.GetRun(line, run);
+		return TCharString(stored.text, stored.length);
+	}
+
+	TCharString GetLineText(const LogLineStore &store, size_t line)
+	{
+		TCharString text;
+		for (size_t i = 0; i != store.GetRunCount(line); ++i)
+			text += GetRunText(store, line, i);
+
+		return text;
+	}
+
+	TCharString Widen(const char *text)
+	{
+		TCharString result;
+		for (; *text; ++text)
+			result += (TCHAR) (unsigned char) *text;
+
+		return result;
+	}
+
+	void Append(LogLineStore *store, LPCTSTR text, COLORREF colour)
+	{
+		store->Append(text, std::char_traits<TCHAR>::length(text), colour);
+	}
+
+	void TestAppend()
+	{
+		LogLineStore store;
+		TEST_CHECK(store.GetLineCount() == 0 && store.GetTextLength() == 0);
+
+		// '\r' is dropped and '\n' ends a line, counting as one character.
+		Append(&store, TEXT("one\r\ntwo\n\nfour\n"), 0);
+		TEST_CHECK(store.GetLineCount() == 4);
+		TEST_CHECK(! store.IsLastLineOpen());
+		TEST_CHECK(store.GetTextLength() == 14);
+
+		TEST_CHECK(GetLineText(store, 0) == TEXT("one"));
+		TEST_CHECK(GetLineText(store, 1) == TEXT("two"));
+		TEST_CHECK(GetLineText(store, 2).empty() && store.GetRunCount(2) == 0);
+		TEST_CHECK(GetLineText(store, 3) == TEXT("four"));
+
+		// Text longer than a block is split between blocks, but is still one
+		// line.
+		TCharString longText(100000, 'x');
+		longText += '\n';
+		store.Append(longText.data(), longText.size(), 0);
+		TEST_CHECK(store.GetLineCount() == 5);
+		TEST_CHECK(GetLineText(store, 4) == TCharString(100000, 'x'));
+		TEST_CHECK(store.GetTextLength() == 14 + 100001);
+	}
+
+	// Each line indexes its own runs, however entries split them.
+	void TestLineIndex()
+	{
+		LogLineStore store;
+
+		for (int i = 0; i != 1000; ++i)
+		{
+			char text[32];
+			sprintf(text, "line %d\n", i);
+
+			TCharString line = Widen(text);
+			store.Append(line.data(), line.size(), (COLORREF) i);
+		}
+
+		TEST_CHECK(store.GetLineCount() == 1000);
+
+		bool indexed = true;
+		for (size_t i = 0; i != store.GetLineCount(); ++i)
+		{
+			char text[32];
+			sprintf(text, "line %d", (int) i);
+
+			TCharString expected = Widen(text);
+			if (store.GetRunCount(i) != 1 || GetRunText(store, i, 0) != expected || store.GetRun(i, 0).colour != (COLORREF) i)
+				indexed = false;
+		}
+
+		TEST_CHECK(indexed);
+	}
+
+	void TestColourRuns()
+	{
+		LogLineStore store;
+
+		// Entries in the same colour on the same line are merged.
+		Append(&store, TEXT("a"), RGB(255, 0, 0));
+		Append(&store, TEXT("b"), RGB(255, 0, 0));
+		Append(&store, TEXT("c"), RGB(0, 0, 255));
+		Append(&store, TEXT("d\ne"), RGB(255, 0, 0));
+
+		TEST_CHECK(store.GetLineCount() == 2);
+		TEST_CHECK(store.GetRunCount(0) == 3);
+		if (store.GetRunCount(0) == 3)
+		{
+			TEST_CHECK(GetRunText(store, 0, 0) == TEXT("ab") && store.GetRun(0, 0).colour == RGB(255, 0, 0));
+			TEST_CHECK(GetRunText(store, 0, 1) == TEXT("c") && store.GetRun(0, 1).colour == RGB(0, 0, 255));
+			TEST_CHECK(GetRunText(store, 0, 2) == TEXT("d") && store.GetRun(0, 2).colour == RGB(255, 0, 0));
+		}
+
+		// A run never crosses a line, even in the same colour.
+		TEST_CHECK(store.GetRunCount(1) == 1 && GetRunText(store, 1, 0) == TEXT("e"));
+	}
+
+	// A line that hasn't been ended yet is carried on by the next entry.
+	void TestPartialLines()
+	{
+		LogLineStore store;
+
+		Append(&store, TEXT("start"), RGB(255, 0, 0));
+		TEST_CHECK(store.GetLineCount() == 1 && store.IsLastLineOpen());
+		TEST_CHECK(store.GetTextLength() == 5);
+
+		Append(&store, TEXT(" middle"), RGB(0, 255, 0));
+		Append(&store, TEXT(" end\nnext"), RGB(0, 255, 0));
+		TEST_CHECK(store.GetLineCount() == 2 && store.IsLastLineOpen());
+		TEST_CHECK(GetLineText(store, 0) == TEXT("start middle end"));
+		TEST_CHECK(store.GetRunCount(0) == 2);
+		TEST_CHECK(GetLineText(store, 1) == TEXT("next"));
+
+		// A line break on its own closes the open line.
+		Append(&store, TEXT("\n"), 0);
+		TEST_CHECK(store.GetLineCount() == 2 && ! store.IsLastLineOpen());
+		TEST_CHECK(store.GetTextLength() == 22);
+
+		// Removing an open last line closes it.
+		Append(&store, TEXT("open"), 0);
+		store.Clear();
+		TEST_CHECK(store.GetLineCount() == 0 && ! store.IsLastLineOpen() && store.GetTextLength() == 0);
+
+		Append(&store, TEXT("fresh\n"), 0);
+		TEST_CHECK(store.GetLineCount() == 1 && GetLineText(store, 0) == TEXT("fresh"));
+	}
+
+	void TestTrim()
+	{
+		LogLineStore store;
+
+		// Ten lines of nine characters and a line break.
+		for (int i = 0; i != 10; ++i)
+			Append(&store, TEXT("123456789\n"), 0);
+
+		TEST_CHECK(store.GetTextLength() == 100);
+		TEST_CHECK(store.Trim(10, 100) == 0);
+
+		// Down to three quarters of the line limit.
+		TEST_CHECK(store.Trim(8, 0) == 4);
+		TEST_CHECK(store.GetLineCount() == 6 && store.GetTextLength() == 60);
+
+		// And of the character limit, in whole lines.
+		TEST_CHECK(store.Trim(0, 40) == 3);
+		TEST_CHECK(store.GetLineCount() == 3 && store.GetTextLength() == 30);
+
+		store.RemoveFrontLines(1);
+		TEST_CHECK(store.GetLineCount() == 2 && GetLineText(store, 0) == TEXT("123456789"));
+
+		// Trimming many blocks' worth frees them, and what's left is intact.
+		TCharString longLine(30000, 'y');
+		longLine += '\n';
+		for (int i = 0; i != 20; ++i)
+			store.Append(longLine.data(), longLine.size(), 0);
+
+		store.Trim(4, 0);
+		TEST_CHECK(store.GetLineCount() == 3);
+		TEST_CHECK(GetLineText(store, 2) == TCharString(30000, 'y'));
+		TEST_CHECK(store.GetTextLength() == 3 * 30001);
+	}
+}
+
+int main()
+{
+	TEST_RUN(TestAppend);
+	TEST_RUN(TestLineIndex);
+	TEST_RUN(TestColourRuns);
+	TEST_RUN(TestPartialLines);
+	TEST_RUN(TestTrim);
+	return TestResult();
+}
@@ -0,0 +1,238 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Measures LogWnd's pipeline without a window: N producer threads format
+// entries in to a LogQueue while a consumer thread takes them and builds the
+// RTF and line bookkeeping the RichEdit display would, trimming to a
+// scrollback limit as it goes. Reports the entries taken per second, how many
+// were dropped, and the 50th and 99th percentile time Format took to return.
+// Some runs also keep every entry in a LogMemorySink, as a headless LogWnd
+// would. Run with no arguments for 1, 2, 4, 8 and 16 producers.
+//
+
+#include "TestUtil.h"
+#include "LogLineStore.h"
+#include "LogQueue.h"
+#include "LogRtf.h"
+#include <algorithm>
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	// The consumer never logs, so producers can always wait for it.
+	class BenchmarkQueue : public LogQueue
+	{
+	protected:
+
+		virtual bool CanWaitForSpace()
+		{
+			return true;
+		}
+	};
+
+	struct Producer
+	{
+		BenchmarkQueue *queue;
+		int thread;
+		int count;
+		bool staging;
+
+		// Nanoseconds per Format call.
+		std::vector<float> latencies;
+	};
+
+	void ProducerProc(void *param)
+	{
+		Producer *producer = (Producer *) param;
+		producer->latencies.reserve(producer->count);
+
+		if (producer->staging)
+			producer->queue->EnableStaging();
+
+		for (int i = 0; i != producer->count; ++i)
+		{
+			double start = GetSeconds();
+			producer->queue->Format(RGB(producer->thread * 40, 0, 0), LogQueue::SHOWCOMMAND_NO_CHANGE,
+				TEXT("thread %d entry %d value %.3f {braces} and a tab\tto escape\n"), producer->thread, i, i * 0.25);
+			producer->latencies.push_back((float) ((GetSeconds() - start) * 1e9));
+		}
+
+		if (producer->staging)
+			producer->queue->DisableStaging();
+	}
+
+	// The colour of the lines TakeEntries adds to report drops.
+	const COLORREF droppedColour = RGB(128, 128, 128);
+
+	struct Consumer
+	{
+		BenchmarkQueue *queue;
+		volatile LONG producersDone;
+
+		std::vector<COLORREF> palette;
+		LogRtfWriter *rtf;
+		LogLineLengths lines;
+		size_t entries;
+		size_t rtfBytes;
+	};
+
+	void ConsumeEntry(void *context, const LogQueue::Entry &entry)
+	{
+		Consumer *consumer = (Consumer *) context;
+		if (entry.colour != droppedColour)
+			++consumer->entries;
+
+		consumer->rtf->Append(entry.text, entry.length, entry.colour);
+		consumer->lines.Add(entry.text, entry.length);
+	}
+
+	void ConsumerProc(void *param)
+	{
+		Consumer *consumer = (Consumer *) param;
+
+		for (;;)
+		{
+			bool done = consumer->producersDone != 0;
+
+			LogRtfWriter rtf(&consumer->palette);
+			consumer->rtf = &rtf;
+
+			size_t taken = consumer->queue->TakeEntries(&ConsumeEntry, consumer);
+
+			if (! rtf.IsEmpty())
+			{
+				// Stands in for streaming the document in to the control.
+				consumer->rtfBytes += rtf.Finish(TEXT("Courier New"), 0, 200).size();
+				consumer->lines.Trim(10000, 0);
+			}
+
+			if (! taken)
+			{
+				if (done)
+					break;
+
+				Sleep(0);
+			}
+		}
+	}
+
+	double GetPercentile(std::vector<float> *values, double percentile)
+	{
+		if (values->empty())
+			return 0;
+
+		size_t index = (size_t) ((values->size() - 1) * percentile / 100.0);
+		std::nth_element(values->begin(), values->begin() + index, values->end());
+		return (*values)[index];
+	}
+
+	void Run(int producerCount, LogQueue::OverflowPolicy policy, bool staging, bool memorySink, int entriesPerProducer)
+	{
+		BenchmarkQueue queue;
+		queue.SetOverflowPolicy(policy);
+
+		LogMemorySink sink;
+		sink.SetScrollback(10000, 0);
+		if (memorySink)
+			queue.SetSink(&sink);
+
+		Consumer consumer;
+		consumer.queue = &queue;
+		consumer.producersDone = 0;
+		consumer.rtf = NULL;
+		consumer.entries = 0;
+		consumer.rtfBytes = 0;
+
+		std::vector<Producer> producers(producerCount);
+		for (int i = 0; i != producerCount; ++i)
+		{
+			producers[i].queue = &queue;
+			producers[i].thread = i;
+			producers[i].count = entriesPerProducer;
+			producers[i].staging = staging;
+		}
+
+		double start = GetSeconds();
+
+		TestThread consumerThread;
+		consumerThread.Start(&ConsumerProc, &consumer);
+
+		std::vector<TestThread *> threads;
+		for (int i = 0; i != producerCount; ++i)
+		{
+			threads.push_back(new TestThread);
+			threads.back()->Start(&ProducerProc, &producers[i]);
+		}
+
+		for (int i = 0; i != producerCount; ++i)
+		{
+			threads[i]->Join();
+			delete threads[i];
+		}
+
+		InterlockedExchange(&consumer.producersDone, 1);
+		consumerThread.Join();
+
+		double elapsed = GetSeconds() - start;
+
+		std::vector<float> latencies;
+		for (int i = 0; i != producerCount; ++i)
+			latencies.insert(latencies.end(), producers[i].latencies.begin(), producers[i].latencies.end());
+
+		double p50 = GetPercentile(&latencies, 50);
+		double p99 = GetPercentile(&latencies, 99);
+
+		size_t dropped = (size_t) queue.GetDroppedCount();
+		size_t logged = (size_t) producerCount * entriesPerProducer;
+
+		printf("%9d %-11s %-7s %-6s %12.0f %9lu %9.0f %9.0f\n", producerCount,
+			policy == LogQueue::OVERFLOW_BLOCK ? "block" : "drop oldest", staging ? "staged" : "direct",
+			memorySink ? "memory" : "none", consumer.entries / elapsed, (unsigned long) dropped, p50, p99);
+
+		// Every entry is either taken or counted as dropped.
+		if (policy == LogQueue::OVERFLOW_BLOCK)
+			TEST_CHECK(dropped == 0 && consumer.entries == logged);
+		else
+			TEST_CHECK(consumer.entries + dropped == logged);
+
+		TEST_CHECK(consumer.rtfBytes != 0);
+
+		// The sink gets every entry, dropped or not, and keeps the newest.
+		if (memorySink)
+		{
+			TEST_CHECK((size_t) sink.GetEntryCount() == logged);
+			size_t lines = sink.GetStore().GetLineCount();
+			TEST_CHECK(lines <= 10000 && lines >= (logged < 7500 ? logged : 7500));
+			queue.SetSink(NULL);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool quick = IsQuickRun(argc, argv);
+	int entriesPerProducer = quick ? 2000 : 200000;
+
+	const int producerCounts[] = { 1, 2, 4, 8, 16 };
+	size_t runs = quick ? 3 : WNDLIB_COUNTOF(producerCounts);
+
+	printf("%9s %-11s %-7s %-6s %12s %9s %9s %9s\n", "producers", "overflow", "staging", "sink", "entries/s", "dropped", "p50 ns", "p99 ns");
+
+	for (size_t i = 0; i != runs; ++i)
+	{
+		int producerCount = producerCounts[quick ? i * 2 : i];
+
+		Run(producerCount, LogQueue::OVERFLOW_DROP_OLDEST, false, false, entriesPerProducer);
+		Run(producerCount, LogQueue::OVERFLOW_BLOCK, false, false, entriesPerProducer);
+		Run(producerCount, LogQueue::OVERFLOW_DROP_OLDEST, true, false, entriesPerProducer);
+		Run(producerCount, LogQueue::OVERFLOW_BLOCK, true, false, entriesPerProducer);
+		Run(producerCount, LogQueue::OVERFLOW_DROP_OLDEST, false, true, entriesPerProducer);
+	}
+
+	return TestResult();
+}
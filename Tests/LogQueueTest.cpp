@@ -0,0 +1,697 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Checks the window independent half of LogWnd: the queue's ordering, overflow
+// policies, levels, sinks (including LogMemorySink), staging and deferred
+// formatting, and the RTF and line bookkeeping the RichEdit display is built
+// from.
+//
+
+#include "TestUtil.h"
+#include "LogLineStore.h"
+#include "LogQueue.h"
+#include "LogRtf.h"
+#include <string>
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	struct TakenEntry
+	{
+		TCharString text;
+		COLORREF colour;
+		LogQueue::ShowCommand showCommand;
+	};
+
+	void CollectEntry(void *context, const LogQueue::Entry &entry)
+	{
+		TakenEntry taken;
+		taken.text.assign(entry.text, entry.length);
+		taken.colour = entry.colour;
+		taken.showCommand = entry.showCommand;
+		((std::vector<TakenEntry> *) context)->push_back(taken);
+	}
+
+	std::vector<TakenEntry> TakeAll(LogQueue *queue)
+	{
+		std::vector<TakenEntry> entries;
+		size_t count = queue->TakeEntries(&CollectEntry, &entries);
+		TEST_CHECK(count == entries.size());
+		return entries;
+	}
+
+	TCharString Widen(const char *text)
+	{
+		TCharString result;
+		for (; *text; ++text)
+			result += (TCHAR) (unsigned char) *text;
+
+		return result;
+	}
+
+	// What "%d\n" logs.
+	TCharString NumberLine(long number)
+	{
+		char text[32];
+		sprintf(text, "%ld\n", number);
+		return Widen(text);
+	}
+
+	TCharString DroppedLine(long dropped)
+	{
+		char text[64];
+		sprintf(text, "(%ld log entries dropped)\n", dropped);
+		return Widen(text);
+	}
+
+	void TestOrder()
+	{
+		LogQueue queue;
+
+		queue.Log(TEXT("one\n"), RGB(255, 0, 0), LogQueue::SHOWCOMMAND_NO_CHANGE);
+		queue.Log(TEXT("two\n"), RGB(0, 255, 0), LogQueue::SHOWCOMMAND_ALERT);
+
+		// Long enough to need several cells.
+		TCharString longText(1000, 'x');
+		queue.Log(longText.c_str(), RGB(0, 0, 255), LogQueue::SHOWCOMMAND_NO_CHANGE);
+
+		std::vector<TakenEntry> entries = TakeAll(&queue);
+		TEST_CHECK(entries.size() == 3);
+		if (entries.size() == 3)
+		{
+			TEST_CHECK(entries[0].text == TEXT("one\n") && entries[0].colour == RGB(255, 0, 0));
+			TEST_CHECK(entries[1].text == TEXT("two\n") && entries[1].showCommand == LogQueue::SHOWCOMMAND_ALERT);
+			TEST_CHECK(entries[2].text == longText && entries[2].colour == RGB(0, 0, 255));
+		}
+
+		TEST_CHECK(TakeAll(&queue).empty());
+		TEST_CHECK(queue.GetDroppedCount() == 0);
+	}
+
+	void TestDropOldest()
+	{
+		LogQueue queue;
+		queue.SetQueueSize(8 * 1024);
+
+		for (int i = 0; i != 1000; ++i)
+			queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("entry %d\n"), i);
+
+		LONG dropped = queue.GetDroppedCount();
+		TEST_CHECK(dropped > 0);
+
+		// The count comes first, then the newest entries, in order.
+		std::vector<TakenEntry> entries = TakeAll(&queue);
+		TEST_CHECK(entries.size() == (size_t) (1000 - dropped) + 1);
+		if (entries.size() > 1)
+		{
+			TEST_CHECK(entries[0].text == DroppedLine(dropped));
+			TEST_CHECK(entries.back().text == TEXT("entry 999\n"));
+		}
+
+		// Reported once.
+		queue.Log(TEXT("after\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+		entries = TakeAll(&queue);
+		TEST_CHECK(entries.size() == 1);
+	}
+
+	void TestDropNewest()
+	{
+		LogQueue queue;
+		queue.SetQueueSize(8 * 1024);
+		queue.SetOverflowPolicy(LogQueue::OVERFLOW_DROP_NEWEST);
+
+		for (int i = 0; i != 1000; ++i)
+			queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("entry %d\n"), i);
+
+		LONG dropped = queue.GetDroppedCount();
+		TEST_CHECK(dropped > 0);
+
+		std::vector<TakenEntry> entries = TakeAll(&queue);
+		TEST_CHECK(entries.size() == (size_t) (1000 - dropped) + 1);
+		if (entries.size() > 1)
+			TEST_CHECK(entries[1].text == TEXT("entry 0\n"));
+	}
+
+	// Without anything taking entries, OVERFLOW_BLOCK can't wait.
+	void TestBlockWithoutConsumer()
+	{
+		LogQueue queue;
+		queue.SetQueueSize(8 * 1024);
+		queue.SetOverflowPolicy(LogQueue::OVERFLOW_BLOCK);
+
+		for (int i = 0; i != 1000; ++i)
+			queue.Log(TEXT("entry\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+
+		TEST_CHECK(queue.GetDroppedCount() > 0);
+	}
+
+	class BlockingQueue : public LogQueue
+	{
+	protected:
+
+		virtual bool CanWaitForSpace()
+		{
+			return true;
+		}
+	};
+
+	struct BlockingTest
+	{
+		BlockingQueue queue;
+		volatile LONG done;
+		int count;
+	};
+
+	void BlockingProducer(void *param)
+	{
+		BlockingTest *test = (BlockingTest *) param;
+
+		for (int i = 0; i != test->count; ++i)
+			test->queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("%d\n"), i);
+
+		InterlockedExchange(&test->done, 1);
+	}
+
+	void TestBlock()
+	{
+		BlockingTest test;
+		test.queue.SetQueueSize(4 * 1024);
+		test.queue.SetOverflowPolicy(LogQueue::OVERFLOW_BLOCK);
+		test.done = 0;
+		test.count = 20000;
+
+		TestThread producer;
+		producer.Start(&BlockingProducer, &test);
+
+		std::vector<TakenEntry> entries;
+		for (;;)
+		{
+			bool done = test.done != 0;
+			if (! test.queue.TakeEntries(&CollectEntry, &entries) && done)
+				break;
+		}
+
+		producer.Join();
+
+		// Nothing dropped, and everything in order.
+		TEST_CHECK(test.queue.GetDroppedCount() == 0);
+		TEST_CHECK(entries.size() == (size_t) test.count);
+
+		bool ordered = true;
+		for (size_t i = 0; i != entries.size() && ordered; ++i)
+			ordered = entries[i].text == NumberLine((long) i);
+
+		TEST_CHECK(ordered);
+	}
+
+	void TestLevels()
+	{
+		LogQueue queue;
+
+		TEST_CHECK(queue.IsEnabled(0, LogQueue::LEVEL_TRACE));
+		TEST_CHECK(! queue.IsEnabled(LogQueue::MAX_CATEGORIES, LogQueue::LEVEL_ERROR));
+		TEST_CHECK(queue.GetLevel(LogQueue::MAX_CATEGORIES) == LogQueue::LEVEL_OFF);
+
+		queue.SetLevel(3, LogQueue::LEVEL_WARNING);
+		TEST_CHECK(queue.GetLevel(3) == LogQueue::LEVEL_WARNING);
+		TEST_CHECK(! queue.IsEnabled(3, LogQueue::LEVEL_INFO));
+		TEST_CHECK(queue.IsEnabled(3, LogQueue::LEVEL_ERROR));
+
+		queue.Log(3, LogQueue::LEVEL_INFO, TEXT("discarded\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+		queue.Format(3, LogQueue::LEVEL_DEBUG, 0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("discarded %d\n"), 1);
+		queue.Log(3, LogQueue::LEVEL_ERROR, TEXT("kept\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+		queue.Log(4, LogQueue::LEVEL_TRACE, TEXT("kept\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+
+		TEST_CHECK(TakeAll(&queue).size() == 2);
+
+		queue.SetLevel(LogQueue::LEVEL_OFF);
+		queue.Log(4, LogQueue::LEVEL_ERROR, TEXT("discarded\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+		TEST_CHECK(TakeAll(&queue).empty());
+	}
+
+	class CountingSink : public LogSink
+	{
+	public:
+
+		CountingSink() :
+			count(0)
+		{
+		}
+
+		virtual void Write(LPCTSTR text, size_t length, COLORREF)
+		{
+			CriticalSection::ScopedLock lock(cs);
+			++count;
+			last.assign(text, length);
+		}
+
+		CriticalSection cs;
+		int count;
+		TCharString last;
+	};
+
+	void TestSinks()
+	{
+		LogQueue queue;
+		queue.SetQueueSize(8 * 1024);
+		queue.SetOverflowPolicy(LogQueue::OVERFLOW_DROP_NEWEST);
+
+		CountingSink sink, ring;
+		queue.SetSink(&sink);
+		queue.SetSharedRing(&ring);
+
+		// The sink gets everything, including what the queue drops.
+		for (int i = 0; i != 1000; ++i)
+			queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("entry %d\n"), i);
+
+		TEST_CHECK(queue.GetDroppedCount() > 0);
+		TEST_CHECK(sink.count == 1000 && ring.count == 1000);
+		TEST_CHECK(sink.last == TEXT("entry 999\n"));
+
+		// Deferred formatting is ignored while there's a sink.
+		queue.SetDeferredFormatting(true);
+		TakeAll(&queue);
+		queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("%d\n"), 5);
+		TEST_CHECK(sink.last == TEXT("5\n"));
+
+		// Without one, the shared ring gets deferred entries once they're
+		// formatted.
+		queue.SetSink(NULL);
+		queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("%d\n"), 6);
+		TEST_CHECK(ring.last == TEXT("5\n"));
+		TakeAll(&queue);
+		TEST_CHECK(ring.last == TEXT("6\n"));
+
+		queue.SetSharedRing(NULL);
+	}
+
+	struct MemorySinkTest
+	{
+		LogQueue *queue;
+		int thread;
+		int count;
+	};
+
+	void MemorySinkProducer(void *param)
+	{
+		MemorySinkTest *test = (MemorySinkTest *) param;
+
+		for (int i = 0; i != test->count; ++i)
+			test->queue->Format((COLORREF) test->thread, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("%d %d\n"), test->thread, i);
+	}
+
+	// A LogMemorySink keeps what several threads log, up to its scrollback.
+	void TestMemorySink()
+	{
+		LogQueue queue;
+		queue.SetQueueSize(8 * 1024);
+		queue.SetOverflowPolicy(LogQueue::OVERFLOW_DROP_OLDEST);
+
+		LogMemorySink sink;
+		sink.SetScrollback(1000, 0);
+		queue.SetSink(&sink);
+
+		const int threadCount = 4;
+		MemorySinkTest tests[threadCount];
+		TestThread threads[threadCount];
+
+		for (int i = 0; i != threadCount; ++i)
+		{
+			tests[i].queue = &queue;
+			tests[i].thread = i;
+			tests[i].count = 2000;
+			threads[i].Start(&MemorySinkProducer, &tests[i]);
+		}
+
+		for (int i = 0; i != threadCount; ++i)
+			threads[i].Join();
+
+		TEST_CHECK(sink.GetEntryCount() == threadCount * 2000);
+
+		CriticalSection::ScopedLock lock(sink.GetLock());
+		const LogLineStore &store = sink.GetStore();
+		TEST_CHECK(store.GetLineCount() <= 1000 && store.GetLineCount() >= 750);
+
+		// Each line is a whole entry, in its thread's colour, and each
+		// thread's lines are in order.
+		int next[threadCount] = { 0 };
+		int lastEntry = -1;
+		bool ordered = true;
+		for (size_t line = 0; line != store.GetLineCount(); ++line)
+		{
+			if (store.GetRunCount(line) != 1)
+			{
+				ordered = false;
+				continue;
+			}
+
+			const LogLineStore::Run &run = store.GetRun(line, 0);
+			TCharString text(run.text, run.length);
+			int thread = (int) run.colour;
+
+			char expected[32];
+			sprintf(expected, "%d ", thread);
+			if (thread < 0 || thread >= threadCount || text.compare(0, strlen(expected), Widen(expected)) != 0)
+			{
+				ordered = false;
+				continue;
+			}
+
+			int entry = 0;
+			for (size_t i = strlen(expected); i != text.size(); ++i)
+				entry = entry * 10 + (int) (text[i] - '0');
+
+			if (entry < next[thread])
+				ordered = false;
+
+			next[thread] = entry + 1;
+			lastEntry = entry;
+		}
+
+		TEST_CHECK(ordered);
+
+		// The newest entry, some thread's last, is always kept.
+		TEST_CHECK(lastEntry == 1999);
+
+		queue.SetSink(NULL);
+	}
+
+	void TestDeferredFormatting()
+	{
+		LogQueue queue;
+		queue.SetDeferredFormatting(true);
+
+		const char *narrow = "narrow";
+		const WCHAR *wide = L"wide";
+
+		queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("%d %u %x %5.2f %c %hs %ls %*d %.*s %lld %%\n"),
+			-7, 7u, 255, 3.14159, 'z', narrow, wide, 4, 9, 3, TEXT("abcdef"), (LONGLONG) 1 << 40);
+
+		// %n can't be deferred, so it's formatted at once.
+		int written = 0;
+		queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("%s%n\n"), TEXT("at once"), &written);
+		TEST_CHECK(written == 7);
+
+		// long is the size of a pointer on some systems and not others, and
+		// long double, size_t and intmax_t can't be stored, so they're
+		// formatted at once. Either way the arguments after them are read
+		// correctly.
+		long big = sizeof(long) == 8 ? (long) ((LONGLONG) 1 << 40) : 0x7fffffffL;
+		queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("%ld %lu %d %Lf %d %zu %d\n"),
+			-big, (unsigned long) big, 1, (long double) 2.5, 2, (size_t) 3, 4);
+
+		std::vector<TakenEntry> entries = TakeAll(&queue);
+		TEST_CHECK(entries.size() == 3);
+		if (entries.size() == 3)
+		{
+			TEST_CHECK(entries[0].text == Widen("-7 7 ff  3.14 z narrow wide    9 abc 1099511627776 %\n"));
+			TEST_CHECK(entries[1].text == TEXT("at once\n"));
+
+			char expected[128];
+			sprintf(expected, "%ld %lu 1 2.500000 2 3 4\n", -big, (unsigned long) big);
+			TEST_CHECK(entries[2].text == Widen(expected));
+		}
+	}
+
+	struct StagingTest
+	{
+		LogQueue *queue;
+		int thread;
+		int count;
+	};
+
+	void StagingProducer(void *param)
+	{
+		StagingTest *test = (StagingTest *) param;
+
+		test->queue->EnableStaging();
+
+		for (int i = 0; i != test->count; ++i)
+			test->queue->Format((COLORREF) test->thread, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("%d\n"), i);
+
+		test->queue->DisableStaging();
+	}
+
+	void TestStaging()
+	{
+		LogQueue queue;
+		queue.SetQueueSize(1024 * 1024);
+		queue.SetStagingInterval(1000000);
+
+		// Staged entries wait for FlushStaging.
+		queue.EnableStaging();
+		queue.Log(TEXT("staged\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+		TEST_CHECK(TakeAll(&queue).empty());
+		queue.FlushStaging();
+		TEST_CHECK(TakeAll(&queue).size() == 1);
+
+		// Except when they'd show the window.
+		queue.Log(TEXT("staged\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+		queue.Log(TEXT("shown\n"), 0, LogQueue::SHOWCOMMAND_SHOW_IN_BACKGROUND);
+		std::vector<TakenEntry> entries = TakeAll(&queue);
+		TEST_CHECK(entries.size() == 2);
+		if (entries.size() == 2)
+			TEST_CHECK(entries[1].showCommand == LogQueue::SHOWCOMMAND_SHOW_IN_BACKGROUND);
+
+		queue.DisableStaging();
+
+		// Several threads' batches are merged, each thread's entries staying
+		// in order.
+		const int threadCount = 4;
+		StagingTest tests[threadCount];
+		TestThread threads[threadCount];
+
+		for (int i = 0; i != threadCount; ++i)
+		{
+			tests[i].queue = &queue;
+			tests[i].thread = i;
+			tests[i].count = 500;
+			threads[i].Start(&StagingProducer, &tests[i]);
+		}
+
+		for (int i = 0; i != threadCount; ++i)
+			threads[i].Join();
+
+		entries = TakeAll(&queue);
+		TEST_CHECK(queue.GetDroppedCount() == 0);
+		TEST_CHECK(entries.size() == (size_t) threadCount * 500);
+
+		int next[threadCount] = { 0 };
+		bool ordered = true;
+		for (size_t i = 0; i != entries.size(); ++i)
+		{
+			int thread = (int) entries[i].colour;
+			if (thread < 0 || thread >= threadCount || entries[i].text != NumberLine(next[thread]))
+				ordered = false;
+			else
+				++next[thread];
+		}
+
+		TEST_CHECK(ordered);
+	}
+
+	// Entries left staged by a thread that's stopped logging are taken once
+	// the staging interval has passed.
+	void TestStaleStaging()
+	{
+		LogQueue queue;
+		queue.SetStagingInterval(100);
+
+		queue.EnableStaging();
+		queue.Log(TEXT("one\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+		queue.Log(TEXT("two\n"), 0, LogQueue::SHOWCOMMAND_NO_CHANGE);
+		TEST_CHECK(TakeAll(&queue).empty());
+
+		Sleep(200);
+		std::vector<TakenEntry> entries = TakeAll(&queue);
+		TEST_CHECK(entries.size() == 2);
+		if (entries.size() == 2)
+			TEST_CHECK(entries[0].text == TEXT("one\n") && entries[1].text == TEXT("two\n"));
+
+		// Nothing is left to publish.
+		queue.DisableStaging();
+		TEST_CHECK(TakeAll(&queue).empty());
+	}
+
+	// A dropped batch counts every entry in it.
+	void TestStagingDrops()
+	{
+		const LogQueue::OverflowPolicy policies[] = { LogQueue::OVERFLOW_DROP_OLDEST, LogQueue::OVERFLOW_DROP_NEWEST };
+
+		for (size_t i = 0; i != WNDLIB_COUNTOF(policies); ++i)
+		{
+			LogQueue queue;
+			queue.SetQueueSize(8 * 1024);
+			queue.SetOverflowPolicy(policies[i]);
+			queue.SetStagingInterval(1000000);
+
+			queue.EnableStaging();
+			for (int j = 0; j != 1000; ++j)
+				queue.Format(0, LogQueue::SHOWCOMMAND_NO_CHANGE, TEXT("entry %d\n"), j);
+			queue.DisableStaging();
+
+			LONG dropped = queue.GetDroppedCount();
+			TEST_CHECK(dropped > 0);
+
+			// Plus the line reporting the drops.
+			TEST_CHECK(TakeAll(&queue).size() == (size_t) (1000 - dropped) + 1);
+		}
+	}
+
+	void TestRtfWriter()
+	{
+		std::vector<COLORREF> palette;
+		LogRtfWriter rtf(&palette);
+
+		TEST_CHECK(rtf.IsEmpty());
+
+		// Runs in the same colour merge, and colours get the same index
+		// however often they come back.
+		rtf.Append(TEXT("a"), 1, RGB(255, 0, 0));
+		rtf.Append(TEXT("b"), 1, RGB(255, 0, 0));
+		rtf.Append(TEXT("c"), 1, RGB(0, 0, 255));
+		rtf.Append(TEXT("d"), 1, RGB(255, 0, 0));
+		TEST_CHECK(rtf.GetBody() == "\\cf1 ab\\cf2 c\\cf1 d");
+		TEST_CHECK(palette.size() == 2);
+
+		rtf.ClearBody();
+		rtf.Append(TEXT("x{y}\\z\ttab\r\nline"), 16, RGB(0, 0, 255));
+		TEST_CHECK(rtf.GetBody() == "\\cf2 x\\{y\\}\\\\z\\tab tab\\par\nline");
+
+		rtf.ClearBody();
+		rtf.EndLine();
+		TEST_CHECK(rtf.GetBody() == "\\par\n");
+
+		rtf.ClearBody();
+		rtf.Append(TEXT("end"), 3, RGB(255, 0, 0));
+		TEST_CHECK(rtf.Finish(TEXT("Courier New"), 0, 200) ==
+			"{\\rtf1\\ansi\\uc1\\deff0{\\fonttbl{\\f0\\fnil\\fcharset0 Courier New;}}"
+			"{\\colortbl;\\red255\\green0\\blue0;\\red0\\green0\\blue255;}\\f0\\fs20 \\cf1 end}");
+
+		// A second writer sharing the palette keeps the indices.
+		LogRtfWriter next(&palette);
+		next.Append(TEXT("e"), 1, RGB(0, 0, 255));
+		TEST_CHECK(next.GetBody() == "\\cf2 e");
+
+		#ifndef WNDLIB_UNICODE
+			// The body continues the same document, so the colour carries on.
+			next.ClearBody();
+			next.Append("\xe9", 1, RGB(0, 0, 255));
+			TEST_CHECK(next.GetBody() == "\\'e9");
+		#endif
+	}
+
+	// Pass document through a merger in pieces of pieceSize bytes.
+	std::string MergeRtf(LogRtfMerger *merger, const std::string &document, size_t pieceSize)
+	{
+		std::string merged;
+		for (size_t i = 0; i < document.size(); i += pieceSize)
+		{
+			size_t size = document.size() - i < pieceSize ? document.size() - i : pieceSize;
+			merger->Write(document.data() + i, size, &merged);
+		}
+
+		merger->Finish(&merged);
+		return merged;
+	}
+
+	void TestRtfMerger()
+	{
+		// Hidden lines in a colour of their own, added to a document with one
+		// colour already.
+		std::vector<COLORREF> palette;
+		LogRtfWriter rtf(&palette);
+		rtf.AddColour(RGB(0, 0, 255));
+		TEST_CHECK(rtf.GetColourTable() == "\\red0\\green0\\blue255;");
+
+		// The way RichEdit streams out a log.
+		const std::string document =
+			"{\\rtf1\\ansi\\ansicpg1252\\deff0{\\fonttbl{\\f0\\fnil\\fcharset0 Courier New;}}\r\n"
+			"{\\colortbl ;\\red255\\green0\\blue0;}\r\n"
+			"\\viewkind4\\uc1\\pard\\cf1\\f0\\fs20 a \\{brace\\}\\par\r\n}\r\n";
+
+		const std::string expected =
+			"{\\rtf1\\ansi\\ansicpg1252\\deff0{\\fonttbl{\\f0\\fnil\\fcharset0 Courier New;}}\r\n"
+			"{\\colortbl ;\\red255\\green0\\blue0;\\red0\\green0\\blue255;}\r\n"
+			"\\viewkind4\\uc1\\pard\\cf1\\f0\\fs20 a \\{brace\\}\\par\r\n";
+
+		const size_t pieceSizes[] = { 1, 7, 4096 };
+		for (size_t i = 0; i != WNDLIB_COUNTOF(pieceSizes); ++i)
+		{
+			LogRtfMerger merger(rtf.GetColourTable());
+			TEST_CHECK(MergeRtf(&merger, document, pieceSizes[i]) == expected);
+			TEST_CHECK(merger.GetFirstColourIndex() == 2);
+		}
+
+		// The hidden lines then use the indices after the document's.
+		rtf.SetFirstColourIndex(2);
+		rtf.Append(TEXT("hidden"), 6, RGB(0, 0, 255));
+		TEST_CHECK(rtf.GetBody() == "\\cf2 hidden");
+
+		// Without a colour table, one is added after the font table.
+		const std::string plain =
+			"{\\rtf1\\ansi\\deff0{\\fonttbl{\\f0\\fnil Arial;}}\r\n"
+			"{\\*\\generator Riched20;}\\pard plain\\par\r\n}";
+
+		for (size_t i = 0; i != WNDLIB_COUNTOF(pieceSizes); ++i)
+		{
+			LogRtfMerger merger(rtf.GetColourTable());
+			TEST_CHECK(MergeRtf(&merger, plain, pieceSizes[i]) ==
+				"{\\rtf1\\ansi\\deff0{\\fonttbl{\\f0\\fnil Arial;}}{\\colortbl;\\red0\\green0\\blue255;}\r\n"
+				"{\\*\\generator Riched20;}\\pard plain\\par\r\n");
+			TEST_CHECK(merger.GetFirstColourIndex() == 1);
+		}
+	}
+
+	void TestLineLengths()
+	{
+		LogLineLengths lines;
+
+		lines.Add(TEXT("one\r\ntwo\nthr"), 12);
+		lines.Add(TEXT("ee\n"), 3);
+		TEST_CHECK(lines.GetLineCount() == 3);
+		TEST_CHECK(lines.GetTextLength() == 14);
+
+		// Under both limits.
+		TEST_CHECK(lines.Trim(10, 100) == 0);
+
+		// Over the line limit, so down to three quarters of it.
+		for (int i = 0; i != 10; ++i)
+			lines.Add(TEXT("12345\n"), 6);
+
+		TEST_CHECK(lines.GetLineCount() == 13);
+		TEST_CHECK(lines.Trim(8, 0) == 4 + 4 + 6 + 6 * 5);
+		TEST_CHECK(lines.GetLineCount() == 5 && lines.GetTextLength() == 30);
+
+		// Over the character limit.
+		TEST_CHECK(lines.Trim(0, 30) == 0);
+		TEST_CHECK(lines.Trim(0, 28) == 6 * 2);
+		TEST_CHECK(lines.GetLineCount() == 3 && lines.GetTextLength() == 18);
+	}
+}
+
+int main()
+{
+	TEST_RUN(TestOrder);
+	TEST_RUN(TestDropOldest);
+	TEST_RUN(TestDropNewest);
+	TEST_RUN(TestBlockWithoutConsumer);
+	TEST_RUN(TestBlock);
+	TEST_RUN(TestLevels);
+	TEST_RUN(TestSinks);
+	TEST_RUN(TestMemorySink);
+	TEST_RUN(TestDeferredFormatting);
+	TEST_RUN(TestStaging);
+	TEST_RUN(TestStaleStaging);
+	TEST_RUN(TestStagingDrops);
+	TEST_RUN(TestRtfWriter);
+	TEST_RUN(TestRtfMerger);
+	TEST_RUN(TestLineLengths);
+
+	return TestResult();
+}
@@ -0,0 +1,162 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Measures the log text scanners with each instruction set the processor has,
+// over text that looks like a log: lines of 20 to 140 characters, mostly plain
+// ASCII with the odd tab, brace or accented character.
+//
+
+#include "TestUtil.h"
+#include "LogScan.h"
+#include <string>
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	const Private::ScanLevel levels[] = { Private::SCAN_SCALAR, Private::SCAN_SSE2, Private::SCAN_AVX2 };
+	const char *const levelNames[] = { "scalar", "SSE2", "AVX2" };
+
+	template<typename Char>
+	std::basic_string<Char> MakeLogText(size_t length)
+	{
+		std::basic_string<Char> text;
+		text.reserve(length);
+
+		ULONG_PTR seed = 42;
+		size_t lineLength = 0;
+		size_t lineEnd = 80;
+
+		while (text.size() < length)
+		{
+			seed = seed * 1103515245u + 12345u;
+			unsigned pick = (unsigned) (seed >> 8);
+
+			if (lineLength == lineEnd)
+			{
+				text += (Char) '\n';
+				lineLength = 0;
+				lineEnd = 20 + pick % 121;
+				continue;
+			}
+
+			Char ch = (Char) ('a' + pick % 26);
+			switch (pick % 500)
+			{
+				case 0: ch = '\t'; break;
+				case 1: ch = '{'; break;
+				case 2: ch = (Char) 0xe9; break;
+			}
+
+			if (pick % 7 == 0)
+				ch = ' ';
+
+			text += ch;
+			++lineLength;
+		}
+
+		return text;
+	}
+
+	// Each returns how many things it found, so none of them is optimised away.
+
+	template<typename Char>
+	size_t CountLines(const std::basic_string<Char> &text)
+	{
+		size_t count = 0;
+		const Char *end = text.data() + text.size();
+
+		for (const Char *p = text.data(); (p = Private::FindLineBreak(p, end)) != end; ++p)
+			++count;
+
+		return count;
+	}
+
+	template<typename Char>
+	size_t CountRtfSpecials(const std::basic_string<Char> &text)
+	{
+		size_t count = 0;
+		const Char *end = text.data() + text.size();
+
+		for (const Char *p = text.data(); (p = Private::FindRtfSpecialChar(p, end)) != end; ++p)
+			++count;
+
+		return count;
+	}
+
+	template<typename Char>
+	size_t Normalize(const std::basic_string<Char> &text)
+	{
+		static std::basic_string<Char> output;
+		static std::vector<size_t> lineEnds;
+
+		output.clear();
+		lineEnds.clear();
+		return Private::NormalizeLineBreaks(text.data(), text.size(), &output, &lineEnds);
+	}
+
+	// Returns MB per second.
+	template<typename Char>
+	double Measure(size_t (*function)(const std::basic_string<Char> &), const std::basic_string<Char> &text,
+		int repeats, size_t *result)
+	{
+		double start = GetSeconds();
+
+		for (int i = 0; i != repeats; ++i)
+			*result = function(text);
+
+		double elapsed = GetSeconds() - start;
+		return (double) (text.size() * sizeof(Char)) * repeats / elapsed / (1024.0 * 1024.0);
+	}
+
+	template<typename Char>
+	void Run(const char *name, size_t length, int repeats)
+	{
+		std::basic_string<Char> text = MakeLogText<Char>(length);
+		Private::ScanLevel supported = Private::GetScanLevel();
+
+		size_t lines = 0, specials = 0, normalized = 0;
+
+		for (size_t i = 0; i != WNDLIB_COUNTOF(levels) && levels[i] <= supported; ++i)
+		{
+			Private::SetMaxScanLevel(levels[i]);
+
+			size_t levelLines, levelSpecials, levelNormalized;
+			double lineRate = Measure(&CountLines<Char>, text, repeats, &levelLines);
+			double specialRate = Measure(&CountRtfSpecials<Char>, text, repeats, &levelSpecials);
+			double normalizeRate = Measure(&Normalize<Char>, text, repeats, &levelNormalized);
+
+			printf("%-6s %-7s %12.0f %12.0f %12.0f\n", name, levelNames[levels[i]], lineRate, specialRate, normalizeRate);
+
+			// Every implementation must agree.
+			if (i)
+				TEST_CHECK(levelLines == lines && levelSpecials == specials && levelNormalized == normalized);
+
+			lines = levelLines;
+			specials = levelSpecials;
+			normalized = levelNormalized;
+		}
+
+		TEST_CHECK(lines == normalized && lines != 0);
+
+		Private::SetMaxScanLevel(Private::SCAN_AVX2);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool quick = IsQuickRun(argc, argv);
+	size_t length = quick ? 64 * 1024 : 16 * 1024 * 1024;
+	int repeats = quick ? 2 : 20;
+
+	printf("%-6s %-7s %12s %12s %12s\n", "chars", "level", "breaks MB/s", "rtf MB/s", "crlf MB/s");
+
+	Run<char>("8 bit", length, repeats);
+	Run<WORD>("16 bit", length, repeats);
+
+	return TestResult();
+}
@@ -0,0 +1,244 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Checks the log text scanners against a character at a time reference, with
+// every instruction set the processor has, for 8 and 16 bit text, at every
+// alignment and with the interesting character at every position.
+//
+
+#include "TestUtil.h"
+#include "LogScan.h"
+#include <string>
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	const Private::ScanLevel levels[] = { Private::SCAN_SCALAR, Private::SCAN_SSE2, Private::SCAN_AVX2 };
+	const char *const levelNames[] = { "scalar", "SSE2", "AVX2" };
+
+	template<typename Char>
+	const Char *ReferenceFindLineBreak(const Char *text, const Char *end)
+	{
+		while (text != end && *text != '\r' && *text != '\n')
+			++text;
+
+		return text;
+	}
+
+	template<typename Char>
+	const Char *ReferenceFindRtfSpecialChar(const Char *text, const Char *end)
+	{
+		for (; text != end; ++text)
+		{
+			unsigned ch = (unsigned) *text & (sizeof(Char) == 1 ? 0xff : 0xffff);
+			if (ch < 0x20 || ch >= 0x80 || ch == '\\' || ch == '{' || ch == '}')
+				break;
+		}
+
+		return text;
+	}
+
+	// Every length up to a few vectors, starting at every alignment, with
+	// special placed at every position in turn, over a run of filler.
+	template<typename Char>
+	void CheckFind(const Char *(*find)(const Char *, const Char *), const Char *(*reference)(const Char *, const Char *),
+		Char filler, Char special)
+	{
+		const size_t maxLength = 80;
+		std::vector<Char> buffer(maxLength + 8);
+
+		for (size_t align = 0; align != 4; ++align)
+		{
+			for (size_t length = 0; length <= maxLength; ++length)
+			{
+				Char *text = &buffer[align];
+				Char *end = text + length;
+
+				for (size_t at = 0; at <= length; ++at)
+				{
+					for (size_t i = 0; i != buffer.size(); ++i)
+						buffer[i] = filler;
+
+					// Put a special just past the end too, which mustn't be found.
+					*end = special;
+					if (at != length)
+						text[at] = special;
+
+					if (find(text, end) != reference(text, end))
+					{
+						TEST_CHECK(! "find disagrees with reference");
+						return;
+					}
+				}
+			}
+		}
+	}
+
+	template<typename Char>
+	void TestFindLineBreak()
+	{
+		const Char breaks[] = { '\r', '\n' };
+		const Char fillers[] = { 'a', ' ', 0x0b, 0x0c, 0x0e, 0x7f };
+
+		for (size_t b = 0; b != WNDLIB_COUNTOF(breaks); ++b)
+		{
+			for (size_t f = 0; f != WNDLIB_COUNTOF(fillers); ++f)
+				CheckFind<Char>(&Private::FindLineBreak<Char>, &ReferenceFindLineBreak<Char>, fillers[f], breaks[b]);
+		}
+	}
+
+	template<typename Char>
+	void TestFindRtfSpecialChar(const std::vector<Char> &specials)
+	{
+		const Char fillers[] = { 'a', ' ', '~', 0x7f, '[', '|' };
+
+		for (size_t s = 0; s != specials.size(); ++s)
+		{
+			for (size_t f = 0; f != WNDLIB_COUNTOF(fillers); ++f)
+				CheckFind<Char>(&Private::FindRtfSpecialChar<Char>, &ReferenceFindRtfSpecialChar<Char>, fillers[f], specials[s]);
+		}
+	}
+
+	void TestFindRtfSpecialChar8()
+	{
+		const char specials[] = { '\0', '\t', '\n', 0x1f, '\\', '{', '}', (char) 0x80, (char) 0xa9, (char) 0xff };
+		TestFindRtfSpecialChar(std::vector<char>(specials, specials + WNDLIB_COUNTOF(specials)));
+	}
+
+	void TestFindRtfSpecialChar16()
+	{
+		const WORD specials[] = { 0, '\t', '\n', 0x1f, '\\', '{', '}', 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xfffd, 0xffff };
+		TestFindRtfSpecialChar(std::vector<WORD>(specials, specials + WNDLIB_COUNTOF(specials)));
+	}
+
+	template<typename Char>
+	std::basic_string<Char> Widen(const char *text)
+	{
+		std::basic_string<Char> result;
+		for (; *text; ++text)
+			result += (Char) (unsigned char) *text;
+
+		return result;
+	}
+
+	// What NormalizeLineBreaks should produce.
+	template<typename Char>
+	std::basic_string<Char> ReferenceNormalize(const std::basic_string<Char> &text, std::vector<size_t> *lineEnds)
+	{
+		std::basic_string<Char> result;
+
+		for (size_t i = 0; i != text.size(); ++i)
+		{
+			if (text[i] == '\r')
+				continue;
+
+			if (text[i] == '\n')
+			{
+				result += (Char) '\r';
+				result += (Char) '\n';
+				lineEnds->push_back(result.size());
+				continue;
+			}
+
+			result += text[i];
+		}
+
+		return result;
+	}
+
+	template<typename Char>
+	void CheckNormalize(const std::basic_string<Char> &text, const std::basic_string<Char> &prefix)
+	{
+		std::vector<size_t> expectedEnds;
+		std::basic_string<Char> expected = prefix + ReferenceNormalize(text, &expectedEnds);
+		for (size_t i = 0; i != expectedEnds.size(); ++i)
+			expectedEnds[i] += prefix.size();
+
+		std::basic_string<Char> output = prefix;
+		std::vector<size_t> lineEnds;
+		size_t lines = Private::NormalizeLineBreaks(text.data(), text.size(), &output, &lineEnds);
+
+		TEST_CHECK(output == expected);
+		TEST_CHECK(lineEnds == expectedEnds);
+		TEST_CHECK(lines == expectedEnds.size());
+
+		// The offsets are optional.
+		output = prefix;
+		TEST_CHECK(Private::NormalizeLineBreaks(text.data(), text.size(), &output, (std::vector<size_t> *) NULL) == lines);
+		TEST_CHECK(output == expected);
+	}
+
+	template<typename Char>
+	void TestNormalizeLineBreaks()
+	{
+		std::vector<size_t> lineEnds;
+		std::basic_string<Char> output;
+
+		// '\r' is dropped wherever it is, and each '\n' becomes CRLF.
+		std::basic_string<Char> text = Widen<Char>("one\ntwo\r\nthree\rfour\n\n");
+		TEST_CHECK(Private::NormalizeLineBreaks(text.data(), text.size(), &output, &lineEnds) == 4);
+		TEST_CHECK(output == Widen<Char>("one\r\ntwo\r\nthreefour\r\n\r\n"));
+		TEST_CHECK(lineEnds.size() == 4);
+		if (lineEnds.size() == 4)
+			TEST_CHECK(lineEnds[0] == 5 && lineEnds[1] == 10 && lineEnds[2] == 21 && lineEnds[3] == 23);
+
+		CheckNormalize(std::basic_string<Char>(), Widen<Char>("kept"));
+		CheckNormalize(Widen<Char>("no breaks at all"), std::basic_string<Char>());
+		CheckNormalize(Widen<Char>("\r\r\n\n\r"), Widen<Char>("x\r\n"));
+
+		// Long lines, so breaks land inside and across vectors.
+		ULONG_PTR seed = 12345;
+		for (int round = 0; round != 200; ++round)
+		{
+			text.clear();
+			for (int i = 0; i != 300; ++i)
+			{
+				seed = seed * 1103515245u + 12345u;
+				unsigned pick = (unsigned) (seed >> 8) % 40;
+				text += pick == 0 ? (Char) '\n' : pick == 1 ? (Char) '\r' : (Char) ('a' + pick % 26);
+			}
+
+			CheckNormalize(text, round % 2 ? Widen<Char>("prefix") : std::basic_string<Char>());
+		}
+	}
+
+	void TestAllLevels()
+	{
+		Private::ScanLevel supported = Private::GetScanLevel();
+		printf("best supported: %s\n", levelNames[supported]);
+
+		for (size_t i = 0; i != WNDLIB_COUNTOF(levels); ++i)
+		{
+			Private::SetMaxScanLevel(levels[i]);
+
+			// A level that isn't supported falls back to the best that is.
+			TEST_CHECK(Private::GetScanLevel() == (levels[i] < supported ? levels[i] : supported));
+			if (levels[i] > supported)
+				continue;
+
+			printf("testing %s\n", levelNames[levels[i]]);
+
+			TestFindLineBreak<char>();
+			TestFindLineBreak<WORD>();
+			TestFindRtfSpecialChar8();
+			TestFindRtfSpecialChar16();
+			TestNormalizeLineBreaks<char>();
+			TestNormalizeLineBreaks<WORD>();
+		}
+
+		Private::SetMaxScanLevel(Private::SCAN_AVX2);
+		TEST_CHECK(Private::GetScanLevel() == supported);
+	}
+}
+
+int main()
+{
+	TEST_RUN(TestAllLevels);
+
+	return TestResult();
+}
@@ -0,0 +1,300 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Checks LogSharedRing: appending and reading through shared memory, falling
+// behind a writer that laps the reader, keeping entries in a file, and
+// recovering from records that were never finished or have been torn.
+// Records are damaged by writing to the file the ring is kept in, so these
+// tests know the ring's layout: a 64 byte header, then records aligned to 16
+// bytes, each starting with its position, size, length and colour.
+//
+
+#include "TestUtil.h"
+#include "LogQueue.h"
+#include "LogSharedRing.h"
+#include <stdio.h>
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	const TCHAR ringName[] = TEXT("/WndLibLogSharedRingTest");
+	const TCHAR ringPath[] = TEXT("LogSharedRingTest.ring");
+	const char ringPathA[] = "LogSharedRingTest.ring";
+
+	enum { DATA_OFFSET = 64, RECORD_HEADER_SIZE = 16, RECORD_ALIGNMENT = 16 };
+
+	struct ReadRecord
+	{
+		TCharString text;
+		COLORREF colour;
+	};
+
+	void CollectRecord(void *context, const LogSharedRing::Record &record)
+	{
+		ReadRecord read;
+		read.text.assign(record.text, record.length);
+		read.colour = record.colour;
+		((std::vector<ReadRecord> *) context)->push_back(read);
+	}
+
+	std::vector<ReadRecord> ReadAll(LogSharedRing *ring, LONG *position, bool skipUnfinished = false)
+	{
+		std::vector<ReadRecord> records;
+		size_t count = ring->Read(position, &CollectRecord, &records, skipUnfinished);
+		TEST_CHECK(count == records.size());
+		return records;
+	}
+
+	TCharString Widen(const char *text)
+	{
+		TCharString result;
+		for (; *text; ++text)
+			result += (TCHAR) (unsigned char) *text;
+
+		return result;
+	}
+
+	// Every record these tests write is the same length, so they can find
+	// them in the file.
+	TCharString RecordText(int number)
+	{
+		char text[32];
+		sprintf(text, "record %03d\n", number);
+		return Widen(text);
+	}
+
+	const size_t RECORD_SIZE = (RECORD_HEADER_SIZE + 11 * sizeof(TCHAR) + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+
+	void AppendRecords(LogSharedRing *ring, int first, int count)
+	{
+		for (int i = first; i != first + count; ++i)
+		{
+			TCharString text = RecordText(i);
+			ring->Append(text.data(), text.size(), (COLORREF) i);
+		}
+	}
+
+	// Write a fresh file holding records 0 to count - 1.
+	bool WriteRingFile(int count)
+	{
+		remove(ringPathA);
+
+		LogSharedRing ring;
+		if (! ring.Create(ringName, 4096, ringPath))
+			return false;
+
+		AppendRecords(&ring, 0, count);
+		return true;
+	}
+
+	// Overwrite a field of the record at index in the file.
+	void PatchRecord(int index, size_t fieldOffset, DWORD value)
+	{
+		FILE *file = fopen(ringPathA, "r+b");
+		TEST_CHECK(file != NULL);
+		if (! file)
+			return;
+
+		fseek(file, (long) (DATA_OFFSET + index * RECORD_SIZE + fieldOffset), SEEK_SET);
+		fwrite(&value, sizeof(value), 1, file);
+		fclose(file);
+	}
+
+	enum { FIELD_POSITION = 0, FIELD_SIZE = 4, FIELD_LENGTH = 8 };
+
+	bool HasRecords(const std::vector<ReadRecord> &records, const int *expected, size_t count)
+	{
+		if (records.size() != count)
+			return false;
+
+		for (size_t i = 0; i != count; ++i)
+		{
+			if (records[i].text != RecordText(expected[i]) || records[i].colour != (COLORREF) expected[i])
+				return false;
+		}
+
+		return true;
+	}
+
+	void TestAppendRead()
+	{
+		LogSharedRing::Remove(ringName);
+
+		LogSharedRing writer;
+		TEST_CHECK(writer.Create(ringName, 4096));
+
+		writer.Append(TEXT("one\n"), 4, RGB(255, 0, 0));
+		writer.Append(TEXT("two\n"), 4, RGB(0, 255, 0));
+
+		// Another process would attach by name.
+		LogSharedRing reader;
+		TEST_CHECK(reader.Open(ringName));
+
+		LONG position = reader.GetOldestPosition();
+		std::vector<ReadRecord> records = ReadAll(&reader, &position);
+		TEST_CHECK(records.size() == 2);
+		if (records.size() == 2)
+		{
+			TEST_CHECK(records[0].text == TEXT("one\n") && records[0].colour == RGB(255, 0, 0));
+			TEST_CHECK(records[1].text == TEXT("two\n") && records[1].colour == RGB(0, 255, 0));
+		}
+
+		TEST_CHECK(ReadAll(&reader, &position).empty());
+
+		writer.Append(TEXT("three\n"), 6, 0);
+		records = ReadAll(&reader, &position);
+		TEST_CHECK(records.size() == 1 && records[0].text == TEXT("three\n"));
+
+		// A reader can't append.
+		reader.Append(TEXT("ignored\n"), 8, 0);
+		TEST_CHECK(ReadAll(&reader, &position).empty());
+
+		// A queue writes to it as a sink.
+		LogQueue queue;
+		queue.SetSharedRing(&writer);
+		queue.Log(TEXT("queued\n"), RGB(0, 0, 255), LogQueue::SHOWCOMMAND_NO_CHANGE);
+		records = ReadAll(&reader, &position);
+		TEST_CHECK(records.size() == 1 && records[0].text == TEXT("queued\n") && records[0].colour == RGB(0, 0, 255));
+
+		reader.Close();
+		writer.Close();
+		TEST_CHECK(LogSharedRing::Remove(ringName));
+		TEST_CHECK(! reader.Open(ringName));
+	}
+
+	// A reader that's been lapped resumes at the oldest record.
+	void TestWrap()
+	{
+		LogSharedRing::Remove(ringName);
+
+		LogSharedRing ring;
+		TEST_CHECK(ring.Create(ringName, 4096));
+
+		LONG position = ring.GetOldestPosition();
+		AppendRecords(&ring, 0, 1000);
+
+		std::vector<ReadRecord> records = ReadAll(&ring, &position);
+		TEST_CHECK(! records.empty() && records.size() < 1000);
+
+		bool consecutive = ! records.empty();
+		int first = 1000 - (int) records.size();
+		for (size_t i = 0; i != records.size(); ++i)
+		{
+			if (records[i].text != RecordText(first + (int) i))
+				consecutive = false;
+		}
+
+		TEST_CHECK(consecutive);
+
+		// Text longer than a quarter of the ring is truncated.
+		TCharString longText(4096, 'x');
+		ring.Append(longText.data(), longText.size(), 0);
+		records = ReadAll(&ring, &position);
+		TEST_CHECK(records.size() == 1 && records[0].text.size() == (1024 - RECORD_HEADER_SIZE) / sizeof(TCHAR));
+
+		ring.Close();
+		LogSharedRing::Remove(ringName);
+	}
+
+	// A ring kept in a file keeps its records from one run to the next.
+	void TestFile()
+	{
+		TEST_CHECK(WriteRingFile(3));
+
+		LogSharedRing ring;
+		TEST_CHECK(ring.Create(ringName, 4096, ringPath));
+		AppendRecords(&ring, 3, 1);
+		ring.Close();
+
+		TEST_CHECK(ring.OpenFile(ringPath));
+		LONG position = ring.GetOldestPosition();
+		const int expected[] = { 0, 1, 2, 3 };
+		TEST_CHECK(HasRecords(ReadAll(&ring, &position), expected, WNDLIB_COUNTOF(expected)));
+
+		// Asking for a different size starts again.
+		ring.Close();
+		TEST_CHECK(ring.Create(ringName, 8192, ringPath));
+		position = ring.GetOldestPosition();
+		TEST_CHECK(ReadAll(&ring, &position).empty());
+		ring.Close();
+
+		remove(ringPathA);
+	}
+
+	// A record that was reserved but never written, as when a process
+	// crashes mid-append, stops reading unless it's skipped.
+	void TestUnfinished()
+	{
+		TEST_CHECK(WriteRingFile(5));
+		PatchRecord(2, FIELD_POSITION, (DWORD) -1);
+
+		LogSharedRing ring;
+		TEST_CHECK(ring.OpenFile(ringPath));
+
+		LONG position = ring.GetOldestPosition();
+		const int before[] = { 0, 1 };
+		TEST_CHECK(HasRecords(ReadAll(&ring, &position), before, WNDLIB_COUNTOF(before)));
+		TEST_CHECK(position == (LONG) (2 * RECORD_SIZE));
+
+		const int after[] = { 3, 4 };
+		TEST_CHECK(HasRecords(ReadAll(&ring, &position, true), after, WNDLIB_COUNTOF(after)));
+
+		ring.Close();
+		remove(ringPathA);
+	}
+
+	// A record whose header doesn't make sense is skipped, and reading picks
+	// up again at the next record FindRecord finds.
+	void TestTorn()
+	{
+		const size_t fields[] = { FIELD_SIZE, FIELD_SIZE, FIELD_LENGTH };
+		const DWORD values[] = { 7, 0x10000, (DWORD) RECORD_SIZE };
+
+		for (size_t i = 0; i != WNDLIB_COUNTOF(fields); ++i)
+		{
+			TEST_CHECK(WriteRingFile(5));
+			PatchRecord(2, fields[i], values[i]);
+
+			LogSharedRing ring;
+			TEST_CHECK(ring.OpenFile(ringPath));
+
+			LONG position = ring.GetOldestPosition();
+			const int expected[] = { 0, 1, 3, 4 };
+			TEST_CHECK(HasRecords(ReadAll(&ring, &position), expected, WNDLIB_COUNTOF(expected)));
+
+			ring.Close();
+		}
+
+		// A damaged ring header makes the file unreadable.
+		TEST_CHECK(WriteRingFile(5));
+
+		FILE *file = fopen(ringPathA, "r+b");
+		TEST_CHECK(file != NULL);
+		if (file)
+		{
+			DWORD magic = 0;
+			fwrite(&magic, sizeof(magic), 1, file);
+			fclose(file);
+		}
+
+		LogSharedRing ring;
+		TEST_CHECK(! ring.OpenFile(ringPath));
+
+		remove(ringPathA);
+	}
+}
+
+int main()
+{
+	TEST_RUN(TestAppendRead);
+	TEST_RUN(TestWrap);
+	TEST_RUN(TestFile);
+	TEST_RUN(TestUnfinished);
+	TEST_RUN(TestTorn);
+	return TestResult();
+}
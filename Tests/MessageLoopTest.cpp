@@ -0,0 +1,337 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Tests MessageLoopBase's scheduling by driving it from a simulated message
+// loop with a fake clock, in place of MessageLoop's Win32 wait and dispatch.
+//
+
+#include "TestUtil.h"
+#include "MessageLoopBase.h"
+#include <deque>
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	//
+	// Simulated loop
+	//
+
+	// A message cost that stands for WM_QUIT.
+	const DWORD quitMessage = 0xffffffff;
+
+	// Does what MessageLoop::RunOnce does, except that each message just
+	// advances the clock by its cost.
+	class SimulatedLoop : public MessageLoopBase
+	{
+	public:
+
+		SimulatedLoop() :
+			now(0),
+			dispatched(0),
+			signalled(-1)
+		{
+		}
+
+		bool RunOnce(DWORD timeout = INFINITE)
+		{
+			waits.push_back(GetWaitTimeout(timeout));
+
+			if (signalled >= 0)
+			{
+				CallHandleHandler((DWORD) signalled);
+				signalled = -1;
+			}
+
+			bool outOfTime = false;
+			DWORD start = now;
+
+			while (! messages.empty())
+			{
+				DWORD cost = messages.front();
+				messages.pop_front();
+
+				if (cost == quitMessage)
+				{
+					SetExitCode(42);
+					return false;
+				}
+
+				now += cost;
+				++dispatched;
+
+				if (IsOutOfTime(start, now))
+				{
+					outOfTime = true;
+					break;
+				}
+			}
+
+			EndIteration(outOfTime);
+			return true;
+		}
+
+		bool IsOutOfTimeAt(DWORD start, DWORD at) const
+		{
+			return IsOutOfTime(start, at);
+		}
+
+		void Signal(DWORD index)
+		{
+			signalled = (int) index;
+		}
+
+		// The cost, in milliseconds, of each queued message.
+		std::deque<DWORD> messages;
+
+		// The timeout each iteration waited with.
+		std::vector<DWORD> waits;
+
+		DWORD now;
+		int dispatched;
+		int signalled;
+	};
+
+	class CountingIdleHandler : public MessageLoopBase::IdleHandler
+	{
+	public:
+
+		CountingIdleHandler(int moreWork = 0, MessageLoopBase *removeFrom = NULL) :
+			calls(0),
+			_moreWork(moreWork),
+			_removeFrom(removeFrom)
+		{
+		}
+
+		virtual bool OnIdle()
+		{
+			++calls;
+
+			if (_removeFrom)
+				_removeFrom->RemoveIdleHandler(this);
+
+			if (_moreWork)
+			{
+				--_moreWork;
+				return true;
+			}
+
+			return false;
+		}
+
+		int calls;
+
+	private:
+
+		int _moreWork;
+		MessageLoopBase *_removeFrom;
+	};
+
+	class RecordingHandleHandler : public MessageLoopBase::HandleHandler
+	{
+	public:
+
+		RecordingHandleHandler() : last(NULL), calls(0) { }
+
+		virtual void OnHandleSignalled(HANDLE handle)
+		{
+			last = handle;
+			++calls;
+		}
+
+		HANDLE last;
+		int calls;
+	};
+
+	HANDLE MakeHandle(size_t index)
+	{
+		return (HANDLE) (UINT_PTR) (0x100 + index * 4);
+	}
+
+	//
+	// Tests
+	//
+
+	void TestBudget()
+	{
+		SimulatedLoop loop;
+		CountingIdleHandler idle;
+		loop.AddIdleHandler(&idle);
+
+		TEST_CHECK(loop.GetBudget() == 50);
+
+		for (int i = 0; i != 8; ++i)
+			loop.messages.push_back(10);
+
+		// The budget runs out after five messages, and idle handlers wait for
+		// the queue to be emptied.
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(loop.dispatched == 5);
+		TEST_CHECK(idle.calls == 0);
+
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(loop.dispatched == 8);
+		TEST_CHECK(idle.calls == 1);
+
+		// Without a budget, everything is dispatched at once.
+		loop.SetBudget(INFINITE);
+		for (int i = 0; i != 10; ++i)
+			loop.messages.push_back(1000);
+
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(loop.dispatched == 18);
+		TEST_CHECK(idle.calls == 2);
+	}
+
+	void TestBudgetWraps()
+	{
+		SimulatedLoop loop;
+
+		// GetTickCount wraps every 49.7 days.
+		TEST_CHECK(! loop.IsOutOfTimeAt(0xfffffff0, 0x00000021));
+		TEST_CHECK(loop.IsOutOfTimeAt(0xfffffff0, 0x00000022));
+
+		loop.now = 0xfffffff0;
+		for (int i = 0; i != 4; ++i)
+			loop.messages.push_back(20);
+
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(loop.dispatched == 3);
+	}
+
+	void TestIdleMoreWork()
+	{
+		SimulatedLoop loop;
+		CountingIdleHandler idle(2);
+		loop.AddIdleHandler(&idle);
+
+		// Idle work doesn't wait until the handler says it's done.
+		for (int i = 0; i != 4; ++i)
+			TEST_CHECK(loop.RunOnce(1000));
+
+		TEST_CHECK(loop.waits.size() == 4);
+		if (loop.waits.size() == 4)
+		{
+			TEST_CHECK(loop.waits[0] == 1000);
+			TEST_CHECK(loop.waits[1] == 0);
+			TEST_CHECK(loop.waits[2] == 0);
+			TEST_CHECK(loop.waits[3] == 1000);
+		}
+
+		TEST_CHECK(idle.calls == 4);
+	}
+
+	void TestOutOfTimeDefersIdle()
+	{
+		SimulatedLoop loop;
+		CountingIdleHandler idle(10);
+		loop.AddIdleHandler(&idle);
+
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(idle.calls == 1);
+
+		// An iteration that runs out of time doesn't run the idle handlers, and
+		// waits normally next time (MessageLoop's wait returns at once for the
+		// messages left behind).
+		loop.messages.push_back(60);
+		loop.messages.push_back(1);
+
+		TEST_CHECK(loop.RunOnce(1000));
+		TEST_CHECK(idle.calls == 1);
+
+		TEST_CHECK(loop.RunOnce(1000));
+		TEST_CHECK(idle.calls == 2);
+
+		TEST_CHECK(loop.waits.size() == 3);
+		if (loop.waits.size() == 3)
+		{
+			TEST_CHECK(loop.waits[1] == 0);
+			TEST_CHECK(loop.waits[2] == 1000);
+		}
+	}
+
+	void TestIdleHandlerRemoval()
+	{
+		SimulatedLoop loop;
+		CountingIdleHandler first;
+		CountingIdleHandler once(0, &loop);
+		CountingIdleHandler last;
+
+		loop.AddIdleHandler(&first);
+		loop.AddIdleHandler(&once);
+		loop.AddIdleHandler(&last);
+
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(loop.RunOnce());
+
+		TEST_CHECK(first.calls == 2);
+		TEST_CHECK(once.calls == 1);
+		TEST_CHECK(last.calls == 2);
+
+		loop.RemoveIdleHandler(&first);
+		loop.RemoveIdleHandler(&first);
+
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(first.calls == 2);
+		TEST_CHECK(last.calls == 3);
+	}
+
+	void TestHandles()
+	{
+		SimulatedLoop loop;
+		std::vector<RecordingHandleHandler> handlers(MAXIMUM_WAIT_OBJECTS);
+
+		// One slot is kept for the message queue.
+		for (size_t i = 0; i != MAXIMUM_WAIT_OBJECTS - 1; ++i)
+			TEST_CHECK(loop.AddHandle(MakeHandle(i), &handlers[i]));
+
+		TEST_CHECK(! loop.AddHandle(MakeHandle(100), &handlers[MAXIMUM_WAIT_OBJECTS - 1]));
+
+		// Removing a handle shifts the ones after it down.
+		loop.RemoveHandle(MakeHandle(3));
+		loop.RemoveHandle(MakeHandle(1000));
+
+		loop.Signal(3);
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(handlers[4].calls == 1 && handlers[4].last == MakeHandle(4));
+		TEST_CHECK(handlers[3].calls == 0);
+
+		TEST_CHECK(loop.AddHandle(MakeHandle(100), &handlers[MAXIMUM_WAIT_OBJECTS - 1]));
+		loop.Signal(MAXIMUM_WAIT_OBJECTS - 2);
+		TEST_CHECK(loop.RunOnce());
+		TEST_CHECK(handlers[MAXIMUM_WAIT_OBJECTS - 1].last == MakeHandle(100));
+	}
+
+	void TestQuit()
+	{
+		SimulatedLoop loop;
+		CountingIdleHandler idle;
+		loop.AddIdleHandler(&idle);
+
+		loop.messages.push_back(1);
+		loop.messages.push_back(quitMessage);
+		loop.messages.push_back(1);
+
+		TEST_CHECK(! loop.RunOnce());
+		TEST_CHECK(loop.GetExitCode() == 42);
+		TEST_CHECK(loop.dispatched == 1);
+		TEST_CHECK(idle.calls == 0);
+	}
+}
+
+int main()
+{
+	TEST_RUN(TestBudget);
+	TEST_RUN(TestBudgetWraps);
+	TEST_RUN(TestIdleMoreWork);
+	TEST_RUN(TestOutOfTimeDefersIdle);
+	TEST_RUN(TestIdleHandlerRemoval);
+	TEST_RUN(TestHandles);
+	TEST_RUN(TestQuit);
+
+	return TestResult();
+}
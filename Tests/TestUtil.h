@@ -0,0 +1,181 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Helpers shared by the tests and benchmarks: checks, timing and threads.
+//
+
+#ifndef WNDLIB_TESTS_TESTUTIL_H
+#define WNDLIB_TESTS_TESTUTIL_H
+
+#include "WndLibBase.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#include <process.h>
+#else
+	#include <pthread.h>
+#endif
+
+//
+// Checks
+//
+
+// The number of failed checks, returned by main.
+static int testFailures = 0;
+
+#define TEST_CHECK(_Condition) \
+	do \
+	{ \
+		if (! (_Condition)) \
+		{ \
+			printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #_Condition); \
+			++testFailures; \
+		} \
+	} \
+	while (0)
+
+// Run a test function, printing its name.
+#define TEST_RUN(_Function) \
+	do \
+	{ \
+		printf("%s\n", #_Function); \
+		_Function(); \
+	} \
+	while (0)
+
+inline int TestResult()
+{
+	if (testFailures)
+		printf("%d check(s) failed\n", testFailures);
+	else
+		printf("All checks passed\n");
+
+	return testFailures ? 1 : 0;
+}
+
+//
+// Benchmarks
+//
+
+// Benchmarks run a much shorter version of themselves when passed --quick,
+// which is how the test suite runs them.
+inline bool IsQuickRun(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--quick") == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// Seconds since some fixed point.
+inline double GetSeconds()
+{
+	#ifdef _WIN32
+		LARGE_INTEGER frequency, counter;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&counter);
+		return (double) counter.QuadPart / (double) frequency.QuadPart;
+	#else
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+	#endif
+}
+
+//
+// Threads
+//
+
+class TestThread
+{
+public:
+
+	typedef void (*Function)(void *param);
+
+	TestThread() :
+		_function(NULL),
+		_param(NULL)
+	{
+		#ifdef _WIN32
+			_thread = NULL;
+		#else
+			_started = false;
+		#endif
+	}
+
+	~TestThread()
+	{
+		Join();
+	}
+
+	bool Start(Function function, void *param)
+	{
+		_function = function;
+		_param = param;
+
+		#ifdef _WIN32
+			_thread = (HANDLE) _beginthreadex(NULL, 0, &StaticThreadProc, this, 0, NULL);
+			return _thread != NULL;
+		#else
+			_started = pthread_create(&_thread, NULL, &StaticThreadProc, this) == 0;
+			return _started;
+		#endif
+	}
+
+	void Join()
+	{
+		#ifdef _WIN32
+			if (_thread)
+			{
+				WaitForSingleObject(_thread, INFINITE);
+				CloseHandle(_thread);
+				_thread = NULL;
+			}
+		#else
+			if (_started)
+			{
+				pthread_join(_thread, NULL);
+				_started = false;
+			}
+		#endif
+	}
+
+private:
+
+	#ifdef _WIN32
+		static unsigned __stdcall StaticThreadProc(void *param)
+		{
+			TestThread *thread = (TestThread *) param;
+			thread->_function(thread->_param);
+			return 0;
+		}
+
+		HANDLE _thread;
+	#else
+		static void *StaticThreadProc(void *param)
+		{
+			TestThread *thread = (TestThread *) param;
+			thread->_function(thread->_param);
+			return NULL;
+		}
+
+		pthread_t _thread;
+		bool _started;
+	#endif
+
+	Function _function;
+	void *_param;
+
+	// Not copyable.
+	TestThread(const TestThread &);
+	TestThread &operator=(const TestThread &);
+};
+
+#endif
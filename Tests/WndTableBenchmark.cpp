@@ -0,0 +1,195 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// Compares Wnd::FindWnd's WndTable against the std::map behind a
+// CriticalSection that it replaced, with 10,000 to 100,000 live windows, a
+// varying number of reader threads and optionally a thread creating and
+// destroying windows at the same time.
+//
+
+#include "TestUtil.h"
+#include "WndTable.h"
+#include <map>
+#include <vector>
+
+using namespace WndLib;
+
+namespace
+{
+	//
+	// The old lookup, as FindWnd used to do it.
+	//
+
+	class LockedMap
+	{
+	public:
+
+		void Insert(HWND hwnd, Wnd *wnd)
+		{
+			CriticalSection::ScopedLock lock(_lock);
+			_map[hwnd] = wnd;
+		}
+
+		void Remove(HWND hwnd)
+		{
+			CriticalSection::ScopedLock lock(_lock);
+			_map.erase(hwnd);
+		}
+
+		Wnd *Find(HWND hwnd)
+		{
+			CriticalSection::ScopedLock lock(_lock);
+			return _map[hwnd];
+		}
+
+	private:
+
+		std::map<HWND, Wnd *> _map;
+		CriticalSection _lock;
+	};
+
+	//
+	// Benchmark
+	//
+
+	// HWNDs are multiples of 4 handed out in roughly increasing order, which is
+	// what the window manager does, so fake them the same way.
+	inline HWND MakeHandle(size_t index)
+	{
+		return (HWND) (UINT_PTR) (0x10000 + index * 4);
+	}
+
+	inline Wnd *MakeWnd(size_t index)
+	{
+		return (Wnd *) (UINT_PTR) (0x1000000 + index * 16);
+	}
+
+	template<typename Map>
+	struct RunState
+	{
+		Map *map;
+		size_t windows;
+		size_t lookups;
+		volatile LONG stop;
+		volatile LONG failures;
+	};
+
+	template<typename Map>
+	void ReaderThread(void *param)
+	{
+		RunState<Map> *state = (RunState<Map> *) param;
+
+		// A cheap LCG so every thread probes a different sequence of windows.
+		ULONG_PTR seed = (ULONG_PTR) GetCurrentThreadId() * 2654435761u;
+		LONG failures = 0;
+
+		for (size_t i = 0; i != state->lookups; ++i)
+		{
+			seed = seed * 1103515245u + 12345u;
+			size_t index = (size_t) (seed >> 8) % state->windows;
+
+			if (state->map->Find(MakeHandle(index)) != MakeWnd(index))
+				++failures;
+		}
+
+		InterlockedExchangeAdd(&state->failures, failures);
+	}
+
+	// Creates and destroys windows above the live range until told to stop, so
+	// that readers contend with writers and with resizes.
+	template<typename Map>
+	void ChurnThread(void *param)
+	{
+		RunState<Map> *state = (RunState<Map> *) param;
+
+		size_t next = state->windows;
+
+		while (! state->stop)
+		{
+			for (size_t i = 0; i != 64; ++i)
+				state->map->Insert(MakeHandle(next + i), MakeWnd(next + i));
+
+			for (size_t i = 0; i != 64; ++i)
+				state->map->Remove(MakeHandle(next + i));
+
+			next += 64;
+		}
+	}
+
+	template<typename Map>
+	double Run(size_t windows, int readers, size_t lookups, bool churn)
+	{
+		Map map;
+
+		for (size_t i = 0; i != windows; ++i)
+			map.Insert(MakeHandle(i), MakeWnd(i));
+
+		RunState<Map> state;
+		state.map = &map;
+		state.windows = windows;
+		state.lookups = lookups;
+		state.stop = 0;
+		state.failures = 0;
+
+		TestThread churnThread;
+		if (churn)
+			churnThread.Start(&ChurnThread<Map>, &state);
+
+		std::vector<TestThread *> threads(readers);
+
+		double start = GetSeconds();
+
+		for (int i = 0; i != readers; ++i)
+		{
+			threads[i] = new TestThread;
+			threads[i]->Start(&ReaderThread<Map>, &state);
+		}
+
+		for (int i = 0; i != readers; ++i)
+		{
+			threads[i]->Join();
+			delete threads[i];
+		}
+
+		double elapsed = GetSeconds() - start;
+
+		InterlockedExchange(&state.stop, 1);
+		churnThread.Join();
+
+		TEST_CHECK(state.failures == 0);
+
+		// Nanoseconds per lookup, as seen by each reader.
+		return elapsed * 1e9 / (double) lookups;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool quick = IsQuickRun(argc, argv);
+
+	static const size_t windowCounts[] = { 10000, 100000 };
+	static const int readerCounts[] = { 1, 4 };
+	size_t lookups = quick ? 20000 : 5000000;
+
+	printf("%-8s %-8s %-6s %14s %14s\n", "windows", "readers", "churn", "map ns/lookup", "table ns/lookup");
+
+	for (size_t w = 0; w != WNDLIB_COUNTOF(windowCounts); ++w)
+	{
+		for (size_t r = 0; r != WNDLIB_COUNTOF(readerCounts); ++r)
+		{
+			for (int churn = 0; churn != 2; ++churn)
+			{
+				double mapTime = Run<LockedMap>(windowCounts[w], readerCounts[r], lookups, churn != 0);
+				double tableTime = Run<Private::WndTable>(windowCounts[w], readerCounts[r], lookups, churn != 0);
+
+				printf("%-8u %-8d %-6s %14.1f %14.1f\n", (unsigned) windowCounts[w], readerCounts[r],
+					churn ? "yes" : "no", mapTime, tableTime);
+			}
+		}
+	}
+
+	return TestResult();
+}
@@ -0,0 +1,134 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#include "WmTable.h"
+#include <algorithm>
+
+namespace WndLib
+{
+	//
+	// WmTable
+	//
+
+	namespace Private
+	{
+		static bool WmTableEntryLess(const WmTableEntry &a, const WmTableEntry &b)
+		{
+			if (a.kind != b.kind)
+				return a.kind < b.kind;
+
+			return a.id < b.id;
+		}
+
+		static const WmTableEntry *WmTableSearch(const WmTableEntry *entries, size_t count, UINT kind, UINT id)
+		{
+			WmTableEntry key;
+			key.kind = kind;
+			key.id = id;
+
+			const WmTableEntry *end = entries + count;
+			const WmTableEntry *found = std::lower_bound(entries, end, key, &WmTableEntryLess);
+
+			if (found == end || found->kind != kind || found->id != id)
+				return NULL;
+
+			return found;
+		}
+
+		void WmTable::Prepare()
+		{
+			if (InterlockedCompareExchange(&state, WMTABLE_STATE_SORTING, WMTABLE_STATE_UNSORTED) != WMTABLE_STATE_UNSORTED)
+			{
+				// Another thread got here first.
+				while (state != WMTABLE_STATE_READY)
+					Sleep(0);
+
+				return;
+			}
+
+			// Stable, so the first of any duplicates still wins.
+			std::stable_sort(entries, entries + count, &WmTableEntryLess);
+
+			WmTable *base = flatten ? (*getBaseTable)() : NULL;
+			if (base && base->state != WMTABLE_STATE_READY)
+				base->Prepare();
+
+			if (! base || ! base->flatten)
+			{
+				// Our base class's WndProc has to be called to do whatever it does.
+				flattened = entries;
+				flattenedCount = count;
+				fallback = baseWndProc;
+			}
+			else
+			{
+				// Our entries go first so they win over the base's after the
+				// stable sort. This is built once per class and never freed.
+				size_t total = count + base->flattenedCount;
+				WmTableEntry *merged = new WmTableEntry[total ? total : 1];
+
+				std::copy(entries, entries + count, merged);
+
+				for (size_t i = 0; i != base->flattenedCount; ++i)
+				{
+					merged[count + i] = base->flattened[i];
+					++merged[count + i].level;
+				}
+
+				std::stable_sort(merged, merged + total, &WmTableEntryLess);
+
+				flattened = merged;
+				flattenedCount = total;
+				fallback = base->fallback;
+			}
+
+			InterlockedExchange(&state, WMTABLE_STATE_READY);
+		}
+
+		const WmTableEntry *WmTable::Find(const WmTableEntry *entries, size_t count,
+			UINT msg, WPARAM wparam, LPARAM lparam)
+		{
+			const WmTableEntry *entry = WmTableSearch(entries, count, WMTABLE_MESSAGE, msg);
+			const WmTableEntry *specific = NULL;
+
+			if (msg == WM_COMMAND)
+				specific = WmTableSearch(entries, count, WMTABLE_COMMAND, LOWORD(wparam));
+			else if (msg == WM_NOTIFY)
+				specific = WmTableSearch(entries, count, WMTABLE_NOTIFY, ((const NMHDR *) lparam)->code);
+
+			if (specific && (! entry || specific->level <= entry->level))
+				return specific;
+
+			return entry;
+		}
+
+		bool WmTable::Dispatch(Wnd *wnd, UINT msg, WPARAM wparam, LPARAM lparam, LRESULT *result)
+		{
+			if (state != WMTABLE_STATE_READY)
+				Prepare();
+
+			const WmTableEntry *entry = Find(entries, count, msg, wparam, lparam);
+			if (! entry)
+				return false;
+
+			*result = (*entry->handler)(wnd, msg, wparam, lparam);
+			return true;
+		}
+
+		LRESULT WmTable::DispatchFlattened(Wnd *wnd, UINT msg, WPARAM wparam, LPARAM lparam)
+		{
+			if (state != WMTABLE_STATE_READY)
+				Prepare();
+
+			const WmTableEntry *entry = Find(flattened, flattenedCount, msg, wparam, lparam);
+			if (! entry)
+				return (*fallback)(wnd, msg, wparam, lparam);
+
+			return (*entry->handler)(wnd, msg, wparam, lparam);
+		}
+	}
+}
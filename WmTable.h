@@ -0,0 +1,325 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_WMTABLE_H
+#define WNDLIB_WMTABLE_H
+
+#include "WndLibBase.h"
+#include <stddef.h>
+
+namespace WndLib
+{
+	//
+	// Message handling macros
+	//
+	// Example:
+	//
+	// // In the header file:
+	//
+	// class MyWnd : public BaseClassWnd
+	// {
+	//     WND_WM_DECLARE(MyWnd, BaseClassWnd)
+	//     WND_WM_FUNC(OnCreate)
+	//     WND_WM_FUNC(OnPaint)
+	//     ...
+	// public:
+	//     ... remaining declarations go here ...
+	// }
+	//
+	// // In the source file:
+	//
+	// WND_WM_BEGIN(MyWnd, BaseClassWnd)
+	//     WND_WM(WM_CREATE, OnCreate)
+	//     WND_WM(WM_PAINT, OnPaint)
+	//     ...
+	//     WND_WM_COMMAND(ID_HELP_ABOUT, OnHelpAbout)
+	//     WND_WM_NOTIFY(NM_CUSTOMDRAW, OnCustomDraw)
+	// WND_WM_END()
+	//
+
+	#define WND_WM_DECLARE(_Class, _BaseClass) \
+		private: \
+			bool WmDispatch(UINT msg, WPARAM wparam, LPARAM lparam, LRESULT *result); \
+		public: \
+			typedef _Class WmClass; \
+			static WndLib::Private::WmTable *WmGetTable(); \
+			virtual LRESULT WndProc(UINT msg, WPARAM wparam, LPARAM lparam); \
+			inline LRESULT BaseWndProc(UINT msg, WPARAM wparam, LPARAM lparam) \
+			{ \
+				return _BaseClass::WndProc(msg, wparam, lparam); \
+			} \
+		private:
+
+	// Use this to define the WmDispatch method without defining WndProc.
+	// This allows you to write your own WndProc and dispatch via the message
+	// table only when needed.
+	#define WND_WM_BEGIN_NO_WNDPROC(_Class, _BaseClass) \
+		WndLib::Private::WmTable *_Class::WmGetTable() \
+		{ \
+			return NULL; \
+		} \
+		bool _Class::WmDispatch(UINT msg, WPARAM wparam, LPARAM lparam, LRESULT *result) \
+		{ \
+			(void) msg; \
+			(void) wparam; \
+			(void) lparam; \
+			(void) result; \
+
+	#define WND_WM_BEGIN(_Class, _BaseClass) \
+		LRESULT _Class::WndProc(UINT msg, WPARAM wparam, LPARAM lparam) \
+		{ \
+			LRESULT result; \
+			if (! WmDispatch(msg, wparam, lparam, &result)) \
+				result = BaseWndProc(msg, wparam, lparam); \
+			return result; \
+		} \
+		WND_WM_BEGIN_NO_WNDPROC(_Class, _BaseClass)
+
+	#define WND_WM(_Msg, _Func) \
+		if (msg == (_Msg)) \
+		{ \
+			*result = _Func(msg, wparam, lparam); \
+			return true; \
+		}
+
+	#define WND_WM_COMMAND(_Cmd, _Func) \
+		if (msg == WM_COMMAND && LOWORD(wparam) == (_Cmd)) \
+		{ \
+			*result = _Func(msg, wparam, lparam); \
+			return true; \
+		}
+
+	#define WND_WM_NOTIFY(_NotifyCode, _Func) \
+		if (msg == WM_NOTIFY) \
+		{ \
+			if (((const NMHDR *) lparam)->code == (_NotifyCode)) \
+			{ \
+				*result = _Func(msg, wparam, lparam); \
+				return true; \
+			} \
+		}
+
+	#define WND_WM_END() \
+			return false; \
+		}
+
+	#define WND_WM_FUNC(_Name) LRESULT _Name(UINT msg, WPARAM wparam, LPARAM lparam);
+
+	//
+	// Message table macros
+	//
+	//
+	// WND_WM_TABLE_BEGIN and WND_WM_TABLE_END are used in place of WND_WM_BEGIN
+	// and WND_WM_END to build a static table of handlers instead of a chain of
+	// if statements. The table is sorted the first time it's used and then
+	// binary searched, so dispatch cost grows with log2 of the number of
+	// handlers. Use these for windows with many handlers. The header side is
+	// the same (WND_WM_DECLARE and WND_WM_FUNC).
+	//
+	// WND_WM_TABLE_BEGIN(MyWnd, BaseClassWnd)
+	//     WND_WM_TABLE(WM_CREATE, OnCreate)
+	//     WND_WM_TABLE(WM_PAINT, OnPaint)
+	//     ...
+	//     WND_WM_TABLE_COMMAND(ID_HELP_ABOUT, OnHelpAbout)
+	//     WND_WM_TABLE_NOTIFY(NM_CUSTOMDRAW, OnCustomDraw)
+	// WND_WM_TABLE_END()
+	//
+	// Unlike the if chain, order doesn't matter except between duplicates (the
+	// first wins), and WND_WM_TABLE_COMMAND and WND_WM_TABLE_NOTIFY handlers are
+	// always tried before a WND_WM_TABLE(WM_COMMAND) or WND_WM_TABLE(WM_NOTIFY).
+	//
+	// The first time a class defined with WND_WM_TABLE_BEGIN receives a message,
+	// its entries are merged with those of every base class that also uses
+	// WND_WM_TABLE_BEGIN, so any message is resolved with one lookup however
+	// deep the hierarchy. Messages nobody handles go straight to the WndProc of
+	// the nearest base class that isn't table driven (Wnd::WndProc, which calls
+	// DefWindowProc or the subclassed window procedure, if they all are).
+	// BaseWndProc still works as before.
+	//
+
+	class Wnd;
+
+	namespace Private
+	{
+		typedef LRESULT (*WmHandler)(Wnd *wnd, UINT msg, WPARAM wparam, LPARAM lparam);
+
+		// Calls a message handler of a Wnd subclass through a plain function pointer.
+		template<class _Class, LRESULT (_Class::*_Func)(UINT, WPARAM, LPARAM)>
+		LRESULT WmThunk(Wnd *wnd, UINT msg, WPARAM wparam, LPARAM lparam)
+		{
+			return (static_cast<_Class *>(wnd)->*_Func)(msg, wparam, lparam);
+		}
+
+		// The sub-tables, in sort order.
+		enum WmTableKind
+		{
+			WMTABLE_MESSAGE,
+			WMTABLE_COMMAND,
+			WMTABLE_NOTIFY,
+			WMTABLE_END
+		};
+
+		// Calls _Class::WndProc without going through the vtable.
+		template<class _Class>
+		LRESULT WmWndProcThunk(Wnd *wnd, UINT msg, WPARAM wparam, LPARAM lparam)
+		{
+			return static_cast<_Class *>(wnd)->_Class::WndProc(msg, wparam, lparam);
+		}
+
+		struct WmTableEntry
+		{
+			UINT kind;
+
+			// The message, command ID or notification code.
+			UINT id;
+
+			WmHandler handler;
+
+			// How many classes up the hierarchy the handler was declared. A
+			// derived class's WND_WM_TABLE(WM_COMMAND) beats a base class's
+			// WND_WM_TABLE_COMMAND, as it would have before flattening.
+			UINT level;
+		};
+
+		// WmTable::state
+		enum
+		{
+			WMTABLE_STATE_UNSORTED,
+			WMTABLE_STATE_SORTING,
+			WMTABLE_STATE_READY
+		};
+
+		// This is an aggregate so the macros can initialise it statically.
+		struct WNDLIB_EXPORT WmTable
+		{
+			// The class's own entries.
+			WmTableEntry *entries;
+			size_t count;
+
+			// True if the class's WndProc dispatches through the flattened table.
+			bool flatten;
+
+			// Returns the base class's table, or NULL if it doesn't have one.
+			WmTable *(*getBaseTable)();
+
+			// Calls the base class's WndProc.
+			WmHandler baseWndProc;
+
+			volatile LONG state;
+
+			// The following are filled in by Prepare.
+
+			// The class's entries merged with its base classes'.
+			WmTableEntry *flattened;
+			size_t flattenedCount;
+
+			// Where the flattened table sends messages it doesn't handle.
+			WmHandler fallback;
+
+			// Dispatch using only the class's own entries. Returns false if none
+			// handles the message.
+			bool Dispatch(Wnd *wnd, UINT msg, WPARAM wparam, LPARAM lparam, LRESULT *result);
+
+			// Dispatch using the flattened table.
+			LRESULT DispatchFlattened(Wnd *wnd, UINT msg, WPARAM wparam, LPARAM lparam);
+
+			// Sort the entries and build the flattened table, if another thread
+			// hasn't already.
+			void Prepare();
+
+			static const WmTableEntry *Find(const WmTableEntry *entries, size_t count,
+				UINT msg, WPARAM wparam, LPARAM lparam);
+		};
+
+		template<class _A, class _B>
+		struct WmSameClass
+		{
+			enum { value = 0 };
+		};
+
+		template<class _A>
+		struct WmSameClass<_A, _A>
+		{
+			enum { value = 1 };
+		};
+
+		// Returns _Class's table if _Class used WND_WM_DECLARE itself (otherwise
+		// _Class::WmGetTable would be an ancestor's).
+		template<class _Class, int _HasOwnTable>
+		struct WmBaseTable
+		{
+			static WmTable *Get()
+			{
+				return NULL;
+			}
+		};
+
+		template<class _Class>
+		struct WmBaseTable<_Class, 1>
+		{
+			static WmTable *Get()
+			{
+				return _Class::WmGetTable();
+			}
+		};
+	}
+
+	// Used by WND_WM_TABLE_BEGIN and WND_WM_TABLE_BEGIN_NO_WNDPROC.
+	#define WND_WM_TABLE_BEGIN_ENTRIES(_Class, _BaseClass, _Flatten) \
+		bool _Class::WmDispatch(UINT msg, WPARAM wparam, LPARAM lparam, LRESULT *result) \
+		{ \
+			return WmGetTable()->Dispatch(this, msg, wparam, lparam, result); \
+		} \
+		WndLib::Private::WmTable *_Class::WmGetTable() \
+		{ \
+			typedef _Class WmThisClass; \
+			typedef _BaseClass WmBaseClass; \
+			enum { wmFlatten = (_Flatten) }; \
+			static WndLib::Private::WmTableEntry wmEntries[] = \
+			{
+
+	// Use this to define WmDispatch without defining WndProc, as with
+	// WND_WM_BEGIN_NO_WNDPROC. Derived classes won't merge this table in to
+	// theirs, since WndProc may do anything.
+	#define WND_WM_TABLE_BEGIN_NO_WNDPROC(_Class, _BaseClass) \
+		WND_WM_TABLE_BEGIN_ENTRIES(_Class, _BaseClass, false)
+
+	#define WND_WM_TABLE_BEGIN(_Class, _BaseClass) \
+		LRESULT _Class::WndProc(UINT msg, WPARAM wparam, LPARAM lparam) \
+		{ \
+			return WmGetTable()->DispatchFlattened(this, msg, wparam, lparam); \
+		} \
+		WND_WM_TABLE_BEGIN_ENTRIES(_Class, _BaseClass, true)
+
+	#define WND_WM_TABLE(_Msg, _Func) \
+				{ WndLib::Private::WMTABLE_MESSAGE, (UINT) (_Msg), \
+					&WndLib::Private::WmThunk<WmThisClass, &WmThisClass::_Func>, 0 },
+
+	#define WND_WM_TABLE_COMMAND(_Cmd, _Func) \
+				{ WndLib::Private::WMTABLE_COMMAND, (UINT) (_Cmd), \
+					&WndLib::Private::WmThunk<WmThisClass, &WmThisClass::_Func>, 0 },
+
+	#define WND_WM_TABLE_NOTIFY(_NotifyCode, _Func) \
+				{ WndLib::Private::WMTABLE_NOTIFY, (UINT) (_NotifyCode), \
+					&WndLib::Private::WmThunk<WmThisClass, &WmThisClass::_Func>, 0 },
+
+	#define WND_WM_TABLE_END() \
+				{ WndLib::Private::WMTABLE_END, 0, 0, 0 } \
+			}; \
+			static WndLib::Private::WmTable wmTable = \
+			{ \
+				wmEntries, WNDLIB_COUNTOF(wmEntries) - 1, wmFlatten != 0, \
+				&WndLib::Private::WmBaseTable<WmBaseClass, \
+					WndLib::Private::WmSameClass<WmBaseClass::WmClass, WmBaseClass>::value>::Get, \
+				&WndLib::Private::WmWndProcThunk<WmBaseClass>, \
+				0, NULL, 0, NULL \
+			}; \
+			return &wmTable; \
+		}
+}
+
+#endif
@@ -1,6 +1,8 @@
 #include "WndLib.h"
+#include "CreationSlot.h"
 #include <memory>
 #include <algorithm>
+#include <vector>
 #include <ShlObj.h>
 #include <commdlg.h>
 
@@ -338,8 +340,129 @@ namespace WndLib
 	// Utility functions
 	//
 
+	// Bumped by Wnd::InvalidateFilterChains, which invalidates the filter chain
+	// caches of every thread.
+	static volatile LONG filterChainGeneration = 0;
+
+	namespace Private
+	{
+		// The Wnds FilterMessage calls for a window: the window's own Wnd, if any,
+		// followed by those of its mapped ancestors.
+		struct FilterChain
+		{
+			enum { MAX_WNDS = 15 };
+
+			HWND hwnd;
+
+			// Used to spot the window being reparented, or its handle being reused.
+			HWND parent;
+
+			Wnd *target;
+			size_t count;
+			Wnd *wnds[MAX_WNDS];
+		};
+
+		// Each message pumping thread has a small direct mapped cache of chains, so
+		// the common case is a single lookup that takes no locks. These are never
+		// freed, since a thread can't be told about its own exit.
+		struct FilterChainCache
+		{
+			enum { SIZE = 16 };
+
+			LONG generation;
+			FilterChain chains[SIZE];
+		};
+
+		static ThreadLocalPointer filterChainCache;
+
+		// Returns NULL if the chain is too long to cache.
+		const FilterChain *GetFilterChain(HWND hwnd)
+		{
+			FilterChainCache *cache = (FilterChainCache *) filterChainCache.Get();
+			if (! cache)
+			{
+				cache = new FilterChainCache;
+				memset(cache, 0, sizeof(*cache));
+				filterChainCache.Set(cache);
+			}
+
+			LONG generation = filterChainGeneration;
+			if (cache->generation != generation)
+			{
+				memset(cache->chains, 0, sizeof(cache->chains));
+				cache->generation = generation;
+			}
+
+			FilterChain *chain = &cache->chains[((UINT_PTR) hwnd >> 2) % FilterChainCache::SIZE];
+			HWND parent = GetParent(hwnd);
+
+			// Mapping and unmapping a window's own Wnd doesn't invalidate the
+			// caches, so check it's still the same.
+			Wnd *target = Wnd::FindWnd(hwnd);
+
+			if (chain->hwnd == hwnd && chain->parent == parent && chain->target == target)
+				return chain;
+
+			chain->hwnd = NULL;
+			chain->parent = parent;
+			chain->target = target;
+			chain->count = 0;
+
+			if (chain->target)
+				chain->wnds[chain->count++] = chain->target;
+
+			for (HWND ancestor = parent; ancestor; ancestor = GetParent(ancestor))
+			{
+				if (Wnd *found = Wnd::FindWnd(ancestor))
+				{
+					if (chain->count == FilterChain::MAX_WNDS)
+						return NULL;
+
+					// Unmap only invalidates the caches for Wnds marked as ancestors.
+					// If it unmapped this one before seeing the mark, FindWnd no
+					// longer finds it.
+					if (! found->_filterChainAncestor)
+					{
+						InterlockedExchange(&found->_filterChainAncestor, 1);
+						if (Wnd::FindWnd(ancestor) != found)
+							return NULL;
+					}
+
+					chain->wnds[chain->count++] = found;
+				}
+			}
+
+			chain->hwnd = hwnd;
+			return chain;
+		}
+	}
+
 	bool FilterMessage(MSG *msg)
 	{
+		if (const Private::FilterChain *cached = Private::GetFilterChain(msg->hwnd))
+		{
+			// A filter can pump messages (e.g., run a modal dialog), which can
+			// reuse the cache entry, so work from a copy. If a filter destroys
+			// any of the ancestors, the rest of the chain can't be trusted.
+			Private::FilterChain chain = *cached;
+			LONG generation = filterChainGeneration;
+
+			for (size_t i = 0; i != chain.count; ++i)
+			{
+				if (chain.wnds[i]->FilterMessage(msg))
+					return true;
+
+				if (filterChainGeneration != generation)
+					return false;
+			}
+
+			// Destroying the target doesn't invalidate the caches.
+			if (chain.target && Wnd::FindWnd(msg->hwnd) == chain.target)
+				return chain.target->PreTranslateMessage(msg);
+
+			return false;
+		}
+
 		Wnd *target = Wnd::FindWnd(msg->hwnd);
 		if (target && target->FilterMessage(msg))
 			return true;
@@ -366,6 +489,89 @@ namespace WndLib
 		return false;
 	}
 
+	//
+	// MessageLoop
+	//
+
+	MessageLoop::MessageLoop()
+	{
+	}
+
+	MessageLoop::~MessageLoop()
+	{
+	}
+
+	int MessageLoop::Run()
+	{
+		while (RunOnce(INFINITE))
+		{
+		}
+
+		return GetExitCode();
+	}
+
+	bool MessageLoop::RunOnce(DWORD timeout)
+	{
+		// MWMO_INPUTAVAILABLE makes this return if there are messages in the queue
+		// that have already been seen, e.g., left behind when the budget ran out.
+		DWORD count = GetHandleCount();
+		DWORD result = MsgWaitForMultipleObjectsEx(count, GetHandles(),
+			GetWaitTimeout(timeout), QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+
+		if (result >= WAIT_OBJECT_0 && result < WAIT_OBJECT_0 + count)
+			CallHandleHandler(result - WAIT_OBJECT_0);
+		else if (result >= WAIT_ABANDONED_0 && result < WAIT_ABANDONED_0 + count)
+			CallHandleHandler(result - WAIT_ABANDONED_0);
+
+		bool outOfTime;
+		if (! DispatchMessages(&outOfTime))
+			return false;
+
+		EndIteration(outOfTime);
+		return true;
+	}
+
+	bool MessageLoop::DispatchMessages(bool *outOfTime)
+	{
+		*outOfTime = false;
+
+		DWORD start = GetTickCount();
+
+		MSG msg;
+		while (::PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+		{
+			if (msg.message == WM_QUIT)
+			{
+				SetExitCode((int) msg.wParam);
+				return false;
+			}
+
+			if (! FilterMessage(&msg))
+			{
+				TranslateMessage(&msg);
+				DispatchMessage(&msg);
+			}
+
+			if (IsOutOfTime(start, GetTickCount()))
+			{
+				// WM_PAINT is only generated when the queue is otherwise empty, so
+				// ask for it explicitly. Bounded in case a window never validates.
+				for (int paints = 0; paints != 64; ++paints)
+				{
+					if (! ::PeekMessage(&msg, NULL, WM_PAINT, WM_PAINT, PM_REMOVE))
+						break;
+
+					DispatchMessage(&msg);
+				}
+
+				*outOfTime = true;
+				return true;
+			}
+		}
+
+		return true;
+	}
+
 	void CentreWindow(HWND parent, HWND child)
 	{
 		RECT rparent;
@@ -608,15 +814,133 @@ namespace WndLib
 		
 	}
 
+	//
+	// WmTable
+	//
+
+	namespace Private
+	{
+		static WmTableEntry wndWmEntries[] =
+		{
+			{ WMTABLE_END, 0, 0, 0 }
+		};
+
+		static WmTable *WndNoBaseTable()
+		{
+			return NULL;
+		}
+
+		static WmTable wndWmTable =
+		{
+			wndWmEntries, 0, true,
+			&WndNoBaseTable,
+			&WmWndProcThunk<Wnd>,
+			WMTABLE_STATE_READY, wndWmEntries, 0, &WmWndProcThunk<Wnd>
+		};
+	}
+
 	//
 	// Wnd
 	//
 
-	Wnd::WndMap Wnd::wndMap;
-	CriticalSection Wnd::mapLock;
+	Private::WndTable Wnd::wndTable;
+
+	#ifdef WNDLIB_PROFILE_DISPATCH
+		#define WNDLIB_PROFILE_DISPATCH_BEGIN(_Wnd) \
+			LPCTSTR profileClassName = (_Wnd)->GetClassName(); \
+			LONGLONG profileStart = DispatchProfiler::Begin();
+		#define WNDLIB_PROFILE_DISPATCH_END(_Msg) \
+			DispatchProfiler::End(profileClassName, (_Msg), profileStart);
+	#else
+		#define WNDLIB_PROFILE_DISPATCH_BEGIN(_Wnd)
+		#define WNDLIB_PROFILE_DISPATCH_END(_Msg)
+	#endif
+
+	// Marks the invoke queue of a Wnd with no window. BeginInvoke fails rather
+	// than queue tasks that would never run.
+	static char invokeQueueClosedMarker;
+	static InvokeTask * const invokeQueueClosed = (InvokeTask *) &invokeQueueClosedMarker;
+
+	// The most tasks run for each wake up message, so that a flood of tasks
+	// can't starve input and painting.
+	static const int invokeBatchSize = 32;
+
+	static volatile UINT invokeMessage = 0;
+
+	static UINT GetInvokeMessage()
+	{
+		if (! invokeMessage)
+			invokeMessage = RegisterWindowMessage(TEXT("WndLib.Invoke"));
+
+		return invokeMessage;
+	}
+
+	// Wraps the caller's task for Wnd::Invoke, and signals when it's done.
+	class InvokeWaiter : public InvokeTask
+	{
+	public:
+
+		InvokeWaiter(InvokeTask *task) :
+			_task(task),
+			_ran(false)
+		{
+			_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+		}
+
+		~InvokeWaiter()
+		{
+			if (_event)
+				CloseHandle(_event);
+		}
+
+		bool Wait()
+		{
+			WaitForSingleObject(_event, INFINITE);
+			return _ran;
+		}
+
+		virtual void Run()
+		{
+			_task->Run();
+			_ran = true;
+		}
+
+		virtual void Release()
+		{
+			// The waiting thread may destroy us as soon as this is set.
+			SetEvent(_event);
+		}
+
+	private:
 
-	static Wnd *creatingWnd = 0;
-	static CriticalSection creationLock;
+		InvokeTask *_task;
+		HANDLE _event;
+		bool _ran;
+	};
+
+	static Private::CreationSlot creatingWnd;
+
+	// Window classes found or registered by CreateIndirect. atom is zero unless
+	// we registered the class.
+	struct CachedWndClass
+	{
+		ATOM atom;
+		WNDCLASSEX wc;
+	};
+
+	// Window class names aren't case sensitive.
+	struct WndClassNameLess
+	{
+		bool operator()(const TCharString &a, const TCharString &b) const
+		{
+			return lstrcmpi(a.c_str(), b.c_str()) < 0;
+		}
+	};
+
+	typedef std::map<TCharString, CachedWndClass, WndClassNameLess> WndClassCache;
+	static WndClassCache wndClassCache;
+	static CriticalSection wndClassCacheLock;
+	static Wnd::ClassCacheStats wndClassCacheStats;
 
 	Wnd::Wnd()
 	{
@@ -634,6 +958,10 @@ namespace WndLib
 		_hwnd = NULL;
 		_prevproc = NULL;
 		_selfDestruct = false;
+		_invokeQueue = invokeQueueClosed;
+		_invokeBacklog = NULL;
+		_invokeWakePending = 0;
+		_filterChainAncestor = 0;
 	}
 
 	Wnd::~Wnd()
@@ -781,23 +1109,19 @@ namespace WndLib
 		// Work out which DefWindowProc to use
 		_defWindowProc = GetDefWindowProc(cs);
 
+		LPCTSTR className = cs.lpszClass;
+
 		// Check the window class
 		if (cs.hInstance == GetHInstance())
 		{
 			WNDCLASSEX wc;
-			memset(&wc, 0, sizeof(wc));
-			wc.cbSize = sizeof(wc);
+			ATOM atom;
 
-			if (! GetClassInfoEx(cs.hInstance, cs.lpszClass, &wc))
-			{
-				// Need to register the class
-				GetWndClass(&wc);
-
-				wc.lpszClassName = GetClassName();
+			if (! FindWndClass(cs.lpszClass, &wc, &atom))
+				return false;
 
-				if (! RegisterClassEx(&wc))
-					return false;
-			}
+			if (atom)
+				className = MAKEINTATOM(atom);
 
 			if (wc.lpfnWndProc == &StaticWndProc)
 				attach = false;
@@ -805,7 +1129,7 @@ namespace WndLib
 
 		if (attach)
 		{
-			HWND hwnd = DoCreateWindowEx(cs.dwExStyle, cs.lpszClass, cs.lpszName, cs.style,
+			HWND hwnd = DoCreateWindowEx(cs.dwExStyle, className, cs.lpszName, cs.style,
 				cs.x, cs.y, cs.cx, cs.cy, cs.hwndParent, cs.hMenu, cs.hInstance,
 				cs.lpCreateParams);
 
@@ -821,16 +1145,13 @@ namespace WndLib
 		}
 		else
 		{
-			// CriticalSections are recursive mutexes, so our thread can create
-			// multiple window while holding the lock.
-			CriticalSection::ScopedLock lock(creationLock);
-			creatingWnd = this;
+			Wnd *previous = creatingWnd.Begin(this);
 
-			HWND hwnd = DoCreateWindowEx(cs.dwExStyle, cs.lpszClass, cs.lpszName, cs.style,
+			HWND hwnd = DoCreateWindowEx(cs.dwExStyle, className, cs.lpszName, cs.style,
 				cs.x, cs.y, cs.cx, cs.cy, cs.hwndParent, cs.hMenu, cs.hInstance,
 				cs.lpCreateParams);
 
-			if (creatingWnd != 0)
+			if (! creatingWnd.End(this, previous))
 			{
 				OutputDebugStringA(
 					"Wnd::CreateIndirect: failed to create window.\r\n");
@@ -848,13 +1169,116 @@ namespace WndLib
 		}
 	}
 
+	bool Wnd::FindWndClass(LPCTSTR className, WNDCLASSEX *wc, ATOM *atom)
+	{
+		*atom = 0;
+
+		// Atoms can't be cached by name.
+		bool cacheable = HIWORD((ULONG_PTR) className) != 0;
+
+		if (cacheable)
+		{
+			CriticalSection::ScopedLock lock(wndClassCacheLock);
+
+			WndClassCache::const_iterator found = wndClassCache.find(className);
+			if (found != wndClassCache.end())
+			{
+				*wc = found->second.wc;
+				*atom = found->second.atom;
+				++wndClassCacheStats.lookupsAvoided;
+
+				if (*atom)
+					++wndClassCacheStats.createdByAtom;
+
+				return true;
+			}
+		}
+
+		// The lock isn't held while looking up or registering the class, since
+		// RegisterClassEx can be slow. Two threads may both get here for the same
+		// class, in which case one registers it and the other finds it.
+		memset(wc, 0, sizeof(*wc));
+		wc->cbSize = sizeof(*wc);
+
+		ATOM registered = 0;
+		LONG lookups = 1;
+
+		if (! GetClassInfoEx(GetHInstance(), className, wc))
+		{
+			// Need to register the class
+			GetWndClass(wc);
+
+			wc->lpszClassName = GetClassName();
+
+			registered = RegisterClassEx(wc);
+			if (! registered)
+			{
+				// Another thread may have registered it since we looked.
+				if (GetLastError() != ERROR_CLASS_ALREADY_EXISTS)
+					return false;
+
+				memset(wc, 0, sizeof(*wc));
+				wc->cbSize = sizeof(*wc);
+
+				++lookups;
+
+				if (! GetClassInfoEx(GetHInstance(), className, wc))
+					return false;
+			}
+		}
+
+		CriticalSection::ScopedLock lock(wndClassCacheLock);
+
+		wndClassCacheStats.lookups += lookups;
+
+		if (registered)
+		{
+			++wndClassCacheStats.registrations;
+
+			// The atom can only stand in for className if that's the name we
+			// registered.
+			if (cacheable && lstrcmpi(className, wc->lpszClassName) == 0)
+			{
+				*atom = registered;
+				++wndClassCacheStats.createdByAtom;
+			}
+			else
+				cacheable = false;
+		}
+
+		if (cacheable)
+		{
+			CachedWndClass cached;
+			cached.atom = *atom;
+			cached.wc = *wc;
+
+			// If another thread cached the class while we weren't holding the
+			// lock, keep its entry, which has the atom if it registered it.
+			WndClassCache::iterator inserted = wndClassCache.insert(std::make_pair(TCharString(className), cached)).first;
+			inserted->second.wc.lpszClassName = inserted->first.c_str();
+		}
+
+		return true;
+	}
+
+	void Wnd::GetClassCacheStats(ClassCacheStats *stats)
+	{
+		CriticalSection::ScopedLock lock(wndClassCacheLock);
+		*stats = wndClassCacheStats;
+	}
+
+	void Wnd::FlushClassCache()
+	{
+		CriticalSection::ScopedLock lock(wndClassCacheLock);
+		wndClassCache.clear();
+	}
+
 	LRESULT WINAPI Wnd::StaticWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
 	{
 		Wnd *wnd = (Wnd *) HelpGetWindowPtr(hwnd, 0);
 		if (! wnd)
 		{
-			wnd = creatingWnd;
-			creatingWnd = NULL;
+			wnd = creatingWnd.Claim();
 
 			if (! wnd)
 			{
@@ -868,7 +1292,12 @@ namespace WndLib
 			wnd->_hwnd = hwnd;
 		}
 
+		if (HandleInvokeMessage(hwnd, wnd, msg))
+			return 0;
+
+		WNDLIB_PROFILE_DISPATCH_BEGIN(wnd)
 		LRESULT result = wnd->WndProc(msg, wparam, lparam);
+		WNDLIB_PROFILE_DISPATCH_END(msg)
 
 		if (msg == WM_NCDESTROY)
 		{
@@ -906,6 +1335,11 @@ namespace WndLib
 		return CreateIndirect(cs, subclass);
 	}
 
+	Private::WmTable *Wnd::WmGetTable()
+	{
+		return &Private::wndWmTable;
+	}
+
 	LRESULT Wnd::WndProc(UINT msg, WPARAM wparam, LPARAM lparam)
 	{
 		if (_prevproc)
@@ -928,30 +1362,193 @@ namespace WndLib
 
 	void Wnd::Map(HWND hwnd, Wnd *wnd)
 	{
-		CriticalSection::ScopedLock lock(mapLock);
-		wndMap[hwnd] = wnd;
+		wndTable.Insert(hwnd, wnd);
+
+		// A window being created has no children, so this is only needed when
+		// attaching to an existing window. The window's own cached chain is
+		// checked by GetFilterChain.
+		if (::GetWindow(hwnd, GW_CHILD))
+			InvalidateFilterChains();
+
+		wnd->OpenInvokeQueue();
 	}
 
 	void Wnd::Unmap(Wnd *wnd)
 	{
-		CriticalSection::ScopedLock lock(mapLock);
+		wndTable.Remove(wnd->GetHWnd());
+
+		// Pairs with GetFilterChain, which marks the Wnd and then checks it's
+		// still mapped.
+		if (InterlockedCompareExchange(&wnd->_filterChainAncestor, 0, 1))
+			InvalidateFilterChains();
+
+		wnd->CloseInvokeQueue();
+	}
+
+	void Wnd::InvalidateFilterChains()
+	{
+		InterlockedIncrement(&filterChainGeneration);
+	}
+
+	bool Wnd::BeginInvoke(InvokeTask *task)
+	{
+		// Read first, Unmap clears it.
+		HWND hwnd = _hwnd;
+
+		for (;;)
+		{
+			InvokeTask *head = _invokeQueue;
+			if (head == invokeQueueClosed || ! hwnd)
+			{
+				task->Release();
+				return false;
+			}
+
+			task->_next = head;
+
+			if (InterlockedCompareExchangePointer((PVOID volatile *) &_invokeQueue, task, head) == head)
+			{
+				WakeInvokeQueue(hwnd);
+				return true;
+			}
+		}
+	}
+
+	bool Wnd::Invoke(InvokeTask *task)
+	{
+		HWND hwnd = _hwnd;
+		if (! hwnd)
+			return false;
+
+		if (GetWindowThreadProcessId(hwnd, NULL) == GetCurrentThreadId())
+		{
+			task->Run();
+			return true;
+		}
+
+		InvokeWaiter waiter(task);
+
+		// If this fails, waiter has already been released.
+		BeginInvoke(&waiter);
+
+		return waiter.Wait();
+	}
+
+	void Wnd::OpenInvokeQueue()
+	{
+		InterlockedExchange(&_invokeWakePending, 0);
+		InterlockedCompareExchangePointer((PVOID volatile *) &_invokeQueue, NULL, invokeQueueClosed);
+	}
+
+	void Wnd::WakeInvokeQueue(HWND hwnd)
+	{
+		// Cheap check first, since most calls find a message already pending.
+		if (_invokeWakePending || InterlockedExchange(&_invokeWakePending, 1) != 0)
+			return;
+
+		// If the message can't be posted, let the next BeginInvoke try again.
+		if (! ::PostMessage(hwnd, GetInvokeMessage(), 0, 0))
+			InterlockedExchange(&_invokeWakePending, 0);
+	}
+
+	void Wnd::CloseInvokeQueue()
+	{
+		InvokeTask *queued = (InvokeTask *) InterlockedExchangePointer((PVOID volatile *) &_invokeQueue, invokeQueueClosed);
+		if (queued == invokeQueueClosed)
+			queued = NULL;
 
-		WndMap::iterator i = wndMap.find(wnd->GetHWnd());
-		if (i != wndMap.end())
-			wndMap.erase(i);
+		InvokeTask *lists[2] = { _invokeBacklog, queued };
+		_invokeBacklog = NULL;
+
+		for (size_t i = 0; i != WNDLIB_COUNTOF(lists); ++i)
+		{
+			while (InvokeTask *task = lists[i])
+			{
+				lists[i] = task->_next;
+				task->Release();
+			}
+		}
+	}
+
+	bool Wnd::HandleInvokeMessage(HWND hwnd, Wnd *wnd, UINT msg)
+	{
+		// RegisterWindowMessage only returns messages in this range, so this
+		// quickly rejects everything else.
+		if (msg < 0xc000 || msg != GetInvokeMessage())
+			return false;
+
+		// Cleared before taking the queue, so a task queued after that posts
+		// another message.
+		InterlockedExchange(&wnd->_invokeWakePending, 0);
+
+		// Take everything queued so far.
+		InvokeTask *taken;
+		for (;;)
+		{
+			taken = wnd->_invokeQueue;
+			if (taken == invokeQueueClosed)
+				return true;
+
+			if (InterlockedCompareExchangePointer((PVOID volatile *) &wnd->_invokeQueue, NULL, taken) == taken)
+				break;
+		}
+
+		// It's most recent first, so reverse it on to the end of the backlog.
+		InvokeTask *oldestFirst = NULL;
+		while (taken)
+		{
+			InvokeTask *next = taken->_next;
+			taken->_next = oldestFirst;
+			oldestFirst = taken;
+			taken = next;
+		}
+
+		InvokeTask **tail = &wnd->_invokeBacklog;
+		while (*tail)
+			tail = &(*tail)->_next;
+
+		*tail = oldestFirst;
+
+		for (int i = 0; i != invokeBatchSize; ++i)
+		{
+			InvokeTask *task = wnd->_invokeBacklog;
+			if (! task)
+				return true;
+
+			wnd->_invokeBacklog = task->_next;
+			task->_next = NULL;
+
+			task->Run();
+			task->Release();
+
+			// The task may have destroyed the window, or detached or deleted the
+			// Wnd, in which case the rest of the backlog has been released.
+			if (FindWnd(hwnd) != wnd)
+				return true;
+		}
+
+		// Let other messages through before running the rest.
+		if (wnd->_invokeBacklog)
+			wnd->WakeInvokeQueue(hwnd);
+
+		return true;
 	}
 
 	Wnd *Wnd::FindWnd(HWND hwnd)
 	{
-		CriticalSection::ScopedLock lock(mapLock);
-		return wndMap[hwnd];
+		return wndTable.Find(hwnd);
 	}
 
 	LRESULT WINAPI Wnd::SubclassWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
 	{
 		if (Wnd *wnd = FindWnd(hwnd))
 		{
+			if (HandleInvokeMessage(hwnd, wnd, msg))
+				return 0;
+
+			WNDLIB_PROFILE_DISPATCH_BEGIN(wnd)
 			LRESULT result = wnd->WndProc(msg, wparam, lparam);
+			WNDLIB_PROFILE_DISPATCH_END(msg)
 
 			if (msg == WM_NCDESTROY)
 			{
@@ -1108,10 +1705,10 @@ namespace WndLib
 	// MainWnd
 	//
 
-	WND_WM_BEGIN(MainWnd, Wnd)
-		WND_WM(WM_CLOSE, OnClose)
-		WND_WM(WM_DESTROY, OnDestroy)
-	WND_WM_END()
+	WND_WM_TABLE_BEGIN(MainWnd, Wnd)
+		WND_WM_TABLE(WM_CLOSE, OnClose)
+		WND_WM_TABLE(WM_DESTROY, OnDestroy)
+	WND_WM_TABLE_END()
 
 	LRESULT MainWnd::OnClose(UINT, WPARAM, LPARAM)
 	{
@@ -1489,10 +2086,15 @@ namespace WndLib
 		if (! wnd)
 			return FALSE;
 
+		if (HandleInvokeMessage(hwnd, wnd, msg))
+			return TRUE;
+
 		if (msg == WM_DESTROY)
 			Unmap(wnd);
 
+		WNDLIB_PROFILE_DISPATCH_BEGIN(wnd)
 		LRESULT result = wnd->WndProc(msg, wparam, lparam);
+		WNDLIB_PROFILE_DISPATCH_END(msg)
 
 		if (msg == WM_NCDESTROY)
 		{
@@ -2139,8 +2741,8 @@ namespace WndLib
 	// PropertySheetWnd
 	//
 
-	WND_WM_BEGIN(PropertySheetWnd, TabControlWnd)
-	WND_WM_END()
+	WND_WM_TABLE_BEGIN(PropertySheetWnd, TabControlWnd)
+	WND_WM_TABLE_END()
 
 	PropertySheetWnd::PropertySheetWnd()
 	{
@@ -82,6 +82,66 @@ LIB32=link.exe -lib
 # Name "WndLib - Win32 Debug"
 # Begin Source File
 
+SOURCE=.\CreationSlot.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\DispatchProfiler.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\DispatchProfiler.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogFileSink.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogFileSink.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogLineStore.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogLineStore.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogQueue.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogQueue.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogRtf.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogRtf.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogScan.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogScan.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogSharedRing.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\LogSharedRing.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\LogWnd.cpp
 # End Source File
 # Begin Source File
@@ -90,6 +150,14 @@ SOURCE=.\LogWnd.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\MessageLoopBase.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\MessageLoopBase.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\RegistryKey.cpp
 # End Source File
 # Begin Source File
@@ -106,11 +174,31 @@ SOURCE=.\VerInfo.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\WmTable.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\WmTable.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\WndLib.cpp
 # End Source File
 # Begin Source File
 
 SOURCE=.\WndLib.h
 # End Source File
+# Begin Source File
+
+SOURCE=.\WndLibBase.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\WndTable.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\WndTable.h
+# End Source File
 # End Target
 # End Project
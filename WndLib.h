@@ -12,105 +12,24 @@
 #ifndef WNDLIB_WNDLIB_H
 #define WNDLIB_WNDLIB_H
 
-#ifdef _MSC_VER
-
-	#pragma warning(disable:4251) // "class X needs to have dll-interface to be used by clients of class Y"
-	#pragma warning(disable:4786) // symbol truncated to 255 chars in debug information
-
-	#if defined(WNDLIB_DLL_EXPORT)
-
-		#define WNDLIB_EXPORT __declspec(dllexport)
-
-		#pragma warning(disable:4251) // "class X needs to have dll-interface to be used by clients of class Y"
-
-	#elif defined(WNDLIB_DLL) || (defined(_USE_DLLS) && ! defined(WNDLIB_STATIC))
-
-		#define WNDLIB_EXPORT __declspec(dllimport)
-
-	#else
-
-		#define WNDLIB_EXPORT
-
-	#endif
-
-#elif defined(__GNUC__) && __GNUC__ >= 4
-
-	#define WNDLIB_EXPORT __attribute__((visibility("default")))
-
-#else
-
-	#define WNDLIB_EXPORT
-
-#endif
-
-// Include windows.h with correct SDK constants. If you want to use some other Windows versions, either define
-// WINVER, etc., yourself, or include windows.h before including this header. Don't change this header.
-
-#ifndef _WINDOWS_
-
-	#ifndef WINVER
-		#define WINVER 0x0400
-	#endif
-
-	#ifndef _WIN32_WINDOWS
-		#define _WIN32_WINDOWS 0x0400
-	#endif
-
-	#ifndef _WIN32_WINNT
-		#define _WIN32_WINNT 0x0400
-	#endif
-
-	#ifndef _WIN32_IE
-		#define _WIN32_IE 0x0400
-	#endif
-
-	#ifndef WIN32_LEAN_AND_MEAN
-		#define WIN32_LEAN_AND_MEAN
-	#endif
-
-	#ifndef VC_EXTRALEAN
-		#define VC_EXTRALEAN
-	#endif
-
-	#ifndef STRICT
-		#define STRICT
-	#endif
-
-	#include <windows.h>
-
-#endif
+#include "WndLibBase.h"
 
 #ifdef __MINGW32__
 	typedef DWORD UNDONAMEID;
 	typedef DWORD TEXTMODE;
 #endif
 
-#if defined(UNICODE) || defined(_UNICODE)
-	#define WNDLIB_UNICODE
-#endif
-
 #include <richedit.h>
 #include <commctrl.h>
 #include <shellapi.h>
-#include <assert.h>
 #include <winreg.h>
 #include <stdio.h>
-#include <stdarg.h>
-#include <string>
 #include <map>
-
-#define WNDLIB_ASSERT assert
-#define WNDLIB_COUNTOF(arr) (sizeof(arr) / sizeof((arr)[0]))
-
-#if defined(va_copy)
-	#define WNDLIB_VA_COPY va_copy
-#elif defined(__va_copy)
-	#define WNDLIB_VA_COPY __va_copy
-#elif defined(_va_copy)
-	#define WNDLIB_VA_COPY _va_copy
-#else
-	#define WNDLIB_VA_COPY(dst, src) ((dst) = (src))
-#endif
+#include <vector>
+#include "DispatchProfiler.h"
+#include "MessageLoopBase.h"
+#include "WmTable.h"
+#include "WndTable.h"
 
 namespace WndLib
 {
@@ -118,9 +37,6 @@ namespace WndLib
 	// Strings
 	//
 
-	typedef std::basic_string<TCHAR> TCharString;
-	typedef std::basic_string<WCHAR> WCharString;
-
 	WNDLIB_EXPORT bool TCharStringFormat(TCHAR *buffer, size_t bufferSize, const TCHAR *format, ...);
 	WNDLIB_EXPORT bool TCharStringFormatVA(TCHAR *buffer, size_t bufferSize, const TCHAR *format, va_list argptr);
 
@@ -175,6 +91,51 @@ namespace WndLib
 	// Wnds for the MSG. Returns true if the message was intercepted.
 	WNDLIB_EXPORT bool FilterMessage(MSG *msg);
 
+	#ifndef MWMO_INPUTAVAILABLE
+		#define MWMO_INPUTAVAILABLE 0x0004
+	#endif
+
+	//
+	// MessageLoop: A message loop that can also wait on handles and do work when
+	// idle. Messages are passed through FilterMessage before being dispatched.
+	//
+	// Each iteration waits for a message or a handle, then dispatches messages
+	// until the queue is empty or the time budget is spent. If the budget runs
+	// out, pending WM_PAINTs are dispatched before the next iteration, so a
+	// flood of posted messages can't stop the windows being painted. Signalled
+	// handles are serviced ahead of messages. The scheduling is done by
+	// MessageLoopBase.
+	//
+
+	class WNDLIB_EXPORT MessageLoop : public MessageLoopBase
+	{
+	public:
+
+		MessageLoop();
+
+		~MessageLoop();
+
+		// Run until WM_QUIT is received, and return its exit code.
+		int Run();
+
+		// Run a single iteration, waiting up to timeout milliseconds for something
+		// to do. Returns false if WM_QUIT was received.
+		bool RunOnce(DWORD timeout = INFINITE);
+
+		// Dispatch any waiting messages without waiting. Returns false if WM_QUIT
+		// was received.
+		bool Pump()
+		{
+			return RunOnce(0);
+		}
+
+	private:
+
+		// Returns false if WM_QUIT was received. outOfTime is set if messages were
+		// left in the queue because the budget ran out.
+		bool DispatchMessages(bool *outOfTime);
+	};
+
 	//
 	// Utility functions
 	//
@@ -289,235 +250,63 @@ namespace WndLib
 
 
 	//
-	// CriticalSection: Wrapper around CRITICAL_SECTION.
+	// InvokeTask: Work queued on a window's thread by Wnd::BeginInvoke.
 	//
 
-	namespace Private
+	class WNDLIB_EXPORT InvokeTask
 	{
-		// Locks a threading primitive until destructed.
-		template<class LockType>
-		class ScopedLock
-		{
-		public:
-
-			// Magic type used for ScopedLock's DONT_LOCK constructor.
-			enum ScopedLockDontLock
-			{
-				DONT_LOCK
-			};
-
-			ScopedLock() :
-				lockable(NULL)
-			{}
-
-			// Immediately lock the specified object.
-			ScopedLock(LockType *lock) :
-				lockable(lock)
-			{
-				if (lockable)
-					lockable->Lock();
-			}
-
-			// Immediately lock the specified object.
-			ScopedLock(LockType &lock) :
-				lockable(&lock)
-			{
-				if (lockable)
-					lockable->Lock();
-			}
-
-			// Assign an object but don't lock it. It will be unlocked by the destructor.
-			ScopedLock(LockType *dontLock, ScopedLockDontLock) :
-				lockable(dontLock)
-			{
-			}
-
-			// Assign an object but don't lock it. It will be unlocked by the destructor.
-			ScopedLock(LockType &dontLock, ScopedLockDontLock) :
-				lockable(&dontLock)
-			{
-			}
-
-			~ScopedLock()
-			{
-				if (lockable)
-					lockable->Unlock();
-			}
-
-			// Get the object we're managing.
-			LockType *GetLockable() const
-			{
-				return lockable;
-			}
+	public:
 
-			// Try to lock the specified lock. Returns false if it wasn't locked and doesn't attach the lock to this object.
-			bool TryLock(LockType *lock)
-			{
-				WNDLIB_ASSERT(! lockable);
+		InvokeTask() : _next(NULL) { }
 
-				if (! lock->TryLock())
-					return false;
+		virtual ~InvokeTask() { }
 
-				lockable = lock;
-				return true;
-			}
+		// Called on the window's thread.
+		virtual void Run() = 0;
 
-			// Lock the specified lock and attach it to this object.
-			void Lock(LockType *lock)
-			{
-				WNDLIB_ASSERT(! lockable);
-				lock->Lock();
-				lockable = lock;
-			}
-
-			// Assign a different object to this lock, but don't lock it.
-			void Attach(LockType *lock)
-			{
-				WNDLIB_ASSERT(! lockable);
-				lockable = lock;
-			}
+		// Called once the task has run, or instead of running it if the window is
+		// destroyed or detached first. The default deletes the task.
+		virtual void Release()
+		{
+			delete this;
+		}
 
-			// Unlock the object we're managing and detach it from this lock.
-			void Release()
-			{
-				WNDLIB_ASSERT(lockable);
-				lockable->Unlock();
-				lockable = NULL;
-			}
+	private:
 
-		private:
+		friend class Wnd;
 
-			LockType *lockable;
-		};
-	}
+		InvokeTask *_next;
+	};
 
-	class WNDLIB_EXPORT CriticalSection
+	// An InvokeTask that calls a copy of a function object.
+	template<typename _Functor>
+	class FunctorInvokeTask : public InvokeTask
 	{
 	public:
 
-		// You can do: CriticalSection::ScopedLock lock(anyCriticalSection) to
-		// lock the critical section and automatically unlock it when lock 
-		// goes out of scope.
-		typedef WndLib::Private::ScopedLock<CriticalSection> ScopedLock;
-
-		CriticalSection()
-		{
-			InitializeCriticalSection(&_cs);
-		}
-
-		~CriticalSection()
-		{
-			DeleteCriticalSection(&_cs);
-		}
+		explicit FunctorInvokeTask(const _Functor &functor) : _functor(functor) { }
 
-		void Lock()
+		virtual void Run()
 		{
-			EnterCriticalSection(&_cs);
-		}
-
-		void Unlock()
-		{
-			LeaveCriticalSection(&_cs);
+			_functor();
 		}
 
 	private:
 
-		CRITICAL_SECTION _cs;
+		_Functor _functor;
 	};
 
 	//
-	// Message handling macros
-	//
-	// Example:
-	//
-	// // In the header file:
-	//
-	// class MyWnd : public BaseClassWnd
-	// {
-	//     WND_WM_DECLARE(MyWnd, BaseClassWnd)
-	//     WND_WM_FUNC(OnCreate)
-	//     WND_WM_FUNC(OnPaint)
-	//     ...
-	// public:
-	//     ... remaining declarations go here ...
-	// }
-	//
-	// // In the source file:
-	//
-	// WND_WM_BEGIN(MyWnd, BaseClassWnd)
-	//     WND_WM(WM_CREATE, OnCreate)
-	//     WND_WM(WM_PAINT, OnPaint)
-	//     ...
-	//     WND_WM_COMMAND(ID_HELP_ABOUT, OnHelpAbout)
-	//     WND_WM_NOTIFY(NM_CUSTOMDRAW, OnCustomDraw)
-	// WND_WM_END()
+	// Wnd
 	//
 
-	#define WND_WM_DECLARE(_Class, _BaseClass) \
-		private: \
-			bool WmDispatch(UINT msg, WPARAM wparam, LPARAM lparam, LRESULT *result); \
-		public: \
-			virtual LRESULT WndProc(UINT msg, WPARAM wparam, LPARAM lparam); \
-			inline LRESULT BaseWndProc(UINT msg, WPARAM wparam, LPARAM lparam) \
-			{ \
-				return _BaseClass::WndProc(msg, wparam, lparam); \
-			} \
-		private:
-
-	// Use this to define the WmDispatch method without defining WndProc.
-	// This allows you to write your own WndProc and dispatch via the message
-	// table only when needed.
-	#define WND_WM_BEGIN_NO_WNDPROC(_Class, _BaseClass) \
-		bool _Class::WmDispatch(UINT msg, WPARAM wparam, LPARAM lparam, LRESULT *result) \
-		{ \
-			(void) msg; \
-			(void) wparam; \
-			(void) lparam; \
-			(void) result; \
-
-	#define WND_WM_BEGIN(_Class, _BaseClass) \
-		LRESULT _Class::WndProc(UINT msg, WPARAM wparam, LPARAM lparam) \
-		{ \
-			LRESULT result; \
-			if (! WmDispatch(msg, wparam, lparam, &result)) \
-				result = BaseWndProc(msg, wparam, lparam); \
-			return result; \
-		} \
-		WND_WM_BEGIN_NO_WNDPROC(_Class, _BaseClass)
-
-	#define WND_WM(_Msg, _Func) \
-		if (msg == (_Msg)) \
-		{ \
-			*result = _Func(msg, wparam, lparam); \
-			return true; \
-		}
-
-	#define WND_WM_COMMAND(_Cmd, _Func) \
-		if (msg == WM_COMMAND && LOWORD(wparam) == (_Cmd)) \
-		{ \
-			*result = _Func(msg, wparam, lparam); \
-			return true; \
-		}
-
-	#define WND_WM_NOTIFY(_NotifyCode, _Func) \
-		if (msg == WM_NOTIFY) \
-		{ \
-			if (((const NMHDR *) lparam)->code == (_NotifyCode)) \
-			{ \
-				*result = _Func(msg, wparam, lparam); \
-				return true; \
-			} \
-		}
-
-	#define WND_WM_END() \
-			return false; \
-		}
-
-	#define WND_WM_FUNC(_Name) LRESULT _Name(UINT msg, WPARAM wparam, LPARAM lparam);
+	namespace Private
+	{
+		struct FilterChain;
 
-	//
-	// Wnd
-	//
+		// Used by WndLib::FilterMessage.
+		const FilterChain *GetFilterChain(HWND hwnd);
+	}
 
 	class WNDLIB_EXPORT Wnd
 	{
@@ -595,6 +384,11 @@ namespace WndLib
 		// Our window procedure.
 		virtual LRESULT WndProc(UINT msg, WPARAM wparam, LPARAM lparam);
 
+		// The root of the message tables built by WND_WM_TABLE_BEGIN. It has no
+		// entries and sends everything to Wnd::WndProc.
+		typedef Wnd WmClass;
+		static Private::WmTable *WmGetTable();
+
 		// Set the size of this window's client area
 		void SetClientAreaSize(int cx, int cy);
 
@@ -605,6 +399,36 @@ namespace WndLib
 		// Allows the window to implement TranslateAccelerator.
 		virtual bool FilterMessage(MSG *msg);
 
+		// Queue a task to be run on this window's thread. Can be called from any
+		// thread, and takes ownership of the task. Queuing is lock-free, and
+		// a message is only posted if one isn't already on its way, so any
+		// number of tasks can be queued for the cost of one PostMessage. If the
+		// message can't be posted (e.g., the thread's message queue is full),
+		// the task stays queued and the next BeginInvoke tries again. The window
+		// must have been created or subclassed by WndLib. Returns false, having
+		// released the task, if there's no window.
+		bool BeginInvoke(InvokeTask *task);
+
+		template<typename _Functor>
+		bool BeginInvoke(const _Functor &functor)
+		{
+			return BeginInvoke(new FunctorInvokeTask<_Functor>(functor));
+		}
+
+		// Run a task on this window's thread and wait for it to finish. The task
+		// is run immediately if this is the window's thread. Doesn't take
+		// ownership of the task. Returns false if the task wasn't run because
+		// the window was destroyed. Beware of deadlock if the window's thread
+		// may be waiting on this thread.
+		bool Invoke(InvokeTask *task);
+
+		template<typename _Functor>
+		bool Invoke(const _Functor &functor)
+		{
+			FunctorInvokeTask<_Functor> task(functor);
+			return Invoke(&task);
+		}
+
 		//
 		// API wrappers
 		//
@@ -740,7 +564,9 @@ namespace WndLib
 		}
 		HWND SetParent(HWND newParent)
 		{
-			return ::SetParent(GetHWnd(), newParent);
+			HWND oldParent = ::SetParent(GetHWnd(), newParent);
+			InvalidateFilterChains();
+			return oldParent;
 		}
 		HWND GetWindow(UINT cmd)
 		{
@@ -917,6 +743,34 @@ namespace WndLib
 
 		static Wnd *FindWnd(HWND hwnd);
 
+		// CreateIndirect caches the window classes it looks up and registers,
+		// so it only calls GetClassInfoEx and RegisterClassEx once per class.
+		struct ClassCacheStats
+		{
+			// Calls made to GetClassInfoEx, and calls avoided by the cache.
+			LONG lookups;
+			LONG lookupsAvoided;
+
+			// Classes registered by CreateIndirect.
+			LONG registrations;
+
+			// Windows created using a cached atom rather than a class name.
+			LONG createdByAtom;
+		};
+
+		static void GetClassCacheStats(ClassCacheStats *stats);
+
+		// Forget every cached window class. Call this if you unregister a class
+		// that CreateIndirect may have cached.
+		static void FlushClassCache();
+
+		// WndLib::FilterMessage caches, for each window, the Wnds it needs to
+		// call. Attaching a Wnd to a window with children, detaching or
+		// destroying a Wnd that's cached as an ancestor, and Wnd::SetParent,
+		// invalidate the caches. If you call ::SetParent directly on a window
+		// that has children, call this afterwards.
+		static void InvalidateFilterChains();
+
 		static LRESULT WINAPI StaticWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam);
 		static LRESULT WINAPI SubclassWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam);
 
@@ -932,10 +786,28 @@ namespace WndLib
 		// Ask the Wnd to destroy itself
 		virtual void SelfDestruct();
 
+		// Returns true if msg was the BeginInvoke wake up message, in which
+		// case some queued tasks have been run. wnd may have been deleted by
+		// the time this returns.
+		static bool HandleInvokeMessage(HWND hwnd, Wnd *wnd, UINT msg);
+
 	private:
 
 		void Construct();
 
+		// Find the window class, registering it if necessary. atom is set if we
+		// registered the class and windows can be created using the atom.
+		bool FindWndClass(LPCTSTR className, WNDCLASSEX *wc, ATOM *atom);
+
+		// Reopen the invoke queue for a newly mapped window.
+		void OpenInvokeQueue();
+
+		// Stop accepting tasks and release any still queued.
+		void CloseInvokeQueue();
+
+		// Post the invoke message, unless one is already pending.
+		void WakeInvokeQueue(HWND hwnd);
+
 		WNDPROC _prevproc;
 
 		// If this flag is true, the object will be deleted when it receives a
@@ -947,10 +819,26 @@ namespace WndLib
 
 		HWND _hwnd;
 
-		typedef std::map<HWND, Wnd *> WndMap;
-		static WndMap wndMap;
+		// Tasks queued by BeginInvoke, most recent first. Producers push with
+		// InterlockedCompareExchangePointer and the window's thread takes the
+		// whole list at once.
+		InvokeTask * volatile _invokeQueue;
+
+		// Tasks taken from _invokeQueue but not run yet, oldest first. Only
+		// touched by the window's thread.
+		InvokeTask *_invokeBacklog;
+
+		// Non-zero from posting the invoke message until the window's thread
+		// starts handling it.
+		volatile LONG _invokeWakePending;
+
+		// Set once a filter chain cache holds this Wnd as an ancestor of another
+		// window, after which unmapping it must invalidate the caches.
+		volatile LONG _filterChainAncestor;
+
+		static Private::WndTable wndTable;
 
-		static CriticalSection mapLock;
+		friend const Private::FilterChain *Private::GetFilterChain(HWND hwnd);
 	};
 
 	//
@@ -5310,7 +5198,7 @@ namespace WndLib
 
 	class WNDLIB_EXPORT MainWnd : public Wnd
 	{
-		WND_WM_DECLARE(MainWindow, Wnd)
+		WND_WM_DECLARE(MainWnd, Wnd)
 		WND_WM_FUNC(OnClose)
 		WND_WM_FUNC(OnDestroy)
 		
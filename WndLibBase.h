@@ -0,0 +1,640 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+// The parts of WndLib that don't involve windows: export macros, strings and
+// threading primitives. WndLib.h includes this, so there's no need to include
+// it yourself.
+//
+// On Windows this includes windows.h. Elsewhere it defines the few Win32 types
+// and functions used by the window independent parts of WndLib (WndTable, the
+// message tables and the LogWnd pipeline), so those can be built and tested on
+// other platforms.
+//
+
+#ifndef WNDLIB_WNDLIBBASE_H
+#define WNDLIB_WNDLIBBASE_H
+
+#ifdef _MSC_VER
+
+	#pragma warning(disable:4251) // "class X needs to have dll-interface to be used by clients of class Y"
+	#pragma warning(disable:4786) // symbol truncated to 255 chars in debug information
+
+	#if defined(WNDLIB_DLL_EXPORT)
+
+		#define WNDLIB_EXPORT __declspec(dllexport)
+
+		#pragma warning(disable:4251) // "class X needs to have dll-interface to be used by clients of class Y"
+
+	#elif defined(WNDLIB_DLL) || (defined(_USE_DLLS) && ! defined(WNDLIB_STATIC))
+
+		#define WNDLIB_EXPORT __declspec(dllimport)
+
+	#else
+
+		#define WNDLIB_EXPORT
+
+	#endif
+
+#elif defined(__GNUC__) && __GNUC__ >= 4
+
+	#define WNDLIB_EXPORT __attribute__((visibility("default")))
+
+#else
+
+	#define WNDLIB_EXPORT
+
+#endif
+
+#if defined(UNICODE) || defined(_UNICODE)
+	#define WNDLIB_UNICODE
+#endif
+
+#ifdef _WIN32
+
+	// Include windows.h with correct SDK constants. If you want to use some other Windows versions, either define
+	// WINVER, etc., yourself, or include windows.h before including this header. Don't change this header.
+
+	#ifndef _WINDOWS_
+
+		#ifndef WINVER
+			#define WINVER 0x0400
+		#endif
+
+		#ifndef _WIN32_WINDOWS
+			#define _WIN32_WINDOWS 0x0400
+		#endif
+
+		#ifndef _WIN32_WINNT
+			#define _WIN32_WINNT 0x0400
+		#endif
+
+		#ifndef _WIN32_IE
+			#define _WIN32_IE 0x0400
+		#endif
+
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+
+		#ifndef VC_EXTRALEAN
+			#define VC_EXTRALEAN
+		#endif
+
+		#ifndef STRICT
+			#define STRICT
+		#endif
+
+		#include <windows.h>
+
+	#endif
+
+#else
+
+	#include <pthread.h>
+	#include <sched.h>
+	#include <stdint.h>
+	#include <time.h>
+	#include <wchar.h>
+
+	#ifdef __linux__
+		#include <sys/syscall.h>
+		#include <unistd.h>
+	#endif
+
+	#include <sys/time.h>
+
+	typedef int32_t LONG;
+	typedef uint32_t DWORD;
+	typedef uint16_t WORD;
+	typedef uint8_t BYTE;
+	typedef unsigned int UINT;
+	typedef int BOOL;
+	typedef int64_t LONGLONG;
+	typedef uint64_t ULONGLONG;
+	typedef intptr_t INT_PTR;
+	typedef intptr_t LONG_PTR;
+	typedef uintptr_t UINT_PTR;
+	typedef uintptr_t ULONG_PTR;
+	typedef uintptr_t DWORD_PTR;
+	typedef void *PVOID;
+	typedef void *HANDLE;
+	typedef wchar_t WCHAR;
+	typedef DWORD COLORREF;
+	typedef struct HWND__ *HWND;
+	typedef UINT_PTR WPARAM;
+	typedef LONG_PTR LPARAM;
+	typedef LONG_PTR LRESULT;
+
+	#ifdef WNDLIB_UNICODE
+		typedef WCHAR TCHAR;
+		#define WNDLIB_TEXT(_Text) L##_Text
+	#else
+		typedef char TCHAR;
+		#define WNDLIB_TEXT(_Text) _Text
+	#endif
+
+	#define TEXT(_Text) WNDLIB_TEXT(_Text)
+
+	typedef TCHAR *LPTSTR;
+	typedef const TCHAR *LPCTSTR;
+
+	#define TRUE 1
+	#define FALSE 0
+	#define INFINITE 0xffffffff
+	#define MAXIMUM_WAIT_OBJECTS 64
+	#define CLR_INVALID 0xffffffff
+
+	#define RGB(r, g, b) ((COLORREF) ((BYTE) (r) | ((DWORD) (BYTE) (g) << 8) | ((DWORD) (BYTE) (b) << 16)))
+	#define GetRValue(rgb) ((BYTE) (rgb))
+	#define GetGValue(rgb) ((BYTE) ((rgb) >> 8))
+	#define GetBValue(rgb) ((BYTE) ((rgb) >> 16))
+
+	#define LOWORD(l) ((WORD) ((DWORD_PTR) (l) & 0xffff))
+	#define HIWORD(l) ((WORD) ((DWORD_PTR) (l) >> 16))
+
+	// Used by the message tables (WmTable.h).
+
+	#define WM_NOTIFY 0x004e
+	#define WM_COMMAND 0x0111
+	#define WM_USER 0x0400
+
+	typedef struct tagNMHDR
+	{
+		HWND hwndFrom;
+		UINT_PTR idFrom;
+		UINT code;
+	} NMHDR;
+
+	// Like their Win32 namesakes, these are all full barriers.
+
+	inline LONG InterlockedCompareExchange(volatile LONG *destination, LONG exchange, LONG comparand)
+	{
+		return __sync_val_compare_and_swap(destination, comparand, exchange);
+	}
+
+	inline LONG InterlockedExchange(volatile LONG *target, LONG value)
+	{
+		LONG old;
+		do
+		{
+			old = *target;
+		}
+		while (! __sync_bool_compare_and_swap(target, old, value));
+
+		return old;
+	}
+
+	inline LONG InterlockedExchangeAdd(volatile LONG *addend, LONG value)
+	{
+		return __sync_fetch_and_add(addend, value);
+	}
+
+	inline LONG InterlockedIncrement(volatile LONG *addend)
+	{
+		return __sync_add_and_fetch(addend, 1);
+	}
+
+	inline LONG InterlockedDecrement(volatile LONG *addend)
+	{
+		return __sync_sub_and_fetch(addend, 1);
+	}
+
+	inline PVOID InterlockedCompareExchangePointer(PVOID volatile *destination, PVOID exchange, PVOID comparand)
+	{
+		return __sync_val_compare_and_swap(destination, comparand, exchange);
+	}
+
+	inline PVOID InterlockedExchangePointer(PVOID volatile *target, PVOID value)
+	{
+		PVOID old;
+		do
+		{
+			old = *target;
+		}
+		while (! __sync_bool_compare_and_swap(target, old, value));
+
+		return old;
+	}
+
+	inline void MemoryBarrier()
+	{
+		__sync_synchronize();
+	}
+
+	inline void YieldProcessor()
+	{
+		#if defined(__i386__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+		#endif
+	}
+
+	inline void Sleep(DWORD milliseconds)
+	{
+		if (! milliseconds)
+		{
+			sched_yield();
+			return;
+		}
+
+		struct timespec duration;
+		duration.tv_sec = milliseconds / 1000;
+		duration.tv_nsec = (long) (milliseconds % 1000) * 1000000;
+		nanosleep(&duration, NULL);
+	}
+
+	inline DWORD GetTickCount()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (DWORD) ((ULONGLONG) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	}
+
+	typedef union _LARGE_INTEGER
+	{
+		struct
+		{
+			DWORD LowPart;
+			LONG HighPart;
+		} u;
+		LONGLONG QuadPart;
+	} LARGE_INTEGER;
+
+	// Nanoseconds, so the frequency is fixed.
+	inline BOOL QueryPerformanceCounter(LARGE_INTEGER *counter)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		counter->QuadPart = (LONGLONG) now.tv_sec * 1000000000 + now.tv_nsec;
+		return TRUE;
+	}
+
+	inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+	{
+		frequency->QuadPart = 1000000000;
+		return TRUE;
+	}
+
+	inline DWORD GetCurrentThreadId()
+	{
+		#ifdef __linux__
+			return (DWORD) syscall(SYS_gettid);
+		#else
+			return (DWORD) (UINT_PTR) pthread_self();
+		#endif
+	}
+
+#endif
+
+#include <assert.h>
+#include <stdarg.h>
+#include <string>
+
+#define WNDLIB_ASSERT assert
+#define WNDLIB_COUNTOF(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#if defined(va_copy)
+	#define WNDLIB_VA_COPY va_copy
+#elif defined(__va_copy)
+	#define WNDLIB_VA_COPY __va_copy
+#elif defined(_va_copy)
+	#define WNDLIB_VA_COPY _va_copy
+#else
+	#define WNDLIB_VA_COPY(dst, src) ((dst) = (src))
+#endif
+
+namespace WndLib
+{
+	//
+	// Strings
+	//
+
+	typedef std::basic_string<TCHAR> TCharString;
+	typedef std::basic_string<WCHAR> WCharString;
+
+	//
+	// CriticalSection: Wrapper around CRITICAL_SECTION.
+	//
+
+	namespace Private
+	{
+		// Locks a threading primitive until destructed.
+		template<class LockType>
+		class ScopedLock
+		{
+		public:
+
+			// Magic type used for ScopedLock's DONT_LOCK constructor.
+			enum ScopedLockDontLock
+			{
+				DONT_LOCK
+			};
+
+			ScopedLock() :
+				lockable(NULL)
+			{}
+
+			// Immediately lock the specified object.
+			ScopedLock(LockType *lock) :
+				lockable(lock)
+			{
+				if (lockable)
+					lockable->Lock();
+			}
+
+			// Immediately lock the specified object.
+			ScopedLock(LockType &lock) :
+				lockable(&lock)
+			{
+				if (lockable)
+					lockable->Lock();
+			}
+
+			// Assign an object but don't lock it. It will be unlocked by the destructor.
+			ScopedLock(LockType *dontLock, ScopedLockDontLock) :
+				lockable(dontLock)
+			{
+			}
+
+			// Assign an object but don't lock it. It will be unlocked by the destructor.
+			ScopedLock(LockType &dontLock, ScopedLockDontLock) :
+				lockable(&dontLock)
+			{
+			}
+
+			~ScopedLock()
+			{
+				if (lockable)
+					lockable->Unlock();
+			}
+
+			// Get the object we're managing.
+			LockType *GetLockable() const
+			{
+				return lockable;
+			}
+
+			// Try to lock the specified lock. Returns false if it wasn't locked and doesn't attach the lock to this object.
+			bool TryLock(LockType *lock)
+			{
+				WNDLIB_ASSERT(! lockable);
+
+				if (! lock->TryLock())
+					return false;
+
+				lockable = lock;
+				return true;
+			}
+
+			// Lock the specified lock and attach it to this object.
+			void Lock(LockType *lock)
+			{
+				WNDLIB_ASSERT(! lockable);
+				lock->Lock();
+				lockable = lock;
+			}
+
+			// Assign a different object to this lock, but don't lock it.
+			void Attach(LockType *lock)
+			{
+				WNDLIB_ASSERT(! lockable);
+				lockable = lock;
+			}
+
+			// Unlock the object we're managing and detach it from this lock.
+			void Release()
+			{
+				WNDLIB_ASSERT(lockable);
+				lockable->Unlock();
+				lockable = NULL;
+			}
+
+		private:
+
+			LockType *lockable;
+		};
+	}
+
+	class WNDLIB_EXPORT CriticalSection
+	{
+	public:
+
+		// You can do: CriticalSection::ScopedLock lock(anyCriticalSection) to
+		// lock the critical section and automatically unlock it when lock
+		// goes out of scope.
+		typedef WndLib::Private::ScopedLock<CriticalSection> ScopedLock;
+
+		CriticalSection()
+		{
+			#ifdef _WIN32
+				InitializeCriticalSection(&_cs);
+			#else
+				// Recursive, like a CRITICAL_SECTION.
+				pthread_mutexattr_t attributes;
+				pthread_mutexattr_init(&attributes);
+				pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+				pthread_mutex_init(&_cs, &attributes);
+				pthread_mutexattr_destroy(&attributes);
+			#endif
+		}
+
+		~CriticalSection()
+		{
+			#ifdef _WIN32
+				DeleteCriticalSection(&_cs);
+			#else
+				pthread_mutex_destroy(&_cs);
+			#endif
+		}
+
+		void Lock()
+		{
+			#ifdef _WIN32
+				EnterCriticalSection(&_cs);
+			#else
+				pthread_mutex_lock(&_cs);
+			#endif
+		}
+
+		void Unlock()
+		{
+			#ifdef _WIN32
+				LeaveCriticalSection(&_cs);
+			#else
+				pthread_mutex_unlock(&_cs);
+			#endif
+		}
+
+	private:
+
+		#ifdef _WIN32
+			CRITICAL_SECTION _cs;
+		#else
+			pthread_mutex_t _cs;
+		#endif
+	};
+
+	//
+	// ThreadLocalPointer: Wrapper around a TLS index.
+	//
+
+	class WNDLIB_EXPORT ThreadLocalPointer
+	{
+	public:
+
+		ThreadLocalPointer()
+		{
+			#ifdef _WIN32
+				_index = TlsAlloc();
+				WNDLIB_ASSERT(_index != TLS_OUT_OF_INDEXES);
+			#else
+				_valid = pthread_key_create(&_key, NULL) == 0;
+				WNDLIB_ASSERT(_valid);
+			#endif
+		}
+
+		~ThreadLocalPointer()
+		{
+			#ifdef _WIN32
+				if (_index != TLS_OUT_OF_INDEXES)
+					TlsFree(_index);
+			#else
+				if (_valid)
+					pthread_key_delete(_key);
+			#endif
+		}
+
+		// Returns NULL if this thread hasn't set a value.
+		void *Get() const
+		{
+			#ifdef _WIN32
+				return TlsGetValue(_index);
+			#else
+				return pthread_getspecific(_key);
+			#endif
+		}
+
+		void Set(void *value)
+		{
+			#ifdef _WIN32
+				TlsSetValue(_index, value);
+			#else
+				pthread_setspecific(_key, value);
+			#endif
+		}
+
+	private:
+
+		#ifdef _WIN32
+			DWORD _index;
+		#else
+			pthread_key_t _key;
+			bool _valid;
+		#endif
+	};
+
+	//
+	// Event: Wrapper around a manual reset event.
+	//
+
+	class WNDLIB_EXPORT Event
+	{
+	public:
+
+		Event()
+		{
+			#ifdef _WIN32
+				_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			#else
+				pthread_mutex_init(&_mutex, NULL);
+				pthread_cond_init(&_cond, NULL);
+				_set = false;
+			#endif
+		}
+
+		~Event()
+		{
+			#ifdef _WIN32
+				if (_event)
+					CloseHandle(_event);
+			#else
+				pthread_cond_destroy(&_cond);
+				pthread_mutex_destroy(&_mutex);
+			#endif
+		}
+
+		// Wake every thread waiting, and any that wait until Reset is called.
+		void Set()
+		{
+			#ifdef _WIN32
+				SetEvent(_event);
+			#else
+				pthread_mutex_lock(&_mutex);
+				_set = true;
+				pthread_cond_broadcast(&_cond);
+				pthread_mutex_unlock(&_mutex);
+			#endif
+		}
+
+		void Reset()
+		{
+			#ifdef _WIN32
+				ResetEvent(_event);
+			#else
+				pthread_mutex_lock(&_mutex);
+				_set = false;
+				pthread_mutex_unlock(&_mutex);
+			#endif
+		}
+
+		// Returns false if milliseconds passed without the event being set.
+		bool Wait(DWORD milliseconds)
+		{
+			#ifdef _WIN32
+				return WaitForSingleObject(_event, milliseconds) == WAIT_OBJECT_0;
+			#else
+				pthread_mutex_lock(&_mutex);
+
+				if (milliseconds == INFINITE)
+				{
+					while (! _set)
+						pthread_cond_wait(&_cond, &_mutex);
+				}
+				else
+				{
+					struct timeval now;
+					gettimeofday(&now, NULL);
+
+					struct timespec until;
+					ULONGLONG nanoseconds = (ULONGLONG) now.tv_usec * 1000 + (ULONGLONG) (milliseconds % 1000) * 1000000;
+					until.tv_sec = now.tv_sec + milliseconds / 1000 + (time_t) (nanoseconds / 1000000000);
+					until.tv_nsec = (long) (nanoseconds % 1000000000);
+
+					while (! _set)
+					{
+						if (pthread_cond_timedwait(&_cond, &_mutex, &until) != 0)
+							break;
+					}
+				}
+
+				bool set = _set;
+				pthread_mutex_unlock(&_mutex);
+				return set;
+			#endif
+		}
+
+	private:
+
+		#ifdef _WIN32
+			HANDLE _event;
+		#else
+			pthread_mutex_t _mutex;
+			pthread_cond_t _cond;
+			bool _set;
+		#endif
+	};
+}
+
+#endif
@@ -0,0 +1,292 @@
+#include "WndTable.h"
+#include <utility>
+#include <vector>
+
+namespace WndLib
+{
+	//
+	// WndTable
+	//
+
+	namespace Private
+	{
+		// Key used to mark a slot whose mapping has been removed. Probing continues
+		// past these, whereas an empty (NULL) slot ends the probe.
+		static const HWND deletedHWnd = (HWND) (INT_PTR) -1;
+
+		static const size_t wndTableMinCapacity = 64;
+
+		WndTable::WndTable() :
+			_table(NULL),
+			_sequence(0)
+		{
+		}
+
+		WndTable::~WndTable()
+		{
+			FreeTables(_table);
+		}
+
+		WndTable::Table *WndTable::AllocateTable(size_t capacity)
+		{
+			Table *table = (Table *) new char[sizeof(Table) + (capacity - 1) * sizeof(Slot)];
+			table->retired = NULL;
+			table->mask = capacity - 1;
+			table->live = 0;
+			table->used = 0;
+
+			for (size_t i = 0; i != capacity; ++i)
+			{
+				table->slots[i].hwnd = NULL;
+				table->slots[i].wnd = NULL;
+			}
+
+			return table;
+		}
+
+		void WndTable::FreeTables(Table *table)
+		{
+			while (table)
+			{
+				Table *retired = table->retired;
+				delete[] (char *) table;
+				table = retired;
+			}
+		}
+
+		size_t WndTable::Hash(HWND hwnd)
+		{
+			// Handles are small, closely spaced integers so mix all the bits down.
+			DWORD hash = (DWORD) (UINT_PTR) hwnd;
+			hash ^= hash >> 16;
+			hash *= 0x7feb352d;
+			hash ^= hash >> 15;
+			hash *= 0x846ca68b;
+			hash ^= hash >> 16;
+			return (size_t) hash;
+		}
+
+		void WndTable::InsertSlot(Table *table, HWND hwnd, Wnd *wnd)
+		{
+			Slot *reuse = NULL;
+			size_t index = Hash(hwnd) & table->mask;
+
+			for (;;)
+			{
+				Slot *slot = &table->slots[index];
+
+				if (slot->hwnd == hwnd)
+				{
+					slot->wnd = wnd;
+					return;
+				}
+
+				if (! slot->hwnd)
+					break;
+
+				if (slot->hwnd == deletedHWnd && ! reuse)
+					reuse = slot;
+
+				index = (index + 1) & table->mask;
+			}
+
+			if (reuse)
+			{
+				reuse->wnd = wnd;
+				reuse->hwnd = hwnd;
+			}
+			else
+			{
+				Slot *slot = &table->slots[index];
+				slot->wnd = wnd;
+				slot->hwnd = hwnd;
+				++table->used;
+			}
+
+			++table->live;
+		}
+
+		void WndTable::BeginWrite()
+		{
+			// Interlocked functions are full barriers, so the sequence number is odd
+			// before any slot changes.
+			InterlockedIncrement(&_sequence);
+		}
+
+		void WndTable::EndWrite()
+		{
+			InterlockedIncrement(&_sequence);
+		}
+
+		void WndTable::Reserve()
+		{
+			// Keep the load factor (including deleted slots) at or below 3/4 so
+			// probes stay short and always terminate.
+			Table *table = _table;
+			if (table && (table->used + 1) * 4 <= (table->mask + 1) * 3)
+				return;
+
+			size_t capacity = wndTableMinCapacity;
+			if (table)
+			{
+				capacity = table->mask + 1;
+
+				// Grow if more than 3/8 of the slots are live, otherwise the table is
+				// mostly deleted slots and a rebuild at the same size will do.
+				if ((table->live + 1) * 8 > capacity * 3)
+					capacity *= 2;
+			}
+
+			if (table && capacity == table->mask + 1)
+			{
+				// Rebuild in place. Readers retry until we're done.
+				std::vector<std::pair<HWND, Wnd *> > live;
+				live.reserve(table->live);
+
+				for (size_t i = 0; i <= table->mask; ++i)
+				{
+					HWND hwnd = table->slots[i].hwnd;
+					if (hwnd && hwnd != deletedHWnd)
+						live.push_back(std::make_pair(hwnd, table->slots[i].wnd));
+				}
+
+				BeginWrite();
+
+				for (size_t i = 0; i <= table->mask; ++i)
+				{
+					table->slots[i].hwnd = NULL;
+					table->slots[i].wnd = NULL;
+				}
+
+				table->live = 0;
+				table->used = 0;
+
+				for (size_t i = 0; i != live.size(); ++i)
+					InsertSlot(table, live[i].first, live[i].second);
+
+				EndWrite();
+				return;
+			}
+
+			// Build the new table before publishing it, then retire the old one.
+			Table *grown = AllocateTable(capacity);
+			if (table)
+			{
+				for (size_t i = 0; i <= table->mask; ++i)
+				{
+					HWND hwnd = table->slots[i].hwnd;
+					if (hwnd && hwnd != deletedHWnd)
+						InsertSlot(grown, hwnd, table->slots[i].wnd);
+				}
+			}
+
+			grown->retired = table;
+
+			BeginWrite();
+			_table = grown;
+			EndWrite();
+		}
+
+		void WndTable::Insert(HWND hwnd, Wnd *wnd)
+		{
+			WNDLIB_ASSERT(hwnd && hwnd != deletedHWnd);
+
+			CriticalSection::ScopedLock lock(_lock);
+
+			Reserve();
+
+			BeginWrite();
+			InsertSlot(_table, hwnd, wnd);
+			EndWrite();
+		}
+
+		void WndTable::Remove(HWND hwnd)
+		{
+			if (! hwnd || hwnd == deletedHWnd)
+				return;
+
+			CriticalSection::ScopedLock lock(_lock);
+
+			Table *table = _table;
+			if (! table)
+				return;
+
+			size_t index = Hash(hwnd) & table->mask;
+			for (;;)
+			{
+				Slot *slot = &table->slots[index];
+
+				if (slot->hwnd == hwnd)
+				{
+					BeginWrite();
+					slot->hwnd = deletedHWnd;
+					slot->wnd = NULL;
+					--table->live;
+					EndWrite();
+					return;
+				}
+
+				if (! slot->hwnd)
+					return;
+
+				index = (index + 1) & table->mask;
+			}
+		}
+
+		Wnd *WndTable::Find(HWND hwnd) const
+		{
+			if (! hwnd || hwnd == deletedHWnd)
+				return NULL;
+
+			for (;;)
+			{
+				LONG sequence = _sequence;
+				if (sequence & 1)
+				{
+					// A writer is part way through a change.
+					YieldProcessor();
+					continue;
+				}
+
+				MemoryBarrier();
+
+				Wnd *found = NULL;
+				const Table *table = _table;
+
+				if (table)
+				{
+					// Bound the probe, a torn read could otherwise loop forever. The
+					// result is discarded in that case anyway.
+					size_t index = Hash(hwnd) & table->mask;
+					for (size_t probes = 0; probes <= table->mask; ++probes)
+					{
+						const Slot *slot = &table->slots[index];
+						HWND key = slot->hwnd;
+
+						if (key == hwnd)
+						{
+							found = slot->wnd;
+							break;
+						}
+
+						if (! key)
+							break;
+
+						index = (index + 1) & table->mask;
+					}
+				}
+
+				MemoryBarrier();
+
+				if (_sequence == sequence)
+					return found;
+			}
+		}
+
+		size_t WndTable::GetCount() const
+		{
+			CriticalSection::ScopedLock lock(_lock);
+			return _table ? _table->live : 0;
+		}
+	}
+}
@@ -0,0 +1,94 @@
+//
+// WndLib
+// Copyright (c) 1994-2014 Mark H. P. Lord. All rights reserved.
+//
+// See LICENSE.txt for license.
+//
+
+#ifndef WNDLIB_WNDTABLE_H
+#define WNDLIB_WNDTABLE_H
+
+#include "WndLibBase.h"
+#include <stddef.h>
+
+namespace WndLib
+{
+	class Wnd;
+
+	//
+	// WndTable: Maps HWNDs to Wnds for Wnd::FindWnd.
+	//
+
+	namespace Private
+	{
+		// An open addressing hash table. Writers are serialised by a CriticalSection
+		// and bump a sequence number either side of every change, so readers never
+		// lock: they retry if the sequence number was odd or changed while they were
+		// probing (a seqlock). Tables that have been outgrown are kept until the
+		// WndTable is destroyed so that a reader racing a resize never touches freed
+		// memory; since the table doubles each time, they never total more than the
+		// current table.
+		class WNDLIB_EXPORT WndTable
+		{
+		public:
+
+			WndTable();
+
+			~WndTable();
+
+			// Map hwnd to wnd, replacing any existing mapping.
+			void Insert(HWND hwnd, Wnd *wnd);
+
+			// Remove the mapping for hwnd, if there is one.
+			void Remove(HWND hwnd);
+
+			// Returns NULL if hwnd isn't mapped. Never blocks, can be called from any
+			// thread.
+			Wnd *Find(HWND hwnd) const;
+
+			// Returns the number of mapped HWNDs.
+			size_t GetCount() const;
+
+		private:
+
+			struct Slot
+			{
+				HWND volatile hwnd;
+				Wnd * volatile wnd;
+			};
+
+			struct Table
+			{
+				// The table this one replaced.
+				Table *retired;
+
+				// Capacity - 1. Capacity is always a power of 2.
+				size_t mask;
+
+				// Number of slots holding a mapping.
+				size_t live;
+
+				// Number of slots that aren't empty (live + deleted).
+				size_t used;
+
+				Slot slots[1];
+			};
+
+			static Table *AllocateTable(size_t capacity);
+			static void FreeTables(Table *table);
+			static size_t Hash(HWND hwnd);
+			static void InsertSlot(Table *table, HWND hwnd, Wnd *wnd);
+
+			void BeginWrite();
+			void EndWrite();
+
+			void Reserve();
+
+			Table * volatile _table;
+			volatile LONG _sequence;
+			mutable CriticalSection _lock;
+		};
+	}
+}
+
+#endif